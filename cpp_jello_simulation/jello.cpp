@@ -12,6 +12,7 @@
 #include "showCube.h"
 #include "input.h"
 #include "physics.h"
+#include "trajectory.h"
 
 // camera parameters
 double Theta = pi / 6;
@@ -31,6 +32,9 @@ int shear=0, bend=0, structural=1, pause=0, viewingMode=0, saveScreenToFile=0;
 
 struct world jello;
 
+// integrator specialised for the loaded world, chosen once in main()
+stepFunction stepJello;
+
 int windowWidth, windowHeight;
 
 void myinit()
@@ -232,17 +236,10 @@ void doIdle()
   if (pause == 0)
   {
     // insert code which appropriately performs multiple steps of the cube simulation based on jello.n:
-     
-     if (strcmp(jello.integrator, "Euler") == 0) {
-        for (int i = 0; i < jello.n; i++) {
-           Euler(&jello);
-        }
-     }
-     else if (strcmp(jello.integrator, "RK4") == 0) {
-        for (int i = 0; i < jello.n; i++) {
-           RK4(&jello);
-        }
-     }
+     stepJello(&jello, jello.n);
+
+     // stream the displayed frame to the trajectory file, if one is being recorded
+     recordTrajectoryFrame(&jello);
   }
 
   glutPostRedisplay();
@@ -253,11 +250,19 @@ int main (int argc, char ** argv)
   if (argc<2)
   {  
     printf ("Oops! You didn't say the jello world file!\n");
-    printf ("Usage: %s [worldfile]\n", argv[0]);
+    printf ("Usage: %s [worldfile] [trajectory file (optional)]\n", argv[0]);
     exit(0);
   }
 
   readWorld(argv[1],&jello);
+  stepJello = selectStepper(&jello);
+
+  // record the positions of every displayed frame; the file is flushed when the program exits
+  if (argc >= 3 && startTrajectory(argv[2], &jello))
+  {
+    recordTrajectoryFrame(&jello);
+    atexit(stopTrajectory);
+  }
 
   glutInit(&argc,argv);
   
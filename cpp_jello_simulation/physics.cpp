@@ -8,52 +8,23 @@
 #include "jello.h"
 #include "physics.h"
 
-double restLen; /* rest length of structural springs */
-point L; /* vector pointing from another point to current point, can be normalized or not */
-double length; /* length of L */
-point vDiff; /* difference in velocities of two points */
-double product; /* inner product of two vectors */
-
-/*	Computes acceleration to every control point of the jello cube, 
-	which is in state given by 'jello'.
-   Returns result in array 'a'. */
-void computeAcceleration(struct world * jello, struct point a[8][8][8])
-{
-	int i,j,k;
-
-	/*	accelerations due to forces (Hook's + damping)
-		exerted by structural, shear, and bend springs respectively,
-		where the accelerations caused by structural and bend springs
-		are summed together for convenience in calculation. */
-	point accStructBend, accShear; 
-
-	/* acceleration from force exerted by collision springs */
-	point accCollision;
-
-	/* acceleration derived from the external force field */
-	point accFField;
-
-	for (i = 0; i <= 7; i++) 
-		for (j = 0; j <= 7; j++)
-			for (k = 0; k <= 7; k++) {
-				accStructBend = computeAccStructBend(jello, i, j, k);
-				accShear = computeAccShear(jello, i, j, k);
-				accCollision = checkCollision(jello, i, j, k);
-				pSUM(accStructBend, accShear, a[i][j][k]);
-				pSUM(a[i][j][k], accCollision, a[i][j][k]);
-				if (jello->resolution != 0) {
-					accFField = computeAccFField(jello, i, j, k);
-					pSUM(a[i][j][k], accFField, a[i][j][k]);
-				}
-			}
-}
-
-/* Computes the combined Hook's and damping forces exerted on point pA 
-	by the spring connecting pA and pB.
+/*	The stepping pipeline is assembled from compile-time policies:
+	the integrator (Euler or RK4) is a template over the force model, and the
+	force model is a template over the lattice size and the optional force terms
+	(inclined plane, external force field). selectStepper() inspects the world once
+	and returns the matching instantiation, so the per-particle kernels contain
+	no branches for features the world does not use. */
+
+/* Computes the combined Hook's and damping forces exerted on point pA
+	by the spring of rest length restLen connecting pA and pB.
 	Returns result in a point type. */
-point computeNetForce(const point& pA, const point& pB, const point& vA, \
-	const point& vB, double coeffK, double coeffD)
+static inline point computeNetForce(const point& pA, const point& pB, const point& vA, \
+	const point& vB, double restLen, double coeffK, double coeffD)
 {
+	point L; /* vector pointing from pB to pA, normalized */
+	double length; /* length of L, set by pNORMALIZE */
+	point vDiff; /* difference in velocities of two points */
+	double product; /* inner product of two vectors */
 	point outF;
 	pMAKE(0.0, 0.0, 0.0, outF);
 	point temp;
@@ -71,58 +42,93 @@ point computeNetForce(const point& pA, const point& pB, const point& vA, \
 	return outF;
 }
 
-/*	Computes acceleration due to the combined Hook's and damping forces 
-	exerted by both structural and bend springs on the jello point jello->p[i][j][k].
+/* width of the ghost halo around the lattice, the reach of the bend springs */
+#define HALO 2
+
+/*	The N x N x N lattice padded with a halo of HALO ghost cells on every side.
+	Springs to ghost cells have zero stiffness and zero damping, so the spring
+	kernels visit the same neighbours for interior and boundary points and need
+	no bounds checks. Ghosts sit far outside the bounding box, so the spring
+	direction towards them is always well defined. */
+template <int N>
+struct paddedLattice
+{
+	static const int M = N + 2 * HALO;
+
+	point p[M][M][M];
+	point v[M][M][M];
+	double stiffness[M][M][M]; /* 1 for real points, 0 for ghosts */
+
+	paddedLattice()
+	{
+		for (int i = 0; i < M; i++)
+			for (int j = 0; j < M; j++)
+				for (int k = 0; k < M; k++) {
+					int ghost = i < HALO || i >= N + HALO || j < HALO || j >= N + HALO || k < HALO || k >= N + HALO;
+					pMAKE(1.0e6, 1.0e6, 1.0e6, p[i][j][k]);
+					pMAKE(0.0, 0.0, 0.0, v[i][j][k]);
+					stiffness[i][j][k] = ghost ? 0.0 : 1.0;
+				}
+	}
+
+	/* copies the state of the jello cube into the interior cells */
+	void load(const struct world* jello)
+	{
+		for (int i = 0; i < N; i++)
+			for (int j = 0; j < N; j++) {
+				memcpy(&p[i + HALO][j + HALO][HALO], &jello->p[i][j][0], N * sizeof(point));
+				memcpy(&v[i + HALO][j + HALO][HALO], &jello->v[i][j][0], N * sizeof(point));
+			}
+	}
+};
+
+/* neighbour offsets of the shear springs: 12 face diagonals and 8 body diagonals */
+static const int shearOffsets[20][3] = {
+	{-1, -1, -1}, {-1, -1, 0}, {-1, -1, 1}, {-1, 0, -1}, {-1, 0, 1},
+	{-1, 1, -1}, {-1, 1, 0}, {-1, 1, 1}, {0, -1, -1}, {0, -1, 1},
+	{0, 1, -1}, {0, 1, 1}, {1, -1, -1}, {1, -1, 0}, {1, -1, 1},
+	{1, 0, -1}, {1, 0, 1}, {1, 1, -1}, {1, 1, 0}, {1, 1, 1}
+};
+
+/*	Computes acceleration due to the combined Hook's and damping forces
+	exerted by both structural and bend springs on the point lat.p[i][j][k],
+	given in padded coordinates.
 	Returns result in a point as a 3d vector. */
-point computeAccStructBend(struct world* jello, int i, int j, int k)
+template <int N>
+static inline point computeAccStructBend(const paddedLattice<N>& lat, const struct world* jello, int i, int j, int k)
 {
 	point res; /* return variable */
 	pMAKE(0.0, 0.0, 0.0, res);
 	point temp;
+	double restLen;
 
 	for (int f = 1; f <= 2; f++) {
-		if (f == 1) {
-			restLen = 1.0 / 7; /* for structural springs */
-		}
-		else {
-			restLen = 2.0 / 7; /* for bend springs */
-		}
-
-		if (i + f <= 7) {
-			temp = computeNetForce(jello->p[i][j][k], jello->p[i + f][j][k], \
-				jello->v[i][j][k], jello->v[i + f][j][k], jello->kElastic, jello->dElastic);
-			pSUM(temp, res, res);
-		}
-
-		if (i - f >= 0) {
-			temp = computeNetForce(jello->p[i][j][k], jello->p[i - f][j][k], \
-				jello->v[i][j][k], jello->v[i - f][j][k], jello->kElastic, jello->dElastic);
-			pSUM(temp, res, res);
-		}
-
-		if (j + f <= 7) {
-			temp = computeNetForce(jello->p[i][j][k], jello->p[i][j + f][k], \
-				jello->v[i][j][k], jello->v[i][j + f][k], jello->kElastic, jello->dElastic);
-			pSUM(temp, res, res);
-		}
-
-		if (j - f >= 0) {
-			temp = computeNetForce(jello->p[i][j][k], jello->p[i][j - f][k], \
-				jello->v[i][j][k], jello->v[i][j - f][k], jello->kElastic, jello->dElastic);
-			pSUM(temp, res, res);
-		}
-
-		if (k + f <= 7) {
-			temp = computeNetForce(jello->p[i][j][k], jello->p[i][j][k + f], \
-				jello->v[i][j][k], jello->v[i][j][k + f], jello->kElastic, jello->dElastic);
-			pSUM(temp, res, res);
-		}
-
-		if (k - f >= 0) {
-			temp = computeNetForce(jello->p[i][j][k], jello->p[i][j][k - f], \
-				jello->v[i][j][k], jello->v[i][j][k - f], jello->kElastic, jello->dElastic);
-			pSUM(temp, res, res);
-		}
+		/* f == 1: structural springs, f == 2: bend springs */
+		restLen = (double)f / (N - 1);
+
+		temp = computeNetForce(lat.p[i][j][k], lat.p[i + f][j][k], lat.v[i][j][k], lat.v[i + f][j][k], restLen, \
+			jello->kElastic * lat.stiffness[i + f][j][k], jello->dElastic * lat.stiffness[i + f][j][k]);
+		pSUM(temp, res, res);
+
+		temp = computeNetForce(lat.p[i][j][k], lat.p[i - f][j][k], lat.v[i][j][k], lat.v[i - f][j][k], restLen, \
+			jello->kElastic * lat.stiffness[i - f][j][k], jello->dElastic * lat.stiffness[i - f][j][k]);
+		pSUM(temp, res, res);
+
+		temp = computeNetForce(lat.p[i][j][k], lat.p[i][j + f][k], lat.v[i][j][k], lat.v[i][j + f][k], restLen, \
+			jello->kElastic * lat.stiffness[i][j + f][k], jello->dElastic * lat.stiffness[i][j + f][k]);
+		pSUM(temp, res, res);
+
+		temp = computeNetForce(lat.p[i][j][k], lat.p[i][j - f][k], lat.v[i][j][k], lat.v[i][j - f][k], restLen, \
+			jello->kElastic * lat.stiffness[i][j - f][k], jello->dElastic * lat.stiffness[i][j - f][k]);
+		pSUM(temp, res, res);
+
+		temp = computeNetForce(lat.p[i][j][k], lat.p[i][j][k + f], lat.v[i][j][k], lat.v[i][j][k + f], restLen, \
+			jello->kElastic * lat.stiffness[i][j][k + f], jello->dElastic * lat.stiffness[i][j][k + f]);
+		pSUM(temp, res, res);
+
+		temp = computeNetForce(lat.p[i][j][k], lat.p[i][j][k - f], lat.v[i][j][k], lat.v[i][j][k - f], restLen, \
+			jello->kElastic * lat.stiffness[i][j][k - f], jello->dElastic * lat.stiffness[i][j][k - f]);
+		pSUM(temp, res, res);
 	}
 
 	pMULTIPLY(res, 1 / jello->mass, res);
@@ -130,46 +136,37 @@ point computeAccStructBend(struct world* jello, int i, int j, int k)
 }
 
 /*	Computes acceleration due to the combined Hook's and damping forces
-	exerted by shear springs on the jello point jello->p[i][j][k].
+	exerted by shear springs on the point lat.p[i][j][k], given in padded coordinates.
 	Returns result in a point as a 3d vector. */
-point computeAccShear(struct world* jello, int i, int j, int k)
+template <int N>
+static inline point computeAccShear(const paddedLattice<N>& lat, const struct world* jello, int i, int j, int k)
 {
 	point res; /* return variable */
 	pMAKE(0.0, 0.0, 0.0, res);
 	point temp;
-	
-	for (int dx = -1; dx <= 1; dx++) 
-		for (int dy = -1; dy <= 1; dy++) 
-			for (int dz = -1; dz <= 1; dz++) {
-				if ((dx == 0 && dy == 0 && dz == 0) || (dx != 0 && dy == 0 && dz == 0)\
-					|| (dx == 0 && dy != 0 && dz == 0) || (dx == 0 && dy == 0 && dz != 0)) {
-					continue;
-				}
-
-				if (dx * dy * dz == 0) {
-					restLen = sqrt(2) / 7;
-				}
-				else {
-					restLen = sqrt(3) / 7;
-				}
-
-				if (i + dx >= 0 && i + dx <= 7 && j + dy >= 0 && j + dy <= 7 && k + dz >= 0 \
-					&& k + dz <= 7) {
-					temp = computeNetForce(jello->p[i][j][k], jello->p[i + dx][j + dy][k + dz], \
-						jello->v[i][j][k], jello->v[i + dx][j + dy][k + dz], jello->kElastic, jello->dElastic);
-					pSUM(temp, res, res);
-				}
-			}
+	const double restLenFace = sqrt(2) / (N - 1); /* springs along face diagonals */
+	const double restLenBody = sqrt(3) / (N - 1); /* springs along body diagonals */
+
+	for (int s = 0; s < 20; s++) {
+		int dx = shearOffsets[s][0], dy = shearOffsets[s][1], dz = shearOffsets[s][2];
+		double restLen = (dx * dy * dz == 0) ? restLenFace : restLenBody;
+		double w = lat.stiffness[i + dx][j + dy][k + dz];
+		temp = computeNetForce(lat.p[i][j][k], lat.p[i + dx][j + dy][k + dz], \
+			lat.v[i][j][k], lat.v[i + dx][j + dy][k + dz], restLen, jello->kElastic * w, jello->dElastic * w);
+		pSUM(temp, res, res);
+	}
 
-	pMULTIPLY(res, 1 / jello->mass, res); 
+	pMULTIPLY(res, 1 / jello->mass, res);
 	return res;
 }
 
-/* Performs collision detection at boundaries of the bounding box.
-	If collision occurs, computes the acceleartion caused by the collision spring 
+/* Performs collision detection at boundaries of the bounding box, and with the
+	inclined plane if the Plane policy provides one.
+	If collision occurs, computes the acceleartion caused by the collision spring
 	located at the contact point, and returns the result in a point type.
 	If no collision occurs, returns a zero vector. */
-point checkCollision(struct world* jello, int i, int j, int k)
+template <class Plane>
+static inline point checkCollision(const struct world* jello, int i, int j, int k)
 {
 	point res;
 	point temp;
@@ -180,107 +177,105 @@ point checkCollision(struct world* jello, int i, int j, int k)
 	pMAKE(0.0, 0.0, 0.0, res);
 	pCPY(jello->v[i][j][k],vA);
 	pMAKE(0.0, 0.0, 0.0, vB);
-	restLen = 0.0;
 
 	/* Composition of forces */
 	if (jello->p[i][j][k].x <= -2.0) {
 		pMAKE(jello->p[i][j][k].x, 0.0, 0.0, pA);
 		pMAKE(-2.0, 0.0, 0.0, pB);
-		temp = computeNetForce(pA, pB, vA, vB, jello->kCollision, jello->dCollision);
+		temp = computeNetForce(pA, pB, vA, vB, 0.0, jello->kCollision, jello->dCollision);
 		pSUM(temp, res, res);
 	}
 
 	if (jello->p[i][j][k].x >= 2.0) {
 		pMAKE(jello->p[i][j][k].x, 0.0, 0.0, pA);
 		pMAKE(2.0, 0.0, 0.0, pB);
-		temp = computeNetForce(pA, pB, vA, vB, jello->kCollision, jello->dCollision);
+		temp = computeNetForce(pA, pB, vA, vB, 0.0, jello->kCollision, jello->dCollision);
 		pSUM(temp, res, res);
 	}
 
 	if (jello->p[i][j][k].y <= -2.0) {
 		pMAKE(0.0, jello->p[i][j][k].y, 0.0, pA);
 		pMAKE(0.0, -2.0, 0.0, pB);
-		temp = computeNetForce(pA, pB, vA, vB, jello->kCollision, jello->dCollision);
+		temp = computeNetForce(pA, pB, vA, vB, 0.0, jello->kCollision, jello->dCollision);
 		pSUM(temp, res, res);
 	}
 
 	if (jello->p[i][j][k].y >= 2.0) {
 		pMAKE(0.0, jello->p[i][j][k].y, 0.0, pA);
 		pMAKE(0.0, 2.0, 0.0, pB);
-		temp = computeNetForce(pA, pB, vA, vB, jello->kCollision, jello->dCollision);
+		temp = computeNetForce(pA, pB, vA, vB, 0.0, jello->kCollision, jello->dCollision);
 		pSUM(temp, res, res);
 	}
 
 	if (jello->p[i][j][k].z <= -2.0) {
 		pMAKE(0.0, 0.0, jello->p[i][j][k].z, pA);
 		pMAKE(0.0, 0.0, -2.0, pB);
-		temp = computeNetForce(pA, pB, vA, vB, jello->kCollision, jello->dCollision);
+		temp = computeNetForce(pA, pB, vA, vB, 0.0, jello->kCollision, jello->dCollision);
 		pSUM(temp, res, res);
 	}
 
 	if (jello->p[i][j][k].z >= 2.0) {
-		pMAKE(0.0, 0.0, jello->p[i][j][k].z, pA); 
+		pMAKE(0.0, 0.0, jello->p[i][j][k].z, pA);
 		pMAKE(0.0, 0.0, 2.0, pB);
-		temp = computeNetForce(pA, pB, vA, vB, jello->kCollision, jello->dCollision);
+		temp = computeNetForce(pA, pB, vA, vB, 0.0, jello->kCollision, jello->dCollision);
 		pSUM(temp, res, res);
 	}
 
-	// collision detection with the input inclined plane
-	if (jello->incPlanePresent) {
-		double check = jello->p[i][j][k].x * jello->a + jello->p[i][j][k].y * jello->b \
-			+ jello->p[i][j][k].z * jello->c + jello->d;
-		double t;
-		double contactX; // x coordinate of the contact point
-		double contactY; // y coordinate of the contact point
-		double contactZ; // z coordinate of the contact point
-		if (jello->d >= 0) {
-			if (check <= 0) {
-				pMAKE(jello->p[i][j][k].x, jello->p[i][j][k].y, jello->p[i][j][k].z, pA); 
-				t = -check / (jello->a * jello->a + jello->b * jello->b + jello->c * jello->c);
-				contactX = jello->p[i][j][k].x + jello->a * t;
-				contactY = jello->p[i][j][k].y + jello->b * t;
-				contactZ = jello->p[i][j][k].z + jello->c * t;
-				pMAKE(contactX, contactY, contactZ, pB);
-				temp = computeNetForce(pA, pB, vA, vB, jello->kCollision, jello->dCollision);
-				pSUM(temp, res, res);
-			}
-		}
-		else {
-			if (check >= 0) {
-				pMAKE(jello->p[i][j][k].x, jello->p[i][j][k].y, jello->p[i][j][k].z, pA);
-				t = -check / (jello->a * jello->a + jello->b * jello->b + jello->c * jello->c);
-				contactX = jello->p[i][j][k].x + jello->a * t;
-				contactY = jello->p[i][j][k].y + jello->b * t;
-				contactZ = jello->p[i][j][k].z + jello->c * t;
-				pMAKE(contactX, contactY, contactZ, pB);
-				temp = computeNetForce(pA, pB, vA, vB, jello->kCollision, jello->dCollision);
-				pSUM(temp, res, res);
-			}
-		}
-	}
+	Plane::add(jello, i, j, k, res);
 
 	pMULTIPLY(res, 1 / jello->mass, res);
 	return res;
 }
 
+/* Collision detection with the input inclined plane.
+	Adds the force exerted by the collision spring at the contact point to res,
+	if the point is on the wrong side of the plane. */
+static inline void addPlaneCollision(const struct world* jello, int i, int j, int k, point& res)
+{
+	point temp;
+	point pA;
+	point pB;
+	point vA;
+	point vB;
+	pCPY(jello->v[i][j][k],vA);
+	pMAKE(0.0, 0.0, 0.0, vB);
+
+	double check = jello->p[i][j][k].x * jello->a + jello->p[i][j][k].y * jello->b \
+		+ jello->p[i][j][k].z * jello->c + jello->d;
+	double t;
+	double contactX; // x coordinate of the contact point
+	double contactY; // y coordinate of the contact point
+	double contactZ; // z coordinate of the contact point
+	if ((jello->d >= 0 && check <= 0) || (jello->d < 0 && check >= 0)) {
+		pMAKE(jello->p[i][j][k].x, jello->p[i][j][k].y, jello->p[i][j][k].z, pA);
+		t = -check / (jello->a * jello->a + jello->b * jello->b + jello->c * jello->c);
+		contactX = jello->p[i][j][k].x + jello->a * t;
+		contactY = jello->p[i][j][k].y + jello->b * t;
+		contactZ = jello->p[i][j][k].z + jello->c * t;
+		pMAKE(contactX, contactY, contactZ, pB);
+		temp = computeNetForce(pA, pB, vA, vB, 0.0, jello->kCollision, jello->dCollision);
+		pSUM(temp, res, res);
+	}
+}
+
 /*	Computes acceleration due to the external non-homogeneous time-independent
 	force field. Supports a grid resolution between 2 and 30.
 	Applies trilinear interpolation to find the field force exerted on
 	one jello sampling point.
 	Returns result in a point type as a 3d vector. */
-point computeAccFField(struct world* jello, int i, int j, int k)
+static inline point computeAccFField(const struct world* jello, int i, int j, int k)
 {
 	point res;
 	pMAKE(0.0, 0.0, 0.0, res);
 	point temp;
 
 	/* Out of the force field */
-	if (jello->p[i][j][k].x < -2.0 || jello->p[i][j][k].x > 2.0 || jello->p[i][j][k].y < -2.0 || jello->p[i][j][k].y > 2.0 
-		|| jello->p[i][j][k].z < -2.0 || jello->p[i][j][k].z > 2.0) { 
+	if (jello->p[i][j][k].x < -2.0 || jello->p[i][j][k].x > 2.0 || jello->p[i][j][k].y < -2.0 || jello->p[i][j][k].y > 2.0
+		|| jello->p[i][j][k].z < -2.0 || jello->p[i][j][k].z > 2.0) {
 			return res;
 	}
 
-	int iBase = floor((jello->p[i][j][k].x + 2.0) / 4.0 * (jello->resolution - 1)); // nearest lower field index along x-axis 
+	int iBase = floor((jello->p[i][j][k].x + 2.0) / 4.0 * (jello->resolution - 1)); // nearest lower field index along x-axis
 	int jBase = floor((jello->p[i][j][k].y + 2.0) / 4.0 * (jello->resolution - 1)); // nearest lower field index along y-axis
 	int kBase = floor((jello->p[i][j][k].z + 2.0) / 4.0 * (jello->resolution - 1)); // nearest lower field index along z-axis
 
@@ -321,127 +316,245 @@ point computeAccFField(struct world* jello, int i, int j, int k)
 	}
 	if ((iBase + 1 < jello->resolution) && (jBase + 1 < jello->resolution) && (kBase + 1 < jello->resolution)) {
 		pMULTIPLY(jello->forceField[(iBase + 1) * jello->resolution * jello->resolution + (jBase + 1) * jello->resolution + (kBase + 1)], rx * ry * rz, temp);
-		pSUM(res, temp, res); 
+		pSUM(res, temp, res);
 	}
 
 	pMULTIPLY(res, 1 / jello->mass, res);
 	return res;
 }
 
+/* Optional force terms. Each policy adds its contribution, or compiles to nothing.
+	The plane adds a collision force, the field adds an acceleration. */
+struct noPlane
+{
+	static inline void add(const struct world*, int, int, int, point&) {}
+};
+
+struct inclinedPlane
+{
+	static inline void add(const struct world* jello, int i, int j, int k, point& f)
+	{
+		addPlaneCollision(jello, i, j, k, f);
+	}
+};
+
+struct noField
+{
+	static inline void add(const struct world*, int, int, int, point&) {}
+};
+
+struct forceField
+{
+	static inline void add(const struct world* jello, int i, int j, int k, point& a)
+	{
+		point accFField = computeAccFField(jello, i, j, k);
+		pSUM(a, accFField, a);
+	}
+};
+
+/*	Force model of an N x N x N jello cube: springs and bounding box collisions
+	are always present, the inclined plane and the force field are policies. */
+template <int N, class Plane, class Field>
+struct forceModel
+{
+	static const int size = N;
+
+	/*	Computes acceleration to every control point of the jello cube,
+		which is in state given by 'jello'.
+		Returns result in array 'a'. */
+	static void computeAcceleration(const struct world * jello, struct point a[N][N][N])
+	{
+		/*	accelerations due to forces (Hook's + damping)
+			exerted by structural, shear, and bend springs respectively,
+			where the accelerations caused by structural and bend springs
+			are summed together for convenience in calculation. */
+		point accStructBend, accShear;
+
+		/* acceleration from force exerted by collision springs */
+		point accCollision;
+
+		/* the springs are evaluated on a copy of the state with a ghost halo */
+		static paddedLattice<N> lattice;
+		lattice.load(jello);
+
+		for (int i = 0; i <= N - 1; i++)
+			for (int j = 0; j <= N - 1; j++)
+				for (int k = 0; k <= N - 1; k++) {
+					accStructBend = computeAccStructBend<N>(lattice, jello, i + HALO, j + HALO, k + HALO);
+					accShear = computeAccShear<N>(lattice, jello, i + HALO, j + HALO, k + HALO);
+					accCollision = checkCollision<Plane>(jello, i, j, k);
+					pSUM(accStructBend, accShear, a[i][j][k]);
+					pSUM(a[i][j][k], accCollision, a[i][j][k]);
+					Field::add(jello, i, j, k, a[i][j][k]);
+				}
+	}
+};
+
 /* performs one step of Euler Integration */
 /* as a result, updates the jello structure */
-void Euler(struct world * jello)
+template <class Forces>
+struct eulerIntegrator
 {
-  int i,j,k;
-  point a[8][8][8];
-
-  computeAcceleration(jello, a);
-  
-  for (i=0; i<=7; i++)
-	for (j=0; j<=7; j++)
-	  for (k=0; k<=7; k++)
-	  {
-		jello->p[i][j][k].x += jello->dt * jello->v[i][j][k].x;
-		jello->p[i][j][k].y += jello->dt * jello->v[i][j][k].y;
-		jello->p[i][j][k].z += jello->dt * jello->v[i][j][k].z;
-		jello->v[i][j][k].x += jello->dt * a[i][j][k].x;
-		jello->v[i][j][k].y += jello->dt * a[i][j][k].y;
-		jello->v[i][j][k].z += jello->dt * a[i][j][k].z;
-	  }
-}
+	static const int N = Forces::size;
+
+	static void step(struct world * jello)
+	{
+	  int i,j,k;
+	  point a[N][N][N];
+
+	  Forces::computeAcceleration(jello, a);
+
+	  for (i=0; i<=N-1; i++)
+		for (j=0; j<=N-1; j++)
+		  for (k=0; k<=N-1; k++)
+		  {
+			jello->p[i][j][k].x += jello->dt * jello->v[i][j][k].x;
+			jello->p[i][j][k].y += jello->dt * jello->v[i][j][k].y;
+			jello->p[i][j][k].z += jello->dt * jello->v[i][j][k].z;
+			jello->v[i][j][k].x += jello->dt * a[i][j][k].x;
+			jello->v[i][j][k].y += jello->dt * a[i][j][k].y;
+			jello->v[i][j][k].z += jello->dt * a[i][j][k].z;
+		  }
+	}
+};
 
 /* performs one step of RK4 Integration */
 /* as a result, updates the jello structure */
-void RK4(struct world * jello)
+template <class Forces>
+struct rk4Integrator
+{
+	static const int N = Forces::size;
+
+	static void step(struct world * jello)
+	{
+	  point F1p[N][N][N], F1v[N][N][N],
+			F2p[N][N][N], F2v[N][N][N],
+			F3p[N][N][N], F3v[N][N][N],
+			F4p[N][N][N], F4v[N][N][N];
+
+	  point a[N][N][N];
+
+
+	  struct world buffer;
+
+	  int i,j,k;
+
+	  buffer = *jello; // make a copy of jello
+
+	  Forces::computeAcceleration(jello, a);
+
+	  for (i=0; i<=N-1; i++)
+		for (j=0; j<=N-1; j++)
+		  for (k=0; k<=N-1; k++)
+		  {
+			 pMULTIPLY(jello->v[i][j][k],jello->dt,F1p[i][j][k]);
+			 pMULTIPLY(a[i][j][k],jello->dt,F1v[i][j][k]);
+			 pMULTIPLY(F1p[i][j][k],0.5,buffer.p[i][j][k]);
+			 pMULTIPLY(F1v[i][j][k],0.5,buffer.v[i][j][k]);
+			 pSUM(jello->p[i][j][k],buffer.p[i][j][k],buffer.p[i][j][k]);
+			 pSUM(jello->v[i][j][k],buffer.v[i][j][k],buffer.v[i][j][k]);
+		  }
+
+	  Forces::computeAcceleration(&buffer, a);
+
+	  for (i=0; i<=N-1; i++)
+		for (j=0; j<=N-1; j++)
+		  for (k=0; k<=N-1; k++)
+		  {
+			 // F2p = dt * buffer.v;
+			 pMULTIPLY(buffer.v[i][j][k],jello->dt,F2p[i][j][k]);
+			 // F2v = dt * a(buffer.p,buffer.v);
+			 pMULTIPLY(a[i][j][k],jello->dt,F2v[i][j][k]);
+			 pMULTIPLY(F2p[i][j][k],0.5,buffer.p[i][j][k]);
+			 pMULTIPLY(F2v[i][j][k],0.5,buffer.v[i][j][k]);
+			 pSUM(jello->p[i][j][k],buffer.p[i][j][k],buffer.p[i][j][k]);
+			 pSUM(jello->v[i][j][k],buffer.v[i][j][k],buffer.v[i][j][k]);
+		  }
+
+	  Forces::computeAcceleration(&buffer, a);
+
+	  for (i=0; i<=N-1; i++)
+		for (j=0; j<=N-1; j++)
+		  for (k=0; k<=N-1; k++)
+		  {
+			 // F3p = dt * buffer.v;
+			 pMULTIPLY(buffer.v[i][j][k],jello->dt,F3p[i][j][k]);
+			 // F3v = dt * a(buffer.p,buffer.v);
+			 pMULTIPLY(a[i][j][k],jello->dt,F3v[i][j][k]);
+			 pMULTIPLY(F3p[i][j][k],1.0,buffer.p[i][j][k]);
+			 pMULTIPLY(F3v[i][j][k],1.0,buffer.v[i][j][k]);
+			 pSUM(jello->p[i][j][k],buffer.p[i][j][k],buffer.p[i][j][k]);
+			 pSUM(jello->v[i][j][k],buffer.v[i][j][k],buffer.v[i][j][k]);
+		  }
+
+	  Forces::computeAcceleration(&buffer, a);
+
+
+	  for (i=0; i<=N-1; i++)
+		for (j=0; j<=N-1; j++)
+		  for (k=0; k<=N-1; k++)
+		  {
+			 // F3p = dt * buffer.v;
+			 pMULTIPLY(buffer.v[i][j][k],jello->dt,F4p[i][j][k]);
+			 // F3v = dt * a(buffer.p,buffer.v);
+			 pMULTIPLY(a[i][j][k],jello->dt,F4v[i][j][k]);
+
+			 pMULTIPLY(F2p[i][j][k],2,buffer.p[i][j][k]);
+			 pMULTIPLY(F3p[i][j][k],2,buffer.v[i][j][k]);
+			 pSUM(buffer.p[i][j][k],buffer.v[i][j][k],buffer.p[i][j][k]);
+			 pSUM(buffer.p[i][j][k],F1p[i][j][k],buffer.p[i][j][k]);
+			 pSUM(buffer.p[i][j][k],F4p[i][j][k],buffer.p[i][j][k]);
+			 pMULTIPLY(buffer.p[i][j][k],1.0 / 6,buffer.p[i][j][k]);
+			 pSUM(buffer.p[i][j][k],jello->p[i][j][k],jello->p[i][j][k]);
+
+			 pMULTIPLY(F2v[i][j][k],2,buffer.p[i][j][k]);
+			 pMULTIPLY(F3v[i][j][k],2,buffer.v[i][j][k]);
+			 pSUM(buffer.p[i][j][k],buffer.v[i][j][k],buffer.p[i][j][k]);
+			 pSUM(buffer.p[i][j][k],F1v[i][j][k],buffer.p[i][j][k]);
+			 pSUM(buffer.p[i][j][k],F4v[i][j][k],buffer.p[i][j][k]);
+			 pMULTIPLY(buffer.p[i][j][k],1.0 / 6,buffer.p[i][j][k]);
+			 pSUM(buffer.p[i][j][k],jello->v[i][j][k],jello->v[i][j][k]);
+		  }
+	}
+};
+
+/* advances the simulation by 'steps' timesteps of the given integrator */
+template <class Integrator>
+static void runSteps(struct world * jello, int steps)
+{
+	for (int s = 0; s < steps; s++)
+		Integrator::step(jello);
+}
+
+/* used when the world file names an unknown integrator: the cube stays still */
+static void noSteps(struct world *, int)
+{
+}
+
+/* picks the integrator instantiation for the force terms present in the world */
+template <template <class> class Integrator, int N>
+static stepFunction selectForces(const struct world * jello)
 {
-  point F1p[8][8][8], F1v[8][8][8], 
-		F2p[8][8][8], F2v[8][8][8],
-		F3p[8][8][8], F3v[8][8][8],
-		F4p[8][8][8], F4v[8][8][8];
-
-  point a[8][8][8];
-
-
-  struct world buffer;
-
-  int i,j,k;
-
-  buffer = *jello; // make a copy of jello
-
-  computeAcceleration(jello, a);
-
-  for (i=0; i<=7; i++)
-	for (j=0; j<=7; j++)
-	  for (k=0; k<=7; k++)
-	  {
-		 pMULTIPLY(jello->v[i][j][k],jello->dt,F1p[i][j][k]);
-		 pMULTIPLY(a[i][j][k],jello->dt,F1v[i][j][k]);
-		 pMULTIPLY(F1p[i][j][k],0.5,buffer.p[i][j][k]);
-		 pMULTIPLY(F1v[i][j][k],0.5,buffer.v[i][j][k]);
-		 pSUM(jello->p[i][j][k],buffer.p[i][j][k],buffer.p[i][j][k]);
-		 pSUM(jello->v[i][j][k],buffer.v[i][j][k],buffer.v[i][j][k]);
-	  }
-
-  computeAcceleration(&buffer, a);
-
-  for (i=0; i<=7; i++)
-	for (j=0; j<=7; j++)
-	  for (k=0; k<=7; k++)
-	  {
-		 // F2p = dt * buffer.v;
-		 pMULTIPLY(buffer.v[i][j][k],jello->dt,F2p[i][j][k]);
-		 // F2v = dt * a(buffer.p,buffer.v);     
-		 pMULTIPLY(a[i][j][k],jello->dt,F2v[i][j][k]);
-		 pMULTIPLY(F2p[i][j][k],0.5,buffer.p[i][j][k]);
-		 pMULTIPLY(F2v[i][j][k],0.5,buffer.v[i][j][k]);
-		 pSUM(jello->p[i][j][k],buffer.p[i][j][k],buffer.p[i][j][k]);
-		 pSUM(jello->v[i][j][k],buffer.v[i][j][k],buffer.v[i][j][k]);
-	  }
-
-  computeAcceleration(&buffer, a);
-
-  for (i=0; i<=7; i++)
-	for (j=0; j<=7; j++)
-	  for (k=0; k<=7; k++)
-	  {
-		 // F3p = dt * buffer.v;
-		 pMULTIPLY(buffer.v[i][j][k],jello->dt,F3p[i][j][k]);
-		 // F3v = dt * a(buffer.p,buffer.v);     
-		 pMULTIPLY(a[i][j][k],jello->dt,F3v[i][j][k]);
-		 pMULTIPLY(F3p[i][j][k],1.0,buffer.p[i][j][k]);
-		 pMULTIPLY(F3v[i][j][k],1.0,buffer.v[i][j][k]);
-		 pSUM(jello->p[i][j][k],buffer.p[i][j][k],buffer.p[i][j][k]);
-		 pSUM(jello->v[i][j][k],buffer.v[i][j][k],buffer.v[i][j][k]);
-	  }
-		 
-  computeAcceleration(&buffer, a);
-
-
-  for (i=0; i<=7; i++)
-	for (j=0; j<=7; j++)
-	  for (k=0; k<=7; k++)
-	  {
-		 // F3p = dt * buffer.v;
-		 pMULTIPLY(buffer.v[i][j][k],jello->dt,F4p[i][j][k]);
-		 // F3v = dt * a(buffer.p,buffer.v);     
-		 pMULTIPLY(a[i][j][k],jello->dt,F4v[i][j][k]);
-
-		 pMULTIPLY(F2p[i][j][k],2,buffer.p[i][j][k]);
-		 pMULTIPLY(F3p[i][j][k],2,buffer.v[i][j][k]);
-		 pSUM(buffer.p[i][j][k],buffer.v[i][j][k],buffer.p[i][j][k]);
-		 pSUM(buffer.p[i][j][k],F1p[i][j][k],buffer.p[i][j][k]);
-		 pSUM(buffer.p[i][j][k],F4p[i][j][k],buffer.p[i][j][k]);
-		 pMULTIPLY(buffer.p[i][j][k],1.0 / 6,buffer.p[i][j][k]);
-		 pSUM(buffer.p[i][j][k],jello->p[i][j][k],jello->p[i][j][k]);
-
-		 pMULTIPLY(F2v[i][j][k],2,buffer.p[i][j][k]);
-		 pMULTIPLY(F3v[i][j][k],2,buffer.v[i][j][k]);
-		 pSUM(buffer.p[i][j][k],buffer.v[i][j][k],buffer.p[i][j][k]);
-		 pSUM(buffer.p[i][j][k],F1v[i][j][k],buffer.p[i][j][k]);
-		 pSUM(buffer.p[i][j][k],F4v[i][j][k],buffer.p[i][j][k]);
-		 pMULTIPLY(buffer.p[i][j][k],1.0 / 6,buffer.p[i][j][k]);
-		 pSUM(buffer.p[i][j][k],jello->v[i][j][k],jello->v[i][j][k]);
-	  }
-
-  return;  
+	if (jello->incPlanePresent) {
+		if (jello->resolution != 0)
+			return runSteps<Integrator<forceModel<N, inclinedPlane, forceField> > >;
+		return runSteps<Integrator<forceModel<N, inclinedPlane, noField> > >;
+	}
+	if (jello->resolution != 0)
+		return runSteps<Integrator<forceModel<N, noPlane, forceField> > >;
+	return runSteps<Integrator<forceModel<N, noPlane, noField> > >;
+}
+
+stepFunction selectStepper(const struct world * jello)
+{
+	/* the world structure stores an 8 x 8 x 8 lattice */
+	const int N = sizeof(jello->p[0][0]) / sizeof(jello->p[0][0][0]);
+
+	if (strcmp(jello->integrator, "Euler") == 0)
+		return selectForces<eulerIntegrator, N>(jello);
+	if (strcmp(jello->integrator, "RK4") == 0)
+		return selectForces<rk4Integrator, N>(jello);
+
+	printf("Unknown integrator %s, the simulation will not advance.\n", jello->integrator);
+	return noSteps;
 }
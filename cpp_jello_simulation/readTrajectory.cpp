@@ -0,0 +1,89 @@
+/*
+
+  USC/Viterbi/Computer Science
+  "Jello Cube" Assignment 1 starter code
+
+  readTrajectory utility to inspect trajectory files recorded by the simulator
+
+  Usage:
+    readTrajectory <trajectory file>                  prints a summary of the recording
+    readTrajectory <trajectory file> <output file>    also writes every frame as text,
+                                                      in the same "x y z" format as world files
+
+*/
+
+#include "jello.h"
+#include "trajectory.h"
+
+#include <vector>
+
+int main(int argc, char ** argv)
+{
+  if (argc < 2)
+  {
+    printf("Usage: %s <trajectory file> [output text file]\n", argv[0]);
+    exit(0);
+  }
+
+  FILE * file = fopen(argv[1], "rb");
+  if (file == NULL)
+  {
+    printf("can't open file %s\n", argv[1]);
+    exit(1);
+  }
+
+  struct trajectoryHeader header;
+  if (!readTrajectoryHeader(file, &header))
+  {
+    printf("%s is not a trajectory file\n", argv[1]);
+    exit(1);
+  }
+
+  FILE * out = NULL;
+  if (argc >= 3)
+  {
+    out = fopen(argv[2], "w");
+    if (out == NULL)
+    {
+      printf("can't open file %s\n", argv[2]);
+      exit(1);
+    }
+  }
+
+  std::vector<int32_t> q(header.numPoints * 3);
+  long frames = 0;
+  long textBytes = 0; // size the same frames take as a text dump
+  char line[128];
+  int status;
+  while ((status = readTrajectoryFrame(file, &header, q.data())) == 1)
+  {
+    if (out != NULL)
+      fprintf(out, "# frame %ld t = %lf\n", frames, frames * header.frameTime);
+    for (uint32_t c = 0; c < header.numPoints * 3; c += 3)
+    {
+      int len = snprintf(line, sizeof line, "%lf %lf %lf\n",
+        q[c] * header.quantum, q[c + 1] * header.quantum, q[c + 2] * header.quantum);
+      textBytes += len;
+      if (out != NULL)
+        fputs(line, out);
+    }
+    frames++;
+  }
+
+  long fileBytes = ftell(file);
+  fclose(file);
+  if (out != NULL)
+    fclose(out);
+
+  if (status < 0)
+    printf("%s is truncated or malformed after frame %ld; the summary covers the frames before it\n", argv[1], frames);
+  // the recording spans the intervals between its frames
+  printf("frames: %ld (%lf s of simulated time)\n", frames, frames > 0 ? (frames - 1) * header.frameTime : 0.0);
+  printf("points per frame: %u, quantum: %g m, key frame every %u frames\n",
+    header.numPoints, header.quantum, header.keyInterval);
+  printf("file size: %ld bytes (%.1lf bytes per frame)\n", fileBytes, frames ? (double)fileBytes / frames : 0.0);
+  printf("as text: %ld bytes (%.1lfx larger)\n", textBytes, fileBytes ? (double)textBytes / fileBytes : 0.0);
+
+  return status < 0 ? 1 : 0;
+}
+
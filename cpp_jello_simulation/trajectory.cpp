@@ -0,0 +1,256 @@
+/*
+
+  USC/Viterbi/Computer Science
+  "Jello Cube" Assignment 1 starter code
+
+*/
+
+#include "jello.h"
+#include "trajectory.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+/* number of frames that may wait for the writer thread before the simulation blocks */
+#define TRAJ_QUEUE_SIZE 64
+
+/* largest encoded frame: every coordinate takes at most 5 varint bytes */
+#define TRAJ_MAX_PAYLOAD (TRAJ_NUM_POINTS * 3 * 5)
+
+static const char trajMagic[4] = { 'J', 'T', 'R', 'J' };
+
+/* state shared between the simulation thread and the writer thread */
+struct trajectoryWriter
+{
+  FILE * file;
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable notEmpty, notFull;
+  struct point frames[TRAJ_QUEUE_SIZE][TRAJ_NUM_POINTS]; // ring of raw frames
+  int head, count; // index of the oldest queued frame, number of queued frames
+  int stopping;
+};
+
+static struct trajectoryWriter * writer = NULL;
+
+static void putU32(unsigned char * dest, uint32_t value)
+{
+  for (int b = 0; b < 4; b++)
+    dest[b] = (unsigned char)(value >> (8 * b));
+}
+
+static uint32_t getU32(const unsigned char * src)
+{
+  return (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+static void putDouble(unsigned char * dest, double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof bits);
+  putU32(dest, (uint32_t)bits);
+  putU32(dest + 4, (uint32_t)(bits >> 32));
+}
+
+static double getDouble(const unsigned char * src)
+{
+  uint64_t bits = (uint64_t)getU32(src) | ((uint64_t)getU32(src + 4) << 32);
+  double value;
+  memcpy(&value, &bits, sizeof value);
+  return value;
+}
+
+/* appends a signed value as a zigzag varint, returns the number of bytes written */
+static int putVarint(unsigned char * dest, int32_t value)
+{
+  uint32_t zz = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+  int n = 0;
+  while (zz >= 0x80)
+  {
+    dest[n++] = (unsigned char)(zz | 0x80);
+    zz >>= 7;
+  }
+  dest[n++] = (unsigned char)zz;
+  return n;
+}
+
+/* reads a zigzag varint, returns the number of bytes consumed or 0 if the buffer ends first */
+static int getVarint(const unsigned char * src, int available, int32_t * value)
+{
+  uint32_t zz = 0;
+  for (int n = 0; n < available && n < 5; n++)
+  {
+    zz |= (uint32_t)(src[n] & 0x7f) << (7 * n);
+    if ((src[n] & 0x80) == 0)
+    {
+      *value = (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+      return n + 1;
+    }
+  }
+  return 0;
+}
+
+/* quantizes a coordinate, clamping values the int32_t range (and the deltas between them) cannot hold */
+static int32_t quantize(double value)
+{
+  double steps = floor(value / TRAJ_QUANTUM + 0.5);
+  if (steps != steps) // NaN
+    return 0;
+  if (steps > TRAJ_MAX_QUANTIZED)
+    return TRAJ_MAX_QUANTIZED;
+  if (steps < -TRAJ_MAX_QUANTIZED)
+    return -TRAJ_MAX_QUANTIZED;
+  return (int32_t)steps;
+}
+
+/* encodes the frames handed over by the simulation and writes them to disk */
+static void writerLoop()
+{
+  struct point frame[TRAJ_NUM_POINTS];
+  int32_t prev[TRAJ_NUM_POINTS * 3];
+  unsigned char out[5 + TRAJ_MAX_PAYLOAD];
+  unsigned int frameIndex = 0;
+
+  while (1)
+  {
+    {
+      std::unique_lock<std::mutex> guard(writer->lock);
+      writer->notEmpty.wait(guard, [] { return writer->count > 0 || writer->stopping; });
+      if (writer->count == 0)
+        break; // stopping and fully drained
+      memcpy(frame, writer->frames[writer->head], sizeof frame);
+      writer->head = (writer->head + 1) % TRAJ_QUEUE_SIZE;
+      writer->count--;
+    }
+    writer->notFull.notify_one();
+
+    int key = (frameIndex % TRAJ_KEY_INTERVAL) == 0;
+    int size = 0;
+    for (int c = 0; c < TRAJ_NUM_POINTS * 3; c++)
+    {
+      const double * coords = &frame[c / 3].x;
+      int32_t q = quantize(coords[c % 3]);
+      size += putVarint(out + 5 + size, key ? q : q - prev[c]);
+      prev[c] = q;
+    }
+    out[0] = key ? TRAJ_KEY_FRAME : TRAJ_DELTA_FRAME;
+    putU32(out + 1, (uint32_t)size);
+    fwrite(out, 1, 5 + size, writer->file);
+    frameIndex++;
+  }
+}
+
+/* Opens the trajectory file, writes its header and starts the writer thread.
+   Frames are spaced jello->dt * jello->n apart in simulated time. */
+int startTrajectory(const char * fileName, struct world * jello)
+{
+  FILE * file = fopen(fileName, "wb");
+  if (file == NULL)
+  {
+    printf("can't open trajectory file %s\n", fileName);
+    return 0;
+  }
+
+  unsigned char header[4 + 4 * 4 + 2 * 8];
+  memcpy(header, trajMagic, 4);
+  putU32(header + 4, TRAJ_VERSION);
+  putU32(header + 8, TRAJ_NUM_POINTS);
+  putU32(header + 12, TRAJ_KEY_INTERVAL);
+  putU32(header + 16, 0); // reserved
+  putDouble(header + 20, TRAJ_QUANTUM);
+  putDouble(header + 28, jello->dt * jello->n);
+  fwrite(header, 1, sizeof header, file);
+
+  writer = new trajectoryWriter();
+  writer->file = file;
+  writer->head = 0;
+  writer->count = 0;
+  writer->stopping = 0;
+  writer->thread = std::thread(writerLoop);
+  return 1;
+}
+
+/* Hands the current positions over to the writer thread.
+   Only copies the positions; quantization, encoding and I/O happen in the background.
+   Blocks only if the writer has fallen TRAJ_QUEUE_SIZE frames behind. */
+void recordTrajectoryFrame(struct world * jello)
+{
+  if (writer == NULL)
+    return;
+
+  {
+    std::unique_lock<std::mutex> guard(writer->lock);
+    writer->notFull.wait(guard, [] { return writer->count < TRAJ_QUEUE_SIZE; });
+    int tail = (writer->head + writer->count) % TRAJ_QUEUE_SIZE;
+    memcpy(writer->frames[tail], jello->p, sizeof writer->frames[tail]);
+    writer->count++;
+  }
+  writer->notEmpty.notify_one();
+}
+
+/* Flushes the queued frames and closes the file. Safe to call more than once. */
+void stopTrajectory()
+{
+  if (writer == NULL)
+    return;
+
+  {
+    std::lock_guard<std::mutex> guard(writer->lock);
+    writer->stopping = 1;
+  }
+  writer->notEmpty.notify_one();
+  writer->thread.join();
+  fclose(writer->file);
+  delete writer;
+  writer = NULL;
+}
+
+int readTrajectoryHeader(FILE * file, struct trajectoryHeader * header)
+{
+  unsigned char buf[4 + 4 * 4 + 2 * 8];
+  if (fread(buf, 1, sizeof buf, file) != sizeof buf || memcmp(buf, trajMagic, 4) != 0)
+    return 0;
+
+  header->version = getU32(buf + 4);
+  header->numPoints = getU32(buf + 8);
+  header->keyInterval = getU32(buf + 12);
+  header->quantum = getDouble(buf + 20);
+  header->frameTime = getDouble(buf + 28);
+  // a frame of numPoints * 3 varints must stay addressable by int
+  return header->version == TRAJ_VERSION && header->numPoints > 0 && header->numPoints <= INT32_MAX / (3 * 5);
+}
+
+int readTrajectoryFrame(FILE * file, const struct trajectoryHeader * header, int32_t * q)
+{
+  unsigned char frameHeader[5];
+  size_t got = fread(frameHeader, 1, sizeof frameHeader, file);
+  if (got == 0 && feof(file))
+    return 0;
+  if (got != sizeof frameHeader)
+    return -1;
+
+  // check the size against the largest frame before allocating, so a corrupt size is not trusted
+  uint32_t size = getU32(frameHeader + 1);
+  if ((frameHeader[0] != TRAJ_KEY_FRAME && frameHeader[0] != TRAJ_DELTA_FRAME)
+    || size > (uint64_t)header->numPoints * 3 * 5)
+    return -1;
+  std::vector<unsigned char> payload(size);
+  if (fread(payload.data(), 1, size, file) != size)
+    return -1;
+
+  int key = frameHeader[0] == TRAJ_KEY_FRAME;
+  int pos = 0;
+  for (uint32_t c = 0; c < header->numPoints * 3; c++)
+  {
+    int32_t value;
+    int used = getVarint(payload.data() + pos, (int)size - pos, &value);
+    if (used == 0)
+      return -1;
+    pos += used;
+    q[c] = key ? value : q[c] + value;
+  }
+  return 1;
+}
+
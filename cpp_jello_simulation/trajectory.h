@@ -0,0 +1,74 @@
+/*
+
+  USC/Viterbi/Computer Science
+  "Jello Cube" Assignment 1 starter code
+
+  Trajectory recording: streams the 512 control point positions of every
+  displayed frame to a compact binary file, for offline rendering and analysis.
+
+*/
+
+#ifndef _TRAJECTORY_H_
+#define _TRAJECTORY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+  File layout (all integers little-endian):
+
+  header:
+    char     magic[4];          "JTRJ"
+    uint32_t version;           TRAJ_VERSION
+    uint32_t numPoints;         512
+    uint32_t keyInterval;       every keyInterval-th frame is a key frame
+    uint32_t reserved;          0
+    double   quantum;           size of one quantization step, in meters
+    double   frameTime;         simulated time between two frames (dt * n)
+
+  followed by any number of frames:
+    uint8_t  type;              TRAJ_KEY_FRAME or TRAJ_DELTA_FRAME
+    uint32_t size;              number of payload bytes that follow
+    payload:                    numPoints * 3 zigzag varints, ordered p[i][j][k].x,y,z
+
+  Every coordinate is quantized to round(value / quantum). Key frames store the
+  quantized coordinates themselves; delta frames store the difference to the
+  previous frame. Between two displayed frames the cube moves very little, so
+  most deltas fit in one or two bytes instead of the ~30 bytes of a text dump.
+  A simulation that blows up still gives a readable file: coordinates beyond
+  +-TRAJ_MAX_QUANTIZED steps are clamped to it, and NaN is stored as 0.
+*/
+
+#define TRAJ_VERSION 1
+#define TRAJ_NUM_POINTS 512
+#define TRAJ_QUANTUM 1.0e-5
+#define TRAJ_MAX_QUANTIZED 0x3fffffff // keeps every delta within int32_t
+#define TRAJ_KEY_INTERVAL 64
+#define TRAJ_KEY_FRAME 0
+#define TRAJ_DELTA_FRAME 1
+
+struct trajectoryHeader
+{
+  uint32_t version;
+  uint32_t numPoints;
+  uint32_t keyInterval;
+  double quantum;
+  double frameTime;
+};
+
+// recording, used by the simulator; a background thread encodes and writes the frames
+// returns 0 if the file could not be opened
+int startTrajectory(const char * fileName, struct world * jello);
+void recordTrajectoryFrame(struct world * jello);
+void stopTrajectory();
+
+// playback, used by the readTrajectory utility
+// readTrajectoryHeader returns 0 on a malformed file
+// readTrajectoryFrame decodes the next frame into q (numPoints * 3 quantized coordinates,
+// which must hold the previous frame on entry) and returns 1, 0 at the end of the file,
+// or -1 if the frame is truncated or malformed
+int readTrajectoryHeader(FILE * file, struct trajectoryHeader * header);
+int readTrajectoryFrame(FILE * file, const struct trajectoryHeader * header, int32_t * q);
+
+#endif
+
@@ -1,35 +1,203 @@
-/*	This file implements the client interface that users interact with, connecting to Server M via TCP connections. */
+/*	This file implements the client interface that users interact with, connecting to Server M via TCP connections.
+ *	Price updates of the stocks the user has subscribed to are pushed by Server M and shown whenever the client
+ *	is waiting, whether for the user's input or for a response.
+ *	After a successful login, the session token issued by Server M is saved in the file .session_<username>,
+ *	so that the next client of the same user logs in with it instead of asking for the password.
+ *	Limit orders rest on the book of the matching engine until they are filled or cancelled; their fills reach the
+ *	user's portfolio without further confirmation.
+ */
 
 #include "utility.h"
 using namespace std;
 
+// Global Variables
+uint32_t nextRequestId = 1; // request ID of the next request sent to Server M
+string inputBuf;            // typed input that does not form a complete line yet
+
+/*
+ * Show a price update Server M has pushed for a subscribed stock.
+ * @param update the update, format: <stock> <price>
+ */
+void showUpdate(const string& update) {
+	printf("[Client] Price update: %s\n", update.c_str());
+}
+
+/*
+ * Send a message to Server M, or exit if the connection has failed.
+ * @param sockfd the TCP socket connecting to Server M
+ * @param id the request ID the message belongs to
+ * @param msg the message
+ * @param errMsg the message printed on failure
+ */
+void sendMsg(int sockfd, uint32_t id, const string& msg, const char* errMsg) {
+	if (sendFrame(sockfd, id, msg) == -1) {
+		close(sockfd);
+		perror(errMsg);
+		exit(1);
+	}
+}
+
+/*
+ * Receive the next message of a request from Server M, or exit if the connection has failed.
+ * Messages that belong to other requests are skipped.
+ * @param sockfd the TCP socket connecting to Server M
+ * @param id the request ID
+ * @param errMsg the message printed on failure
+ * @return the message
+ */
+string recvMsg(int sockfd, uint32_t id, const char* errMsg) {
+	uint32_t msgId;
+	string msg;
+	do {
+		if (recvFrame(sockfd, msgId, msg) == -1) {
+			close(sockfd);
+			perror(errMsg);
+			exit(1);
+		}
+		if (msgId == PUSH_ID) {
+			showUpdate(msg);
+		}
+	} while (msgId != id);
+	return msg;
+}
+
+/*
+ * Read a line typed by the user, showing the price updates that arrive meanwhile.
+ * The client exits once the input has ended.
+ * @param sockfd the TCP socket connecting to Server M
+ * @param line the returned line, without its newline
+ */
+void readLine(int sockfd, string& line) {
+	size_t newline;
+	while ((newline = inputBuf.find('\n')) == string::npos) {
+		fflush(stdout);
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(STDIN_FILENO, &readfds);
+		FD_SET(sockfd, &readfds);
+		if (select(max(sockfd, STDIN_FILENO) + 1, &readfds, NULL, NULL, NULL) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Client: select");
+			exit(1);
+		}
+		if (FD_ISSET(sockfd, &readfds)) {
+			uint32_t msgId;
+			string msg;
+			if (recvFrame(sockfd, msgId, msg) == -1) {
+				close(sockfd);
+				perror("Client: recv update");
+				exit(1);
+			}
+			if (msgId == PUSH_ID) {
+				showUpdate(msg);
+			}
+		}
+		if (FD_ISSET(STDIN_FILENO, &readfds)) {
+			char buf[MAXBUFSIZE];
+			ssize_t numbytes = read(STDIN_FILENO, buf, sizeof buf);
+			if (numbytes <= 0) { // end of input: finish the last line, or leave
+				if (inputBuf.empty()) {
+					close(sockfd);
+					exit(0);
+				}
+				inputBuf += '\n';
+				continue;
+			}
+			inputBuf.append(buf, numbytes);
+		}
+	}
+	line = inputBuf.substr(0, newline);
+	inputBuf.erase(0, newline + 1);
+}
+
+/*
+ * Check whether Server M did not serve a request: it gave up because a backend server did not answer, or it refused
+ * the request because it is busy.
+ * @param response the response from Server M
+ * @return true, if the request was not served
+ */
+bool notServed(const string& response) {
+	if (response == TIMEOUT_MSG) {
+		printf("[Client] Error: the request timed out. Please try again.\n");
+		return true;
+	}
+	if (response == BUSY_MSG) {
+		printf("[Client] Error: the main server is busy. Please try again later.\n");
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Get the file the session token of a user is saved in.
+ * @param uname the username
+ * @return the file name
+ */
+string tokenFile(const string& uname) {
+	return ".session_" + uname;
+}
+
+/*
+ * Save the session token issued at login, readable by the current user only.
+ * @param uname the username
+ * @param token the session token
+ */
+void saveToken(const string& uname, const string& token) {
+	int fd = open(tokenFile(uname).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 || write(fd, token.c_str(), token.length()) == -1) {
+		perror("Client: save session token");
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+/*
+ * Log in with the session token saved at an earlier login of the user, if there is one.
+ * @param sockfd the TCP socket connecting to Server M
+ * @param uname the username
+ * @return true, if Server M has accepted the token
+ */
+bool resumeSession(int sockfd, const string& uname) {
+	ifstream file(tokenFile(uname).c_str());
+	string token;
+	if (!(file >> token)) {
+		return false;
+	}
+	uint32_t id = nextRequestId++;
+	sendMsg(sockfd, id, "@" + token, "Client: send session token");
+	string response = recvMsg(sockfd, id, "Client: recv session token response");
+	if (response == "s") {
+		printf("[Client] Resumed the previous session of %s.\n", uname.c_str());
+		return true;
+	}
+	// The token has expired or Server M has restarted since
+	remove(tokenFile(uname).c_str());
+	return false;
+}
+
 /*
  * Process the quote commands for a specific stock.
  * @param sockfd the TCP socket connecting to Server M
  * @param localPort the dynamically assigned local TCP port number
- * @param buf the buffer to store the incoming messages
  * @param stockname the stock for which the user is requesting a quote
  */
-void quoteSpec(const int& sockfd, const int& localPort, char* buf, const string& stockname) {
-	int numbytes;
+void quoteSpec(const int& sockfd, const int& localPort, const string& stockname) {
+	uint32_t id = nextRequestId++;
+	string response;
 	// Compose a specific quote request
 	string quoteRequest = "q" + stockname;
 	// Send the quote request to Server M
-	if (send(sockfd, quoteRequest.c_str(), quoteRequest.length(), 0) == -1) {
-		close(sockfd);
-		perror("Client: send quote request");
-		exit(1);
-	}
+	sendMsg(sockfd, id, quoteRequest, "Client: send quote request");
 	printf("[Client] Sent a quote request to the main server.\n");
 	// Receive the quote response
-	if ((numbytes = recv(sockfd, buf, MAXBUFSIZE - 1, 0)) == -1) {
-		close(sockfd);
-		perror("Client: recv quote response");
-		exit(1);
+	response = recvMsg(sockfd, id, "Client: recv quote response");
+	if (notServed(response)) {
+		printf("—Start a new request—\n");
 	}
-	buf[numbytes] = '\0';
-	string response(buf);
-	if (response == "NOT_EXIST") {
+	else if (response == "NOT_EXIST") {
 		printf("[Client] Received the response from the main server using TCP over port %d.\n"
 			"%s does not exist. Please try again.\n"
 			"—Start a new request—\n", localPort, stockname.c_str());
@@ -45,27 +213,21 @@ void quoteSpec(const int& sockfd, const int& localPort, char* buf, const string&
  * Process the general quote commands for all stocks.
  * @param sockfd the TCP socket connecting to Server M
  * @param localPort the dynamically assigned local TCP port number
- * @param buf the buffer to store the incoming messages
  */
-void quoteGen(const int& sockfd, const int& localPort, char* buf) {
-	int numbytes;
+void quoteGen(const int& sockfd, const int& localPort) {
+	uint32_t id = nextRequestId++;
+	string response;
 	// Compose a general quote request
 	string quoteRequest = "qALL_STOCK";
 	// Send the quote request to Server M
-	if (send(sockfd, quoteRequest.c_str(), quoteRequest.length(), 0) == -1) {
-		close(sockfd);
-		perror("Client: send quote request");
-		exit(1);
-	}
+	sendMsg(sockfd, id, quoteRequest, "Client: send quote request");
 	printf("[Client] Sent a quote request to the main server.\n");
 	// Receive the quote response
-	if ((numbytes = recv(sockfd, buf, MAXBUFSIZE - 1, 0)) == -1) {
-		close(sockfd);
-		perror("Client: recv quote response");
-		exit(1);
+	response = recvMsg(sockfd, id, "Client: recv quote response");
+	if (notServed(response)) {
+		printf("—Start a new request—\n");
+		return;
 	}
-	buf[numbytes] = '\0';
-	string response(buf);
 	printf("[Client] Received the response from the main server using TCP over port %d.\n"
 			"%s"
 			"—Start a new request—\n", localPort, response.c_str());
@@ -75,29 +237,24 @@ void quoteGen(const int& sockfd, const int& localPort, char* buf) {
  * Process the buy commands for purchasing a specific number of shares of a specific stock.
  * @param sockfd the TCP socket connecting to Server M
  * @param localPort the dynamically assigned local TCP port number
- * @param buf the buffer to store the incoming messages
  * @param uname the username
  * @param stockname the stock for which the user intends to buy some shares
  * @param numShares the number of shares involved in the purchase
  */
-void buy(const int& sockfd, const int& localPort, char* buf, const string& uname, const string& stockname, const string& numShares) {
-	int numbytes;
+void buy(const int& sockfd, const int& localPort, const string& uname, const string& stockname, const string& numShares) {
+	uint32_t id = nextRequestId++;
+	string response;
 	// Compose a buy request
 	string buyRequest = "b" + stockname + "," + numShares;
 	// Send the buy request to Server M
-	if (send(sockfd, buyRequest.c_str(), buyRequest.length(), 0) == -1) {
-		close(sockfd);
-		perror("Client: send buy request");
-		exit(1);
-	}
+	sendMsg(sockfd, id, buyRequest, "Client: send buy request");
 	// Receive a response from Server M
-	if ((numbytes = recv(sockfd, buf, MAXBUFSIZE - 1, 0)) == -1) {
-		close(sockfd);
-		perror("Client: recv buy response");
-		exit(1);
+	response = recvMsg(sockfd, id, "Client: recv buy response");
+	if (notServed(response)) {
+		printf("—Start a new request—\n");
+		return;
 	}
-	buf[numbytes] = '\0';
-	if (strcmp(buf, "NOT_EXIST") == 0) { // unavailable stock name
+	else if (response == "NOT_EXIST") { // unavailable stock name
 		printf("[Client] Error: stock name does not exist. Please check again.\n"
 			"—Start a new request—\n");
 		return;
@@ -106,8 +263,8 @@ void buy(const int& sockfd, const int& localPort, char* buf, const string& uname
 		string input;
 		while (1) {
 			// Ask for buy confirmation
-			printf("[Client] %s’s current price is %s. Proceed to buy? (Y/N)\n", stockname.c_str(), buf);
-			getline(cin, input);
+			printf("[Client] %s’s current price is %s. Proceed to buy? (Y/N)\n", stockname.c_str(), response.c_str());
+			readLine(sockfd, input);
 			if (input == "Y" || input == "y" || input == "N" || input == "n") {
 				break;
 			}
@@ -117,19 +274,13 @@ void buy(const int& sockfd, const int& localPort, char* buf, const string& uname
 		string decision;
 		if (input == "Y" || input == "y") {
 			decision = "Y";
-			if (send(sockfd, decision.c_str(), decision.length(), 0) == -1) {
-				close(sockfd);
-				perror("Client: send decision");
-				exit(1);
-			}
+			sendMsg(sockfd, id, decision, "Client: send decision");
 			// Receive a purchase result from Server M
-			if ((numbytes = recv(sockfd, buf, MAXBUFSIZE - 1, 0)) == -1) {
-				close(sockfd);
-				perror("Client: recv buy response");
-				exit(1);
+			response = recvMsg(sockfd, id, "Client: recv buy response");
+			if (notServed(response)) {
+				printf("—Start a new request—\n");
 			}
-			buf[numbytes] = '\0';
-			if (buf[0] == 's') {
+			else if (response == "s") {
 				printf("[Client] Received the response from the main server using TCP over port %d.\n"
 					"%s successfully bought %s shares of %s.\n"
 					"—Start a new request—\n", localPort, uname.c_str(), numShares.c_str(), stockname.c_str());
@@ -137,11 +288,7 @@ void buy(const int& sockfd, const int& localPort, char* buf, const string& uname
 		}
 		else {
 			decision = "N";
-			if (send(sockfd, decision.c_str(), decision.length(), 0) == -1) {
-				close(sockfd);
-				perror("Client: send decision");
-				exit(1);
-			}
+			sendMsg(sockfd, id, decision, "Client: send decision");
 			printf("—Start a new request—\n");
 		}
 	}
@@ -151,34 +298,29 @@ void buy(const int& sockfd, const int& localPort, char* buf, const string& uname
  * Process the sell commands for selling a specific number of shares of a specific stock from the user's portfolio.
  * @param sockfd the TCP socket connecting to Server M
  * @param localPort the dynamically assigned local TCP port number
- * @param buf the buffer to store the incoming messages
  * @param uname the username
  * @param stockname the stock for which the user intends to sell some shares
  * @param numShares the number of shares involved in the sale
  */
-void sell(const int& sockfd, const int& localPort, char* buf, const string& uname, const string& stockname, const string& numShares) {
-	int numbytes;
+void sell(const int& sockfd, const int& localPort, const string& uname, const string& stockname, const string& numShares) {
+	uint32_t id = nextRequestId++;
+	string response;
 	// Compose a sell request
 	string sellRequest = "s" + stockname + "," + numShares;
 	// Send the sell request to Server M
-	if (send(sockfd, sellRequest.c_str(), sellRequest.length(), 0) == -1) {
-		close(sockfd);
-		perror("Client: send sell request");
-		exit(1);
-	}
+	sendMsg(sockfd, id, sellRequest, "Client: send sell request");
 	// Receive a response from Server M
-	if ((numbytes = recv(sockfd, buf, MAXBUFSIZE - 1, 0)) == -1) {
-		close(sockfd);
-		perror("Client: recv sell response");
-		exit(1);
+	response = recvMsg(sockfd, id, "Client: recv sell response");
+	if (notServed(response)) {
+		printf("—Start a new request—\n");
+		return;
 	}
-	buf[numbytes] = '\0';
-	if (strcmp(buf, "NOT_EXIST") == 0) { // unavailable stock name
+	else if (response == "NOT_EXIST") { // unavailable stock name
 		printf("[Client] Error: stock name does not exist. Please check again.\n"
 			"—Start a new request—\n");
 		return;
 	}
-	else if (strcmp(buf, "NOT_SUFF") == 0) { // nut sufficient held shares
+	else if (response == "NOT_SUFF") { // nut sufficient held shares
 		printf("[Client] Error: %s does not have enough shares of %s to sell. Please try again.\n"
 			"—Start a new request—\n", uname.c_str(), stockname.c_str());
 		return;
@@ -187,8 +329,8 @@ void sell(const int& sockfd, const int& localPort, char* buf, const string& unam
 		string input;
 		while (1) {
 			// Ask for sell confirmation
-			printf("[Client] %s’s current price is %s. Proceed to sell? (Y/N)\n", stockname.c_str(), buf);
-			getline(cin, input);
+			printf("[Client] %s’s current price is %s. Proceed to sell? (Y/N)\n", stockname.c_str(), response.c_str());
+			readLine(sockfd, input);
 			if (input == "Y" || input == "y" || input == "N" || input == "n") {
 				break;
 			}
@@ -198,65 +340,163 @@ void sell(const int& sockfd, const int& localPort, char* buf, const string& unam
 		string decision;
 		if (input == "Y" || input == "y") {
 			decision = "Y";
-			if (send(sockfd, decision.c_str(), decision.length(), 0) == -1) {
-				close(sockfd);
-				perror("Client: send decision");
-				exit(1);
-			}
+			sendMsg(sockfd, id, decision, "Client: send decision");
 			// Receive a sell result from Server M
-			if ((numbytes = recv(sockfd, buf, MAXBUFSIZE - 1, 0)) == -1) {
-				close(sockfd);
-				perror("Client: recv sell response");
-				exit(1);
+			response = recvMsg(sockfd, id, "Client: recv sell response");
+			if (notServed(response)) {
+				printf("—Start a new request—\n");
 			}
-			buf[numbytes] = '\0';
-			if (buf[0] == 's') {
+			else if (response == "s") {
 				printf("[Client] %s successfully sold %s shares of %s.\n"
 					"—Start a new request—\n", uname.c_str(), numShares.c_str(), stockname.c_str());
 			}
+			else { // the shares were not held for the sale any more
+				printf("[Client] Error: the sale was not confirmed in time. Please try again.\n"
+					"—Start a new request—\n");
+			}
 		}
 		else {
 			decision = "N";
-			if (send(sockfd, decision.c_str(), decision.length(), 0) == -1) {
-				close(sockfd);
-				perror("Client: send decision");
-				exit(1);
-			}
+			sendMsg(sockfd, id, decision, "Client: send decision");
 			printf("—Start a new request—\n");
 		}
 	}
 }
 
+/*
+ * Process the subscribe commands, after which Server M pushes every price change of the stock.
+ * @param sockfd the TCP socket connecting to Server M
+ * @param localPort the dynamically assigned local TCP port number
+ * @param stockname the stock to watch
+ */
+void subscribe(const int& sockfd, const int& localPort, const string& stockname) {
+	uint32_t id = nextRequestId++;
+	// Send the subscription request to Server M
+	sendMsg(sockfd, id, "+" + stockname, "Client: send subscribe request");
+	printf("[Client] Sent a subscription request to the main server.\n");
+	// Receive the current price of the stock
+	string response = recvMsg(sockfd, id, "Client: recv subscribe response");
+	if (notServed(response)) {
+		printf("—Start a new request—\n");
+	}
+	else if (response == "NOT_EXIST") {
+		printf("[Client] Received the response from the main server using TCP over port %d.\n"
+			"%s does not exist. Please try again.\n"
+			"—Start a new request—\n", localPort, stockname.c_str());
+	}
+	else {
+		printf("[Client] Received the response from the main server using TCP over port %d.\n"
+			"%s\n"
+			"[Client] Price updates of %s will be shown as they arrive.\n"
+			"—Start a new request—\n", localPort, response.c_str(), stockname.c_str());
+	}
+}
+
+/*
+ * Process the unsubscribe commands.
+ * @param sockfd the TCP socket connecting to Server M
+ * @param stockname the stock to stop watching
+ */
+void unsubscribe(const int& sockfd, const string& stockname) {
+	uint32_t id = nextRequestId++;
+	sendMsg(sockfd, id, "-" + stockname, "Client: send unsubscribe request");
+	recvMsg(sockfd, id, "Client: recv unsubscribe response");
+	printf("[Client] Stopped watching %s.\n"
+		"—Start a new request—\n", stockname.c_str());
+}
+
+/*
+ * Process the limit commands, which place an order that trades at the limit price or better and rests on the book
+ * with whatever is not filled at once.
+ * @param sockfd the TCP socket connecting to Server M
+ * @param localPort the dynamically assigned local TCP port number
+ * @param uname the username
+ * @param side buy or sell
+ * @param stockname the stock of the order
+ * @param numShares the number of shares of the order
+ * @param limitPrice the highest price to buy at, or the lowest price to sell at
+ */
+void limitOrder(const int& sockfd, const int& localPort, const string& uname, const string& side, const string& stockname,
+		const string& numShares, const string& limitPrice) {
+	uint32_t id = nextRequestId++;
+	// Compose a limit request
+	string limitRequest = "l" + string(side == "sell" ? "s" : "b") + stockname + "," + numShares + "," + limitPrice;
+	sendMsg(sockfd, id, limitRequest, "Client: send limit request");
+	printf("[Client] %s sent a limit %s order to the main server.\n", uname.c_str(), side.c_str());
+	string response = recvMsg(sockfd, id, "Client: recv limit response");
+	if (notServed(response)) {
+		printf("—Start a new request—\n");
+	}
+	else if (response == "NOT_EXIST") {
+		printf("[Client] Error: stock name does not exist. Please check again.\n"
+			"—Start a new request—\n");
+	}
+	else if (response == "NOT_SUFF") {
+		printf("[Client] Error: %s does not have enough shares of %s to sell. Please try again.\n"
+			"—Start a new request—\n", uname.c_str(), stockname.c_str());
+	}
+	else if (response == "f") {
+		printf("[Client] Error: the number of shares and the limit price must be positive. Please try again.\n"
+			"—Start a new request—\n");
+	}
+	else {
+		// Parse the result: <order ID> <shares filled> <average price> <shares resting>
+		istringstream result(response);
+		string orderId, filled, avgPrice, resting;
+		result >> orderId >> filled >> avgPrice >> resting;
+		printf("[Client] Received the response from the main server using TCP over port %d.\n"
+			"[Client] Order %s: filled %s shares at an average price of %s; %s shares rest on the book.\n"
+			"—Start a new request—\n", localPort, orderId.c_str(), filled.c_str(), avgPrice.c_str(), resting.c_str());
+	}
+}
+
+/*
+ * Process the cancel commands, which take what is left of a limit order off the book.
+ * @param sockfd the TCP socket connecting to Server M
+ * @param localPort the dynamically assigned local TCP port number
+ * @param orderId the ID of the order
+ */
+void cancelOrder(const int& sockfd, const int& localPort, const string& orderId) {
+	uint32_t id = nextRequestId++;
+	sendMsg(sockfd, id, "c" + orderId, "Client: send cancel request");
+	string response = recvMsg(sockfd, id, "Client: recv cancel response");
+	if (notServed(response)) {
+		printf("—Start a new request—\n");
+	}
+	else if (response == "NOT_EXIST") {
+		printf("[Client] Error: order %s is not on the book. Please check again.\n"
+			"—Start a new request—\n", orderId.c_str());
+	}
+	else {
+		printf("[Client] Received the response from the main server using TCP over port %d.\n"
+			"[Client] Cancelled order %s with %s shares left.\n"
+			"—Start a new request—\n", localPort, orderId.c_str(), response.substr(2).c_str());
+	}
+}
+
 /*
  * Process the position commands for checking users' portfolios and the net profit/loss based on the current prices.
  * @param sockfd the TCP socket connecting to Server M
  * @param localPort the dynamically assigned local TCP port number
- * @param buf the buffer to store the incoming messages
  * @param uname the username
  */
-void position(const int& sockfd, const int& localPort, char* buf, const string& uname) {
-	int numbytes;
+void position(const int& sockfd, const int& localPort, const string& uname) {
+	uint32_t id = nextRequestId++;
+	string response;
 	// Compose a position request
 	string posRequest = "p";
 	// Send the position request to Server M
-	if (send(sockfd, posRequest.c_str(), posRequest.length(), 0) == -1) {
-		close(sockfd);
-		perror("Client: send position request");
-		exit(1);
-	}
+	sendMsg(sockfd, id, posRequest, "Client: send position request");
 	printf("[Client] %s sent a position request to the main server.\n", uname.c_str());
 	// Receive a response from Server M
-	if ((numbytes = recv(sockfd, buf, MAXBUFSIZE - 1, 0)) == -1) {
-		close(sockfd);
-		perror("Client: recv position response");
-		exit(1);
+	response = recvMsg(sockfd, id, "Client: recv position response");
+	if (notServed(response)) {
+		return;
 	}
-	buf[numbytes] = '\0';
 	// Parse the position result
-	string payload(buf);
-	int pipe = payload.find('|');
-	double profit = stod(payload.substr(0, pipe));
-	string portfolio = payload.substr(pipe + 1);
+	int pipe = response.find('|');
+	double profit = stod(response.substr(0, pipe));
+	string portfolio = response.substr(pipe + 1);
 	// Print out the portfolio with the profit
 	printf("[Client] Received the response from the main server using TCP over port %d.\n"
 		"stock shares avg_buy_price\n"
@@ -266,13 +506,12 @@ void position(const int& sockfd, const int& localPort, char* buf, const string&
 
 
 int main() {
-	int sockfd, numbytes;
+	int sockfd;
 	struct addrinfo hints, *servinfo, *p;
 	int rv;
 	struct sockaddr_in clientAddr;
 	socklen_t clientAddrLen = sizeof(clientAddr);
 	string uname, password;
-	char buf[MAXBUFSIZE];
 	int localPort;
 	
 	// Bootup
@@ -320,29 +559,29 @@ int main() {
 	while (1) {
 		// Get the username from stdin
 		cout << "Please enter the username: ";
-		getline(cin, uname);
+		readLine(sockfd, uname);
+		if (resumeSession(sockfd, uname)) {
+			printf("[Client] You have been granted access.\n");
+			break;
+		}
 		// Get the password from stdin
 		cout << "Please enter the password: ";
-		getline(cin, password);
+		readLine(sockfd, password);
 		// Compose the message encapsulating credentials
+		uint32_t id = nextRequestId++;
 		string authRequest = uname + "," + password;
 		// Send an authentication request to Server M via TCP
-		if (send(sockfd, authRequest.c_str(), authRequest.length(), 0) == -1) {
-			close(sockfd);
-			perror("Client: send auth request");
-			exit(1);
-		}
+		sendMsg(sockfd, id, authRequest, "Client: send auth request");
 		// Receive the authentication result
-		if ((numbytes = recv(sockfd, buf, MAXBUFSIZE - 1, 0)) == -1) {
-			close(sockfd);
-			perror("Client: recv auth response");
-			exit(1);
-		}
-		buf[numbytes] = '\0';
-		if (buf[0] == 's') {
+		string response = recvMsg(sockfd, id, "Client: recv auth response");
+		if (response.compare(0, 2, "s ") == 0) { // success, followed by the session token
+			saveToken(uname, response.substr(2));
 			printf("[Client] You have been granted access.\n");
 			break;
 		}
+		else if (notServed(response)) {
+			continue;
+		}
 		else {
 			printf("[Client] The credentials are incorrect. Please try again.\n");
 			continue;
@@ -350,7 +589,7 @@ int main() {
 	}
 	
 	/* Operations */
-	string input, command, stockname, numShares;
+	string input, command, stockname, numShares, side, limitPrice, orderId;
 	while (1) {
 		printf("[Client] Please enter the command:\n"
 			"<quote>\n"
@@ -358,8 +597,12 @@ int main() {
 			"<buy <stock name> <number of shares>>\n"
 			"<sell <stock name> <number of shares>>\n"
 			"<position>\n"
+			"<subscribe <stock name>>\n"
+			"<unsubscribe <stock name>>\n"
+			"<limit <buy|sell> <stock name> <number of shares> <limit price>>\n"
+			"<cancel <order id>>\n"
 			"<exit>\n");
-		getline(cin, input);
+		readLine(sockfd, input);
 		istringstream iss(input);
 		iss >> command;
 		
@@ -370,17 +613,17 @@ int main() {
 		else if (command == "quote") { 
 			/* Specific Quote */
 			if (iss >> stockname) { 
-				quoteSpec(sockfd, localPort, buf, stockname);
+				quoteSpec(sockfd, localPort, stockname);
 			}
 			/* General Quote */
 			else { 
-				quoteGen(sockfd, localPort, buf);
+				quoteGen(sockfd, localPort);
 			}
 		}
 		/* Buy */
 		else if (command == "buy") { 
 			if (iss >> stockname && iss >> numShares) {
-				buy(sockfd, localPort, buf, uname, stockname, numShares);
+				buy(sockfd, localPort, uname, stockname, numShares);
 			}
 			else {
 				printf("[Client] Error: stock name/shares are required. Please specify a stock name to buy.\n"
@@ -390,7 +633,7 @@ int main() {
 		/* Sell */
 		else if (command == "sell") {
 			if (iss >> stockname && iss >> numShares) {
-				sell(sockfd, localPort, buf, uname, stockname, numShares);
+				sell(sockfd, localPort, uname, stockname, numShares);
 			}
 			else {
 				printf("[Client] Error: stock name/shares are required. Please specify a stock name to sell.\n"
@@ -399,7 +642,39 @@ int main() {
 		}
 		/* Position */
 		else if (command == "position") {
-			position(sockfd, localPort, buf, uname);
+			position(sockfd, localPort, uname);
+		}
+		/* Subscription */
+		else if (command == "subscribe" || command == "unsubscribe") {
+			if (!(iss >> stockname)) {
+				printf("[Client] Error: stock name is required. Please specify a stock name to %s.\n"
+					"—Start a new request—\n", command.c_str());
+			}
+			else if (command == "subscribe") {
+				subscribe(sockfd, localPort, stockname);
+			}
+			else {
+				unsubscribe(sockfd, stockname);
+			}
+		}
+		/* Limit orders */
+		else if (command == "limit") {
+			if (iss >> side && (side == "buy" || side == "sell") && iss >> stockname && iss >> numShares && iss >> limitPrice) {
+				limitOrder(sockfd, localPort, uname, side, stockname, numShares, limitPrice);
+			}
+			else {
+				printf("[Client] Error: side/stock name/shares/limit price are required. Please specify a limit order.\n"
+					"—Start a new request—\n");
+			}
+		}
+		else if (command == "cancel") {
+			if (iss >> orderId) {
+				cancelOrder(sockfd, localPort, orderId);
+			}
+			else {
+				printf("[Client] Error: order id is required. Please specify an order to cancel.\n"
+					"—Start a new request—\n");
+			}
 		}
 	}
 			
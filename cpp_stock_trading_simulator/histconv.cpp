@@ -0,0 +1,191 @@
+/* This file implements the converter that writes the price-history file (history.h) Server Q loads instead of
+ * quotes.txt, from a text file of ticks.
+ *
+ * Every line of the input is a tick: <ticker> <time in ms> <price>, separated by spaces or commas. With -q, the input
+ * is in the format of quotes.txt instead, a ticker followed by its prices, which get the times 0, 1, 2, ...
+ * The input is read twice: once to count the ticks of every stock, which gives the layout of the file, and once to
+ * write every tick into its place in the mapped output file. So neither the input nor the output has to fit in
+ * memory, apart from the series of one stock if its ticks are not in time order already.
+ * The output is written under a temporary name and renamed into place, so a running Server Q keeps its old mapping.
+ *
+ * Usage: ./histconv [-q] <input> [output]   (quotes.hist by default)
+ */
+
+#include "utility.h"
+#include "history.h"
+using namespace std;
+
+/*
+ * Read the ticks of the next line of the input.
+ * @param file the input
+ * @param quotesFormat whether the input is in the format of quotes.txt
+ * @param ticker the returned ticker
+ * @param ticks the returned ticks of the line, as pairs of time and price
+ * @return false at the end of the input
+ */
+bool readLine(FILE* file, bool quotesFormat, string& ticker, vector<pair<int64_t, double>>& ticks) {
+	static char* line = NULL; // grown by getline to the longest line so far, so a line is never split
+	static size_t capacity = 0;
+	ssize_t length = getline(&line, &capacity, file);
+	if (length == -1) {
+		return false;
+	}
+	replace(line, line + length, ',', ' ');
+	ticks.clear();
+	char* p = line;
+	char* end;
+	while (isspace((unsigned char)*p)) {
+		p++;
+	}
+	char* start = p;
+	while (*p != '\0' && !isspace((unsigned char)*p)) {
+		p++;
+	}
+	ticker.assign(start, p - start);
+	if (quotesFormat) {
+		for (int64_t t = 0; ; t++) {
+			double price = strtod(p, &end);
+			if (end == p) {
+				break;
+			}
+			ticks.push_back(make_pair(t, price));
+			p = end;
+		}
+	}
+	else {
+		int64_t time = strtoll(p, &end, 10);
+		if (end != p) {
+			p = end;
+			double price = strtod(p, &end);
+			if (end != p) {
+				ticks.push_back(make_pair(time, price));
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	bool quotesFormat = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "q")) != -1) {
+		if (opt == 'q') {
+			quotesFormat = true;
+		}
+		else {
+			optind = argc + 1;
+		}
+	}
+	if (optind >= argc || argc - optind > 2) {
+		fprintf(stderr, "Usage: %s [-q] <input> [output]\n", argv[0]);
+		exit(1);
+	}
+	const char* input = argv[optind];
+	string output = optind + 1 < argc ? argv[optind + 1] : HISTORY_FILE;
+
+	FILE* file = fopen(input, "r");
+	if (file == NULL) {
+		perror("Failed to open the input");
+		exit(1);
+	}
+
+	// First pass: count the ticks of every stock
+	map<string, uint64_t> counts;
+	string ticker;
+	vector<pair<int64_t, double>> ticks;
+	uint64_t numTicks = 0, lineNum = 0;
+	while (readLine(file, quotesFormat, ticker, ticks)) {
+		lineNum++;
+		if (ticker.empty()) {
+			continue;
+		}
+		if (ticks.empty() || ticker.length() >= HIST_TICKER_LEN) {
+			fprintf(stderr, "Line %llu: not a tick\n", (unsigned long long)lineNum);
+			exit(1);
+		}
+		counts[ticker] += ticks.size();
+		numTicks += ticks.size();
+	}
+
+	// Lay out the file: the directory in ticker order, and the ticks of each stock together in the columns
+	string tmpName = output + ".tmp";
+	size_t size = histSize(counts.size(), numTicks);
+	int fd = open(tmpName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, size) == -1) {
+		perror("Failed to create the output");
+		exit(1);
+	}
+	void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		perror("Failed to map the output");
+		exit(1);
+	}
+	HistHeader* header = (HistHeader*)addr;
+	memcpy(header->magic, HIST_MAGIC, sizeof header->magic);
+	header->numTickers = counts.size();
+	header->numTicks = numTicks;
+	History h;
+	histLayout(h, addr, size);
+	HistTicker* dir = (HistTicker*)h.tickers;
+	int64_t* times = (int64_t*)h.times;
+	double* prices = (double*)h.prices;
+	unordered_map<string, uint64_t> next; // column index of the next tick of each stock
+	uint64_t first = 0;
+	uint32_t i = 0;
+	for (const auto& entry : counts) {
+		strncpy(dir[i].ticker, entry.first.c_str(), HIST_TICKER_LEN);
+		dir[i].first = first;
+		dir[i].count = entry.second;
+		next[entry.first] = first;
+		first += entry.second;
+		i++;
+	}
+
+	// Second pass: write every tick into its place
+	rewind(file);
+	while (readLine(file, quotesFormat, ticker, ticks)) {
+		if (ticker.empty()) {
+			continue;
+		}
+		uint64_t& n = next[ticker];
+		for (const auto& tick : ticks) {
+			times[n] = tick.first;
+			prices[n] = tick.second;
+			n++;
+		}
+	}
+	fclose(file);
+
+	// Put the series that are not in time order already in order, keeping ticks of the same time in input order
+	for (i = 0; i < header->numTickers; i++) {
+		int64_t* begin = times + dir[i].first;
+		int64_t* end = begin + dir[i].count;
+		if (is_sorted(begin, end)) {
+			continue;
+		}
+		ticks.clear();
+		for (uint64_t k = dir[i].first; k < dir[i].first + dir[i].count; k++) {
+			ticks.push_back(make_pair(times[k], prices[k]));
+		}
+		stable_sort(ticks.begin(), ticks.end(), [](const pair<int64_t, double>& a, const pair<int64_t, double>& b) {
+			return a.first < b.first;
+		});
+		for (uint64_t k = 0; k < ticks.size(); k++) {
+			times[dir[i].first + k] = ticks[k].first;
+			prices[dir[i].first + k] = ticks[k].second;
+		}
+	}
+
+	if (msync(addr, size, MS_SYNC) == -1) {
+		perror("Failed to write the output");
+		exit(1);
+	}
+	munmap(addr, size);
+	if (rename(tmpName.c_str(), output.c_str()) == -1) {
+		perror("Failed to rename the output");
+		exit(1);
+	}
+	printf("[History] Wrote %llu ticks of %zu stocks to %s.\n", (unsigned long long)numTicks, counts.size(), output.c_str());
+	return 0;
+}
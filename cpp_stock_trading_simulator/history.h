@@ -0,0 +1,134 @@
+/* This file implements the price-history file, from which Server Q takes the price series of the stocks when it
+ * exists instead of quotes.txt, and which the histconv tool writes.
+ *
+ * The file holds every tick (a time and a price) of every stock in two columns: all times, then all prices, each a
+ * plain array in the byte order of the host. The ticks of one stock are contiguous and in time order, and a
+ * directory of the stocks, sorted by ticker, gives the range of each in the columns. So the directory is the time
+ * index of each stock: the tick current at a given time is found by a binary search of its range of the time column.
+ *
+ * The file is mapped into memory and never read as a whole. Opening it reads the header and the directory; the
+ * pages of the columns are read by the kernel when a tick on them is first used, so a server starts at once on a
+ * history of any length, and only the stretch of each series around its current tick stays in memory.
+ *
+ * Layout: HistHeader, numTickers × HistTicker, numTicks × int64 time (ms), numTicks × f64 price.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#define HISTORY_FILE "quotes.hist"    // the price history, used instead of quotes.txt when it exists
+#define HIST_MAGIC "STKHIST1"         // first bytes of the file
+#define HIST_TICKER_LEN 16            // bytes per ticker in the directory, including the terminating NUL
+
+// Structure to contain the header of the file
+struct HistHeader {
+	char magic[8];
+	uint32_t numTickers;
+	uint32_t unused;
+	uint64_t numTicks;
+};
+
+// Structure to contain the directory entry of a stock
+struct HistTicker {
+	char ticker[HIST_TICKER_LEN];
+	uint64_t first;   // index of its first tick in the columns
+	uint64_t count;   // number of its ticks, at least 1
+};
+
+// Structure to contain a mapped history file
+struct History {
+	const HistHeader* header = NULL;
+	const HistTicker* tickers = NULL;
+	const int64_t* times = NULL;
+	const double* prices = NULL;
+	size_t size = 0;
+};
+
+/*
+ * Get the size of a history file.
+ * @param numTickers the number of stocks
+ * @param numTicks the number of ticks of all stocks
+ * @return the size in bytes
+ */
+size_t histSize(uint64_t numTickers, uint64_t numTicks) {
+	return sizeof(HistHeader) + numTickers * sizeof(HistTicker) + numTicks * (sizeof(int64_t) + sizeof(double));
+}
+
+/*
+ * Point the parts of a history at a mapping of the file.
+ * @param h the history
+ * @param addr the mapping
+ * @param size the size of the mapping
+ */
+void histLayout(History& h, const void* addr, size_t size) {
+	h.header = (const HistHeader*)addr;
+	h.tickers = (const HistTicker*)(h.header + 1);
+	h.times = (const int64_t*)(h.tickers + h.header->numTickers);
+	h.prices = (const double*)(h.times + h.header->numTicks);
+	h.size = size;
+}
+
+/*
+ * Map a history file for reading.
+ * @param fileName the file
+ * @param h the returned history
+ * @return false, if the file does not exist or is not a valid history
+ */
+bool histOpen(const char* fileName, History& h) {
+	int fd = open(fileName, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+	struct stat st;
+	void* addr = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(HistHeader)) {
+		addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "History: cannot map %s\n", fileName);
+		return false;
+	}
+	const HistHeader* header = (const HistHeader*)addr;
+	if (memcmp(header->magic, HIST_MAGIC, sizeof header->magic) != 0
+			|| histSize(header->numTickers, header->numTicks) != (size_t)st.st_size) {
+		fprintf(stderr, "History: %s is not a valid history file\n", fileName);
+		munmap(addr, st.st_size);
+		return false;
+	}
+	histLayout(h, addr, st.st_size);
+	for (uint32_t i = 0; i < header->numTickers; i++) {
+		const HistTicker& t = h.tickers[i];
+		if (t.count == 0 || t.first + t.count > header->numTicks || t.ticker[HIST_TICKER_LEN - 1] != '\0') {
+			fprintf(stderr, "History: %s has a bad directory entry\n", fileName);
+			munmap(addr, st.st_size);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Find the tick of a stock that is current at a given time.
+ * @param h the history
+ * @param i the index of the stock in the directory
+ * @param time the time (ms)
+ * @return the index of its last tick at or before the time, relative to its first tick; 0 if the time is before all
+ */
+uint64_t histSeek(const History& h, uint32_t i, int64_t time) {
+	const int64_t* begin = h.times + h.tickers[i].first;
+	const int64_t* end = begin + h.tickers[i].count;
+	uint64_t after = std::upper_bound(begin, end, time) - begin;
+	return after > 0 ? after - 1 : 0;
+}
+
+#endif
@@ -0,0 +1,333 @@
+/* This file implements a load generator that measures the capacity of the trading system.
+ * It opens many concurrent sessions with Server M on localhost, logs each of them in, and then keeps a fixed number
+ * of requests in flight on every session, drawn from a weighted mix of quote, buy, sell and position commands.
+ * Buys and sells of one share are confirmed automatically. At the end, it reports the throughput and the latency
+ * percentiles of every command type, measured from the first message of a command to its final response.
+ * Commands Server M refuses as BUSY are counted apart and left out of the latencies, and their session waits
+ * BUSY_BACKOFF_US before it issues its next command, as a client should.
+ *
+ * Usage: ./loadgen -u <username> -p <password> -s <stock> [-c sessions] [-w requests in flight per session]
+ *                  [-d seconds] [-m <quote>,<buy>,<sell>,<position> weights]
+ */
+
+#include "utility.h"
+#include "metrics.h"
+#include <random>
+using namespace std;
+
+#define MAXEVENTS 64
+#define BUSY_BACKOFF_US 1000 // time a session waits after a refused command before it issues the next one
+
+enum CommandType { CMD_QUOTE, CMD_BUY, CMD_SELL, CMD_POSITION, NUM_COMMANDS };
+const char* commandNames[NUM_COMMANDS] = {"quote", "buy", "sell", "position"};
+
+// Structure to contain a command in flight
+struct Request {
+	CommandType type;
+	long long start;   // time (us) the command was sent
+	bool confirmed;    // whether the Y confirmation of a buy or sell has been sent
+};
+
+// Structure to contain one session with Server M
+struct Conn {
+	int fd;
+	bool loggedIn;
+	string inbuf;                              // received bytes that do not form a complete frame yet
+	uint32_t nextId;                           // request ID of the next command
+	unordered_map<uint32_t, Request> inflight; // commands in flight, indexed by request ID
+};
+
+// Global Variables
+int numSessions = 16;
+int window = 1;                 // requests in flight per session
+double duration = 10;           // seconds of load
+int weights[NUM_COMMANDS] = {60, 15, 15, 10};
+string uname, password, stock;
+mt19937 rng(12345);
+bool running = true;            // whether new commands are still issued
+Histogram latency[NUM_COMMANDS]; // latency (us) of the completed commands of each type
+uint64_t errors[NUM_COMMANDS];   // completed commands of each type that did not succeed
+uint64_t busy[NUM_COMMANDS];     // commands of each type Server M refused as busy
+deque<pair<long long, Conn*>> backoff; // sessions waiting to issue their next command after a refusal, by time (us)
+
+/*
+ * Connect to Server M.
+ * @return the TCP socket
+ */
+int connectToServer() {
+	struct addrinfo hints, *servinfo;
+	int rv, sockfd;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rv = getaddrinfo(LOCALHOST, PORT_M_TCP, &hints, &servinfo)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		exit(1);
+	}
+	if ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) == -1) {
+		perror("Load: socket");
+		exit(1);
+	}
+	if (connect(sockfd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
+		perror("Load: TCP connect");
+		exit(1);
+	}
+	freeaddrinfo(servinfo);
+	return sockfd;
+}
+
+/*
+ * Send a message of a command to Server M, or exit if the connection has failed.
+ * @param c the session
+ * @param id the request ID
+ * @param msg the message
+ */
+void sendMsg(Conn& c, uint32_t id, const string& msg) {
+	if (sendFrame(c.fd, id, msg) == -1) {
+		perror("Load: send");
+		exit(1);
+	}
+}
+
+/*
+ * Start a new command on a session, of a type drawn from the mix.
+ * @param c the session
+ */
+void issue(Conn& c) {
+	int total = 0;
+	for (int w : weights) {
+		total += w;
+	}
+	int pick = uniform_int_distribution<int>(0, total - 1)(rng);
+	int type = 0;
+	while (pick >= weights[type]) {
+		pick -= weights[type++];
+	}
+
+	string msg;
+	switch (type) {
+	case CMD_QUOTE:    msg = "q" + stock; break;
+	case CMD_BUY:      msg = "b" + stock + ",1"; break;
+	case CMD_SELL:     msg = "s" + stock + ",1"; break;
+	case CMD_POSITION: msg = "p"; break;
+	}
+	uint32_t id = c.nextId++;
+	c.inflight[id] = {(CommandType)type, nowUs(), false};
+	sendMsg(c, id, msg);
+}
+
+/*
+ * Record a finished command and start the next one.
+ * @param c the session
+ * @param id the request ID of the command
+ * @param ok whether the command succeeded
+ */
+void complete(Conn& c, uint32_t id, bool ok) {
+	Request& req = c.inflight[id];
+	latency[req.type].record(nowUs() - req.start);
+	if (!ok) {
+		errors[req.type]++;
+	}
+	c.inflight.erase(id);
+	if (running) {
+		issue(c);
+	}
+}
+
+/*
+ * Handle a response from Server M.
+ * @param c the session
+ * @param id the request ID
+ * @param msg the response
+ */
+void onResponse(Conn& c, uint32_t id, string_view msg) {
+	if (!c.loggedIn) {
+		if (msg[0] != 's') {
+			fprintf(stderr, "Load: login of %s failed\n", uname.c_str());
+			exit(1);
+		}
+		c.loggedIn = true;
+		return;
+	}
+	auto it = c.inflight.find(id);
+	if (it == c.inflight.end()) { // a pushed price update
+		return;
+	}
+	Request& req = it->second;
+	if (msg == BUSY_MSG) {
+		busy[req.type]++;
+		c.inflight.erase(it);
+		if (running) {
+			backoff.push_back(make_pair(nowUs() + BUSY_BACKOFF_US, &c));
+		}
+		return;
+	}
+	if ((req.type == CMD_BUY || req.type == CMD_SELL) && !req.confirmed) {
+		// Anything but a price ends the command
+		if (!msg.empty() && isdigit(msg[0])) {
+			req.confirmed = true;
+			sendMsg(c, id, "Y");
+			return;
+		}
+		complete(c, id, false);
+		return;
+	}
+	bool ok = msg != TIMEOUT_MSG && msg != "NOT_EXIST" && msg != "f";
+	complete(c, id, ok);
+}
+
+/*
+ * Read what Server M has sent on a session and handle every complete frame in it.
+ * @param c the session
+ */
+void onReadable(Conn& c) {
+	char buf[MAXBUFSIZE];
+	int numbytes = recv(c.fd, buf, MAXBUFSIZE, MSG_DONTWAIT);
+	if (numbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (numbytes <= 0) {
+		fprintf(stderr, "Load: Server M closed a session\n");
+		exit(1);
+	}
+	c.inbuf.append(buf, numbytes);
+	size_t pos = 0;
+	uint32_t id;
+	string_view msg;
+	int rv;
+	while ((rv = decodeFrame(c.inbuf, pos, id, msg)) == 1) {
+		onResponse(c, id, msg);
+	}
+	if (rv == -1) {
+		fprintf(stderr, "Load: malformed frame from Server M\n");
+		exit(1);
+	}
+	c.inbuf.erase(0, pos);
+}
+
+/*
+ * Print the throughput and latency of every command type.
+ * @param elapsed the length of the measurement in seconds
+ */
+void report(double elapsed) {
+	Histogram all;
+	uint64_t allErrors = 0, allBusy = 0;
+	printf("[Load] %d sessions, %d request(s) in flight each, %.1f s\n", numSessions, window, elapsed);
+	printf("%-9s %9s %7s %8s %10s %9s %9s %9s %9s %9s\n", "command", "count", "errors", "busy", "req/s", "mean(us)", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+	for (int i = 0; i < NUM_COMMANDS; i++) {
+		const Histogram& h = latency[i];
+		printf("%-9s %9llu %7llu %8llu %10.1f %9.0f %9llu %9llu %9llu %9llu\n", commandNames[i],
+			(unsigned long long)h.total, (unsigned long long)errors[i], (unsigned long long)busy[i], h.total / elapsed, h.mean(),
+			(unsigned long long)h.percentile(50), (unsigned long long)h.percentile(99),
+			(unsigned long long)h.percentile(99.9), (unsigned long long)h.max);
+		all.merge(h);
+		allErrors += errors[i];
+		allBusy += busy[i];
+	}
+	printf("%-9s %9llu %7llu %8llu %10.1f %9.0f %9llu %9llu %9llu %9llu\n", "all",
+		(unsigned long long)all.total, (unsigned long long)allErrors, (unsigned long long)allBusy, all.total / elapsed, all.mean(),
+		(unsigned long long)all.percentile(50), (unsigned long long)all.percentile(99),
+		(unsigned long long)all.percentile(99.9), (unsigned long long)all.max);
+}
+
+/*
+ * Print the usage and exit.
+ * @param prog the name of the program
+ */
+void usage(const char* prog) {
+	fprintf(stderr, "Usage: %s -u <username> -p <password> -s <stock> [-c sessions] [-w requests in flight per session]\n"
+		"          [-d seconds] [-m <quote>,<buy>,<sell>,<position> weights]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "u:p:s:c:w:d:m:")) != -1) {
+		switch (opt) {
+		case 'u': uname = optarg; break;
+		case 'p': password = optarg; break;
+		case 's': stock = optarg; break;
+		case 'c': numSessions = atoi(optarg); break;
+		case 'w': window = atoi(optarg); break;
+		case 'd': duration = atof(optarg); break;
+		case 'm':
+			if (sscanf(optarg, "%d,%d,%d,%d", &weights[0], &weights[1], &weights[2], &weights[3]) != 4) {
+				usage(argv[0]);
+			}
+			break;
+		default: usage(argv[0]);
+		}
+	}
+	if (uname.empty() || password.empty() || stock.empty() || numSessions < 1 || window < 1
+			|| weights[0] + weights[1] + weights[2] + weights[3] < 1) {
+		usage(argv[0]);
+	}
+
+	int epfd = epoll_create1(0);
+	if (epfd == -1) {
+		perror("Load: epoll_create1");
+		exit(1);
+	}
+	vector<Conn> conns(numSessions);
+	for (int i = 0; i < numSessions; i++) {
+		Conn& c = conns[i];
+		c.fd = connectToServer();
+		c.loggedIn = false;
+		c.nextId = 1;
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+		sendMsg(c, c.nextId++, uname + "," + password);
+	}
+
+	struct epoll_event events[MAXEVENTS];
+	int loggedIn = 0;
+	while (loggedIn < numSessions) {
+		int n = epoll_wait(epfd, events, MAXEVENTS, -1);
+		for (int i = 0; i < n; i++) {
+			Conn& c = conns[events[i].data.u32];
+			bool before = c.loggedIn;
+			onReadable(c);
+			loggedIn += c.loggedIn && !before;
+		}
+	}
+	printf("[Load] Logged in %d sessions. Running for %.1f s.\n", numSessions, duration);
+
+	// Keep every session busy until the time is up
+	long long start = nowUs();
+	long long end = start + (long long)(duration * 1e6);
+	for (Conn& c : conns) {
+		for (int i = 0; i < window; i++) {
+			issue(c);
+		}
+	}
+	while (1) {
+		long long now = nowUs();
+		if (now >= end) {
+			break;
+		}
+		long long wake = backoff.empty() ? end : min(end, backoff.front().first);
+		int n = epoll_wait(epfd, events, MAXEVENTS, (int)((max(wake - now, 0LL) + 999) / 1000));
+		if (n == -1 && errno != EINTR) {
+			perror("Load: epoll_wait");
+			exit(1);
+		}
+		for (int i = 0; i < n; i++) {
+			onReadable(conns[events[i].data.u32]);
+		}
+		// Sessions whose command was refused try again once they have backed off
+		now = nowUs();
+		while (!backoff.empty() && backoff.front().first <= now) {
+			issue(*backoff.front().second);
+			backoff.pop_front();
+		}
+	}
+	running = false;
+	report((nowUs() - start) / 1e6);
+
+	for (Conn& c : conns) {
+		close(c.fd);
+	}
+	return 0;
+}
@@ -0,0 +1,282 @@
+/* This file implements the asynchronous logger of the servers.
+ *
+ * A log call does not format anything. It copies a pointer to its format string, a pointer to the function that will
+ * format it, and its arguments in binary (strings by value) into a record of the calling thread's ring buffer, which
+ * takes a few tens of nanoseconds. Every thread has its own ring, with the thread as its only producer and the logger
+ * thread as its only consumer, so no lock or atomic read-modify-write is needed. The logger thread formats the records
+ * of all rings in time order and writes them out in batches. A thread whose ring is full drops its records instead of
+ * waiting, and the logger reports how many were dropped.
+ *
+ * Records below the level given by the environment variable LOG_LEVEL (debug, info, warn or error; info by default)
+ * are discarded at the call site. Warnings and errors go to stderr, the rest to stdout.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#define LOG_RING_SLOTS 4096   // records per thread; a power of two
+#define LOG_RECORD_SIZE 256   // bytes per record; longer string arguments are cut short
+#define LOG_IDLE_US 1000      // time the logger thread sleeps when every ring is empty
+#define LOG_MAX_THREADS 64    // threads that can log
+
+enum LogLevel { LEVEL_DEBUG, LEVEL_INFO, LEVEL_WARN, LEVEL_ERROR };
+
+#define LOG(level, ...) do { if ((level) >= logLevel) logRecord((level), __VA_ARGS__); } while (0)
+#define LOG_DEBUG(...) LOG(LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG(LEVEL_ERROR, __VA_ARGS__)
+
+typedef int (*LogFormat)(char* out, size_t n, const char* fmt, const char* args);
+
+// Structure to contain one log call, waiting for the logger thread to format it
+struct LogRecord {
+	long long time;     // time (ns) of the call, by which the records of all threads are merged
+	int level;
+	LogFormat format;   // decodes the arguments and formats them
+	const char* fmt;    // the format string, a literal
+	char args[LOG_RECORD_SIZE - 2 * sizeof(long long) - 2 * sizeof(void*)]; // the arguments, in binary
+};
+
+// Structure to contain the ring buffer of one thread
+struct LogRing {
+	LogRecord slots[LOG_RING_SLOTS];
+	std::atomic<uint64_t> head;    // number of records written, by the owning thread
+	std::atomic<uint64_t> tail;    // number of records consumed, by the logger thread
+	std::atomic<uint64_t> dropped; // number of records dropped because the ring was full
+	uint64_t reported;             // number of dropped records reported so far
+	LogRing() : head(0), tail(0), dropped(0), reported(0) {}
+};
+
+// Global Variables
+int logLevel = LEVEL_INFO;          // lowest level logged
+std::mutex logRingsLock;            // guards logRings and numLogRings
+LogRing* logRings[LOG_MAX_THREADS]; // rings of every thread that has logged; a plain array, so that it outlives exit
+size_t numLogRings = 0;
+std::mutex logDrainLock;            // held while the records are consumed
+thread_local LogRing* logRing = NULL; // ring of the calling thread
+
+/* Binary encoding of the arguments. Arithmetic values are copied as they are, and strings are copied with
+ * their terminating NUL, so that the logger thread can hand a pointer into the record to snprintf. */
+template<typename T> struct LogStored {
+	typedef typename std::decay<T>::type type;
+	static const size_t size = sizeof(type);
+};
+template<typename T> struct LogStored<T*> {
+	typedef const char* type;
+	static const size_t size = 1;
+	static_assert(std::is_same<typename std::remove_cv<T>::type, char>::value, "only C strings can be logged by pointer");
+};
+template<typename T, size_t N> struct LogStored<T[N]> : LogStored<T*> {};
+template<typename T, size_t N> struct LogStored<const T[N]> : LogStored<T*> {};
+
+// Least number of bytes the encoding of a list of arguments takes
+template<typename... Args> struct LogReserve {
+	static const size_t value = 0;
+};
+template<typename T, typename... Rest> struct LogReserve<T, Rest...> {
+	static const size_t value = LogStored<T>::size + LogReserve<Rest...>::value;
+};
+
+template<typename T> void encodeLogArg(char*& p, char* end, T v) {
+	static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "only numbers and C strings can be logged");
+	memcpy(p, &v, sizeof v);
+	p += sizeof v;
+}
+inline void encodeLogArg(char*& p, char* end, const char* s) {
+	size_t len = strnlen(s, end - p - 1);
+	memcpy(p, s, len);
+	p[len] = '\0';
+	p += len + 1;
+}
+
+inline void encodeLogArgs(char*&, char*) {}
+template<typename T, typename... Rest> void encodeLogArgs(char*& p, char* end, const T& v, const Rest&... rest) {
+	// Leave room for the arguments after this one
+	encodeLogArg(p, end - LogReserve<Rest...>::value, static_cast<typename LogStored<T>::type>(v));
+	encodeLogArgs(p, end, rest...);
+}
+
+template<typename T> T decodeLogArg(const char*& p) {
+	T v;
+	memcpy(&v, p, sizeof v);
+	p += sizeof v;
+	return v;
+}
+template<> inline const char* decodeLogArg<const char*>(const char*& p) {
+	const char* s = p;
+	p += strlen(s) + 1;
+	return s;
+}
+
+// Decoder of the arguments of one signature, which calls snprintf once they are all decoded
+template<typename... Stored> struct LogDecoder;
+template<> struct LogDecoder<> {
+	static int run(char* out, size_t n, const char* fmt, const char*) {
+		return snprintf(out, n, fmt, 0); // the extra argument is ignored; it only tells the compiler fmt is not data
+	}
+	template<typename First, typename... Done>
+	static int run(char* out, size_t n, const char* fmt, const char*, First first, Done... done) {
+		return snprintf(out, n, fmt, first, done...);
+	}
+};
+template<typename T, typename... Rest> struct LogDecoder<T, Rest...> {
+	template<typename... Done> static int run(char* out, size_t n, const char* fmt, const char* p, Done... done) {
+		T v = decodeLogArg<T>(p);
+		return LogDecoder<Rest...>::run(out, n, fmt, p, done..., v);
+	}
+};
+template<typename... Stored> int formatLog(char* out, size_t n, const char* fmt, const char* args) {
+	return LogDecoder<Stored...>::run(out, n, fmt, args);
+}
+
+/*
+ * Get the current time of a monotonic clock.
+ * @return the time in nanoseconds
+ */
+long long logNowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Get the ring buffer of the calling thread, creating it on the thread's first log call.
+ * @return the ring
+ */
+LogRing* threadLogRing() {
+	if (logRing == NULL) {
+		std::lock_guard<std::mutex> guard(logRingsLock);
+		if (numLogRings == LOG_MAX_THREADS) {
+			fprintf(stderr, "Logger: too many threads\n");
+			abort();
+		}
+		logRing = new LogRing();
+		logRings[numLogRings++] = logRing;
+	}
+	return logRing;
+}
+
+/*
+ * Queue a log record on the calling thread's ring buffer, or drop it if the ring is full. Use the LOG_* macros instead.
+ * @param level the level of the record
+ * @param fmt the printf format string, which must be a literal
+ * @param args the arguments of the format string: numbers and C strings
+ */
+template<typename... Args> void logRecord(int level, const char* fmt, const Args&... args) {
+	static_assert(LogReserve<Args...>::value < sizeof(LogRecord::args), "too many arguments for a log record");
+	LogRing* ring = threadLogRing();
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) == LOG_RING_SLOTS) {
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	LogRecord& r = ring->slots[head & (LOG_RING_SLOTS - 1)];
+	r.time = logNowNs();
+	r.level = level;
+	r.format = &formatLog<typename LogStored<Args>::type...>;
+	r.fmt = fmt;
+	char* p = r.args;
+	encodeLogArgs(p, r.args + sizeof r.args, args...);
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+/*
+ * Format and write out every record queued so far, merging the rings in time order.
+ * @return the number of records written
+ */
+size_t drainLogs() {
+	std::lock_guard<std::mutex> drain(logDrainLock);
+	std::vector<LogRing*> rings;
+	{
+		std::lock_guard<std::mutex> guard(logRingsLock);
+		rings.assign(logRings, logRings + numLogRings);
+	}
+	std::vector<uint64_t> ends(rings.size());
+	for (size_t i = 0; i < rings.size(); i++) {
+		ends[i] = rings[i]->head.load(std::memory_order_acquire);
+	}
+
+	std::string out, err;
+	char line[1024];
+	size_t written = 0;
+	while (1) {
+		// The oldest record at the tail of a ring goes next
+		LogRing* next = NULL;
+		const LogRecord* oldest = NULL;
+		for (size_t i = 0; i < rings.size(); i++) {
+			uint64_t tail = rings[i]->tail.load(std::memory_order_relaxed);
+			const LogRecord* r = &rings[i]->slots[tail & (LOG_RING_SLOTS - 1)];
+			if (tail != ends[i] && (oldest == NULL || r->time < oldest->time)) {
+				next = rings[i];
+				oldest = r;
+			}
+		}
+		if (next == NULL) {
+			break;
+		}
+		const LogRecord& r = *oldest;
+		int len = r.format(line, sizeof line, r.fmt, r.args);
+		(r.level >= LEVEL_WARN ? err : out).append(line, std::min(std::max(len, 0), (int)sizeof line - 1));
+		next->tail.store(next->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		written++;
+	}
+	for (LogRing* ring : rings) {
+		uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+		if (dropped != ring->reported) {
+			snprintf(line, sizeof line, "[Logger] Dropped %llu records of a thread whose ring buffer was full.\n",
+				(unsigned long long)(dropped - ring->reported));
+			err += line;
+			ring->reported = dropped;
+		}
+	}
+	if (!out.empty()) {
+		fwrite(out.data(), 1, out.length(), stdout);
+		fflush(stdout);
+	}
+	if (!err.empty()) {
+		fwrite(err.data(), 1, err.length(), stderr);
+		fflush(stderr);
+	}
+	return written;
+}
+
+/*
+ * Logger thread: keep writing out the records of all threads.
+ */
+void runLogger() {
+	while (1) {
+		if (drainLogs() == 0) {
+			usleep(LOG_IDLE_US);
+		}
+	}
+}
+
+/*
+ * Read the level to log at from LOG_LEVEL and start the logger thread.
+ * Records still queued when the process exits are written out by an exit handler.
+ */
+void startLogger() {
+	const char* names[] = {"debug", "info", "warn", "error"};
+	const char* level = getenv("LOG_LEVEL");
+	for (int i = LEVEL_DEBUG; level != NULL && i <= LEVEL_ERROR; i++) {
+		if (strcasecmp(level, names[i]) == 0) {
+			logLevel = i;
+		}
+	}
+	std::thread(runLogger).detach();
+	atexit([] { drainLogs(); });
+}
+
+#endif
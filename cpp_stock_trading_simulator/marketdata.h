@@ -0,0 +1,225 @@
+/* This file implements the market-data segment, in which Server Q publishes the current price of every stock for
+ * Server M to read without sending it a request.
+ *
+ * The segment is a POSIX shared-memory object that holds Server Q's ticker directory and one slot per ticker ID.
+ * Server Q is its only writer. Every slot is guarded by a seqlock: the writer makes the slot's sequence number odd,
+ * stores the price and the number of time shifts applied to the stock, and makes the sequence number even again.
+ * A reader copies the slot between two loads of the sequence number and tries again if they differ or are odd.
+ * Readers never write to the segment, so they never slow the writer down, and a read is a handful of loads unless
+ * it overlaps an update of the same stock. The fields are atomics accessed with relaxed loads and stores and ordered
+ * by fences, so that the concurrent accesses are well defined.
+ *
+ * Every update of a price is also appended to a change log, a ring of ticker IDs, so that a reader that keeps prices
+ * of its own (Server P) can catch up on the stocks that changed instead of reading them all. A reader that falls a
+ * whole ring behind reads every price again. The header also counts the time shifts Server Q has applied, which lets
+ * a reader tell whether the prices reflect the time shifts Server M has sent.
+ *
+ * Server Q creates the segment at startup, or takes over the one a previous run left behind, which keeps the
+ * mappings of running readers valid across its restarts. While it rewrites the directory, the version in the header
+ * is 0, which readers take as no data.
+ */
+
+#ifndef MARKETDATA_H
+#define MARKETDATA_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define MD_SHM_NAME "/stock_trading_md" // name of the shared-memory object
+#define MD_MAX_TICKERS 8192             // number of slots in the segment
+#define MD_TICKER_LEN 16                // bytes per ticker in the directory, including the terminating NUL
+#define MD_LOG_SIZE 4096                // entries of the change log
+
+// Structure to contain the current price of one stock, on a cache line of its own
+struct alignas(64) MdSlot {
+	std::atomic<uint32_t> seq;     // odd while the writer updates the slot
+	std::atomic<uint32_t> shifts;  // time shifts applied to the stock since Server Q started
+	std::atomic<uint64_t> price;   // bits of the current price
+};
+
+// Structure to contain the whole segment
+struct MdSegment {
+	std::atomic<uint32_t> version; // version of the ticker directory, as in MSG_DIRECTORY, or 0 while it is written
+	std::atomic<int32_t> pid;      // process ID of Server Q
+	std::atomic<uint32_t> numTickers;
+	std::atomic<uint32_t> timeShifts; // time shifts applied since Server Q started
+	std::atomic<uint64_t> changes;    // price updates published so far; the ticker ID of update n is in changeLog[n % MD_LOG_SIZE]
+	std::atomic<uint16_t> changeLog[MD_LOG_SIZE];
+	char tickers[MD_MAX_TICKERS][MD_TICKER_LEN];
+	MdSlot slots[MD_MAX_TICKERS];
+};
+
+/*
+ * Create the segment, or open the one left by an earlier run, for writing. Used by Server Q.
+ * @return the mapped segment, or NULL if it cannot be set up
+ */
+MdSegment* mdCreate() {
+	int fd = shm_open(MD_SHM_NAME, O_CREAT | O_RDWR, 0644);
+	if (fd == -1) {
+		perror("Market data: shm_open");
+		return NULL;
+	}
+	if (ftruncate(fd, sizeof(MdSegment)) == -1) {
+		perror("Market data: ftruncate");
+		close(fd);
+		return NULL;
+	}
+	void* addr = mmap(NULL, sizeof(MdSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		perror("Market data: mmap");
+		return NULL;
+	}
+	return (MdSegment*)addr;
+}
+
+/*
+ * Open the segment for reading. Used by Server M.
+ * @return the mapped segment, or NULL if Server Q has not created it yet
+ */
+const MdSegment* mdAttach() {
+	int fd = shm_open(MD_SHM_NAME, O_RDONLY, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(MdSegment)) {
+		close(fd);
+		return NULL;
+	}
+	void* addr = mmap(NULL, sizeof(MdSegment), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return addr == MAP_FAILED ? NULL : (const MdSegment*)addr;
+}
+
+/*
+ * Update the price of a stock in the segment.
+ * @param seg the segment
+ * @param id the ticker ID
+ * @param price the current price
+ * @param shifts the number of time shifts applied to the stock
+ */
+void mdPublish(MdSegment* seg, uint16_t id, double price, uint32_t shifts) {
+	MdSlot& slot = seg->slots[id];
+	uint64_t bits;
+	memcpy(&bits, &price, sizeof bits);
+	uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+	slot.seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.price.store(bits, std::memory_order_relaxed);
+	slot.shifts.store(shifts, std::memory_order_relaxed);
+	slot.seq.store(seq + 2, std::memory_order_release);
+	uint64_t n = seg->changes.load(std::memory_order_relaxed);
+	seg->changeLog[n % MD_LOG_SIZE].store(id, std::memory_order_relaxed);
+	seg->changes.store(n + 1, std::memory_order_release);
+}
+
+/*
+ * Count a time shift whose new price has been published.
+ * @param seg the segment
+ */
+void mdCountTimeShift(MdSegment* seg) {
+	seg->timeShifts.store(seg->timeShifts.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/*
+ * Write the ticker directory and the current prices into the segment.
+ * @param seg the segment
+ * @param version the version of the directory
+ * @param tickers the ticker of each ticker ID
+ * @param prices the current price of each ticker ID
+ * @return false, if the directory does not fit into the segment, which is then left without data
+ */
+bool mdPublishDirectory(MdSegment* seg, uint32_t version, const std::vector<std::string>& tickers, const std::vector<double>& prices) {
+	seg->version.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	if (tickers.size() > MD_MAX_TICKERS) {
+		return false;
+	}
+	for (size_t id = 0; id < tickers.size(); id++) {
+		if (tickers[id].length() >= MD_TICKER_LEN) {
+			return false;
+		}
+		strncpy(seg->tickers[id], tickers[id].c_str(), MD_TICKER_LEN);
+		mdPublish(seg, id, prices[id], 0);
+	}
+	seg->numTickers.store(tickers.size(), std::memory_order_relaxed);
+	seg->timeShifts.store(0, std::memory_order_relaxed);
+	seg->pid.store(getpid(), std::memory_order_relaxed);
+	seg->version.store(version, std::memory_order_release);
+	return true;
+}
+
+/*
+ * Read the price of a stock from the segment.
+ * @param seg the segment
+ * @param version the version of the directory the ticker ID comes from
+ * @param id the ticker ID
+ * @param price the returned price
+ * @param shifts the returned number of time shifts applied to the stock
+ * @return false, if the segment holds a different directory or none
+ */
+bool mdRead(const MdSegment* seg, uint32_t version, uint16_t id, double& price, uint32_t& shifts) {
+	if (seg->version.load(std::memory_order_acquire) != version || id >= seg->numTickers.load(std::memory_order_relaxed)) {
+		return false;
+	}
+	const MdSlot& slot = seg->slots[id];
+	uint32_t before, after;
+	uint64_t bits;
+	do {
+		before = slot.seq.load(std::memory_order_acquire);
+		bits = slot.price.load(std::memory_order_relaxed);
+		shifts = slot.shifts.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		after = slot.seq.load(std::memory_order_relaxed);
+	} while (before != after || (before & 1));
+	memcpy(&price, &bits, sizeof price);
+	// The directory may have been rewritten meanwhile
+	return seg->version.load(std::memory_order_relaxed) == version;
+}
+
+/*
+ * Get the ticker IDs whose prices have been updated since a reader last looked, from the change log.
+ * @param seg the segment
+ * @param cursor the number of updates the reader has seen; advanced past the returned ones
+ * @param ids the returned ticker IDs, which may repeat
+ * @return false, if the reader has fallen too far behind to find every update in the log
+ */
+bool mdChanges(const MdSegment* seg, uint64_t& cursor, std::vector<uint16_t>& ids) {
+	uint64_t head = seg->changes.load(std::memory_order_acquire);
+	ids.clear();
+	if (head - cursor >= MD_LOG_SIZE) { // also when the counter is behind the cursor, i.e. the segment is a new one
+		cursor = head;
+		return false;
+	}
+	for (uint64_t n = cursor; n < head; n++) {
+		ids.push_back(seg->changeLog[n % MD_LOG_SIZE].load(std::memory_order_relaxed));
+	}
+	// The writer may have overwritten the oldest of them meanwhile
+	std::atomic_thread_fence(std::memory_order_acquire);
+	bool intact = seg->changes.load(std::memory_order_relaxed) - cursor < MD_LOG_SIZE;
+	cursor = head;
+	return intact;
+}
+
+/*
+ * Tell whether the Server Q that published the segment is still running.
+ * @param seg the segment
+ * @return true, if its process exists
+ */
+bool mdAlive(const MdSegment* seg) {
+	pid_t pid = seg->pid.load(std::memory_order_relaxed);
+	return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+#endif
@@ -0,0 +1,158 @@
+/* This file implements the latency histogram and the request metrics shared by the load generator and the servers.
+ *
+ * The histogram is HDR-style: values below 2^HIST_SUB_BITS each have their own bucket, and every power-of-two range
+ * above that is split into 2^HIST_SUB_BITS equal buckets. Every recorded value is therefore known to within
+ * 1/2^HIST_SUB_BITS (about 3%) of itself, for values up to 2^64, with a fixed array of counters and O(1) recording.
+ *
+ * Every server keeps a Metric per request type it serves, and Server M also per backend request type it sends.
+ * The servers answer a MSG_STATS request on their UDP port with a table of their metrics, which ./stats prints.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+
+#define HIST_SUB_BITS 5                                    // log2 of the number of buckets per power of two
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+// Structure to count values, typically latencies in microseconds, by magnitude
+struct Histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;  // number of values recorded
+	uint64_t sum;    // sum of the values recorded
+	uint64_t max;    // largest value recorded
+
+	Histogram() {
+		reset();
+	}
+	void reset() {
+		memset(counts, 0, sizeof counts);
+		total = sum = max = 0;
+	}
+	void record(uint64_t value) {
+		counts[bucketOf(value)]++;
+		total++;
+		sum += value;
+		if (value > max) {
+			max = value;
+		}
+	}
+	void merge(const Histogram& other) {
+		for (int i = 0; i < HIST_BUCKETS; i++) {
+			counts[i] += other.counts[i];
+		}
+		total += other.total;
+		sum += other.sum;
+		if (other.max > max) {
+			max = other.max;
+		}
+	}
+	double mean() const {
+		return total == 0 ? 0 : (double)sum / total;
+	}
+	/*
+	 * Get a percentile of the recorded values.
+	 * @param p the percentile, between 0 and 100
+	 * @return the largest value of the bucket that holds the percentile, or 0 if nothing has been recorded
+	 */
+	uint64_t percentile(double p) const {
+		if (total == 0) {
+			return 0;
+		}
+		uint64_t rank = (uint64_t)(p / 100 * total + 0.5);
+		if (rank < 1) {
+			rank = 1;
+		}
+		uint64_t seen = 0;
+		for (int i = 0; i < HIST_BUCKETS; i++) {
+			seen += counts[i];
+			if (seen >= rank) {
+				uint64_t top = highestOf(i);
+				return top < max ? top : max;
+			}
+		}
+		return max;
+	}
+
+private:
+	static int bucketOf(uint64_t value) {
+		if (value < HIST_SUB_COUNT) {
+			return value;
+		}
+		int msb = 63 - __builtin_clzll(value);
+		int shift = msb - HIST_SUB_BITS;
+		return (shift + 1) * HIST_SUB_COUNT + (int)((value >> shift) - HIST_SUB_COUNT);
+	}
+	static uint64_t highestOf(int bucket) {
+		if (bucket < HIST_SUB_COUNT) {
+			return bucket;
+		}
+		int shift = bucket / HIST_SUB_COUNT - 1;
+		uint64_t low = (uint64_t)(HIST_SUB_COUNT + bucket % HIST_SUB_COUNT) << shift;
+		return low + ((uint64_t)1 << shift) - 1;
+	}
+};
+
+// Structure to contain the counters and latencies of one type of request
+struct Metric {
+	uint64_t count;    // requests answered
+	uint64_t errors;   // requests answered with a failure status
+	uint64_t timeouts; // requests given up on without an answer
+	uint64_t retries;  // retransmissions of requests
+	Histogram latency; // latency of the answered requests, in microseconds
+
+	Metric() : count(0), errors(0), timeouts(0), retries(0) {}
+	void record(uint64_t us, bool ok) {
+		count++;
+		if (!ok) {
+			errors++;
+		}
+		latency.record(us);
+	}
+};
+
+/*
+ * Get the current time of a monotonic clock.
+ * @return the time in microseconds
+ */
+long long nowUs() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Format the column headings of a table of metrics.
+ * @return the heading line
+ */
+std::string metricHeader() {
+	char line[160];
+	snprintf(line, sizeof line, "%-22s %9s %7s %8s %7s %9s %9s %9s %9s %9s\n", "request", "count", "errors", "timeouts",
+		"retries", "mean(us)", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+	return line;
+}
+
+/*
+ * Append a row to a table of metrics, unless nothing has been recorded in the metric.
+ * @param table the table
+ * @param name the name of the request type
+ * @param m the metric
+ */
+void appendMetric(std::string& table, const std::string& name, const Metric& m) {
+	if (m.count == 0 && m.timeouts == 0 && m.retries == 0) {
+		return;
+	}
+	char line[200];
+	snprintf(line, sizeof line, "%-22s %9llu %7llu %8llu %7llu %9.0f %9llu %9llu %9llu %9llu\n", name.c_str(),
+		(unsigned long long)m.count, (unsigned long long)m.errors, (unsigned long long)m.timeouts,
+		(unsigned long long)m.retries, m.latency.mean(), (unsigned long long)m.latency.percentile(50),
+		(unsigned long long)m.latency.percentile(99), (unsigned long long)m.latency.percentile(99.9),
+		(unsigned long long)m.latency.max);
+	table += line;
+}
+
+#endif
@@ -0,0 +1,327 @@
+/* This file implements the replay driver, which feeds the recorded ticks of a price-history file (history.h) into a
+ * running Server Q as the market's prices, at real time, at a multiple of it, or as fast as Server Q applies them.
+ * The prices reach the rest of the system as any price change does: Server Q publishes them into the market-data
+ * segment, from which Server M and Server P read them, and pushes them to subscribed clients. So hours of market
+ * time can be run through the whole system in seconds.
+ *
+ * The next tick of every stock is kept in a timer wheel with one slot per millisecond of market time. The driver
+ * takes the earliest slot with a tick due, waits for its time at the chosen speed, and sends the tick current at that
+ * time of every stock due. Ticks are sent in MSG_TICKS batches by ticker ID, one batch at a time, and each batch is
+ * sent again until Server Q confirms it. At full speed this paces the driver to Server Q; at a set speed, the ticks
+ * due at once are sent together before the driver waits for the next ones.
+ *
+ * The ticker IDs come from the directory Server Q publishes in the market-data segment (marketdata.h), so the driver
+ * runs on the host of Server Q. Stocks of the history that Server Q does not quote are skipped.
+ *
+ * Usage: ./replay [-s <speed>|max] [history file]   (speed 1 and quotes.hist by default)
+ */
+
+#include "utility.h"
+#include "marketdata.h"
+#include "history.h"
+#include <thread>
+using namespace std;
+
+#define WHEEL_SIZE 4096          // slots of the timer wheel, one per millisecond of market time; a power of 2
+#define BATCH_TICKS 512          // most ticks per MSG_TICKS message
+#define REPLAY_TIMEOUT_MS 500    // time to wait for Server Q to confirm a batch before sending it again
+#define MAX_RETRIES 3
+#define REPORT_MS 5000           // interval of the progress reports
+
+// Structure to contain the next tick of every stock, hashed by its time into the slot of that millisecond
+struct TimerWheel {
+	vector<vector<pair<int64_t, uint32_t>>> slots; // time and stock of every entry
+	int64_t now;                                  // time of the slot expired last
+	size_t size;                                  // number of entries
+
+	TimerWheel(int64_t start) : slots(WHEEL_SIZE), now(start - 1), size(0) {}
+
+	/*
+	 * Add an entry.
+	 * @param time the time (ms), after the slot expired last
+	 * @param stock the index of the stock in the history
+	 */
+	void schedule(int64_t time, uint32_t stock) {
+		slots[time & (WHEEL_SIZE - 1)].push_back(make_pair(time, stock));
+		size++;
+	}
+
+	/*
+	 * Find the time of the earliest entry. Entries of later turns of the wheel share the slots, so each is compared
+	 * by its time; if none is due within one turn, the earliest of all is searched for.
+	 * @return the time (ms), or INT64_MAX if the wheel is empty
+	 */
+	int64_t next() const {
+		if (size == 0) {
+			return INT64_MAX;
+		}
+		for (int64_t t = now + 1; t <= now + WHEEL_SIZE; t++) {
+			for (const auto& entry : slots[t & (WHEEL_SIZE - 1)]) {
+				if (entry.first == t) {
+					return t;
+				}
+			}
+		}
+		int64_t earliest = INT64_MAX;
+		for (const auto& slot : slots) {
+			for (const auto& entry : slot) {
+				earliest = min(earliest, entry.first);
+			}
+		}
+		return earliest;
+	}
+
+	/*
+	 * Remove the entries of a time.
+	 * @param time the time (ms), not before the earliest entry
+	 * @param due the returned stocks of the entries
+	 */
+	void expire(int64_t time, vector<uint32_t>& due) {
+		auto& slot = slots[time & (WHEEL_SIZE - 1)];
+		due.clear();
+		for (size_t i = 0; i < slot.size(); ) {
+			if (slot[i].first == time) {
+				due.push_back(slot[i].second);
+				slot[i] = slot.back();
+				slot.pop_back();
+			}
+			else {
+				i++;
+			}
+		}
+		size -= due.size();
+		now = time;
+	}
+};
+
+// Global Variables
+History history;                   // the mapped history being replayed
+const MdSegment* market = NULL;    // the market-data segment of Server Q
+uint32_t dirVersion;               // version of Server Q's ticker directory
+vector<int> quoteIds;              // ticker ID at Server Q of each stock of the history, or -1 if it does not quote it
+int sockfd;                        // the datagram socket
+Endpoint serverAddr;               // socket address of Server Q
+uint32_t nextReqId;                // request ID of the next batch
+unsigned long long ticksSent = 0;  // ticks Server Q has applied
+
+/*
+ * Map the stocks of the history to the ticker IDs of Server Q's directory, as published in the market-data segment.
+ * @return false, if Server Q has not published a directory, or rewrote it meanwhile
+ */
+bool loadDirectory() {
+	uint32_t version = market->version.load(memory_order_acquire);
+	if (version == 0) {
+		return false;
+	}
+	uint32_t n = min(market->numTickers.load(memory_order_relaxed), (uint32_t)MD_MAX_TICKERS);
+	unordered_map<string, int> ids;
+	for (uint32_t id = 0; id < n; id++) {
+		ids[string(market->tickers[id], strnlen(market->tickers[id], MD_TICKER_LEN))] = id;
+	}
+	if (market->version.load(memory_order_acquire) != version) {
+		return false;
+	}
+	dirVersion = version;
+	quoteIds.assign(history.header->numTickers, -1);
+	for (uint32_t i = 0; i < history.header->numTickers; i++) {
+		auto it = ids.find(history.tickers[i].ticker);
+		if (it != ids.end()) {
+			quoteIds[i] = it->second;
+		}
+	}
+	return true;
+}
+
+/*
+ * Load Server Q's directory, waiting for Server Q to publish it.
+ */
+void waitForDirectory() {
+	for (int attempt = 0; attempt < 50; attempt++) {
+		if (market == NULL) {
+			market = mdAttach();
+		}
+		if (market != NULL && loadDirectory()) {
+			return;
+		}
+		this_thread::sleep_for(chrono::milliseconds(100));
+	}
+	fprintf(stderr, "Replay: Server Q has not published its ticker directory\n");
+	exit(1);
+}
+
+/*
+ * Wait for Server Q's reply to a batch, skipping anything else that arrives.
+ * @param reqId the request ID of the batch
+ * @param applied the returned number of ticks applied
+ * @return the status of the reply, or -1 if none came in time
+ */
+int awaitReply(uint32_t reqId, uint16_t& applied) {
+	char buf[MAXBUFSIZE];
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(REPLAY_TIMEOUT_MS);
+	while (1) {
+		long long left = chrono::duration_cast<chrono::microseconds>(deadline - chrono::steady_clock::now()).count();
+		if (left <= 0) {
+			return -1;
+		}
+		struct timeval tv = {(time_t)(left / 1000000), (suseconds_t)(left % 1000000)};
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(sockfd, &readfds);
+		if (select(sockfd + 1, &readfds, NULL, NULL, &tv) <= 0) {
+			return -1;
+		}
+		int numbytes = recv(sockfd, buf, MAXBUFSIZE, 0);
+		if (numbytes == -1) {
+			perror("Replay: recv");
+			return -1;
+		}
+		MsgReader reply(buf, numbytes);
+		if (reply.ok && reply.type == (MSG_TICKS | MSG_REPLY) && reply.reqId == reqId) {
+			applied = reply.status == ST_OK ? reply.getU16() : 0;
+			return reply.status;
+		}
+	}
+}
+
+/*
+ * Send a batch of ticks to Server Q and wait until it has applied them, sending it again as long as no reply comes.
+ * @param batch the stock and price of each tick; cleared afterwards
+ */
+void sendBatch(vector<pair<uint32_t, double>>& batch) {
+	if (batch.empty()) {
+		return;
+	}
+	for (int attempt = 0; attempt <= MAX_RETRIES; attempt++) {
+		uint32_t reqId = nextReqId++;
+		MsgWriter msg(MSG_TICKS, reqId);
+		msg.putU32(dirVersion);
+		uint16_t n = 0;
+		for (const auto& tick : batch) {
+			n += quoteIds[tick.first] != -1;
+		}
+		msg.putU16(n);
+		for (const auto& tick : batch) {
+			if (quoteIds[tick.first] != -1) {
+				msg.putU16(quoteIds[tick.first]);
+				msg.putF64(tick.second);
+			}
+		}
+		if (sendTo(sockfd, msg.bytes(), msg.size, serverAddr) == -1) {
+			perror("Replay: sendto");
+		}
+		uint16_t applied;
+		int status = awaitReply(reqId, applied);
+		if (status == ST_OK) {
+			ticksSent += applied;
+			batch.clear();
+			return;
+		}
+		if (status == ST_STALE_DIRECTORY) { // Server Q has restarted with other stocks
+			fprintf(stderr, "Replay: Server Q has a new ticker directory\n");
+			waitForDirectory();
+		}
+	}
+	fprintf(stderr, "Replay: Server Q does not answer\n");
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	double speed = 1; // multiple of real time, or 0 for as fast as possible
+	int opt;
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		if (opt == 's') {
+			speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg);
+			if (speed <= 0 && strcmp(optarg, "max") != 0) {
+				optind = argc + 1;
+				break;
+			}
+		}
+		else {
+			optind = argc + 1;
+		}
+	}
+	if (optind > argc || argc - optind > 1) {
+		fprintf(stderr, "Usage: %s [-s <speed>|max] [history file]\n", argv[0]);
+		exit(1);
+	}
+	const char* fileName = optind < argc ? argv[optind] : HISTORY_FILE;
+	if (!histOpen(fileName, history)) {
+		fprintf(stderr, "Replay: cannot open the history %s\n", fileName);
+		exit(1);
+	}
+
+	sockfd = setupDatagram('R', NULL);
+	serverAddr = serverEndpoint(PORT_Q);
+	nextReqId = (uint32_t)getpid() << 16;
+	waitForDirectory();
+
+	// Schedule the first tick of every stock Server Q quotes; the replay starts at the earliest of them
+	uint32_t numStocks = history.header->numTickers;
+	int64_t start = INT64_MAX;
+	size_t quoted = 0;
+	for (uint32_t i = 0; i < numStocks; i++) {
+		if (quoteIds[i] != -1) {
+			start = min(start, history.times[history.tickers[i].first]);
+			quoted++;
+		}
+	}
+	if (quoted == 0) {
+		fprintf(stderr, "Replay: Server Q quotes none of the stocks of %s\n", fileName);
+		exit(1);
+	}
+	TimerWheel wheel(start);
+	for (uint32_t i = 0; i < numStocks; i++) {
+		if (quoteIds[i] != -1) {
+			wheel.schedule(history.times[history.tickers[i].first], i);
+		}
+	}
+	if (speed > 0) {
+		printf("[Replay] Replaying %zu of %u stocks of %s at %g times real time.\n", quoted, numStocks, fileName, speed);
+	}
+	else {
+		printf("[Replay] Replaying %zu of %u stocks of %s at full speed.\n", quoted, numStocks, fileName);
+	}
+	fflush(stdout);
+
+	auto begin = chrono::steady_clock::now();
+	auto report = begin + chrono::milliseconds(REPORT_MS);
+	vector<uint32_t> due;
+	vector<pair<uint32_t, double>> batch;
+	int64_t time = start;
+	while (wheel.size > 0) {
+		time = wheel.next();
+		if (speed > 0) {
+			auto at = begin + chrono::duration_cast<chrono::steady_clock::duration>(
+				chrono::duration<double, milli>((time - start) / speed));
+			if (at > chrono::steady_clock::now()) {
+				sendBatch(batch);
+				this_thread::sleep_until(at);
+			}
+		}
+		// Send the tick of every stock due, and schedule its next one
+		wheel.expire(time, due);
+		for (uint32_t i : due) {
+			const HistTicker& t = history.tickers[i];
+			uint64_t k = histSeek(history, i, time);
+			batch.push_back(make_pair(i, history.prices[t.first + k]));
+			if (batch.size() == BATCH_TICKS) {
+				sendBatch(batch);
+			}
+			if (k + 1 < t.count) {
+				wheel.schedule(history.times[t.first + k + 1], i);
+			}
+		}
+		if (chrono::steady_clock::now() >= report) {
+			printf("[Replay] %.1f s of market time, %llu ticks sent.\n", (time - start) / 1000.0, ticksSent);
+			fflush(stdout);
+			report += chrono::milliseconds(REPORT_MS);
+		}
+	}
+	sendBatch(batch);
+
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+	printf("[Replay] Replayed %llu ticks, %.1f s of market time, in %.2f s (%.0f ticks/s).\n",
+		ticksSent, (time - start) / 1000.0, elapsed, ticksSent / max(elapsed, 1e-9));
+	close(sockfd);
+	return 0;
+}
@@ -1,12 +1,19 @@
 /* 	This file implements the authentication server (Server A) to authenticate users against its stored credentials 
  *	before users can access the other functions of this stock trading system. 
+ *	With WORKERS=n, n worker threads receive and answer requests, each on a socket of its own (utility.h).
  */
 
 #include "utility.h"
+#include "metrics.h"
+#include "logger.h"
+#include <thread>
+#include <mutex>
 using namespace std;
 
 // Global Variable 
 unordered_map<string, string> credentials; // structure storing members' info
+Metric stats[NUM_MSG_TYPES];               // count and service time of the requests of each type
+mutex statsLock;                           // guards stats, which every worker updates
 
 /*
  * Convert a string to lowercase.
@@ -49,8 +56,13 @@ void loadMembers() {
  * @param encrypted the encrypted password passed from the main server
  * @return the result of authentication. 0: Failed. 1: Succeeded.
  */
-bool authenticate(const string& uname, const string& encrypted) {
-	auto it = credentials.find(strToLower(uname));
+bool authenticate(const string& uname, string_view encrypted) {
+	thread_local string key; // the lowercase username, in a buffer reused by every lookup of the thread
+	key = uname;
+	for (char& c : key) {
+		c = tolower(c);
+	}
+	auto it = credentials.find(key);
 	if (it != credentials.end()) {
 		return  encrypted == it->second;
     }
@@ -59,68 +71,95 @@ bool authenticate(const string& uname, const string& encrypted) {
     }
 }
 
-int main() {
-	int sockfd;
+/*
+ * Answer a stats request with the metrics of this server.
+ * @param sockfd the UDP socket
+ * @param addr the socket address of the requester
+ * @param reqId the request ID of the stats request
+ */
+void sendStats(int sockfd, const Endpoint& addr, uint32_t reqId) {
+	lock_guard<mutex> guard(statsLock);
+	string table = "[Server A] " + to_string(credentials.size()) + " members\n" + metricHeader();
+	for (int type = 0; type < NUM_MSG_TYPES; type++) {
+		appendMetric(table, msgTypeName(type), stats[type]);
+	}
+	MsgWriter reply(MSG_STATS | MSG_REPLY, reqId);
+	reply.putText(table);
+	if (sendTo(sockfd, reply.bytes(), reply.size, addr) == -1) {
+		perror("Server A: stats sendto");
+	}
+}
+
+/*
+ * Worker thread: receive authentication requests on a socket and answer them.
+ * @param sockfd the socket of the worker
+ */
+void serveRequests(int sockfd) {
 	int numbytes;
 	char buf[MAXBUFSIZE];
-	string uname, encrypted, result;
-	struct sockaddr_in serverAddr; // socket address of Server M
-	socklen_t addrLen = sizeof(serverAddr);
-	
-	// Bootup
-	// Load input file
-	loadMembers();
-	// Set up UDP socket
-	printf("[Server A] Booting up using UDP on port %s.\n", PORT_A);
-	sockfd = setupUDP('A', PORT_A);
-	
+	string uname;
+	Endpoint serverAddr; // socket address of Server M
+
 	while (1) {
 		// Receive an authentication request from Server M
-		if ((numbytes = recvfrom(sockfd, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&serverAddr, &addrLen)) == -1) {
+		if ((numbytes = recvFrom(sockfd, buf, MAXBUFSIZE - 1, serverAddr)) == -1) {
 			perror("Server A: recvfrom");
 			continue;
 		}
-		buf[numbytes] = '\0';
+
+		long long received = nowUs();
 
 		// Parse the request
-		string authRequest(buf), transID, payload;
-		int colon = authRequest.find(':');
-		transID = authRequest.substr(0, colon);
-		payload = authRequest.substr(colon + 1);
-		int comma = payload.find(',');
-		uname = payload.substr(0, comma);
-		encrypted = payload.substr(comma + 1);
-		printf("[Server A] Received username %s and password ******.\n", uname.c_str());
+		MsgReader request(buf, numbytes);
+		if (request.ok && request.type == MSG_STATS) {
+			sendStats(sockfd, serverAddr, request.reqId);
+			continue;
+		}
+		request.getSymbol(uname);
+		string_view encrypted = request.getSymbol();
+		if (!request.ok || request.type != MSG_AUTH) {
+			continue;
+		}
+		LOG_INFO("[Server A] Received username %s and password ******.\n", uname.c_str());
 
 		// Compose the authentication response
-		if (authenticate(uname, encrypted)) { // send "s" to represent success
-			result = transID + ":s";
-			printf("[Server A] Member %s has been authenticated.\n", uname.c_str());
+		uint8_t status;
+		if (authenticate(uname, encrypted)) {
+			status = ST_OK;
+			LOG_INFO("[Server A] Member %s has been authenticated.\n", uname.c_str());
 		}
-		else { // send "f" to represent failure
-			result = transID + ":f";
-			printf("[Server A] The username %s or password ****** is incorrect.\n", uname.c_str());
+		else {
+			status = ST_AUTH_FAILED;
+			LOG_INFO("[Server A] The username %s or password ****** is incorrect.\n", uname.c_str());
 		}
 
 		// Send the authentication result to Server M via UDP
-		sendto(sockfd, result.c_str(), result.length(), 0, (struct sockaddr*)&serverAddr, addrLen);
+		MsgWriter result(MSG_AUTH | MSG_REPLY, request.reqId, status);
+		sendTo(sockfd, result.bytes(), result.size, serverAddr);
+		lock_guard<mutex> guard(statsLock);
+		stats[MSG_AUTH].record(nowUs() - received, status == ST_OK);
 	}
-	
-	close(sockfd);
-	return 0;
 }
-		
-
-
-
-
-
-
-
-
-
-
-
-
 
+int main() {
+	// Bootup
+	startLogger();
+	// Load input file
+	loadMembers();
+	// Set up UDP sockets, one per worker thread
+	LOG_INFO("[Server A] Booting up using UDP on port %s.\n", PORT_A);
+	vector<int> socks = setupWorkerSockets('A', PORT_A, workerCount());
+	// The credentials may have changed since Server M cached them; tell it to forget what it has verified
+	Endpoint mainAddr = serverEndpoint(PORT_M_UDP);
+	MsgWriter invalidate(MSG_AUTH_INVALIDATE, 0);
+	if (sendTo(socks[0], invalidate.bytes(), invalidate.size, mainAddr) == -1) {
+		perror("Server A: invalidate sendto");
+	}
 
+	// The credentials are only read from now on, so the workers share them without a lock
+	for (size_t i = 1; i < socks.size(); i++) {
+		thread(serveRequests, socks[i]).detach();
+	}
+	serveRequests(socks[0]);
+	return 0;
+}
@@ -0,0 +1,681 @@
+/* This file implements the matching engine (Server E), which keeps a limit order book for every stock and matches
+ * the limit orders users place through Server M.
+ *
+ * Orders are matched by price-time priority: an incoming order trades with the best-priced resting orders of the
+ * other side, oldest first at each price, for as long as the prices cross, and whatever is left rests on the book.
+ * Every fill is sent to Server P, which updates the portfolios of both parties, and the price of the last fill of an
+ * order is sent to Server Q as the current price of the stock. The shares of a limit sell are reserved at Server P
+ * by Server M before the order gets here, and the order carries the ID of its reservation. Server P sells the
+ * reserved shares as the order fills, keeps the reservation once this server reports that the order rests, and
+ * releases whatever is left of it when the order is cancelled. The seller's side of a fill is sent first, and the
+ * buyer's side only once Server P has applied it, so a trade is never reported to only one party; a sell whose
+ * reservation Server P no longer holds is taken off the book.
+ *
+ * Each side of a book is a vector of price levels sorted so that the best price is at the back, where levels are
+ * matched, added and removed in O(1) in the common case. Orders live in one pool and are chained into the queue of
+ * their level by indices stored in the orders themselves. Only resting orders are found by ID, through a hash map,
+ * so an order that fills at once leaves nothing behind and memory follows the size of the books.
+ * Prices are kept in integer cents.
+ *
+ * Messages to Server P are sent again until Server P acknowledges them, since a lost fill would leave a portfolio
+ * wrong. Each side of a fill carries a fill ID, the epoch of the run and a sequence number, with which Server P
+ * recognizes a repeated fill even across restarts, and the lowest sequence number not acknowledged yet, below which
+ * Server P need not remember the IDs. Server M retransmits its requests too, so replies are remembered
+ * like Server P does. The books are kept in memory only and are lost when this server restarts; at every start,
+ * Server P is told to release the reservations of the sells on the books of earlier runs, which are told apart by
+ * the epoch of the run, the time it started.
+ *
+ * ./serverE bench [events] runs a synthetic flow of orders and cancels through the books, without the network,
+ * and reports the rate at which they are processed.
+ */
+
+#include "utility.h"
+#include "metrics.h"
+#include "logger.h"
+#include "history.h"
+#include <poll.h>
+#include <random>
+using namespace std;
+
+#define NIL UINT32_MAX        // no order
+#define RESEND_MS 500         // time to wait for Server P's acknowledgement before sending a message again
+#define REPLY_CACHE_SIZE 1024 // number of recent requests whose replies are remembered
+#define BENCH_EVENTS 10000000 // default number of order events of a benchmark run
+#define BENCH_TICKERS 8       // number of books of a benchmark run
+
+// Structure to contain an order resting on a book
+struct Order {
+	uint32_t id;
+	uint32_t prev, next;  // slots of the older and the newer order at the same price
+	uint32_t user;        // user ID of the owner
+	uint16_t ticker;
+	uint8_t side;
+	int shares;           // shares not filled yet
+	int64_t price;        // limit price in cents
+	uint32_t reserve;     // ID of the reservation of the shares of a sell at Server P, or 0 for a buy
+};
+
+// Structure to contain the queue of orders at one price on one side of a book
+struct Level {
+	int64_t price;        // in cents
+	uint32_t head, tail;  // slots of the oldest and the newest order
+};
+
+// Structure to contain the limit order book of a stock; the best price of each side is at the back
+struct Book {
+	vector<Level> bids;   // ascending prices
+	vector<Level> asks;   // descending prices
+};
+
+// Structure to contain a trade of an incoming order with a resting one
+struct Fill {
+	uint32_t maker;       // user ID of the owner of the resting order
+	uint32_t makerOrder;  // order ID of the resting order
+	uint32_t makerReserve; // reservation ID of the resting order, or 0 for a buy
+	int shares;
+	int64_t price;        // price of the resting order, in cents
+};
+
+// Structure to contain a message to Server P that has not been acknowledged yet
+struct Outbound {
+	string msg;
+	long long deadline;   // time (ms) at which it is sent again
+	uint32_t fill = 0;    // sequence number of the side of a fill the message reports, or 0
+	uint32_t order = 0;   // order ID of the sell whose reservation the message uses, or 0
+	string buyer;         // the seller's side of a fill: username of the buyer, whose side is sent once this one is applied
+	uint16_t ticker = 0;  // the seller's side of a fill: the fill, for the buyer's side
+	int shares = 0;
+	int64_t price = 0;
+};
+
+// Global Variables
+vector<string> tickerNames;                // ticker of each ticker ID
+unordered_map<string, uint16_t> tickerIds; // ticker ID of each ticker
+vector<Book> books;                        // book of each ticker ID
+vector<string> userNames;                  // username of each user ID
+unordered_map<string, uint32_t> userIds;   // user ID of each username
+vector<Order> orders;                      // pool of resting orders
+vector<uint32_t> freeSlots;                // slots of the pool not in use
+unordered_map<uint32_t, uint32_t> slotOf;  // slot of each resting order, by order ID
+uint32_t nextOrderId = 1;
+
+int sockfd;                                // UDP socket
+Endpoint sockaddrP, sockaddrQ;             // socket addresses of Server P and Server Q
+map<uint32_t, Outbound> unacked;           // messages to Server P not acknowledged yet, indexed by request ID
+uint32_t nextReqId;                        // ID given to the next message to Server P
+uint32_t epoch;                            // time this run started, which tells its orders apart from those of earlier runs
+uint32_t nextFillSeq = 1;                  // sequence number of the next side of a fill reported to Server P
+set<uint32_t> openFills;                   // sequence numbers of the sides of fills Server P has not acknowledged yet
+unordered_map<string, string> replyCache;  // reply sent for each recent request, indexed by the request including its ID
+deque<string> replyOrder;                  // requests in replyCache, oldest first
+Metric stats[NUM_MSG_TYPES];               // count and service time of the requests of each type
+
+/*
+ * Load the tickers from the price history or the input "quotes.txt", the same file Server Q loads, and give each
+ * an empty book.
+ */
+void loadTickers() {
+	History history;
+	if (histOpen(HISTORY_FILE, history)) {
+		for (uint32_t i = 0; i < history.header->numTickers; i++) {
+			tickerIds[history.tickers[i].ticker] = tickerNames.size();
+			tickerNames.push_back(history.tickers[i].ticker);
+		}
+		munmap((void*)history.header, history.size);
+		books.resize(tickerNames.size());
+		return;
+	}
+	string line, ticker;
+	ifstream file("quotes.txt");
+	if (!file.is_open()) {
+		perror("Failed to open quotes.txt");
+		exit(1);
+	}
+	while (getline(file, line)) {
+		istringstream iss(line);
+		if (iss >> ticker && !tickerIds.count(ticker)) {
+			tickerIds[ticker] = tickerNames.size();
+			tickerNames.push_back(ticker);
+		}
+	}
+	file.close();
+	books.resize(tickerNames.size());
+}
+
+/*
+ * Get the user ID of a user, assigning the next free one to a user this server has not seen.
+ * @param uname the username
+ * @return the user ID
+ */
+uint32_t internUser(const string& uname) {
+	auto it = userIds.find(uname);
+	if (it != userIds.end()) {
+		return it->second;
+	}
+	userNames.push_back(uname);
+	return userIds[uname] = userNames.size() - 1;
+}
+
+/*
+ * Convert a price to integer cents.
+ * @param price the price
+ * @return the price in cents
+ */
+int64_t toCents(double price) {
+	return llround(price * 100);
+}
+
+/*
+ * Find the price level of a price on one side of a book, or where it belongs.
+ * Levels are sorted from the worst price to the best one: ascending for bids, descending for asks.
+ * @param levels the side
+ * @param side the side of the orders on it
+ * @param price the price in cents
+ * @return the level with the price, or the first level with a better price
+ */
+vector<Level>::iterator findLevel(vector<Level>& levels, uint8_t side, int64_t price) {
+	if (side == SIDE_BUY) {
+		return lower_bound(levels.begin(), levels.end(), price, [](const Level& l, int64_t p) { return l.price < p; });
+	}
+	return lower_bound(levels.begin(), levels.end(), price, [](const Level& l, int64_t p) { return l.price > p; });
+}
+
+/*
+ * Take an order out of the queue of its price level and return its slot to the pool.
+ * @param level the price level
+ * @param slot the slot of the order
+ */
+void removeOrder(Level& level, uint32_t slot) {
+	Order& o = orders[slot];
+	if (o.prev != NIL) {
+		orders[o.prev].next = o.next;
+	}
+	else {
+		level.head = o.next;
+	}
+	if (o.next != NIL) {
+		orders[o.next].prev = o.prev;
+	}
+	else {
+		level.tail = o.prev;
+	}
+	slotOf.erase(o.id);
+	freeSlots.push_back(slot);
+}
+
+/*
+ * Match an incoming order against the resting orders of the other side of a book, by price-time priority.
+ * @param book the book
+ * @param side the side of the incoming order
+ * @param limit the limit price of the incoming order in cents
+ * @param shares the number of shares of the incoming order
+ * @param fills the trades, to which the trades of this order are appended
+ * @return the number of shares left unfilled
+ */
+int matchOrder(Book& book, uint8_t side, int64_t limit, int shares, vector<Fill>& fills) {
+	vector<Level>& opposite = side == SIDE_BUY ? book.asks : book.bids;
+	while (shares > 0 && !opposite.empty()) {
+		Level& level = opposite.back();
+		if (side == SIDE_BUY ? level.price > limit : level.price < limit) {
+			break;
+		}
+		while (shares > 0 && level.head != NIL) {
+			uint32_t slot = level.head;
+			Order& maker = orders[slot];
+			int traded = min(shares, maker.shares);
+			fills.push_back({maker.user, maker.id, maker.reserve, traded, level.price});
+			shares -= traded;
+			maker.shares -= traded;
+			if (maker.shares == 0) {
+				removeOrder(level, slot);
+			}
+		}
+		if (level.head == NIL) {
+			opposite.pop_back();
+		}
+	}
+	return shares;
+}
+
+/*
+ * Give a new order its order ID.
+ * @return the order ID
+ */
+uint32_t newOrderId() {
+	return nextOrderId++;
+}
+
+/*
+ * Put the unfilled part of an order on a book, behind the orders already resting at its price.
+ * @param book the book
+ * @param ticker the ticker ID of the book
+ * @param side the side of the order
+ * @param price the limit price in cents
+ * @param shares the number of shares left
+ * @param user the user ID of the owner
+ * @param reserve the reservation ID of a sell, or 0 for a buy
+ * @return the order ID
+ */
+uint32_t restOrder(Book& book, uint16_t ticker, uint8_t side, int64_t price, int shares, uint32_t user, uint32_t reserve) {
+	uint32_t slot;
+	if (!freeSlots.empty()) {
+		slot = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	else {
+		slot = orders.size();
+		orders.push_back(Order());
+	}
+	uint32_t id = newOrderId();
+	slotOf[id] = slot;
+
+	vector<Level>& levels = side == SIDE_BUY ? book.bids : book.asks;
+	auto it = findLevel(levels, side, price);
+	if (it == levels.end() || it->price != price) {
+		it = levels.insert(it, {price, NIL, NIL});
+	}
+	orders[slot] = {id, it->tail, NIL, user, ticker, side, shares, price, reserve};
+	if (it->tail != NIL) {
+		orders[it->tail].next = slot;
+	}
+	else {
+		it->head = slot;
+	}
+	it->tail = slot;
+	return id;
+}
+
+/*
+ * Cancel a resting order of a user.
+ * @param id the order ID
+ * @param user the user ID of the user asking
+ * @param cancelled the order as it was when cancelled
+ * @return true, if the order was cancelled. false, if it does not exist, has been filled or cancelled, or is another user's.
+ */
+bool cancelOrder(uint32_t id, uint32_t user, Order& cancelled) {
+	auto found = slotOf.find(id);
+	if (found == slotOf.end()) {
+		return false;
+	}
+	uint32_t slot = found->second;
+	if (orders[slot].user != user) {
+		return false;
+	}
+	cancelled = orders[slot];
+	vector<Level>& levels = cancelled.side == SIDE_BUY ? books[cancelled.ticker].bids : books[cancelled.ticker].asks;
+	auto it = findLevel(levels, cancelled.side, cancelled.price);
+	removeOrder(*it, slot);
+	if (it->head == NIL) {
+		levels.erase(it);
+	}
+	return true;
+}
+
+/*
+ * Send a message to Server P and keep it until Server P acknowledges it.
+ * @param msg the message, whose request ID is filled in here
+ * @return the message as kept
+ */
+Outbound& sendToP(MsgWriter& msg) {
+	msg.setReqId(nextReqId++);
+	if (nextReqId == 0) {
+		nextReqId = 1;
+	}
+	Outbound& out = unacked[msg.reqId()];
+	out.msg.assign(msg.bytes(), msg.size);
+	out.deadline = nowUs() / 1000 + RESEND_MS;
+	if (sendTo(sockfd, msg.bytes(), msg.size, sockaddrP) == -1) {
+		perror("Server E: sendto Server P");
+	}
+	return out;
+}
+
+/*
+ * Send one side of a fill to Server P.
+ * @param uname the username of the party
+ * @param ticker the ticker ID of the stock
+ * @param side the side of the party
+ * @param shares the number of shares traded
+ * @param price the price in cents
+ * @param reserve the reservation ID of the sell, or 0 for the buyer's side
+ * @return the message as kept until Server P acknowledges it
+ */
+Outbound& sendFill(const string& uname, uint16_t ticker, uint8_t side, int shares, int64_t price, uint32_t reserve) {
+	MsgWriter msg(MSG_FILL, 0);
+	msg.putSymbol(uname);
+	msg.putSymbol(tickerNames[ticker]);
+	msg.putU8(side);
+	msg.putI32(shares);
+	msg.putF64(price / 100.0);
+	msg.putU32(reserve);
+	uint32_t seq = nextFillSeq++;
+	openFills.insert(seq);
+	msg.putU32(epoch);
+	msg.putU32(seq);
+	msg.putU32(*openFills.begin());
+	Outbound& out = sendToP(msg);
+	out.fill = seq;
+	return out;
+}
+
+/*
+ * Handle Server P's acknowledgement of a message. The buyer's side of a fill follows its seller's side once that is
+ * applied; if Server P does not hold the reservation of the sell, the trade is dropped, and the sell is taken off
+ * its book so that it does not trade again.
+ * @param ack the acknowledgement
+ */
+void onAcknowledged(MsgReader& ack) {
+	auto it = unacked.find(ack.reqId);
+	if (it == unacked.end()) {
+		return;
+	}
+	Outbound out = move(it->second);
+	unacked.erase(it);
+	openFills.erase(out.fill);
+	if (ack.status == ST_OK) {
+		if (!out.buyer.empty()) {
+			sendFill(out.buyer, out.ticker, SIDE_BUY, out.shares, out.price, 0);
+		}
+		return;
+	}
+	auto found = slotOf.find(out.order);
+	if (found != slotOf.end()) {
+		Order dropped;
+		cancelOrder(out.order, orders[found->second].user, dropped);
+	}
+	LOG_ERROR("[Server E] Server P holds no reservation for limit sell %u. Dropped its trade and took it off the book.\n",
+		out.order);
+}
+
+/*
+ * Send again every message to Server P whose acknowledgement is overdue.
+ */
+void resendUnacked() {
+	long long now = nowUs() / 1000;
+	for (auto& entry : unacked) {
+		Outbound& out = entry.second;
+		if (out.deadline <= now) {
+			out.deadline = now + RESEND_MS;
+			if (sendTo(sockfd, out.msg.data(), out.msg.length(), sockaddrP) == -1) {
+				perror("Server E: resend to Server P");
+			}
+		}
+	}
+}
+
+/*
+ * Send a reply to Server M and remember it, so that a retransmission of the request gets the same reply.
+ * @param request the request, as received
+ * @param response the encoded reply
+ * @param addr the socket address of Server M
+ */
+void sendReply(const string& request, const MsgWriter& response, const Endpoint& addr) {
+	if (replyCache.find(request) == replyCache.end()) {
+		replyOrder.push_back(request);
+		if (replyOrder.size() > REPLY_CACHE_SIZE) {
+			replyCache.erase(replyOrder.front());
+			replyOrder.pop_front();
+		}
+	}
+	replyCache[request].assign(response.bytes(), response.size);
+	if (sendTo(sockfd, response.bytes(), response.size, addr) == -1) {
+		perror("Server E: sendto");
+	}
+}
+
+/*
+ * Handle a limit order: match it, report its fills to Server P and its last price to Server Q, and rest the rest.
+ * @param request the request, as received
+ * @param msg the request, being decoded
+ * @param addr the socket address of Server M
+ * @return whether the order was accepted
+ */
+bool handleLimit(const string& request, MsgReader& msg, const Endpoint& addr) {
+	string uname, ticker;
+	msg.getSymbol(uname);
+	msg.getSymbol(ticker);
+	uint8_t side = msg.getU8();
+	int shares = msg.getI32();
+	int64_t limit = toCents(msg.getF64());
+	uint32_t reserve = msg.getU32();
+	if (!msg.ok || shares <= 0 || limit <= 0 || side > SIDE_SELL || (side == SIDE_SELL) != (reserve != 0)) {
+		return false;
+	}
+	LOG_INFO("[Server E] Received a limit %s order for %d shares of %s at %.2f from %s.\n",
+		side == SIDE_BUY ? "buy" : "sell", shares, ticker.c_str(), limit / 100.0, uname.c_str());
+	auto it = tickerIds.find(ticker);
+	if (it == tickerIds.end()) {
+		MsgWriter response(MSG_LIMIT | MSG_REPLY, msg.reqId, ST_NOT_EXIST);
+		sendReply(request, response, addr);
+		return false;
+	}
+	uint16_t tickerId = it->second;
+	uint32_t user = internUser(uname);
+
+	vector<Fill> fills;
+	int left = matchOrder(books[tickerId], side, limit, shares, fills);
+	uint32_t id = left > 0 ? restOrder(books[tickerId], tickerId, side, limit, left, user, reserve) : newOrderId();
+	int64_t cost = 0;
+	for (const Fill& fill : fills) {
+		// The seller's side goes first, and takes the buyer's side along for when it has been applied
+		const string& maker = userNames[fill.maker];
+		bool selling = side == SIDE_SELL;
+		Outbound& out = sendFill(selling ? uname : maker, tickerId, SIDE_SELL, fill.shares, fill.price,
+			selling ? reserve : fill.makerReserve);
+		out.order = selling ? id : fill.makerOrder;
+		out.buyer = selling ? maker : uname;
+		out.ticker = tickerId;
+		out.shares = fill.shares;
+		out.price = fill.price;
+		cost += fill.price * fill.shares;
+	}
+	if (side == SIDE_SELL && left > 0) {
+		// Server P keeps the reservation for as long as the order rests
+		MsgWriter rested(MSG_RESTED, 0);
+		rested.putSymbol(uname);
+		rested.putU32(reserve);
+		rested.putU32(epoch);
+		sendToP(rested).order = id;
+	}
+	if (!fills.empty()) {
+		MsgWriter trade(MSG_TRADE, 0);
+		trade.putSymbol(ticker);
+		trade.putF64(fills.back().price / 100.0);
+		if (sendTo(sockfd, trade.bytes(), trade.size, sockaddrQ) == -1) {
+			perror("Server E: trade sendto");
+		}
+	}
+	int filled = shares - left;
+	MsgWriter response(MSG_LIMIT | MSG_REPLY, msg.reqId);
+	response.putU32(id);
+	response.putI32(filled);
+	response.putF64(filled > 0 ? cost / 100.0 / filled : 0);
+	response.putI32(left);
+	sendReply(request, response, addr);
+	LOG_INFO("[Server E] Order %u filled %d shares in %zu trades; %d shares rest on the book.\n",
+		id, filled, fills.size(), left);
+	return true;
+}
+
+/*
+ * Handle the cancellation of a resting order, releasing the shares of a sell at Server P.
+ * @param request the request, as received
+ * @param msg the request, being decoded
+ * @param addr the socket address of Server M
+ * @return whether the order was cancelled
+ */
+bool handleCancel(const string& request, MsgReader& msg, const Endpoint& addr) {
+	string uname;
+	msg.getSymbol(uname);
+	uint32_t id = msg.getU32();
+	if (!msg.ok) {
+		return false;
+	}
+	LOG_INFO("[Server E] Received the cancellation of order %u from %s.\n", id, uname.c_str());
+	auto user = userIds.find(uname);
+	Order cancelled;
+	if (user == userIds.end() || !cancelOrder(id, user->second, cancelled)) {
+		MsgWriter response(MSG_CANCEL | MSG_REPLY, msg.reqId, ST_NOT_EXIST);
+		sendReply(request, response, addr);
+		return false;
+	}
+	if (cancelled.side == SIDE_SELL) {
+		MsgWriter release(MSG_RELEASE, 0);
+		release.putSymbol(uname);
+		release.putU32(cancelled.reserve);
+		sendToP(release);
+	}
+	MsgWriter response(MSG_CANCEL | MSG_REPLY, msg.reqId);
+	response.putI32(cancelled.shares);
+	sendReply(request, response, addr);
+	LOG_INFO("[Server E] Cancelled order %u with %d shares left.\n", id, cancelled.shares);
+	return true;
+}
+
+/*
+ * Answer a stats request with the metrics of this server.
+ * @param addr the socket address of the requester
+ * @param reqId the request ID of the stats request
+ */
+void sendStats(const Endpoint& addr, uint32_t reqId) {
+	size_t levels = 0;
+	for (const Book& book : books) {
+		levels += book.bids.size() + book.asks.size();
+	}
+	string table = "[Server E] resting orders: " + to_string(orders.size() - freeSlots.size()) + "; price levels: "
+		+ to_string(levels) + "; unacknowledged messages to Server P: " + to_string(unacked.size()) + "\n" + metricHeader();
+	for (int type = 0; type < NUM_MSG_TYPES; type++) {
+		appendMetric(table, msgTypeName(type), stats[type]);
+	}
+	MsgWriter reply(MSG_STATS | MSG_REPLY, reqId);
+	reply.putText(table);
+	if (sendTo(sockfd, reply.bytes(), reply.size, addr) == -1) {
+		perror("Server E: stats sendto");
+	}
+}
+
+/*
+ * Run a synthetic flow of limit orders around a moving price, and cancels of earlier orders, through the books.
+ * @param events the number of orders and cancels
+ */
+void bench(long events) {
+	mt19937 rng(42);
+	books.assign(BENCH_TICKERS, Book());
+	internUser("bench");
+	vector<uint32_t> placed; // IDs of orders that may still rest
+	vector<Fill> fills;
+	int64_t mid = 10000;
+	size_t numFills = 0;
+
+	long long start = nowUs();
+	for (long i = 0; i < events; i++) {
+		uint32_t r = rng();
+		if (r % 10 < 3 && !placed.empty()) { // cancel a random earlier order
+			size_t k = (r >> 8) % placed.size();
+			Order cancelled;
+			cancelOrder(placed[k], 0, cancelled);
+			placed[k] = placed.back();
+			placed.pop_back();
+			continue;
+		}
+		uint8_t side = (r >> 4) & 1;
+		int64_t price = mid + (int64_t)((r >> 8) % 41) - 20;
+		int shares = 1 + (r >> 16) % 100;
+		uint16_t ticker = (r >> 24) % BENCH_TICKERS;
+		fills.clear();
+		int left = matchOrder(books[ticker], side, price, shares, fills);
+		numFills += fills.size();
+		if (left > 0) {
+			placed.push_back(restOrder(books[ticker], ticker, side, price, left, 0, 0));
+		}
+		if ((i & 1023) == 0) {
+			mid += (int64_t)(rng() % 3) - 1;
+		}
+	}
+	double elapsed = (nowUs() - start) / 1e6;
+	printf("[Server E] Processed %ld order events (%zu fills) in %.3f s: %.2f million events per second.\n",
+		events, numFills, elapsed, events / elapsed / 1e6);
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		bench(argc > 2 ? atol(argv[2]) : BENCH_EVENTS);
+		return 0;
+	}
+
+	int numbytes;
+	char buf[MAXBUFSIZE];
+	Endpoint fromAddr;
+
+	// Bootup
+	startLogger();
+	loadTickers();
+	LOG_INFO("[Server E] Booting up using UDP on port %s.\n", PORT_E);
+	sockfd = setupDatagram('E', PORT_E);
+	sockaddrP = serverEndpoint(PORT_P);
+	sockaddrQ = serverEndpoint(PORT_Q);
+	// Start request IDs at a different point on every run, so Server P never mistakes a new message for an old one
+	epoch = (uint32_t)time(NULL);
+	nextReqId = epoch | 1;
+	// The books are empty: Server P releases the shares of the sells that were on them
+	MsgWriter start(MSG_ENGINE_START, 0);
+	start.putU32(epoch);
+	sendToP(start);
+
+	struct pollfd pfd = {sockfd, POLLIN, 0};
+	while (1) {
+		// Sleep until a request arrives or the earliest acknowledgement is overdue
+		int timeout = -1;
+		if (!unacked.empty()) {
+			long long earliest = unacked.begin()->second.deadline;
+			for (const auto& entry : unacked) {
+				earliest = min(earliest, entry.second.deadline);
+			}
+			timeout = (int)max(0LL, earliest - nowUs() / 1000);
+		}
+		if (poll(&pfd, 1, timeout) <= 0) {
+			resendUnacked();
+			continue;
+		}
+		if ((numbytes = recvFrom(sockfd, buf, MAXBUFSIZE, fromAddr)) == -1) {
+			perror("Server E: recvfrom");
+			continue;
+		}
+		long long received = nowUs();
+		MsgReader msg(buf, numbytes);
+		if (!msg.ok) {
+			continue;
+		}
+		if (msg.type == (MSG_FILL | MSG_REPLY) || msg.type == (MSG_RELEASE | MSG_REPLY) || msg.type == (MSG_RESTED | MSG_REPLY)
+			|| msg.type == (MSG_ENGINE_START | MSG_REPLY)) { // Server P's acknowledgement
+			onAcknowledged(msg);
+			continue;
+		}
+		if (msg.type == MSG_STATS) {
+			sendStats(fromAddr, msg.reqId);
+			continue;
+		}
+
+		// A retransmission of a request that has been answered already
+		string request(buf, numbytes);
+		auto cached = replyCache.find(request);
+		if (cached != replyCache.end()) {
+			sendTo(sockfd, cached->second.data(), cached->second.length(), fromAddr);
+			continue;
+		}
+		bool ok;
+		if (msg.type == MSG_LIMIT) {
+			ok = handleLimit(request, msg, fromAddr);
+		}
+		else if (msg.type == MSG_CANCEL) {
+			ok = handleCancel(request, msg, fromAddr);
+		}
+		else {
+			continue;
+		}
+		stats[msg.type].record(nowUs() - received, ok);
+		resendUnacked();
+	}
+	close(sockfd);
+	return 0;
+}
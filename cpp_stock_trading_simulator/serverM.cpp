@@ -1,13 +1,230 @@
-/* This file implements the main server (Server M) connecting to clients over TCP and to the three 
+/* This file implements the main server (Server M) connecting to clients over TCP and to the three
  * backend servers A, P, and Q over UDP. Server M functions as the central controller to handle users' commands
  * sent from clients and then assign different tasks to the three backend servers. This main server is responsible
  * for encrypting users' passwords in the authentication phase and calculating the profit/loss for "position" commands
  * based on the users' portfolios.
+ *
+ * All client connections and the backend UDP socket are multiplexed with epoll on a single thread.
+ * Messages on a client connection are length-prefixed frames tagged with the client's request ID, so a client
+ * may have several requests in progress at once. Each of them is a flow whose state machine records which step
+ * of the auth, quote, buy, sell or position flow it is in, i.e., whether it is waiting for its client or for a
+ * reply from a backend server.
+ *
+ * Every request to a backend server carries a unique request ID, which the backend echoes in its reply.
+ * Pending requests are kept in a table indexed by that ID, so each reply is routed to the flow waiting for it.
+ * A request without a reply is retransmitted after a timeout that doubles with every attempt;
+ * after MAX_RETRIES retransmissions the request fails and the client is told so.
+ *
+ * Clients may subscribe to stocks instead of polling their quotes. Server M subscribes to a stock at Server Q
+ * while at least one client watches it, and fans every price update Server Q pushes out to the watching clients.
+ * Updates are coalesced per stock: a client whose connection is still busy, or that gets several updates of
+ * a stock within one pass of the event loop, is only sent the latest price.
+ *
+ * A successful login is answered with a session token, with which the client can log in again later without its
+ * password. Server M also caches the credentials Server A has verified, so a repeated login skips Server A. Both expire,
+ * both are bounded, and both are dropped whenever Server A reloads its credentials.
+ *
+ * The backend servers are reached over UDP, or over Unix-domain datagram sockets with TRANSPORT=unix (utility.h).
+ * A message a backend server's receive queue has no room for waits in an outbox of that server, in order, and is
+ * sent again on every pass of the event loop until it fits. This matters for Unix-domain sockets, whose queues are
+ * short and make the sender wait instead of dropping the message.
+ *
+ * Current prices are read from the market-data segment Server Q publishes in shared memory (marketdata.h), instead
+ * of asking Server Q, whenever the segment is there, holds the same ticker directory, and reflects every time shift
+ * this server has sent for the stock. The price is then handed to the flow as a reply of Server Q at the end of the
+ * pass of the event loop, so the flows do not tell the two apart. Otherwise Server Q is asked as before.
+ * Server P keeps the profit of every portfolio up to date from the same segment, and answers a position request with
+ * it if its prices reflect the time shifts this server has sent; only otherwise are the prices of the portfolio
+ * looked up as for a quote.
+ *
+ * Overload is met with admission control instead of ever longer queues. At most BACKEND_WINDOW requests are in flight
+ * to each backend server; further ones wait in this server, unsent, until replies make room, so a backend server is
+ * never flooded and waiting requests are not retransmitted. A new command is refused with BUSY if the backend server
+ * it goes to first has BACKEND_QUEUE requests waiting, or if its user has run out of the command budget of a token
+ * bucket refilled at USER_RATE commands per second. Steps of commands that have started are never refused, so every
+ * admitted command runs to its end.
+ *
+ * Limit orders and their cancellations go to the matching engine (Server E). The shares of a limit sell are
+ * reserved at Server P first, so that the order can only fill with shares the user owns and has not sold otherwise.
+ * The reservation of an order that will not be placed is released with a request that is retransmitted like any
+ * other, although no flow waits for its reply.
+ *
+ * Server M measures every client command from the message that starts (or, for a confirmation, continues) it to
+ * its response, and every backend request from its first transmission to its reply, and reports them on MSG_STATS.
  */
 
 #include "utility.h"
+#include "metrics.h"
+#include "logger.h"
+#include "marketdata.h"
+#include <random>
 using namespace std;
 
+#define MAXEVENTS 64        // number of epoll events handled per wakeup
+#define REQ_TIMEOUT_MS 500  // time to wait for the first reply of a backend request before retransmitting it
+#define MAX_RETRIES 3       // number of retransmissions before a backend request fails
+#define DIR_RETRY_MS 1000   // time to wait for Server Q's ticker directory before asking for it again
+#define TOKEN_TTL_MS (30 * 60 * 1000)     // lifetime of a session token since it was last used
+#define MAX_TOKENS 4096                    // number of session tokens kept; the ones closest to expiry go first
+#define AUTH_CACHE_TTL_MS (10 * 60 * 1000) // time a verified credential is trusted without asking Server A
+#define AUTH_CACHE_SIZE 1024               // number of verified credentials kept
+#define OUTBOX_RETRY_MS 1   // time to wait before sending the messages in the outboxes again
+#define OUTBOX_SIZE 4096    // number of messages at which an outbox drops backend requests, which are retransmitted; notifications are always kept
+#define MD_CHECK_MS 1000    // time between checks that the market-data segment exists and Server Q is running
+#define BACKEND_WINDOW 128  // number of requests in flight to each backend server; later ones wait for replies
+#define BACKEND_QUEUE 1024  // number of requests waiting for a backend server at which new commands for it are refused
+#define RATE_ENV "USER_RATE"
+#define DEFAULT_USER_RATE 1000 // commands per second a user may start, unless USER_RATE sets it (0 for no limit)
+#define USER_BURST 100      // commands a user may start at once after a pause
+
+/* Steps of the per-request state machine. In every state a flow waits for exactly one thing:
+ * a message from its client (*_DECISION) or a reply from one backend server (*_WAIT_*). */
+enum FlowState {
+	AUTH_WAIT_A,        // waiting for Server A's authentication result
+	QUOTE_WAIT_Q,       // waiting for Server Q's quote
+	BUY_WAIT_Q,         // waiting for Server Q's current price of the stock to buy
+	BUY_WAIT_DECISION,  // waiting for the client to confirm the purchase
+	BUY_WAIT_P,         // waiting for Server P to record the purchase
+	SELL_WAIT_Q,        // waiting for Server Q's current price of the stock to sell
+	SELL_WAIT_P_CHECK,  // waiting for Server P to check the number of shares held
+	SELL_WAIT_DECISION, // waiting for the client to confirm the sale
+	SELL_WAIT_P_RESULT, // waiting for Server P to record the sale
+	POS_WAIT_P,         // waiting for Server P's copy of the portfolio
+	POS_WAIT_Q,         // waiting for Server Q's current prices of the stocks in the portfolio
+	SUB_WAIT_Q,         // waiting for Server Q to confirm a subscription with the current price
+	LIMIT_WAIT_P,       // waiting for Server P to reserve the shares of a limit sell
+	LIMIT_WAIT_E,       // waiting for Server E to match and rest a limit order
+	CANCEL_WAIT_E       // waiting for Server E to cancel a limit order
+};
+
+// Client commands, as measured in the metrics; a confirmation is measured apart from the command it confirms
+enum Command {
+	CMD_LOGIN, CMD_RESUME, CMD_QUOTE_ALL, CMD_QUOTE, CMD_BUY, CMD_BUY_CONFIRM, CMD_SELL, CMD_SELL_CONFIRM,
+	CMD_POSITION, CMD_SUBSCRIBE, CMD_UNSUBSCRIBE, CMD_LIMIT, CMD_CANCEL, NUM_COMMANDS
+};
+const char* commandNames[NUM_COMMANDS] = {"login", "resume", "quote all", "quote", "buy", "buy confirm", "sell",
+	"sell confirm", "position", "subscribe", "unsubscribe", "limit", "cancel"};
+
+// Structure to contain one client request in progress
+struct Flow {
+	uint32_t id;                     // the client's request ID
+	FlowState state;
+	Command command;                 // the command being served, for the metrics
+	long long started;               // time (us) the last message of the client on this flow arrived
+	uint32_t reqId;                  // ID of the last request sent to a backend server for this flow
+	string uname;                    // the username being authenticated
+	uint64_t passHash;               // hash of the encrypted password being authenticated
+	string ticker;                   // the quote, buy, sell or limit request
+	int shares;
+	double price;
+	uint8_t side;                    // the limit request
+	uint32_t reserveId;              // ID of the reservation of the shares of a limit sell, that of its reserve request
+	uint32_t orderId;                // the cancel request
+	string portfolio;                // the position request
+	vector<string> tickers;
+	vector<int> sharesList;
+	vector<double> avgBuyPriceList;
+};
+
+// Structure to contain the state of one connected client
+struct Session {
+	int fd;                          // TCP child socket connecting to the client
+	bool authenticated;
+	string uname;                    // the authenticated username
+	unordered_map<uint32_t, Flow> flows; // requests in progress, indexed by the client's request ID
+	string inbuf;                    // received bytes that do not form a complete frame yet
+	string outbuf;                   // bytes the TCP socket has not accepted yet
+	set<string> subscriptions;       // stocks the client watches, including those still being subscribed to
+	map<string, double> updates;     // latest prices of watched stocks not pushed to the client yet
+};
+
+// Structure to contain a request sent to a backend server that has not been answered yet
+struct PendingRequest {
+	int fd;                           // TCP socket of the session waiting for the reply, or -1 if no flow waits for it
+	uint32_t flowId;                  // client's request ID of the flow waiting for the reply
+	const Endpoint* server; // the backend server the request was sent to
+	uint8_t type;                     // message type of the request; the reply must have the same type
+	string request;                   // the encoded request, for retransmission
+	long long deadline;               // time (ms) at which the request is retransmitted or fails
+	int retries;                      // number of retransmissions so far
+	long long sent;                   // time (us) the request was first sent
+	bool queued;                      // whether the request waits for room in the window of its server, unsent
+};
+
+// Structure to contain a reply made up from the market-data segment, waiting to be handed to its flow
+struct LocalReply {
+	int fd;                           // TCP socket of the session waiting for the reply
+	uint32_t flowId;                  // client's request ID of the flow waiting for the reply
+	uint32_t reqId;                   // request ID the flow is waiting for
+	string reply;                     // the encoded reply
+};
+
+// Structure to contain the command budget of a user
+struct TokenBucket {
+	double tokens = USER_BURST;       // commands the user may start now
+	long long refilled = 0;           // time (us) the budget was last refilled
+};
+
+// Structure to contain an entry of the session token table or of the credential cache
+struct Credential {
+	string uname;                    // the username, as entered at login
+	uint64_t passHash;               // hash of the encrypted password (credential cache only)
+	long long expiry;                // time (ms) at which the entry expires
+};
+
+// Global Variables
+int epfd;                                // epoll instance
+int sockUDP;                             // UDP socket used to communicate with the three backend servers
+unordered_map<int, Session> sessions;    // sessions indexed by their TCP socket
+map<uint32_t, PendingRequest> pending;   // backend requests still waiting for a reply, indexed by request ID
+set<pair<long long, uint32_t>> deadlines; // retransmission deadline of every pending request
+uint32_t nextReqId;                      // ID given to the next backend request
+Endpoint sockaddrA, sockaddrP, sockaddrQ, sockaddrE; // socket addresses of the backend servers
+map<const Endpoint*, deque<string>> outboxes; // messages to each backend server waiting for room in its receive queue
+uint64_t outboxDrops = 0;                // requests dropped because their outbox was full
+
+// Admission control
+map<const Endpoint*, int> inflight;      // requests sent to each backend server and not answered yet
+map<const Endpoint*, deque<uint32_t>> waiting; // requests waiting for room in the window of each backend server, oldest first
+unordered_map<string, TokenBucket> budgets; // command budget of each user, indexed by the lowercase username
+double userRate;                         // commands per second a user may start, or 0 for no limit
+uint64_t refusedRate = 0;                // commands refused because their user exceeded the rate
+uint64_t refusedBusy = 0;                // commands refused because their backend server had too many requests waiting
+
+// Ticker directory fetched from Server Q, to ask for prices by ticker ID
+bool dirLoaded = false;                  // whether the directory has arrived and is believed current
+uint32_t dirVersion;                     // version of the directory, echoed in requests by ticker ID
+unordered_map<string, uint16_t> tickerIds; // ticker ID of each ticker
+long long dirRequestTime = -DIR_RETRY_MS; // time (ms) the directory was last asked for
+unordered_map<string, uint16_t> dirPages; // ticker ID of each ticker of the pages of a directory fetched so far
+uint32_t dirPagesVersion = 0;            // version of the directory the pages belong to
+
+// Market data published by Server Q in shared memory
+const MdSegment* market = NULL;          // the mapped segment, or NULL until Server Q has created it
+bool marketLive = false;                 // whether the Server Q that publishes the segment was running at the last check
+pid_t marketPid = 0;                     // process ID of that Server Q
+long long marketCheckTime = -MD_CHECK_MS; // time (ms) of the last check
+vector<uint32_t> shiftsSent;             // number of time shifts sent for each ticker ID to the running Server Q
+uint32_t timeShiftsSent = 0;             // number of time shifts sent to it over all stocks
+vector<LocalReply> localReplies;         // prices read from the segment, to hand to their flows
+uint64_t localReads = 0;                 // number of price requests answered from the segment
+uint64_t pricedPositions = 0;            // number of position requests Server P answered with the profit
+
+// Session tokens and verified credentials
+unordered_map<string, Credential> tokens;      // session tokens issued at login
+set<pair<long long, string>> tokenExpiries;    // expiry of every token
+unordered_map<string, Credential> authCache;   // verified credentials, indexed by the lowercase username
+set<pair<long long, string>> authExpiries;     // expiry of every cached credential
+random_device entropy;                         // source of session tokens
+
+// Price subscriptions
+unordered_map<string, set<int>> subscribers; // TCP sockets of the sessions watching each stock
+set<int> updatedSessions;                // sessions with price updates to push at the end of this pass of the event loop
+
+// Metrics
+Metric commandStats[NUM_COMMANDS];       // client commands, from the client's message to the response
+Metric backendStats[NUM_MSG_TYPES];      // backend requests of each type, from the first transmission to the reply
+
 /*
  * This function is cited from Beej's Guide to Network Programming.
  * Set up the TCP server side for Server M.
@@ -18,13 +235,13 @@ int setupTCP() {
 	int yes = 1;
 	int rv;
 	struct addrinfo hints, *servinfo, *p;
-	
+
 	// Get the socket descriptor
 	if ((sockfd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
 		perror("Server M: TCP socket");
 		exit(1);
 	}
-	
+
 	// Set up local address
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_INET;
@@ -41,13 +258,13 @@ int setupTCP() {
 			perror("Server M: TCP socket\n");
 			continue;
 		}
-		
+
 		// Get rid of "address already in use" problem
 		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
 			perror("setsockopt");
 			exit(1);
 		}
-		
+
 		// Bind socket to the local address
 		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
 			close(sockfd);
@@ -61,23 +278,39 @@ int setupTCP() {
 		perror("Server M: TCP failed to bind\n");
 		exit(1);
 	}
-	
+
 	// Listen to connections from clients
 	if (listen(sockfd, BACKLOG) == -1) {
 		close(sockfd);
 		perror("Server M: listen");
 		exit(1);
 	}
-	
+
 	return sockfd;
 }
 
-/* 
+/*
+ * Put a socket into non-blocking mode and register it with the epoll instance.
+ * @param sockfd the socket descriptor
+ * @param events the epoll events of interest
+ */
+void watchSocket(int sockfd, uint32_t events) {
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.fd = sockfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+		perror("Server M: epoll_ctl");
+		exit(1);
+	}
+}
+
+/*
  * Encrypts users' passwords which will be sent to Server A for authentication.
  * @param input the original password
  * @return the encrypted password
  */
-string encryptPass(const string& input) {
+string encryptPass(string_view input) {
 	string res;
 	for (char c : input) {
 		if (c >= 'A' && c <= 'Z') {
@@ -97,644 +330,1818 @@ string encryptPass(const string& input) {
 }
 
 /*
- * Handle authentication requests from clients.
- * @param sockTCP the TCP child socket connecting to the client
- * @param sockUDP the UDP socket used to communicate with the three backend servers
- * @param clientPort the dynamically assigned client's TCP port number, used as the transaction ID for UDP communication
- * @return the authenticated username for each client
+ * Format a price the way clients display it.
+ * @param price the price
+ * @return the price with two decimals
  */
-string handleAuth(const int& sockTCP, const int& sockUDP, const string& clientPort) {
-	char buf[MAXBUFSIZE];
-	string uname, password;
-	int numbytes;
-	// Set the socket address of Server A
-	struct sockaddr_in sockaddrA;
-	socklen_t addrLenA = sizeof(sockaddrA);
-	sockaddrA.sin_family = AF_INET;
-	sockaddrA.sin_port = htons(atoi(PORT_A));
-	sockaddrA.sin_addr.s_addr = inet_addr(LOCALHOST);
-	memset(sockaddrA.sin_zero, '\0', sizeof sockaddrA.sin_zero);
-	while (1) {
-		// Get username and password
-		numbytes = recv(sockTCP, buf, MAXBUFSIZE - 1, 0);
-		buf[numbytes] = '\0';
-		if (numbytes == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: recv");
-			exit(1);
-		}
-		string recvRequest(buf);
-		int comma = recvRequest.find(',');
-		uname = recvRequest.substr(0, comma);
-		password = recvRequest.substr(comma + 1);
-		printf("[Server M] Received username %s and password ****.\n", uname.c_str());
-		// Encrypt password
-		string encrypted;
-		encrypted = encryptPass(password);
-		// Compose authentication message
-		string authRequest = clientPort + ":" + uname + "," + encrypted, authResult;
-		while (1) {
-			// Send the authentication request to Server A via UDP
-			if (sendto(sockUDP, authRequest.c_str(), authRequest.length(), 0, (struct sockaddr*)&sockaddrA, addrLenA) == -1) {
-				close(sockTCP);
-				close(sockUDP);
-				perror("Server M: authentication request");
-				exit(1);
-			}
-			printf("[Server M] Sent the authentication request to Server A.\n");
-			// Receive authentication result from Server A
-			numbytes = recvfrom(sockUDP, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&sockaddrA, &addrLenA);
-			if (numbytes == -1) {
-				close(sockTCP);
-				close(sockUDP);
-				perror("Server M: authentication result");
-				exit(1);
-			}
-			buf[numbytes] = '\0';
-			authResult = buf; 
-			int colon = authResult.find(':');
-			if (authResult.substr(0, colon) == clientPort) {
-				authResult = authResult.substr(colon+1);
-				break;
-			}
-		}
-		printf("[Server M] Received the response from server A using UDP over %s.\n", PORT_M_UDP);
-		// Forward authentication result to client
-		send(sockTCP, authResult.c_str(), authResult.length(), 0);
-		printf("[Server M] Sent the response from server A to the client using TCP over port %s.\n", PORT_M_TCP);
-		if (authResult[0] == 's') {break;}
-	}
-	return uname;
+string formatPrice(double price) {
+	char text[32];
+	snprintf(text, sizeof text, "%.2f", price);
+	return text;
 }
 
 /*
- * Handle quote requests from clients
- * @param sockTCP the TCP child socket connecting to the client
- * @param sockUDP the UDP socket used to communicate with the three backend servers
- * @param clientPort the dynamically assigned client's TCP port number, used as the transaction ID for UDP communication
- * @param uname the username on the client side
- * @param buf the buffer used to store incoming messages
- */
-void handleQuote(const int& sockTCP, const int& sockUDP, const string& clientPort, const string& uname, char* buf) {
-	string request = "";
-	string quoteResult;
-	int numbytes;
-	// Set the socket address of Server Q
-	struct sockaddr_in sockaddrQ;
-	socklen_t addrLenQ = sizeof(sockaddrQ);
-	sockaddrQ.sin_family = AF_INET;
-	sockaddrQ.sin_port = htons(atoi(PORT_Q));
-	sockaddrQ.sin_addr.s_addr = inet_addr(LOCALHOST);
-	memset(sockaddrQ.sin_zero, '\0', sizeof sockaddrQ.sin_zero);
-	// For a general quote
-	if (strcmp(buf, "qALL_STOCK") == 0) {
-		printf("[Server M] Received a quote request from %s, using TCP over port %s.\n", uname.c_str(), PORT_M_TCP);
-		// Compose a general quote request
-		request += clientPort + ":" + "All_Stock";
-		while (1) {
-			// Forward the quote request to Server Q via UDP
-			if (sendto(sockUDP, request.c_str(), request.length(), 0, (struct sockaddr*)&sockaddrQ, addrLenQ) == -1) {
-				close(sockTCP);
-				close(sockUDP);
-				perror("Server M: quote request");
-				exit(1);
-			}
-			printf("[Server M] Forwarded the quote request to server Q.\n");
-			// Get a quote response from Server Q
-			if ((numbytes = recvfrom(sockUDP, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&sockaddrQ, &addrLenQ)) == -1) {
-				close(sockTCP);
-				close(sockUDP);
-				perror("Server M: quote response");
-				exit(1);
-			}
-			buf[numbytes] = '\0';
-			quoteResult = buf; 
-			int colon = quoteResult.find(':');
-			if (quoteResult.substr(0, colon) == clientPort) {
-				quoteResult = quoteResult.substr(colon+1);
-				break;
-			}
-		}
-		printf("[Server M] Received the quote response from server Q using UDP over %s.\n", PORT_M_UDP);
-	}
-	// For a specific stock quote
-	else {
-		string ticker(buf+1);
-		printf("[Server M] Received a quote request from %s for stock %s, using TCP over port %s.\n", uname.c_str(), ticker.c_str(), PORT_M_TCP);
-		// Compose a specific quote request
-		request += clientPort + ":" + ticker;
-		while (1) {
-			// Forward the quote request to Server Q via UDP
-			if (sendto(sockUDP, request.c_str(), request.length(), 0, (struct sockaddr*)&sockaddrQ, addrLenQ) == -1) {
-				close(sockTCP);
-				close(sockUDP);
-				perror("Server M: quote request");
-				exit(1);
-			}
-			printf("[Server M] Forwarded the quote request to server Q.\n");
-			// Get a quote response from Server Q
-			if ((numbytes = recvfrom(sockUDP, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&sockaddrQ, &addrLenQ)) == -1) {
-				close(sockTCP);
-				close(sockUDP);
-				perror("Server M: quote response");
-				exit(1);
-			}
-			buf[numbytes] = '\0';
-			quoteResult = buf; 
-			int colon = quoteResult.find(':');
-			if (quoteResult.substr(0, colon) == clientPort) {
-				quoteResult = quoteResult.substr(colon+1);
-				break;
-			}
-		}
-		printf("[Server M] Received the quote response from server Q for stock %s using UDP over %s.\n", ticker.c_str(), PORT_M_UDP);
+ * Move the price updates waiting for a session into its output buffer, one frame per stock.
+ * @param s the session
+ */
+void queueUpdates(Session& s) {
+	for (const auto& update : s.updates) {
+		s.outbuf += encodeFrame(PUSH_ID, update.first + " " + formatPrice(update.second));
 	}
-	// Forward the quote response to client
-	send(sockTCP, quoteResult.c_str(), quoteResult.length(), 0);
-	printf("[Server M] Forwarded the quote response to the client.\n");
+	s.updates.clear();
 }
 
 /*
- * Handle buy requests from clients
- * @param sockTCP the TCP child socket connecting to the client
- * @param sockUDP the UDP socket used to communicate with the three backend servers
- * @param clientPort the dynamically assigned client's TCP port number, used as the transaction ID for UDP communication
- * @param uname the username on the client side
- * @param buf the buffer used to store incoming messages
+ * Get the current time of a monotonic clock.
+ * @return the time in milliseconds
  */
-void handleBuy(const int& sockTCP, const int& sockUDP, const string& clientPort, const string& uname, char* buf) {
-	printf("[Server M] Received a buy request from member %s using TCP over port %s.\n", uname.c_str(), PORT_M_TCP);
-	int numbytes;
-	string payload(buf+1);
-	int comma = payload.find(',');
-	string ticker = payload.substr(0, comma);
-	string shares = payload.substr(comma+1);
-
-	// Set socket addresses of Server Q and Server P
-	struct sockaddr_in sockaddrQ, sockaddrP;
-	socklen_t addrLenQ = sizeof(sockaddrQ), addrLenP = sizeof(sockaddrP);
-	sockaddrQ.sin_family = AF_INET;
-	sockaddrQ.sin_port = htons(atoi(PORT_Q));
-	sockaddrQ.sin_addr.s_addr = inet_addr(LOCALHOST);
-	memset(sockaddrQ.sin_zero, '\0', sizeof sockaddrQ.sin_zero);
-	sockaddrP.sin_family = AF_INET;
-	sockaddrP.sin_port = htons(atoi(PORT_P));
-	sockaddrP.sin_addr.s_addr = inet_addr(LOCALHOST);
-	memset(sockaddrP.sin_zero, '\0', sizeof sockaddrP.sin_zero);
-
-	string quoteRequest = clientPort + ":" + ticker, quoteResult;
-	while (1) {
-		// Send a quote request to Server Q to get the specific stock's price
-		if (sendto(sockUDP, quoteRequest.c_str(), quoteRequest.length(), 0, (struct sockaddr*)&sockaddrQ, addrLenQ) == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: quote request");
-			exit(1);
-		}
-		printf("[Server M] Sent quote request to server Q.\n");
-		// Get a quote response from Server Q
-		if ((numbytes = recvfrom(sockUDP, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&sockaddrQ, &addrLenQ)) == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: quote response");
-			exit(1);
-		}
-		buf[numbytes] = '\0';
-		quoteResult = buf; 
-		int colon = quoteResult.find(':');
-		if (quoteResult.substr(0, colon) == clientPort) {
-			quoteResult = quoteResult.substr(colon+1);
-			break;
-		}
+long long nowMs() {
+	return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Hash an encrypted password, so that the credential cache does not keep the password itself.
+ * @param encrypted the encrypted password
+ * @return the 64-bit FNV-1a hash
+ */
+uint64_t hashPass(const string& encrypted) {
+	uint64_t hash = 14695981039346656037ull;
+	for (char c : encrypted) {
+		hash = (hash ^ (unsigned char)c) * 1099511628211ull;
 	}
-	printf("[Server M] Received quote response from server Q.\n");
-	if (quoteResult == "NOT_EXIST") {
-		// Notify the client that this purchase failed since the stock name does not exist
-		send(sockTCP, quoteResult.c_str(), quoteResult.length(), 0);
-		printf("[Server M] Forwarded the buy result to the client.\n");
-		return;
+	return hash;
+}
+
+/*
+ * Add an entry to an expiring table, first dropping expired entries and, if the table is full, the one closest to expiry.
+ * @param table the token table or the credential cache
+ * @param expiries the expiry of every entry in the table
+ * @param limit the number of entries the table may hold
+ * @param key the key of the new entry
+ * @param entry the new entry
+ */
+void putExpiring(unordered_map<string, Credential>& table, set<pair<long long, string>>& expiries, size_t limit,
+		const string& key, const Credential& entry) {
+	auto old = table.find(key);
+	if (old != table.end()) {
+		expiries.erase(make_pair(old->second.expiry, key));
+		table.erase(old);
 	}
-	// Get the current price of the queried stock
-	int space = quoteResult.find(' ');
-	string price = quoteResult.substr(space+1);
-	// Send a buy confirmation to the client
-	send(sockTCP, price.c_str(), price.length(), 0);
-	printf("[Server M] Sent the buy confirmation to the client.\n");
-	// Receive the decision of the client
-	if ((numbytes = recv(sockTCP, buf, MAXBUFSIZE - 1, 0)) == -1) {
-		close(sockTCP);
-		close(sockUDP);
-		perror("Server M: recv decision");
-		exit(1);
+	long long now = nowMs();
+	while (!expiries.empty() && (expiries.begin()->first <= now || table.size() >= limit)) {
+		table.erase(expiries.begin()->second);
+		expiries.erase(expiries.begin());
 	}
-	buf[numbytes] = '\0';
-	if (buf[0] == 'Y') {
-		printf("[Server M] Buy approved.\n");
-
-		string buyRequest = clientPort + ":b" + uname + "|" + ticker + "," + shares + "_" + price, buyResult;
-		while (1) {
-			// Send the purchase detail to Server P, format: bUname|ticker,shares_price
-			if (sendto(sockUDP, buyRequest.c_str(), buyRequest.length(), 0, (struct sockaddr*)&sockaddrP, addrLenP) == -1) {
-				close(sockTCP);
-				close(sockUDP);
-				perror("Server M: buy request to P");
-				exit(1);
-			}
-			printf("[Server M] Forwarded the buy confirmation response to Server P.\n");
-			// Receive the buy result from Server P
-			if ((numbytes = recvfrom(sockUDP, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&sockaddrP, &addrLenP)) == -1) {
-				close(sockTCP);
-				close(sockUDP);
-				perror("Server M: buy result from P");
-				exit(1);
-			}
-			buf[numbytes] = '\0';
-			buyResult = buf; 
-			int colon = buyResult.find(':');
-			if (buyResult.substr(0, colon) == clientPort) {
-				buyResult = buyResult.substr(colon+1);
-				break;
-			}
-		}
-		// Forward the buy result to the client
-		send(sockTCP, buyResult.c_str(), buyResult.length(), 0);
-		printf("[Server M] Forwarded the buy result to the client.\n");
+	table[key] = entry;
+	expiries.insert(make_pair(entry.expiry, key));
+}
+
+/*
+ * Look up an entry of an expiring table, dropping it if it has expired.
+ * @param table the token table or the credential cache
+ * @param expiries the expiry of every entry in the table
+ * @param key the key
+ * @return the entry, or NULL if there is no entry or it has expired
+ */
+Credential* getExpiring(unordered_map<string, Credential>& table, set<pair<long long, string>>& expiries, const string& key) {
+	auto it = table.find(key);
+	if (it == table.end()) {
+		return NULL;
 	}
-	else if (buf[0] == 'N') {
-		printf("[Server M] Buy denied.\n");
+	if (it->second.expiry <= nowMs()) {
+		expiries.erase(make_pair(it->second.expiry, key));
+		table.erase(it);
+		return NULL;
 	}
-	else {
-		return;
+	return &it->second;
+}
+
+/*
+ * Convert a username to the lowercase form Server A matches it in.
+ * @param uname the username
+ * @return the username in lowercase
+ */
+string lowerName(const string& uname) {
+	string lower = uname;
+	for (char& c : lower) {
+		c = tolower(c);
 	}
-	// Send a time shift request to Server Q
-	string shiftRequest = clientPort + ":+" + ticker;
-	if (sendto(sockUDP, shiftRequest.c_str(), shiftRequest.length(), 0, (struct sockaddr*)&sockaddrQ, addrLenQ) == -1) {
-		close(sockTCP);
-		close(sockUDP);
-		perror("Server M: shift request");
-		exit(1);
+	return lower;
+}
+
+/*
+ * Issue a new session token for a user.
+ * @param uname the username
+ * @return the token, 32 hexadecimal digits
+ */
+string issueToken(const string& uname) {
+	char token[33];
+	for (int i = 0; i < 4; i++) {
+		snprintf(token + 8 * i, 9, "%08x", (unsigned)entropy());
 	}
-	printf("[Server M] Sent a time forward request for %s.\n", ticker.c_str());
+	putExpiring(tokens, tokenExpiries, MAX_TOKENS, token, {uname, 0, nowMs() + TOKEN_TTL_MS});
+	return token;
 }
 
 /*
- * Handle sell requests from clients
- * @param sockTCP the TCP child socket connecting to the client
- * @param sockUDP the UDP socket used to communicate with the three backend servers
- * @param clientPort the dynamically assigned client's TCP port number, used as the transaction ID for UDP communication
- * @param uname the username on the client side
- * @param buf the buffer used to store incoming messages
+ * Send as much of the session's pending output as the TCP socket accepts.
+ * Whatever is left stays in the output buffer, and the socket is watched for writability until it drains.
+ * Price updates are only queued once the output buffer has drained, so that newer prices can replace them until then.
+ * @param s the session
  */
-void handleSell(const int& sockTCP, const int& sockUDP, const string& clientPort, const string& uname, char* buf) {
-	printf("[Server M] Received a sell request from member %s using TCP over port %s.\n", uname.c_str(), PORT_M_TCP);
-	int numbytes;
-	string payload(buf+1);
-	int comma = payload.find(',');
-	string ticker = payload.substr(0, comma);
-	string shares = payload.substr(comma+1);
-
-	// Set socket addresses of Server Q and Server P
-	struct sockaddr_in sockaddrQ, sockaddrP;
-	socklen_t addrLenQ = sizeof(sockaddrQ), addrLenP = sizeof(sockaddrP);
-	sockaddrQ.sin_family = AF_INET;
-	sockaddrQ.sin_port = htons(atoi(PORT_Q));
-	sockaddrQ.sin_addr.s_addr = inet_addr(LOCALHOST);
-	memset(sockaddrQ.sin_zero, '\0', sizeof sockaddrQ.sin_zero);
-	sockaddrP.sin_family = AF_INET;
-	sockaddrP.sin_port = htons(atoi(PORT_P));
-	sockaddrP.sin_addr.s_addr = inet_addr(LOCALHOST);
-	memset(sockaddrP.sin_zero, '\0', sizeof sockaddrP.sin_zero);
-
-	string quoteRequest = clientPort + ":" + ticker, quoteResult;
+void flushClient(Session& s) {
+	bool wasBlocked = !s.outbuf.empty();
 	while (1) {
-		// Send a quote request to Server Q to get the specific stock's price
-		if (sendto(sockUDP, quoteRequest.c_str(), quoteRequest.length(), 0, (struct sockaddr*)&sockaddrQ, addrLenQ) == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: quote request");
-			exit(1);
-		}
-		printf("[Server M] Sent quote request to server Q.\n");
-		// Get a quote response from Server Q
-		if ((numbytes = recvfrom(sockUDP, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&sockaddrQ, &addrLenQ)) == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: quote response");
-			exit(1);
+		if (s.outbuf.empty()) {
+			if (s.updates.empty()) {
+				break;
+			}
+			queueUpdates(s);
 		}
-		buf[numbytes] = '\0';
-		quoteResult = buf;
-		int colon = quoteResult.find(':');
-		if (quoteResult.substr(0, colon) == clientPort) {
-			quoteResult = quoteResult.substr(colon+1);
+		ssize_t sent = send(s.fd, s.outbuf.data(), s.outbuf.length(), MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("Server M: send");
+				s.outbuf.clear();
+				s.updates.clear();
+			}
 			break;
 		}
+		s.outbuf.erase(0, sent);
 	}
-	printf("[Server M] Received quote response from server Q.\n");
-	if (quoteResult == "NOT_EXIST") {
-		// Notify the client that this sell failed since the stock name does not exist
-		send(sockTCP, quoteResult.c_str(), quoteResult.length(), 0);
-		printf("[Server M] Forwarded the sell result to the client.\n");
+	struct epoll_event ev;
+	ev.events = s.outbuf.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT);
+	ev.data.fd = s.fd;
+	if (wasBlocked != !s.outbuf.empty()) {
+		epoll_ctl(epfd, EPOLL_CTL_MOD, s.fd, &ev);
+	}
+}
+
+
+/*
+ * Record the response to a client's command in the metrics.
+ * @param s the session
+ * @param id the client's request ID the response belongs to
+ * @param msg the response
+ */
+void recordCommand(Session& s, uint32_t id, const string& msg) {
+	auto it = s.flows.find(id);
+	if (it == s.flows.end()) { // a pushed price update
 		return;
 	}
-	// Get the current price of the queried stock
-	int space = quoteResult.find(' ');
-	string price = quoteResult.substr(space+1);
+	Metric& m = commandStats[it->second.command];
+	if (msg == TIMEOUT_MSG) {
+		m.timeouts++;
+		return;
+	}
+	m.record(nowUs() - it->second.started, msg != "f" && msg != "NOT_EXIST" && msg != "NOT_SUFF");
+}
 
-	string sellRequest = clientPort + ":s" + uname + "|" + ticker + "," + shares, shareStatus;
-	while (1) {
-		// Forward the sell request to Server P to check the number of shares
-		if (sendto(sockUDP, sellRequest.c_str(), sellRequest.length(), 0, (struct sockaddr*)&sockaddrP, addrLenP) == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: sell request");
-			exit(1);
-		}
-		printf("[Server M] Forwarded the sell request to server P.\n");
-		// Get a response from Server P about the status of shares
-		if ((numbytes = recvfrom(sockUDP, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&sockaddrP, &addrLenP)) == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: sell response");
-			exit(1);
+/*
+ * Queue a message to the client of a session and try to send it right away.
+ * @param s the session
+ * @param id the client's request ID the message belongs to
+ * @param msg the message
+ */
+void sendToClient(Session& s, uint32_t id, const string& msg) {
+	recordCommand(s, id, msg);
+	bool idle = s.outbuf.empty();
+	s.outbuf += encodeFrame(id, msg);
+	if (idle) {
+		flushClient(s);
+	}
+}
+
+/*
+ * Send a datagram to a backend server, or put it into the server's outbox if its receive queue is full
+ * or earlier messages are waiting there. A request finding OUTBOX_SIZE messages in the outbox is dropped, to be
+ * retransmitted; a notification, which nothing would send again, is kept however full the outbox is.
+ * @param addr the socket address of the backend server, one of sockaddrA, sockaddrP, sockaddrQ and sockaddrE
+ * @param msg the encoded message
+ * @param errMsg the message printed if sending fails
+ * @param retransmitted whether the message is a request that is retransmitted if it gets no reply
+ */
+void sendToBackend(const Endpoint& addr, const string& msg, const char* errMsg, bool retransmitted) {
+	deque<string>& outbox = outboxes[&addr];
+	if (outbox.empty()) {
+		if (sendTo(sockUDP, msg.data(), msg.length(), addr) != -1) {
+			return;
 		}
-		buf[numbytes] = '\0';
-		shareStatus = buf;
-		int colon = shareStatus.find(':');
-		if (shareStatus.substr(0, colon) == clientPort) {
-			shareStatus = shareStatus.substr(colon+1);
-			break;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror(errMsg);
+			return;
 		}
 	}
-	
-	if (shareStatus == "SUFF") {
-		// Forward a sell confirmation to the client
-		send(sockTCP, price.c_str(), price.length(), 0);
-		printf("[Server M] Forwarded the sell confirmation to the client.\n");
-		// Receive the decision of the client
-		if ((numbytes = recv(sockTCP, buf, MAXBUFSIZE - 1, 0)) == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: recv decision");
-			exit(1);
+	if (retransmitted && outbox.size() >= OUTBOX_SIZE) {
+		if (outboxDrops++ % OUTBOX_SIZE == 0) {
+			LOG_WARN("[Server M] An outbox is full. Dropped %llu requests so far, to be retransmitted.\n",
+				(unsigned long long)outboxDrops);
 		}
-		buf[numbytes] = '\0';
-		// Forward the confirmation response from the client to Server P
-		string confirmResult;
-		if (buf[0] == 'Y') {
-			confirmResult = clientPort + ":S_CONFIRMED";
-			string sellResult;
-			while (1) {
-				if (sendto(sockUDP, confirmResult.c_str(), confirmResult.length(), 0, (struct sockaddr*)&sockaddrP, addrLenP) == -1) {
-					close(sockTCP);
-					close(sockUDP);
-					perror("Server M: sell confirmation result");
-					exit(1);
-				}
-				printf("[Server M] Forwarded the sell confirmation response to Server P.\n");
-
-				// Get a sell final result from Server P and then forward the result to the client
-				if ((numbytes = recvfrom(sockUDP, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&sockaddrP, &addrLenP)) == -1) {
-					close(sockTCP);
-					close(sockUDP);
-					perror("Server M: sell final result");
-					exit(1);
-				}
-				buf[numbytes] = '\0';
-				sellResult = buf;
-				int colon = sellResult.find(':');
-				if (sellResult.substr(0, colon) == clientPort) {
-					sellResult = sellResult.substr(colon+1);
+		return;
+	}
+	outbox.push_back(msg);
+}
+
+/*
+ * Send the messages in the outboxes, oldest first, until the receive queue of their backend server is full again.
+ * @return true, if messages are left in an outbox
+ */
+bool flushOutboxes() {
+	bool left = false;
+	for (auto& entry : outboxes) {
+		deque<string>& outbox = entry.second;
+		while (!outbox.empty()) {
+			if (sendTo(sockUDP, outbox.front().data(), outbox.front().length(), *entry.first) == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
 					break;
 				}
+				perror("Server M: outbox sendto");
 			}
-			// Forward the sell result to the client
-			send(sockTCP, sellResult.c_str(), sellResult.length(), 0);
-			printf("[Server M] Forwarded the sell result to the client.\n");
-		}
-		else if (buf[0] == 'N') {
-			confirmResult = clientPort + ":S_DENIED";
-			if (sendto(sockUDP, confirmResult.c_str(), confirmResult.length(), 0, (struct sockaddr*)&sockaddrP, addrLenP) == -1) {
-				close(sockTCP);
-				close(sockUDP);
-				perror("Server M: sell confirmation result");
-				exit(1);
-			}
-			printf("[Server M] Forwarded the sell confirmation response to Server P.\n");
+			outbox.pop_front();
 		}
+		left |= !outbox.empty();
 	}
-	else if (shareStatus == "NOT_SUFF") {
-		// Notify the client that this sell failed since there are no sufficient shares to be sold
-		send(sockTCP, shareStatus.c_str(), shareStatus.length(), 0);
-		printf("[Server M] Forwarded the sell result to the client.\n");
-	}
+	return left;
+}
 
-	// Send a time shift request to Server Q
-	string shiftRequest = clientPort + ":+" + ticker;
-	if (sendto(sockUDP, shiftRequest.c_str(), shiftRequest.length(), 0, (struct sockaddr*)&sockaddrQ, addrLenQ) == -1) {
-		close(sockTCP);
-		close(sockUDP);
-		perror("Server M: shift request");
-		exit(1);
+/*
+ * Send a message to a backend server without waiting for a reply.
+ * @param addr the socket address of the backend server
+ * @param msg the encoded message
+ * @param errMsg the message printed if sending fails
+ */
+void notifyBackend(const Endpoint& addr, const MsgWriter& msg, const char* errMsg) {
+	sendToBackend(addr, string(msg.bytes(), msg.size), errMsg, false);
+}
+
+/*
+ * Send a tracked request to its backend server for the first time, taking a place in the server's window.
+ * @param reqId the request ID
+ * @param req the request
+ * @param errMsg the message printed if sending fails
+ */
+void transmitRequest(uint32_t reqId, PendingRequest& req, const char* errMsg) {
+	req.queued = false;
+	inflight[req.server]++;
+	req.deadline = nowMs() + REQ_TIMEOUT_MS;
+	req.sent = nowUs();
+	deadlines.insert(make_pair(req.deadline, reqId));
+	sendToBackend(*req.server, req.request, errMsg, true);
+}
+
+/*
+ * Put a request into the pending table under the request ID it already carries, and send it unless the window of
+ * its backend server is full.
+ * @param fd the TCP socket of the session waiting for the reply, or -1 if no flow waits for it
+ * @param flowId the client's request ID of the flow waiting for the reply
+ * @param addr the socket address of the backend server
+ * @param msg the encoded request
+ * @param errMsg the message printed if sending fails
+ */
+void addPending(int fd, uint32_t flowId, const Endpoint& addr, const MsgWriter& msg, const char* errMsg) {
+	PendingRequest& req = pending[msg.reqId()];
+	req.fd = fd;
+	req.flowId = flowId;
+	req.server = &addr;
+	req.type = msg.type();
+	req.request.assign(msg.bytes(), msg.size);
+	req.retries = 0;
+	if (inflight[&addr] >= BACKEND_WINDOW) { // sent once a reply makes room
+		req.queued = true;
+		waiting[&addr].push_back(msg.reqId());
+		return;
 	}
-	printf("[Server M] Sent a time forward request for %s.\n", ticker.c_str());
+	transmitRequest(msg.reqId(), req, errMsg);
 }
 
 /*
- * Handle position requests from clients
- * @param sockTCP the TCP child socket connecting to the client
- * @param sockUDP the UDP socket used to communicate with the three backend servers
- * @param clientPort the dynamically assigned client's TCP port number, used as the transaction ID for UDP communication
- * @param uname the username on the client side
- * @param buf the buffer used to store incoming messages
+ * Send a request to a backend server under the request ID it already carries and wait for its reply in the pending table.
+ * @param s the session waiting for the reply
+ * @param f the flow waiting for the reply
+ * @param addr the socket address of the backend server
+ * @param msg the encoded request
+ * @param errMsg the message printed if sending fails
  */
-void handlePosition(const int& sockTCP, const int& sockUDP, const string& clientPort, const string& uname, char* buf) {
-	int numbytes;
-	string tickerList = clientPort + ":p";
-	vector<int> sharesList;
-	vector<double> avgBuyPriceList, curPriceList;
-
-	// Set socket addresses of Server Q and Server P
-	struct sockaddr_in sockaddrQ, sockaddrP;
-	socklen_t addrLenQ = sizeof(sockaddrQ), addrLenP = sizeof(sockaddrP);
-	sockaddrQ.sin_family = AF_INET;
-	sockaddrQ.sin_port = htons(atoi(PORT_Q));
-	sockaddrQ.sin_addr.s_addr = inet_addr(LOCALHOST);
-	memset(sockaddrQ.sin_zero, '\0', sizeof sockaddrQ.sin_zero);
-	sockaddrP.sin_family = AF_INET;
-	sockaddrP.sin_port = htons(atoi(PORT_P));
-	sockaddrP.sin_addr.s_addr = inet_addr(LOCALHOST);
-	memset(sockaddrP.sin_zero, '\0', sizeof sockaddrP.sin_zero);
-
-	printf("[Server M] Received a position request from Member to check %s’s gain using TCP over port %s.\n", uname.c_str(), PORT_M_TCP);
-	string posRequest = clientPort + ":p" + uname, portfolio;
-	while (1) {
-		// Forward the position request to server P
-		if (sendto(sockUDP, posRequest.c_str(), posRequest.length(), 0, (struct sockaddr*)&sockaddrP, addrLenP) == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: position request");
-			exit(1);
-		}
-		printf("[Server M] Forwarded the position request to server P.\n");
+void trackRequest(Session& s, Flow& f, const Endpoint& addr, const MsgWriter& msg, const char* errMsg) {
+	addPending(s.fd, f.id, addr, msg, errMsg);
+	f.reqId = msg.reqId();
+}
 
-		// Receive the portfolio from Server P
-		if ((numbytes = recvfrom(sockUDP, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&sockaddrP, &addrLenP)) == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: portfolio");
-			exit(1);
-		}
-		buf[numbytes] = '\0';
-		portfolio = buf;
-		int colon = portfolio.find(':');
-		if (portfolio.substr(0, colon) == clientPort) {
-			portfolio = portfolio.substr(colon+1);
-			break;
-		}
+/*
+ * Send a request to a backend server under a new request ID.
+ * @param s the session waiting for the reply
+ * @param f the flow waiting for the reply
+ * @param addr the socket address of the backend server
+ * @param msg the encoded request, whose request ID is filled in here
+ * @param errMsg the message printed if sending fails
+ */
+void sendRequest(Session& s, Flow& f, const Endpoint& addr, MsgWriter& msg, const char* errMsg) {
+	msg.setReqId(nextReqId++);
+	if (nextReqId == 0) { // 0 marks messages that expect no reply
+		nextReqId = 1;
 	}
-	printf("[Server M] Received user’s portfolio from server P using UDP over %s.\n", PORT_M_UDP);
+	trackRequest(s, f, addr, msg, errMsg);
+}
 
-	// Read the portfolio and store the stocks' info into lists
-	istringstream iss(portfolio);
-	string line;
-	string ticker;
-	int shares;
-	double avgPrice;
-	while (getline(iss, line)) {
-		istringstream liness(line);
-		if (liness >> ticker >> shares >> avgPrice) {
-			tickerList += ticker + " ";
-			sharesList.push_back(shares);
-			avgBuyPriceList.push_back(avgPrice);
-		}
+/*
+ * Send a request that no flow waits for to a backend server under a new request ID. It is retransmitted like any
+ * other request until its reply arrives, and given up after MAX_RETRIES retransmissions.
+ * @param addr the socket address of the backend server
+ * @param msg the encoded request, whose request ID is filled in here
+ * @param errMsg the message printed if sending fails
+ */
+void sendDetached(const Endpoint& addr, MsgWriter& msg, const char* errMsg) {
+	msg.setReqId(nextReqId++);
+	if (nextReqId == 0) {
+		nextReqId = 1;
 	}
+	addPending(-1, 0, addr, msg, errMsg);
+}
 
-	string curPrices;
-	while (1) {
-		// Send a ticker list to Server Q to get current prices of those stocks listed in the portfolio
-		if (sendto(sockUDP, tickerList.c_str(), tickerList.length(), 0, (struct sockaddr*)&sockaddrQ, addrLenQ) == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: current price request");
-			exit(1);
-		}
+/*
+ * Remove a request from the pending table, if it is still there. The place of a request that was sent goes to the
+ * oldest requests waiting for its backend server, which are sent now.
+ * @param reqId the request ID
+ */
+void forgetRequest(uint32_t reqId) {
+	auto it = pending.find(reqId);
+	if (it == pending.end()) {
+		return;
+	}
+	const Endpoint* server = it->second.server;
+	deque<uint32_t>& queue = waiting[server];
+	if (it->second.queued) {
+		queue.erase(find(queue.begin(), queue.end(), reqId));
+		pending.erase(it);
+		return;
+	}
+	deadlines.erase(make_pair(it->second.deadline, reqId));
+	pending.erase(it);
+	inflight[server]--;
+	while (!queue.empty() && inflight[server] < BACKEND_WINDOW) {
+		uint32_t next = queue.front();
+		queue.pop_front();
+		transmitRequest(next, pending[next], "Server M: queued request");
+	}
+}
 
-		// Receive a list of current prices from Server Q
-		if ((numbytes = recvfrom(sockUDP, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&sockaddrQ, &addrLenQ)) == -1) {
-			close(sockTCP);
-			close(sockUDP);
-			perror("Server M: current prices");
-			exit(1);
+/*
+ * Tell Server P that the sale a flow has asked about will not be confirmed.
+ * @param s the session
+ * @param f the flow
+ */
+void denySale(Session& s, Flow& f) {
+	MsgWriter deny(MSG_SELL_DENY, f.reqId);
+	deny.putSymbol(s.uname);
+	notifyBackend(sockaddrP, deny, "Server M: sell confirmation result");
+}
+
+/*
+ * Tell Server P to release the shares it may have reserved for a limit sell that will not rest on a book.
+ * Nothing waits for the reply; if the request fails, the reservation expires at Server P.
+ * @param s the session
+ * @param f the flow of the limit sell
+ */
+void releaseReserve(Session& s, Flow& f) {
+	MsgWriter release(MSG_RELEASE, 0);
+	release.putSymbol(s.uname);
+	release.putU32(f.reserveId);
+	sendDetached(sockaddrP, release, "Server M: release request");
+}
+
+/*
+ * Stop pushing the price of a stock to a session, and unsubscribe from the stock at Server Q if no session watches it any more.
+ * @param s the session
+ * @param ticker the stock
+ */
+void dropSubscription(Session& s, const string& ticker) {
+	s.subscriptions.erase(ticker);
+	s.updates.erase(ticker);
+	auto it = subscribers.find(ticker);
+	if (it == subscribers.end()) {
+		return;
+	}
+	it->second.erase(s.fd);
+	if (it->second.empty()) {
+		subscribers.erase(it);
+		MsgWriter request(MSG_UNSUBSCRIBE, 0);
+		request.putSymbol(ticker);
+		notifyBackend(sockaddrQ, request, "Server M: unsubscribe request");
+	}
+}
+
+/*
+ * Close a client connection and forget its session, abandoning its requests in progress.
+ * @param fd the TCP child socket connecting to the client
+ */
+void closeSession(int fd) {
+	auto it = sessions.find(fd);
+	if (it == sessions.end()) {
+		return;
+	}
+	Session& s = it->second;
+	for (auto& entry : s.flows) {
+		Flow& f = entry.second;
+		// Server P holds the shares of a sale until the user answers; tell it the answer will never come
+		if (f.state == SELL_WAIT_P_CHECK || f.state == SELL_WAIT_DECISION) {
+			denySale(s, f);
 		}
-		buf[numbytes] = '\0';
-		curPrices = buf;
-		int colon = curPrices.find(':');
-		if (curPrices.substr(0, colon) == clientPort) {
-			curPrices = curPrices.substr(colon+1);
-			break;
+		forgetRequest(f.reqId);
+		// The order of a limit sell whose shares are being reserved will not be placed; one sent to Server E may rest
+		if (f.state == LIMIT_WAIT_P) {
+			releaseReserve(s, f);
 		}
 	}
-
-	// Store current prices into curPriceList
-	istringstream priceSS(curPrices);
-	double price;
-	while (priceSS >> price) {
-		curPriceList.push_back(price);
+	set<string> subscriptions = s.subscriptions;
+	for (const string& ticker : subscriptions) {
+		dropSubscription(s, ticker);
 	}
+	updatedSessions.erase(fd);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+	sessions.erase(it);
+}
 
-	// Calculate the profit
-	double profit = 0;
-	for (size_t i = 0; i < sharesList.size(); i++) {
-		profit += sharesList[i] * (curPriceList[i] - avgBuyPriceList[i]);
+/*
+ * Send a time shift request to Server Q for the stock involved in the finished buy or sell request.
+ * @param f the flow
+ */
+void shiftTime(Flow& f) {
+	MsgWriter shiftRequest(MSG_TIME_SHIFT, 0);
+	shiftRequest.putSymbol(f.ticker);
+	notifyBackend(sockaddrQ, shiftRequest, "Server M: shift request");
+	auto it = tickerIds.find(f.ticker);
+	if (dirLoaded && it != tickerIds.end() && it->second < shiftsSent.size()) {
+		shiftsSent[it->second]++;
+		timeShiftsSent++;
 	}
+	LOG_INFO("[Server M] Sent a time forward request for %s.\n", f.ticker.c_str());
+}
 
-	// Send the portfolio and the profit to the client
-	string posResponse = to_string(profit) + "|" + portfolio;
-	send(sockTCP, posResponse.c_str(), posResponse.length(), 0);
-	printf("[Server M] Forwarded the gain to the client.\n");
+/*
+ * Finish a flow and forget it. The flow must not be used afterwards.
+ * @param s the session
+ * @param f the flow
+ */
+void finishFlow(Session& s, Flow& f) {
+	s.flows.erase(f.id);
 }
 
-int main() {
-	int newSock;
-	int numbytes;
-	struct sockaddr_in clientAddr;
-	socklen_t sin_size = sizeof(struct sockaddr_in);
-	
-	// Bootup
-	int sockUDP = setupUDP('M', PORT_M_UDP);
-	int sockTCP = setupTCP();
-	printf("[Server M] Booting up using UDP on port %s.\n", PORT_M_UDP);
-	
-	// Reap all dead processes
-	// This block of code is cited from Beej's Guide to Network Programming.
-	struct sigaction sa;
-	sa.sa_handler = sigchld_handler;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_RESTART;
-	if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-		perror("sigaction");
-		exit(1);
-	}
+/*
+ * Let the client of a session in as a user.
+ * @param s the session
+ * @param uname the username
+ */
+void grantAccess(Session& s, const string& uname) {
+	s.authenticated = true;
+	s.uname = uname;
+}
 
-	while (1) {
-		if ((newSock = accept(sockTCP, (struct sockaddr*)&clientAddr, &sin_size)) == -1) {
-			perror("Server M: accept");
-			continue;
-		}
-		
-		// For child processes
-		pid_t pid = fork();
-		if (pid == 0) {
-			close(sockTCP);
-			
-			char buf[MAXBUFSIZE];
-			string clientPort = to_string(ntohs(clientAddr.sin_port)); // Use the client port number as transaction ID
-
-			/*------Authentication------*/
-			string uname = handleAuth(newSock, sockUDP, clientPort);
-			
-			/*------Trading------*/
-			while (1) {
-				// Get new request
-				if ((numbytes = recv(newSock, buf, MAXBUFSIZE - 1, 0)) == -1) {
-					close(newSock);
-					perror("Server M: recv");
-					continue;
-				}
-				buf[numbytes] = '\0';
-				
-				/* Quote */
-				if (buf[0] == 'q') {
-					handleQuote(newSock, sockUDP, clientPort, uname, buf);
-				} 
-				/* Buy */
-				else if (buf[0] == 'b') {
-					handleBuy(newSock, sockUDP, clientPort, uname, buf);
-				}
-				/* Sell */
-				else if (buf[0] == 's') {
-					handleSell(newSock, sockUDP, clientPort, uname, buf);
-				}
-				/* Position */
-				else if (buf[0] == 'p') {
-					handlePosition(newSock, sockUDP, clientPort, uname, buf);
-				}
-			}
-			close(newSock);
-			close(sockUDP);
-			exit(0);
-		}
-		else {
-			close(newSock);
-		}
+/*
+ * Handle a login with a session token issued earlier, which does not involve Server A.
+ * Using a token extends its lifetime.
+ * @param s the session
+ * @param f the new flow
+ * @param token the token
+ */
+void resumeSession(Session& s, Flow& f, const string& token) {
+	Credential* entry = getExpiring(tokens, tokenExpiries, token);
+	if (entry == NULL) {
+		sendToClient(s, f.id, "f");
+		LOG_INFO("[Server M] Rejected an unknown or expired session token.\n");
+		finishFlow(s, f);
+		return;
 	}
-	close(sockTCP);
-	close(sockUDP);
-	return 0;
+	string uname = entry->uname;
+	putExpiring(tokens, tokenExpiries, MAX_TOKENS, token, {uname, 0, nowMs() + TOKEN_TTL_MS});
+	grantAccess(s, uname);
+	sendToClient(s, f.id, "s");
+	LOG_INFO("[Server M] Resumed the session of %s with its session token.\n", uname.c_str());
+	finishFlow(s, f);
 }
-	
-	
 
+/*
+ * Handle authentication requests from clients.
+ * Credentials Server A has verified recently are accepted without asking it again.
+ * @param s the session
+ * @param f the new flow
+ * @param request the username and password, format: <username>,<password>; or a session token, format: @<token>
+ */
+void handleAuth(Session& s, Flow& f, string_view request) {
+	if (request[0] == '@') {
+		resumeSession(s, f, string(request.substr(1)));
+		return;
+	}
+	TextReader fields(request);
+	f.uname = fields.getField(',');
+	string_view password = fields.rest;
+	LOG_INFO("[Server M] Received username %s and password ****.\n", f.uname.c_str());
+	string encrypted = encryptPass(password);
+	f.passHash = hashPass(encrypted);
+	Credential* cached = getExpiring(authCache, authExpiries, lowerName(f.uname));
+	if (cached != NULL && cached->passHash == f.passHash) {
+		LOG_INFO("[Server M] Found the credentials of %s in the cache.\n", f.uname.c_str());
+		grantAccess(s, f.uname);
+		sendToClient(s, f.id, "s " + issueToken(f.uname));
+		finishFlow(s, f);
+		return;
+	}
+	// Compose the authentication message with the encrypted password
+	MsgWriter authRequest(MSG_AUTH, 0);
+	authRequest.putSymbol(f.uname);
+	authRequest.putSymbol(encrypted);
+	// Send the authentication request to Server A via UDP
+	sendRequest(s, f, sockaddrA, authRequest, "Server M: authentication request");
+	LOG_INFO("[Server M] Sent the authentication request to Server A.\n");
+	f.state = AUTH_WAIT_A;
+}
 
+/*
+ * Forward Server A's authentication result to the client.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server A's reply
+ */
+void onAuthResult(Session& s, Flow& f, MsgReader& reply) {
+	LOG_INFO("[Server M] Received the response from server A using UDP over %s.\n", PORT_M_UDP);
+	if (reply.status == ST_OK) {
+		putExpiring(authCache, authExpiries, AUTH_CACHE_SIZE, lowerName(f.uname), {f.uname, f.passHash, nowMs() + AUTH_CACHE_TTL_MS});
+		grantAccess(s, f.uname);
+		sendToClient(s, f.id, "s " + issueToken(f.uname));
+	}
+	else {
+		sendToClient(s, f.id, "f");
+	}
+	LOG_INFO("[Server M] Sent the response from server A to the client using TCP over port %s.\n", PORT_M_TCP);
+	finishFlow(s, f);
+}
+
+/*
+ * Forget every verified credential and session token, as Server A has loaded its credentials, which may have changed.
+ */
+void onAuthInvalidate() {
+	authCache.clear();
+	authExpiries.clear();
+	tokens.clear();
+	tokenExpiries.clear();
+	LOG_INFO("[Server M] Server A has loaded its credentials. Cleared the credential cache and session tokens.\n");
+}
+
+/*
+ * Ask Server Q for the next page of its ticker directory, unless it is loaded or has been asked for recently.
+ * The reply is not tracked as a pending request; until the whole directory arrives, prices are asked for by ticker.
+ */
+void requestDirectory() {
+	long long now = nowMs();
+	if (dirLoaded || now - dirRequestTime < DIR_RETRY_MS) {
+		return;
+	}
+	dirRequestTime = now;
+	MsgWriter request(MSG_DIRECTORY, 0);
+	request.putU16(dirPages.size());
+	notifyBackend(sockaddrQ, request, "Server M: directory request");
+}
+
+/*
+ * Add a page of the ticker directory sent by Server Q, and load the directory once every page of one version is in.
+ * @param reply Server Q's reply
+ */
+void onDirectory(MsgReader& reply) {
+	uint32_t version = reply.getU32();
+	uint16_t total = reply.getU16();
+	uint16_t first = reply.getU16();
+	uint16_t n = reply.getU16();
+	vector<string> tickers(n);
+	for (string& ticker : tickers) {
+		reply.getSymbol(ticker);
+	}
+	if (!reply.ok || dirLoaded) {
+		return;
+	}
+	// Pages of another version of the directory do not mix with this one: start over
+	if (version != dirPagesVersion) {
+		dirPages.clear();
+		dirPagesVersion = version;
+	}
+	if (first == dirPages.size()) {
+		for (uint16_t i = 0; i < n; i++) {
+			dirPages[tickers[i]] = first + i;
+		}
+	}
+	if (dirPages.size() < total) {
+		if (n > 0) { // ask for the next page right away
+			dirRequestTime = -DIR_RETRY_MS;
+		}
+		requestDirectory();
+		return;
+	}
+	tickerIds.swap(dirPages);
+	dirPages.clear();
+	dirVersion = version;
+	dirLoaded = true;
+	shiftsSent.assign(total, 0);
+}
+
+/*
+ * Encode a request for the current prices of some stocks by ticker ID.
+ * @param request the MSG_PRICES_BY_ID request to fill in
+ * @param tickers the stocks
+ * @return true, if the directory is loaded and knows every one of the stocks
+ */
+bool encodeTickerIds(MsgWriter& request, const vector<string>& tickers) {
+	requestDirectory();
+	if (!dirLoaded) {
+		return false;
+	}
+	request.putU32(dirVersion);
+	request.putU16(tickers.size());
+	for (const string& ticker : tickers) {
+		auto it = tickerIds.find(ticker);
+		if (it == tickerIds.end()) {
+			return false;
+		}
+		request.putU16(it->second);
+	}
+	return true;
+}
+
+/*
+ * Check, at most every MD_CHECK_MS, whether the market-data segment exists and the Server Q publishing it is running.
+ * The time shifts sent to an earlier run of Server Q do not count for a new one.
+ * @return true, if prices can be read from the segment
+ */
+bool marketDataUsable() {
+	long long now = nowMs();
+	if (now - marketCheckTime >= MD_CHECK_MS) {
+		marketCheckTime = now;
+		if (market == NULL) {
+			market = mdAttach();
+		}
+		marketLive = market != NULL && mdAlive(market);
+		if (marketLive && market->pid.load(memory_order_relaxed) != marketPid) {
+			marketPid = market->pid.load(memory_order_relaxed);
+			fill(shiftsSent.begin(), shiftsSent.end(), 0);
+			timeShiftsSent = 0;
+		}
+	}
+	return marketLive && dirLoaded;
+}
+
+/*
+ * Read the current prices of some stocks from the market-data segment, in the form of Server Q's reply by ticker ID.
+ * @param tickers the stocks
+ * @param reply the reply to fill in
+ * @return true, if every price was read and reflects every time shift sent for its stock
+ */
+bool readMarketData(const vector<string>& tickers, MsgWriter& reply) {
+	if (!marketDataUsable()) {
+		return false;
+	}
+	reply.putU16(tickers.size());
+	for (const string& ticker : tickers) {
+		auto it = tickerIds.find(ticker);
+		double price;
+		uint32_t shifts;
+		if (it == tickerIds.end() || it->second >= shiftsSent.size()
+				|| !mdRead(market, dirVersion, it->second, price, shifts)
+				|| (int32_t)(shifts - shiftsSent[it->second]) < 0) {
+			return false;
+		}
+		reply.putF64(price);
+	}
+	return true;
+}
+
+/*
+ * Answer a flow's request for prices from the market-data segment, if possible.
+ * The reply is handed to the flow at the end of the current pass of the event loop.
+ * @param s the session
+ * @param f the flow
+ * @param tickers the stocks
+ * @return true, if the request has been answered
+ */
+bool answerFromMarketData(Session& s, Flow& f, const vector<string>& tickers) {
+	MsgWriter reply(MSG_PRICES_BY_ID | MSG_REPLY, nextReqId);
+	if (!readMarketData(tickers, reply)) {
+		return false;
+	}
+	f.reqId = nextReqId++;
+	if (nextReqId == 0) {
+		nextReqId = 1;
+	}
+	localReplies.push_back({s.fd, f.id, f.reqId, string(reply.bytes(), reply.size)});
+	localReads++;
+	return true;
+}
+
+/*
+ * Ask Server Q for the current price of the stock of a quote, buy or sell request, unless the market-data segment has it.
+ * Stocks missing from the directory are asked for by ticker, so that Server Q decides whether they exist.
+ * @param s the session
+ * @param f the flow
+ * @return true, if the request was sent to Server Q
+ */
+bool requestQuote(Session& s, Flow& f) {
+	if (answerFromMarketData(s, f, vector<string>(1, f.ticker))) {
+		return false;
+	}
+	MsgWriter byId(MSG_PRICES_BY_ID, 0);
+	if (encodeTickerIds(byId, vector<string>(1, f.ticker))) {
+		sendRequest(s, f, sockaddrQ, byId, "Server M: quote request");
+		return true;
+	}
+	MsgWriter byTicker(MSG_QUOTE, 0);
+	byTicker.putSymbol(f.ticker);
+	sendRequest(s, f, sockaddrQ, byTicker, "Server M: quote request");
+	return true;
+}
+
+/*
+ * Ask Server Q for the current prices of the stocks in a portfolio, unless the market-data segment has them.
+ * @param s the session
+ * @param f the flow
+ */
+void requestPositionPrices(Session& s, Flow& f) {
+	if (answerFromMarketData(s, f, f.tickers)) {
+		return;
+	}
+	MsgWriter byId(MSG_PRICES_BY_ID, 0);
+	if (encodeTickerIds(byId, f.tickers)) {
+		sendRequest(s, f, sockaddrQ, byId, "Server M: current price request");
+		return;
+	}
+	MsgWriter byTicker(MSG_PRICES, 0);
+	byTicker.putU16(f.tickers.size());
+	for (const string& ticker : f.tickers) {
+		byTicker.putSymbol(ticker);
+	}
+	sendRequest(s, f, sockaddrQ, byTicker, "Server M: current price request");
+}
+
+/*
+ * Read the current prices from Server Q's reply to requestQuote or requestPositionPrices.
+ * @param reply Server Q's reply
+ * @param prices the returned prices, in the order of the request
+ * @return true, unless the stock of a quote does not exist or Server Q could not return every price
+ */
+bool readPrices(MsgReader& reply, vector<double>& prices) {
+	if (reply.status != ST_OK) {
+		return false;
+	}
+	string ticker;
+	uint16_t n = reply.getU16();
+	for (uint16_t i = 0; i < n; i++) {
+		if (reply.type == (MSG_QUOTE | MSG_REPLY)) {
+			reply.getSymbol(ticker);
+		}
+		prices.push_back(reply.getF64());
+	}
+	return reply.ok && !prices.empty();
+}
+
+/*
+ * Handle quote requests from clients
+ * @param s the session
+ * @param f the new flow
+ * @param command qALL_STOCK for a general quote, or q<stock> for a specific stock
+ */
+void handleQuote(Session& s, Flow& f, string_view command) {
+	// For a general quote
+	if (command == "qALL_STOCK") {
+		LOG_INFO("[Server M] Received a quote request from %s, using TCP over port %s.\n", s.uname.c_str(), PORT_M_TCP);
+		f.ticker = "";
+		MsgWriter request(MSG_QUOTE_ALL, 0);
+		sendRequest(s, f, sockaddrQ, request, "Server M: quote request");
+	}
+	// For a specific stock quote
+	else {
+		f.ticker = command.substr(1);
+		LOG_INFO("[Server M] Received a quote request from %s for stock %s, using TCP over port %s.\n", s.uname.c_str(), f.ticker.c_str(), PORT_M_TCP);
+		if (!requestQuote(s, f)) {
+			f.state = QUOTE_WAIT_Q;
+			return;
+		}
+	}
+	LOG_INFO("[Server M] Forwarded the quote request to server Q.\n");
+	f.state = QUOTE_WAIT_Q;
+}
+
+/*
+ * Forward Server Q's quote response to the client.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server Q's reply, a list of stocks and their prices
+ */
+void onQuoteResult(Session& s, Flow& f, MsgReader& reply) {
+	if (f.ticker.empty()) {
+		LOG_INFO("[Server M] Received the quote response from server Q using UDP over %s.\n", PORT_M_UDP);
+	}
+	else {
+		LOG_INFO("[Server M] Received the quote response from server Q for stock %s using UDP over %s.\n", f.ticker.c_str(), PORT_M_UDP);
+	}
+	// Compose the quote response, format: <stock> <price>\n... for a general quote, <stock> <price> for a specific one
+	string quoteResult;
+	vector<double> prices;
+	if (f.ticker.empty()) {
+		string ticker;
+		uint16_t n = reply.status == ST_OK ? reply.getU16() : 0;
+		for (uint16_t i = 0; i < n && reply.ok; i++) {
+			reply.getSymbol(ticker);
+			quoteResult += ticker + " " + formatPrice(reply.getF64()) + "\n";
+		}
+		// Never forward a partial list: Server Q answers ST_TOO_LARGE when the quotes overflow one message
+		if (reply.status != ST_OK || !reply.ok) {
+			LOG_WARN("[Server M] Server Q could not return the quotes of all stocks.\n");
+			quoteResult = "The quotes of all stocks do not fit into one reply; quote the stocks one by one.\n";
+		}
+	}
+	else if (readPrices(reply, prices)) {
+		quoteResult = f.ticker + " " + formatPrice(prices[0]);
+	}
+	else {
+		quoteResult = "NOT_EXIST";
+	}
+	sendToClient(s, f.id, quoteResult);
+	LOG_INFO("[Server M] Forwarded the quote response to the client.\n");
+	finishFlow(s, f);
+}
+
+/*
+ * Handle buy requests from clients. The first step gets the current price of the stock from Server Q.
+ * @param s the session
+ * @param f the new flow
+ * @param command the buy request, format: b<stock>,<shares>
+ */
+void handleBuy(Session& s, Flow& f, string_view command) {
+	LOG_INFO("[Server M] Received a buy request from member %s using TCP over port %s.\n", s.uname.c_str(), PORT_M_TCP);
+	TextReader fields(command.substr(1));
+	f.ticker = fields.getField(',');
+	f.shares = fields.getInt(',');
+	// Send a quote request to Server Q to get the specific stock's price
+	if (requestQuote(s, f)) {
+		LOG_INFO("[Server M] Sent quote request to server Q.\n");
+	}
+	f.state = BUY_WAIT_Q;
+}
+
+/*
+ * Ask the client to confirm the purchase at the current price, or report that the stock does not exist.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server Q's quote of the stock
+ */
+void onBuyQuote(Session& s, Flow& f, MsgReader& reply) {
+	LOG_INFO("[Server M] Received quote response from server Q.\n");
+	vector<double> prices;
+	if (!readPrices(reply, prices)) {
+		// Notify the client that this purchase failed since the stock name does not exist
+		sendToClient(s, f.id, "NOT_EXIST");
+		LOG_INFO("[Server M] Forwarded the buy result to the client.\n");
+		finishFlow(s, f);
+		return;
+	}
+	f.price = prices[0];
+	// Send a buy confirmation to the client
+	sendToClient(s, f.id, formatPrice(f.price));
+	LOG_INFO("[Server M] Sent the buy confirmation to the client.\n");
+	f.state = BUY_WAIT_DECISION;
+}
+
+/*
+ * Handle the client's decision on a purchase.
+ * @param s the session
+ * @param f the flow
+ * @param decision Y to approve or N to deny
+ */
+void onBuyDecision(Session& s, Flow& f, string_view decision) {
+	if (!decision.empty() && decision[0] == 'Y') {
+		LOG_INFO("[Server M] Buy approved.\n");
+		// Send the purchase detail to Server P
+		MsgWriter buyRequest(MSG_BUY, 0);
+		buyRequest.putSymbol(s.uname);
+		buyRequest.putSymbol(f.ticker);
+		buyRequest.putI32(f.shares);
+		buyRequest.putF64(f.price);
+		sendRequest(s, f, sockaddrP, buyRequest, "Server M: buy request to P");
+		LOG_INFO("[Server M] Forwarded the buy confirmation response to Server P.\n");
+		f.state = BUY_WAIT_P;
+		return;
+	}
+	else if (!decision.empty() && decision[0] == 'N') {
+		LOG_INFO("[Server M] Buy denied.\n");
+		shiftTime(f);
+	}
+	finishFlow(s, f);
+}
+
+/*
+ * Forward Server P's buy result to the client.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server P's reply
+ */
+void onBuyResult(Session& s, Flow& f, MsgReader& reply) {
+	sendToClient(s, f.id, reply.status == ST_OK ? "s" : "f");
+	LOG_INFO("[Server M] Forwarded the buy result to the client.\n");
+	shiftTime(f);
+	finishFlow(s, f);
+}
+
+/*
+ * Handle sell requests from clients. The first step gets the current price of the stock from Server Q.
+ * @param s the session
+ * @param f the new flow
+ * @param command the sell request, format: s<stock>,<shares>
+ */
+void handleSell(Session& s, Flow& f, string_view command) {
+	LOG_INFO("[Server M] Received a sell request from member %s using TCP over port %s.\n", s.uname.c_str(), PORT_M_TCP);
+	TextReader fields(command.substr(1));
+	f.ticker = fields.getField(',');
+	f.shares = fields.getInt(',');
+	// Send a quote request to Server Q to get the specific stock's price
+	if (requestQuote(s, f)) {
+		LOG_INFO("[Server M] Sent quote request to server Q.\n");
+	}
+	f.state = SELL_WAIT_Q;
+}
+
+/*
+ * Ask Server P whether the user holds enough shares, or report that the stock does not exist.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server Q's quote of the stock
+ */
+void onSellQuote(Session& s, Flow& f, MsgReader& reply) {
+	LOG_INFO("[Server M] Received quote response from server Q.\n");
+	vector<double> prices;
+	if (!readPrices(reply, prices)) {
+		// Notify the client that this sell failed since the stock name does not exist
+		sendToClient(s, f.id, "NOT_EXIST");
+		LOG_INFO("[Server M] Forwarded the sell result to the client.\n");
+		finishFlow(s, f);
+		return;
+	}
+	f.price = prices[0];
+	// Forward the sell request to Server P to check the number of shares
+	MsgWriter sellRequest(MSG_SELL, 0);
+	sellRequest.putSymbol(s.uname);
+	sellRequest.putSymbol(f.ticker);
+	sellRequest.putI32(f.shares);
+	sendRequest(s, f, sockaddrP, sellRequest, "Server M: sell request");
+	LOG_INFO("[Server M] Forwarded the sell request to server P.\n");
+	f.state = SELL_WAIT_P_CHECK;
+}
+
+/*
+ * Ask the client to confirm the sale if the user holds enough shares; otherwise report the failure.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server P's reply, status ST_OK or ST_NOT_SUFF
+ */
+void onSellCheck(Session& s, Flow& f, MsgReader& reply) {
+	if (reply.status == ST_OK) {
+		// Forward a sell confirmation to the client
+		sendToClient(s, f.id, formatPrice(f.price));
+		LOG_INFO("[Server M] Forwarded the sell confirmation to the client.\n");
+		f.state = SELL_WAIT_DECISION;
+		return;
+	}
+	// Notify the client that this sell failed since there are no sufficient shares to be sold
+	sendToClient(s, f.id, "NOT_SUFF");
+	LOG_INFO("[Server M] Forwarded the sell result to the client.\n");
+	shiftTime(f);
+	finishFlow(s, f);
+}
+
+/*
+ * Forward the client's decision on a sale to Server P.
+ * @param s the session
+ * @param f the flow
+ * @param decision Y to approve; any other answer denies the sale
+ */
+void onSellDecision(Session& s, Flow& f, string_view decision) {
+	if (!decision.empty() && decision[0] == 'Y') {
+		// Server P matches the confirmation to the sale by the ID of the sell request
+		MsgWriter confirm(MSG_SELL_CONFIRM, f.reqId);
+		confirm.putSymbol(s.uname);
+		trackRequest(s, f, sockaddrP, confirm, "Server M: sell confirmation result");
+		LOG_INFO("[Server M] Forwarded the sell confirmation response to Server P.\n");
+		f.state = SELL_WAIT_P_RESULT;
+		return;
+	}
+	// Any answer but Y denies the sale, so that Server P does not hold the shares until the sale expires
+	denySale(s, f);
+	LOG_INFO("[Server M] Forwarded the sell confirmation response to Server P.\n");
+	shiftTime(f);
+	finishFlow(s, f);
+}
+
+/*
+ * Forward Server P's final sell result to the client.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server P's reply
+ */
+void onSellResult(Session& s, Flow& f, MsgReader& reply) {
+	sendToClient(s, f.id, reply.status == ST_OK ? "s" : "f");
+	LOG_INFO("[Server M] Forwarded the sell result to the client.\n");
+	shiftTime(f);
+	finishFlow(s, f);
+}
+
+/*
+ * Handle position requests from clients. The first step gets the user's portfolio from Server P.
+ * @param s the session
+ * @param f the new flow
+ */
+void handlePosition(Session& s, Flow& f) {
+	LOG_INFO("[Server M] Received a position request from Member to check %s’s gain using TCP over port %s.\n", s.uname.c_str(), PORT_M_TCP);
+	// Forward the position request to server P, which can tell from the time shifts sent whether its prices are current
+	MsgWriter request(MSG_POSITION, 0);
+	request.putSymbol(s.uname);
+	request.putI32(marketDataUsable() ? marketPid : 0);
+	request.putU32(timeShiftsSent);
+	sendRequest(s, f, sockaddrP, request, "Server M: position request");
+	LOG_INFO("[Server M] Forwarded the position request to server P.\n");
+	f.state = POS_WAIT_P;
+}
+
+/*
+ * Read the portfolio and send it to the client with the profit Server P has calculated, or, if Server P could not,
+ * ask Server Q for the current prices of the stocks in it.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server P's reply, a list of stocks with the shares held and their average buy prices, and the profit
+ */
+void onPortfolio(Session& s, Flow& f, MsgReader& reply) {
+	LOG_INFO("[Server M] Received user’s portfolio from server P using UDP over %s.\n", PORT_M_UDP);
+
+	// Store the stocks' info into lists and compose the portfolio text, format: <stock> <shares> <avg_price>\n...
+	uint16_t n = reply.getU16();
+	string ticker;
+	char line[MAXBUFSIZE];
+	for (uint16_t i = 0; i < n; i++) {
+		reply.getSymbol(ticker);
+		int shares = reply.getI32();
+		// Calculate the profit from the average price shown to the user, i.e., in whole cents
+		double avgPrice = round(reply.getF64() * 100) / 100;
+		f.tickers.push_back(ticker);
+		f.sharesList.push_back(shares);
+		f.avgBuyPriceList.push_back(avgPrice);
+		snprintf(line, sizeof line, "%s %d %.2f\n", ticker.c_str(), shares, avgPrice);
+		f.portfolio += line;
+	}
+
+	uint8_t priced = reply.getU8();
+	double profit = reply.getF64();
+	if (priced && reply.ok) {
+		pricedPositions++;
+		sendToClient(s, f.id, to_string(profit) + "|" + f.portfolio);
+		LOG_INFO("[Server M] Forwarded the gain to the client.\n");
+		finishFlow(s, f);
+		return;
+	}
+
+	// Ask Server Q for the current prices of those stocks listed in the portfolio
+	requestPositionPrices(s, f);
+	f.state = POS_WAIT_Q;
+}
+
+/*
+ * Calculate the profit from the current prices and send it to the client together with the portfolio.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server Q's reply, the current prices in the order of the portfolio
+ */
+void onPositionPrices(Session& s, Flow& f, MsgReader& reply) {
+	// Calculate the profit
+	double profit = 0;
+	vector<double> curPriceList;
+	if (!readPrices(reply, curPriceList) || curPriceList.size() != f.sharesList.size()) {
+		// A gain without the prices of some stocks would be wrong, so the client is asked to try again
+		LOG_WARN("[Server M] Server Q did not return the prices of all stocks of %s.\n", s.uname.c_str());
+		sendToClient(s, f.id, TIMEOUT_MSG);
+		finishFlow(s, f);
+		return;
+	}
+	for (size_t i = 0; i < f.sharesList.size() && i < curPriceList.size(); i++) {
+		profit += f.sharesList[i] * (curPriceList[i] - f.avgBuyPriceList[i]);
+	}
+
+	// Send the portfolio and the profit to the client
+	string posResponse = to_string(profit) + "|" + f.portfolio;
+	sendToClient(s, f.id, posResponse);
+	LOG_INFO("[Server M] Forwarded the gain to the client.\n");
+	finishFlow(s, f);
+}
+
+/*
+ * Handle subscription requests from clients. The session watches the stock from now on,
+ * unless Server Q reports that it does not exist.
+ * @param s the session
+ * @param f the new flow
+ * @param command the subscription request, format: +<stock>
+ */
+void handleSubscribe(Session& s, Flow& f, string_view command) {
+	f.ticker = command.substr(1);
+	LOG_INFO("[Server M] Received a subscription request from %s for stock %s, using TCP over port %s.\n", s.uname.c_str(), f.ticker.c_str(), PORT_M_TCP);
+	// Count the session as a subscriber right away, so that no other session unsubscribes Server Q from the stock meanwhile
+	s.subscriptions.insert(f.ticker);
+	subscribers[f.ticker].insert(s.fd);
+	// Server Q subscribes at most once per stock, so the request is sent for every client to get the current price
+	MsgWriter request(MSG_SUBSCRIBE, 0);
+	request.putSymbol(f.ticker);
+	sendRequest(s, f, sockaddrQ, request, "Server M: subscribe request");
+	f.state = SUB_WAIT_Q;
+}
+
+/*
+ * Send the current price of the newly watched stock to the client, or report that the stock does not exist.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server Q's reply
+ */
+void onSubscribed(Session& s, Flow& f, MsgReader& reply) {
+	vector<double> prices;
+	if (readPrices(reply, prices)) {
+		sendToClient(s, f.id, f.ticker + " " + formatPrice(prices[0]));
+		LOG_INFO("[Server M] Subscribed %s to the price of %s.\n", s.uname.c_str(), f.ticker.c_str());
+	}
+	else {
+		dropSubscription(s, f.ticker);
+		sendToClient(s, f.id, "NOT_EXIST");
+	}
+	finishFlow(s, f);
+}
+
+/*
+ * Handle unsubscription requests from clients.
+ * @param s the session
+ * @param id the client's request ID
+ * @param command the unsubscription request, format: -<stock>
+ */
+void handleUnsubscribe(Session& s, uint32_t id, string_view command) {
+	string ticker(command.substr(1));
+	dropSubscription(s, ticker);
+	sendToClient(s, id, "s");
+	LOG_INFO("[Server M] Unsubscribed %s from the price of %s.\n", s.uname.c_str(), ticker.c_str());
+}
+
+/*
+ * Send a limit order to Server E.
+ * @param s the session
+ * @param f the flow
+ */
+void sendLimit(Session& s, Flow& f) {
+	MsgWriter request(MSG_LIMIT, 0);
+	request.putSymbol(s.uname);
+	request.putSymbol(f.ticker);
+	request.putU8(f.side);
+	request.putI32(f.shares);
+	request.putF64(f.price);
+	request.putU32(f.side == SIDE_SELL ? f.reserveId : 0);
+	sendRequest(s, f, sockaddrE, request, "Server M: limit request");
+	LOG_INFO("[Server M] Forwarded the limit order to server E.\n");
+	f.state = LIMIT_WAIT_E;
+}
+
+/*
+ * Handle a limit order from a client. The shares of a sell are reserved at Server P before the order goes to Server E.
+ * @param s the session
+ * @param f the new flow
+ * @param command the request, format: l<b|s><stock>,<shares>,<limit price>
+ */
+void handleLimit(Session& s, Flow& f, string_view command) {
+	TextReader fields(command.substr(2));
+	f.side = command[1] == 's' ? SIDE_SELL : SIDE_BUY;
+	f.ticker = fields.getField(',');
+	f.shares = fields.getInt(',');
+	f.price = fields.getDouble(',');
+	LOG_INFO("[Server M] Received a limit %s order from member %s using TCP over port %s.\n",
+		f.side == SIDE_BUY ? "buy" : "sell", s.uname.c_str(), PORT_M_TCP);
+	if (f.shares <= 0 || f.price <= 0) {
+		sendToClient(s, f.id, "f");
+		finishFlow(s, f);
+		return;
+	}
+	if (f.side == SIDE_BUY) {
+		sendLimit(s, f);
+		return;
+	}
+	MsgWriter request(MSG_RESERVE, 0);
+	request.putSymbol(s.uname);
+	request.putSymbol(f.ticker);
+	request.putI32(f.shares);
+	sendRequest(s, f, sockaddrP, request, "Server M: reserve request");
+	f.reserveId = f.reqId;
+	LOG_INFO("[Server M] Asked server P to reserve the shares of the limit sell.\n");
+	f.state = LIMIT_WAIT_P;
+}
+
+/*
+ * Place a limit sell whose shares Server P has reserved, or report that there are not enough shares.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server P's reply
+ */
+void onReserved(Session& s, Flow& f, MsgReader& reply) {
+	if (reply.status == ST_OK) {
+		sendLimit(s, f);
+		return;
+	}
+	sendToClient(s, f.id, "NOT_SUFF");
+	finishFlow(s, f);
+}
+
+/*
+ * Forward Server E's result of a limit order to the client.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server E's reply
+ */
+void onLimitResult(Session& s, Flow& f, MsgReader& reply) {
+	if (reply.status != ST_OK) {
+		if (f.side == SIDE_SELL) {
+			releaseReserve(s, f);
+		}
+		sendToClient(s, f.id, "NOT_EXIST");
+		finishFlow(s, f);
+		return;
+	}
+	uint32_t orderId = reply.getU32();
+	int filled = reply.getI32();
+	double avgPrice = reply.getF64();
+	int resting = reply.getI32();
+	sendToClient(s, f.id, to_string(orderId) + " " + to_string(filled) + " " + formatPrice(avgPrice) + " " + to_string(resting));
+	LOG_INFO("[Server M] Forwarded the result of limit order %u to the client.\n", orderId);
+	finishFlow(s, f);
+}
+
+/*
+ * Handle the cancellation of a limit order from a client.
+ * @param s the session
+ * @param f the new flow
+ * @param command the request, format: c<order ID>
+ */
+void handleCancel(Session& s, Flow& f, string_view command) {
+	f.orderId = TextReader(command.substr(1)).getU32(',');
+	LOG_INFO("[Server M] Received the cancellation of order %u from member %s.\n", f.orderId, s.uname.c_str());
+	MsgWriter request(MSG_CANCEL, 0);
+	request.putSymbol(s.uname);
+	request.putU32(f.orderId);
+	sendRequest(s, f, sockaddrE, request, "Server M: cancel request");
+	f.state = CANCEL_WAIT_E;
+}
+
+/*
+ * Forward Server E's result of a cancellation to the client.
+ * @param s the session
+ * @param f the flow
+ * @param reply Server E's reply, with the number of shares that were still resting
+ */
+void onCancelResult(Session& s, Flow& f, MsgReader& reply) {
+	if (reply.status != ST_OK) {
+		sendToClient(s, f.id, "NOT_EXIST");
+	}
+	else {
+		sendToClient(s, f.id, "s " + to_string(reply.getI32()));
+	}
+	finishFlow(s, f);
+}
+
+/*
+ * Hand a price pushed by Server Q to every session watching the stock. The updates are sent at the end of
+ * this pass of the event loop, so a later update of the same stock within the pass replaces this one.
+ * @param update Server Q's update
+ */
+void onPriceUpdate(MsgReader& update) {
+	string ticker;
+	update.getSymbol(ticker);
+	double price = update.getF64();
+	if (!update.ok) {
+		return;
+	}
+	auto it = subscribers.find(ticker);
+	if (it == subscribers.end()) { // an unsubscription got lost; repeat it
+		MsgWriter request(MSG_UNSUBSCRIBE, 0);
+		request.putSymbol(ticker);
+		notifyBackend(sockaddrQ, request, "Server M: unsubscribe request");
+		return;
+	}
+	for (int fd : it->second) {
+		sessions[fd].updates[ticker] = price;
+		updatedSessions.insert(fd);
+	}
+}
+
+/*
+ * Push the price updates collected during this pass of the event loop.
+ * Sessions whose connection is still busy get them once it has drained.
+ */
+void publishUpdates() {
+	for (int fd : updatedSessions) {
+		Session& s = sessions[fd];
+		if (s.outbuf.empty()) {
+			flushClient(s);
+		}
+	}
+	updatedSessions.clear();
+}
+
+/*
+ * Tell which command a request from a client is.
+ * @param s the session
+ * @param command the request
+ * @return the command
+ */
+Command commandOf(const Session& s, string_view command) {
+	if (!s.authenticated) {
+		return command[0] == '@' ? CMD_RESUME : CMD_LOGIN;
+	}
+	switch (command[0]) {
+	case 'q': return command == "qALL_STOCK" ? CMD_QUOTE_ALL : CMD_QUOTE;
+	case 'b': return CMD_BUY;
+	case 's': return CMD_SELL;
+	case 'p': return CMD_POSITION;
+	case '+': return CMD_SUBSCRIBE;
+	case 'l': return CMD_LIMIT;
+	case 'c': return CMD_CANCEL;
+	default:  return CMD_UNSUBSCRIBE;
+	}
+}
+
+/*
+ * Get the backend server a command sends its first request to.
+ * @param command the command
+ * @return the socket address of the server, or NULL if the command needs none
+ */
+const Endpoint* firstBackend(Command command) {
+	switch (command) {
+	case CMD_LOGIN:     return &sockaddrA;
+	case CMD_POSITION:  return &sockaddrP;
+	case CMD_LIMIT:
+	case CMD_CANCEL:    return &sockaddrE;
+	case CMD_RESUME:
+	case CMD_UNSUBSCRIBE: return NULL;
+	default:            return &sockaddrQ; // quotes, buys, sells and subscriptions start with the current price
+	}
+}
+
+/*
+ * Decide whether a new command may start, or must be refused because its user has used up the command budget or
+ * its backend server is overloaded. Commands that need no backend server always start.
+ * @param s the session
+ * @param command the command
+ * @return true, if the command may start
+ */
+bool admitCommand(Session& s, Command command) {
+	const Endpoint* server = firstBackend(command);
+	if (server == NULL) {
+		return true;
+	}
+	if (s.authenticated && userRate > 0) {
+		TokenBucket& budget = budgets[lowerName(s.uname)];
+		long long now = nowUs();
+		budget.tokens = min((double)USER_BURST, budget.tokens + (now - budget.refilled) * userRate / 1e6);
+		budget.refilled = now;
+		if (budget.tokens < 1) {
+			refusedRate++;
+			return false;
+		}
+		budget.tokens--;
+	}
+	if (waiting[server].size() >= BACKEND_QUEUE) {
+		refusedBusy++;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Start a new flow for a request from a client, unless the request is refused as BUSY.
+ * @param s the session
+ * @param id the client's request ID
+ * @param command the request
+ */
+void handleCommand(Session& s, uint32_t id, string_view command) {
+	if (command.empty()) {
+		return;
+	}
+	Command type = commandOf(s, command);
+	if (!admitCommand(s, type)) {
+		sendToClient(s, id, BUSY_MSG);
+		LOG_INFO("[Server M] Refused a request from %s as busy.\n", s.authenticated ? s.uname.c_str() : "a new client");
+		return;
+	}
+	Flow& f = s.flows[id];
+	f.id = id;
+	f.reqId = 0;
+	f.command = type;
+	f.started = nowUs();
+	/* Authentication */
+	if (!s.authenticated) {
+		handleAuth(s, f, command);
+	}
+	/* Quote */
+	else if (command[0] == 'q') {
+		handleQuote(s, f, command);
+	}
+	/* Buy */
+	else if (command[0] == 'b') {
+		handleBuy(s, f, command);
+	}
+	/* Sell */
+	else if (command[0] == 's') {
+		handleSell(s, f, command);
+	}
+	/* Position */
+	else if (command[0] == 'p') {
+		handlePosition(s, f);
+	}
+	/* Subscription */
+	else if (command[0] == '+') {
+		handleSubscribe(s, f, command);
+	}
+	else if (command[0] == '-') {
+		handleUnsubscribe(s, id, command);
+		s.flows.erase(id);
+	}
+	/* Limit orders */
+	else if (command[0] == 'l' && command.length() > 1) {
+		handleLimit(s, f, command);
+	}
+	else if (command[0] == 'c') {
+		handleCancel(s, f, command);
+	}
+	else {
+		s.flows.erase(id);
+	}
+}
+
+/*
+ * Handle one frame from a client: either a new request, or the answer to a request waiting for the client.
+ * @param s the session
+ * @param id the client's request ID
+ * @param msg the message
+ */
+void onClientMessage(Session& s, uint32_t id, string_view msg) {
+	auto it = s.flows.find(id);
+	if (it == s.flows.end()) {
+		handleCommand(s, id, msg);
+		return;
+	}
+	Flow& f = it->second;
+	if (f.state == BUY_WAIT_DECISION) {
+		f.command = CMD_BUY_CONFIRM;
+		f.started = nowUs();
+		onBuyDecision(s, f, msg);
+	}
+	else if (f.state == SELL_WAIT_DECISION) {
+		f.command = CMD_SELL_CONFIRM;
+		f.started = nowUs();
+		onSellDecision(s, f, msg);
+	}
+	// Otherwise the flow is waiting for a backend server, and the message is a protocol error that is ignored
+}
+
+/*
+ * Read what a client has sent and handle every complete frame in it.
+ * @param fd the TCP child socket connecting to the client
+ */
+void onClientReadable(int fd) {
+	char buf[MAXBUFSIZE];
+	int numbytes = recv(fd, buf, MAXBUFSIZE, 0);
+	if (numbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (numbytes <= 0) { // the client has left
+		closeSession(fd);
+		return;
+	}
+	Session& s = sessions[fd];
+	s.inbuf.append(buf, numbytes);
+
+	// Every message is handled in place in the receive buffer, which is not touched until all of them are
+	size_t pos = 0;
+	uint32_t id;
+	string_view msg;
+	int rv;
+	while ((rv = decodeFrame(s.inbuf, pos, id, msg)) == 1) {
+		onClientMessage(s, id, msg);
+	}
+	if (rv == -1) { // not a frame this server can read
+		closeSession(fd);
+		return;
+	}
+	s.inbuf.erase(0, pos);
+}
+
+/*
+ * Get the backend server that serves a type of request.
+ * @param type the message type of the request
+ * @return the letter of the server
+ */
+char backendOf(uint8_t type) {
+	if (type == MSG_AUTH) {
+		return 'A';
+	}
+	if (type == MSG_LIMIT || type == MSG_CANCEL) {
+		return 'E';
+	}
+	return (type >= MSG_BUY && type <= MSG_POSITION) || type == MSG_RESERVE || type == MSG_RELEASE ? 'P' : 'Q';
+}
+
+/*
+ * Answer a stats request with the metrics of this server: its queues, its client commands and its backend requests.
+ * @param addr the socket address of the requester
+ * @param reqId the request ID of the stats request
+ */
+void sendStats(const Endpoint& addr, uint32_t reqId) {
+	size_t flows = 0, queued = 0, unsent = 0, held = 0;
+	for (const auto& entry : sessions) {
+		flows += entry.second.flows.size();
+		queued += entry.second.outbuf.size();
+	}
+	for (const auto& entry : outboxes) {
+		unsent += entry.second.size();
+	}
+	for (const auto& entry : waiting) {
+		held += entry.second.size();
+	}
+	string table = "[Server M] sessions: " + to_string(sessions.size()) + "; requests in progress: " + to_string(flows)
+		+ "; pending backend requests: " + to_string(pending.size()) + " (" + to_string(held) + " waiting for a window)"
+		+ "; messages in outboxes: " + to_string(unsent) + " (" + to_string(outboxDrops) + " requests dropped)"
+		+ "; bytes queued to clients: " + to_string(queued)
+		+ "; watched stocks: " + to_string(subscribers.size()) + "; session tokens: " + to_string(tokens.size())
+		+ "; cached credentials: " + to_string(authCache.size()) + "; prices read from shared memory: " + to_string(localReads)
+		+ "; positions priced by server P: " + to_string(pricedPositions)
+		+ "; refused as busy: " + to_string(refusedBusy) + " for backend load, " + to_string(refusedRate) + " for user rate"
+		+ "\n" + metricHeader();
+	for (int cmd = 0; cmd < NUM_COMMANDS; cmd++) {
+		appendMetric(table, commandNames[cmd], commandStats[cmd]);
+	}
+	for (int type = 0; type < NUM_MSG_TYPES; type++) {
+		appendMetric(table, string("-> ") + backendOf(type) + " " + msgTypeName(type), backendStats[type]);
+	}
+	MsgWriter reply(MSG_STATS | MSG_REPLY, reqId);
+	reply.putText(table);
+	if (sendTo(sockUDP, reply.bytes(), reply.size, addr) == -1) {
+		perror("Server M: stats sendto");
+	}
+}
+
+/*
+ * Route a reply to the handler of the step its flow is in.
+ * @param s the session
+ * @param f the flow
+ * @param reply the reply
+ */
+void dispatchReply(Session& s, Flow& f, MsgReader& reply) {
+	switch (f.state) {
+	case AUTH_WAIT_A:        onAuthResult(s, f, reply); break;
+	case QUOTE_WAIT_Q:       onQuoteResult(s, f, reply); break;
+	case BUY_WAIT_Q:         onBuyQuote(s, f, reply); break;
+	case BUY_WAIT_P:         onBuyResult(s, f, reply); break;
+	case SELL_WAIT_Q:        onSellQuote(s, f, reply); break;
+	case SELL_WAIT_P_CHECK:  onSellCheck(s, f, reply); break;
+	case SELL_WAIT_P_RESULT: onSellResult(s, f, reply); break;
+	case POS_WAIT_P:         onPortfolio(s, f, reply); break;
+	case POS_WAIT_Q:         onPositionPrices(s, f, reply); break;
+	case SUB_WAIT_Q:         onSubscribed(s, f, reply); break;
+	case LIMIT_WAIT_P:       onReserved(s, f, reply); break;
+	case LIMIT_WAIT_E:       onLimitResult(s, f, reply); break;
+	case CANCEL_WAIT_E:      onCancelResult(s, f, reply); break;
+	default: break; // not waiting for a backend server
+	}
+}
+
+/*
+ * Read every pending reply from the backend servers and route each one to the flow waiting for it.
+ * Replies to unknown request IDs, i.e., duplicates of answered requests or replies for sessions that have left, are dropped.
+ */
+void onBackendReadable() {
+	char buf[MAXBUFSIZE];
+	int numbytes;
+	Endpoint fromAddr;
+	while ((numbytes = recvFrom(sockUDP, buf, MAXBUFSIZE, fromAddr)) != -1) {
+		MsgReader reply(buf, numbytes);
+		if (reply.ok && reply.type == (MSG_DIRECTORY | MSG_REPLY)) {
+			onDirectory(reply);
+			continue;
+		}
+		if (reply.ok && reply.type == MSG_PRICE_UPDATE) {
+			onPriceUpdate(reply);
+			continue;
+		}
+		if (reply.ok && reply.type == MSG_AUTH_INVALIDATE && sameEndpoint(fromAddr, sockaddrA)) {
+			onAuthInvalidate();
+			continue;
+		}
+		if (reply.ok && reply.type == MSG_STATS) {
+			sendStats(fromAddr, reply.reqId);
+			continue;
+		}
+		auto it = pending.find(reply.reqId);
+		// A sale's confirmation reuses the ID of its share check, so the type tells a late reply to the check apart
+		if (!reply.ok || it == pending.end() || reply.type != (it->second.type | MSG_REPLY)) {
+			continue;
+		}
+		int fd = it->second.fd;
+		uint32_t flowId = it->second.flowId;
+		backendStats[it->second.type].record(nowUs() - it->second.sent, reply.status == ST_OK);
+		forgetRequest(reply.reqId);
+		if (fd == -1) { // no flow waits for the reply
+			continue;
+		}
+		Session& s = sessions[fd];
+		Flow& f = s.flows[flowId];
+
+		// Server Q has a different directory now: ask by ticker while the new one is fetched
+		if (reply.status == ST_STALE_DIRECTORY) {
+			dirLoaded = false;
+			if (f.state == POS_WAIT_Q) {
+				requestPositionPrices(s, f);
+			}
+			else {
+				requestQuote(s, f);
+			}
+			continue;
+		}
+
+		dispatchReply(s, f, reply);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("Server M: recvfrom");
+	}
+}
+
+/*
+ * Hand every price read from the market-data segment in this pass of the event loop to the flow waiting for it,
+ * unless the flow or its session has gone meanwhile.
+ */
+void deliverLocalReplies() {
+	while (!localReplies.empty()) {
+		vector<LocalReply> batch;
+		batch.swap(localReplies);
+		for (const LocalReply& local : batch) {
+			auto it = sessions.find(local.fd);
+			if (it == sessions.end()) {
+				continue;
+			}
+			Session& s = it->second;
+			auto flow = s.flows.find(local.flowId);
+			if (flow == s.flows.end() || flow->second.reqId != local.reqId) {
+				continue;
+			}
+			MsgReader reply(local.reply.data(), local.reply.size());
+			dispatchReply(s, flow->second, reply);
+		}
+	}
+}
+
+/*
+ * Give up on the backend request a flow is waiting for and tell its client.
+ * @param s the session
+ * @param f the flow
+ */
+void failRequest(Session& s, Flow& f) {
+	LOG_INFO("[Server M] No response from the backend server after %d retransmissions.\n", MAX_RETRIES);
+	// Server P may be holding the shares of the sale for a confirmation that will never come
+	if (f.state == SELL_WAIT_P_CHECK) {
+		denySale(s, f);
+	}
+	else if (f.state == SUB_WAIT_Q) {
+		dropSubscription(s, f.ticker);
+	}
+	// Server P may have reserved the shares of a limit sell that will not be placed now. A limit order sent to
+	// Server E is left alone, as Server E may have rested it; if it never arrived, its reservation expires
+	else if (f.state == LIMIT_WAIT_P) {
+		releaseReserve(s, f);
+	}
+	sendToClient(s, f.id, TIMEOUT_MSG);
+	finishFlow(s, f);
+}
+
+/*
+ * Retransmit every backend request whose deadline has passed, doubling its timeout,
+ * and fail the ones that have been retransmitted MAX_RETRIES times already.
+ */
+void expireRequests() {
+	long long now = nowMs();
+	while (!deadlines.empty() && deadlines.begin()->first <= now) {
+		uint32_t reqId = deadlines.begin()->second;
+		deadlines.erase(deadlines.begin());
+		PendingRequest& req = pending[reqId];
+		if (req.retries == MAX_RETRIES) {
+			backendStats[req.type].timeouts++;
+			if (req.fd == -1) {
+				LOG_ERROR("[Server M] No response to a %s request after %d retransmissions. Gave up on it.\n",
+					msgTypeName(req.type), MAX_RETRIES);
+				forgetRequest(reqId);
+				continue;
+			}
+			Session& s = sessions[req.fd];
+			Flow& f = s.flows[req.flowId];
+			forgetRequest(reqId);
+			failRequest(s, f);
+			continue;
+		}
+		req.retries++;
+		backendStats[req.type].retries++;
+		req.deadline = now + ((long long)REQ_TIMEOUT_MS << req.retries);
+		deadlines.insert(make_pair(req.deadline, reqId));
+		sendToBackend(*req.server, req.request, "Server M: retransmission", true);
+	}
+}
+
+/*
+ * Accept every pending client connection and start its session, which must authenticate first.
+ * @param sockTCP the TCP parent socket
+ */
+void onNewClients(int sockTCP) {
+	struct sockaddr_in clientAddr;
+	socklen_t sin_size = sizeof(struct sockaddr_in);
+	int newSock;
+	while ((newSock = accept(sockTCP, (struct sockaddr*)&clientAddr, &sin_size)) != -1) {
+		watchSocket(newSock, EPOLLIN);
+		Session& s = sessions[newSock];
+		s.fd = newSock;
+		s.authenticated = false;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("Server M: accept");
+	}
+}
+
+int main() {
+	struct epoll_event events[MAXEVENTS];
+	bool backlog = false; // whether messages are waiting in the outboxes
+
+	// Bootup
+	startLogger();
+	sockUDP = setupDatagram('M', PORT_M_UDP);
+	int sockTCP = setupTCP();
+	LOG_INFO("[Server M] Booting up using UDP on port %s.\n", PORT_M_UDP);
+	sockaddrA = serverEndpoint(PORT_A);
+	sockaddrP = serverEndpoint(PORT_P);
+	sockaddrQ = serverEndpoint(PORT_Q);
+	sockaddrE = serverEndpoint(PORT_E);
+	// Start request IDs at a different point on every run, so backends never mistake a new request for an old one
+	nextReqId = (uint32_t)time(NULL) | 1;
+	const char* rate = getenv(RATE_ENV);
+	userRate = rate != NULL ? max(atof(rate), 0.0) : DEFAULT_USER_RATE;
+	if (userRate > 0) {
+		LOG_INFO("[Server M] Limiting every user to %g commands per second.\n", userRate);
+	}
+
+	// Multiplex the TCP parent socket, every client connection and the UDP socket
+	if ((epfd = epoll_create1(0)) == -1) {
+		perror("Server M: epoll_create1");
+		exit(1);
+	}
+	watchSocket(sockTCP, EPOLLIN);
+	watchSocket(sockUDP, EPOLLIN);
+
+	while (1) {
+		// Sleep until the next event or the earliest retransmission deadline
+		int timeout = -1;
+		if (!deadlines.empty()) {
+			timeout = (int)max(0LL, deadlines.begin()->first - nowMs());
+		}
+		if (backlog && (timeout == -1 || timeout > OUTBOX_RETRY_MS)) {
+			timeout = OUTBOX_RETRY_MS;
+		}
+		int n = epoll_wait(epfd, events, MAXEVENTS, timeout);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Server M: epoll_wait");
+			exit(1);
+		}
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == sockTCP) {
+				onNewClients(sockTCP);
+			}
+			else if (fd == sockUDP) {
+				onBackendReadable();
+			}
+			else if (sessions.count(fd)) {
+				if (events[i].events & EPOLLOUT) {
+					flushClient(sessions[fd]);
+				}
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+					onClientReadable(fd);
+				}
+			}
+		}
+		deliverLocalReplies();
+		expireRequests();
+		publishUpdates();
+		backlog = flushOutboxes();
+	}
+	close(sockTCP);
+	close(sockUDP);
+	return 0;
+}
@@ -1,24 +1,261 @@
 /* This file implements the portfolio server (Server P) to manage user portfolios, which for each user
  * maintains a list of stock information containing the ticker name, the number of shares held, and the average buy price
  * of each stock in the user's portfolio. For approved "buy" and "sell" commands, Server P is responsible for updating
- * the users' portfolios. 
+ * the users' portfolios.
+ *
+ * Server M retransmits requests it gets no reply to, so the same request may arrive more than once.
+ * Server P remembers the replies to its most recent requests and answers a repeated request with the remembered
+ * reply instead of applying it again, so that a retransmitted buy or sell is never executed twice.
+ *
+ * The portfolios are split into NUM_SHARDS shards by a hash of the username, and each shard is served by its own
+ * worker thread. The receiving threads only receive requests and queue each one on the shard of its user, so requests
+ * of different users proceed concurrently while those of one user are handled in order. There is one receiving thread,
+ * or with WORKERS=n, n of them, each on a socket of its own (utility.h).
+ * Within a shard, every ticker is interned into a ticker ID, and each portfolio indexes its positions by ticker ID.
+ *
+ * A sell is a two-phase operation. When the share check passes, the shares are held for the sale, so that no other
+ * sale can use them, and the worker goes on with other requests. The user's confirmation sells the held shares and a
+ * denial releases them; if neither arrives within SELL_HOLD_MS, the worker releases them itself.
+ *
+ * The shares of a limit sell are reserved the same way when Server M places the order, under the ID of Server M's
+ * reserve request. The matching engine (Server E) then sends every fill of a limit order, which Server P applies like
+ * a confirmed buy or sale; a fill of a sell only takes shares out of the reservation of its order, and is refused if
+ * they are not there, so that Server E never reports the other side of the trade. Once the rest of a sell rests on
+ * a book, Server E says so, and the reservation lasts until the order fills or is cancelled; until then it expires
+ * after RESERVE_HOLD_MS, in case the order never reached Server E. When Server E starts with empty books, the
+ * reservations of the orders on the books of its earlier runs are released. Reservations are journaled like trades.
+ * Server E sends a fill until it is acknowledged. Every fill carries an ID unique across the runs of Server E, which
+ * is journaled with it, so that a repeated fill is recognized after the reply cache has forgotten it and after a
+ * restart. Server E also names the ID below which every fill has been acknowledged, and only the IDs above it are kept.
+ *
+ * Every buy and sell is appended to a journal before Server M is told about it. A journal thread writes all trades
+ * queued since its last write with one write and one fdatasync (group commit), and only then sends their replies.
+ * After every SNAPSHOT_EVERY trades, it pauses the workers, saves all portfolios to a snapshot and empties the journal.
+ * At boot, Server P loads the snapshot (or portfolios.txt if there is none) and replays the journal on top of it.
+ * Journal and snapshot records use the binary message format, with the journal sequence number in the request ID field.
+ *
+ * Server P keeps the unrealised profit of every portfolio up to date, so that a position request is answered
+ * without asking Server Q for prices or summing over the holdings. Each portfolio keeps the cost and the current
+ * value of its holdings in cents, which every trade adjusts by the change of the one position it touches. Each shard
+ * keeps the current price of every stock and the portfolios holding it; it takes the price updates from the change
+ * log of the market-data segment (marketdata.h) before a position request and moves the value of every holder of a
+ * stock whose price changed. The profit is only answered if these prices reflect every time shift Server M has sent;
+ * otherwise Server M asks Server Q for the prices as before.
  */
 
 #include "utility.h"
+#include "metrics.h"
+#include "logger.h"
+#include "marketdata.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 using namespace std;
 
+#define NUM_SHARDS 4         // number of portfolio shards, each served by one worker thread
+#define REPLY_CACHE_SIZE 256 // number of recent requests whose replies are remembered, per shard
+#define JOURNAL_FILE "portfolios.wal"
+#define SNAPSHOT_FILE "portfolios.snap"
+#define SNAPSHOT_EVERY 10000 // number of journaled trades after which a snapshot is taken
+#define SELL_HOLD_MS 60000   // time the shares of a sale are held for the user's confirmation
+#define RESERVE_HOLD_MS 60000 // time the shares of a limit sell are reserved before its order has rested on a book
+#define MD_ATTACH_MS 1000    // time between attempts to open the market-data segment before Server Q has created it
+
+// Record types of the journal and the snapshot
+enum RecordType {
+	REC_BUY = 1,  // journal: uname, ticker, i32 shares, f64 price
+	REC_SELL,     // journal: uname, ticker, i32 shares
+	REC_SNAPSHOT, // snapshot: empty; first record, whose sequence number is that of the last trade included
+	REC_MEMBER,   // snapshot: uname
+	REC_POSITION, // snapshot: uname, ticker, i32 shares, f64 avg price
+	REC_RESERVE,  // journal, snapshot: uname, ticker, i32 shares, u32 reservation ID, u32 engine epoch (0 until the order rests)
+	REC_RESTED,   // journal: uname, u32 reservation ID, u32 engine epoch
+	REC_RELEASE,  // journal: uname, u32 reservation ID
+	REC_FILL,     // journal: uname, ticker, u8 side, i32 shares, f64 price, u32 reservation ID, u32 engine epoch, u32 fill sequence number
+	REC_FILL_FLOOR, // snapshot: u32 engine epoch, u32 fill sequence number below which every fill has been applied
+	REC_APPLIED   // snapshot: u32 engine epoch, u32 sequence number of a fill applied above the floor
+};
+
 // Structure to contain the details of a stock owned by a member
-struct OneStockInfo {
-	string ticker;
+struct Position {
+	uint32_t tickerId;
 	int shares;
 	double avgPrice;
+	int held;         // shares held for sales waiting for confirmation or reserved for limit sells, included in shares
+	size_t holder;    // index of the portfolio in the holders of the stock
 };
 
-// Global Variable
-unordered_map<string, vector<OneStockInfo>> pf;
+// Structure to contain the portfolio of a member
+struct Portfolio {
+	vector<Position> positions;               // stocks held, in the order they were acquired
+	unordered_map<uint32_t, size_t> slots;    // index into positions of each ticker ID held
+	int64_t cost = 0;                         // sum of shares × average buy price in cents, as shown to the user
+	int64_t value = 0;                        // sum of shares × current price in cents
+};
+
+// Structure to contain a sale that has passed the share check and waits for the user's confirmation
+struct PendingSell {
+	string uname;
+	uint32_t tickerId;
+	int shares;
+	chrono::steady_clock::time_point expiry; // time at which the held shares are released
+};
+
+// Structure to contain the shares reserved for a limit sell
+struct Reservation {
+	string uname;
+	uint32_t tickerId;
+	int shares;       // shares not filled yet
+	uint32_t epoch;   // epoch of the Server E on whose book the order rests, or 0 if it has not rested yet
+	chrono::steady_clock::time_point expiry; // time at which the shares are released unless the order has rested
+};
+
+// Structure to contain a request received from Server M
+struct Job {
+	string request;                 // the request, as received
+	Endpoint serverAddr;            // the socket address to reply to
+	long long received;             // time (us) the request was received
+};
+
+// Structure to contain one shard of the portfolios, which only its worker thread touches, except while a snapshot is taken
+struct Shard {
+	unordered_map<string, Portfolio> pf;
+	unordered_map<string, uint32_t> tickerIds; // ticker ID of each ticker known to the shard
+	vector<string> tickerNames;                // ticker of each ticker ID
+	unordered_map<uint32_t, PendingSell> sells; // sales waiting for confirmation, indexed by the ID of the sell request
+	unordered_map<uint32_t, Reservation> reserves; // shares reserved for limit sells, indexed by the reservation ID
+	set<pair<chrono::steady_clock::time_point, uint32_t>> expiries; // expiry of every sale in sells and every reservation not rested
+	vector<int64_t> prices;                    // current price of each ticker ID in cents, or 0 if unknown
+	vector<vector<Portfolio*>> holders;        // portfolios holding each ticker ID
+	unordered_map<string, string> replyCache;  // reply sent for each recent request, indexed by the request including its ID
+	deque<string> replyOrder;                  // requests in replyCache, oldest first
+
+	// Queue of requests from the main thread
+	mutex lock;
+	condition_variable ready;
+	deque<Job> jobs;
+	size_t maxJobs = 0;             // longest the queue has been
+
+	mutex stateLock; // held by the worker while it handles a request, and by the journal thread while it takes a snapshot
+
+	// Where the prices come from
+	int32_t marketPid = 0;        // process ID of the Server Q whose segment they were read from
+	uint32_t marketVersion = 0;   // version of the directory of the segment, or 0 to read every price again
+	uint64_t marketCursor = 0;    // updates of the segment seen so far
+	vector<uint32_t> marketIds;   // ticker ID in the shard of each ticker ID of the segment
+	vector<uint16_t> changed;     // ticker IDs of the segment updated since the last look
+};
+
+// Structure to contain a reply waiting for its trade to be committed to the journal
+struct Commit {
+	string record;                  // the journal record of the trade, or empty for a reply that only has to wait its turn
+	string reply;                   // the encoded reply, or empty for a record that nobody waits for
+	Endpoint serverAddr;            // the socket address to reply to
+	long long received;             // time (us) the request was received
+};
+
+// Global Variables
+const MdSegment* market = NULL; // the market-data segment, or NULL until Server Q has created it
+mutex marketLock;               // guards market and marketAttachTime
+long long marketAttachTime = -MD_ATTACH_MS; // time (ms) of the last attempt to open the segment
+int sockfd;               // UDP socket the replies are sent from, shared by all threads
+Shard shards[NUM_SHARDS];
+
+// Journal
+int journalFd;
+uint32_t lastLsn = 0;         // sequence number of the last journaled trade
+int tradesSinceSnapshot = 0;
+mutex journalLock;
+condition_variable journalReady;
+deque<Commit> commits;        // trades and replies queued for the journal thread
+size_t maxBatch = 0;          // largest number of replies committed together
+
+// Fills of limit orders applied, by fill ID: the epoch of Server E in the high half and the sequence number in the low one
+mutex fillLock;
+uint64_t fillFloor = 0;       // every fill with a lower ID has been applied or refused, and acknowledged
+set<uint64_t> appliedFills;   // IDs of the fills applied at or above fillFloor
+
+// Metrics, updated by the workers and the journal thread
+mutex statsLock;
+Metric stats[NUM_MSG_TYPES];  // count and latency from receipt to reply of the requests of each type
+Metric journalStats;          // count and latency of the journal writes, each with its fdatasync
 
 /*
- * Load member portfolios from the input "portfolios.txt" to the global variable. 
+ * Find the shard holding the portfolio of a user.
+ * @param uname the username
+ * @return the shard
+ */
+Shard& shardOf(string_view uname) {
+	return shards[hash<string_view>()(uname) % NUM_SHARDS]; // the same hash as that of the username as a string
+}
+
+/*
+ * Get the ticker ID of a stock within a shard, assigning the next free one to a stock the shard has not seen.
+ * @param shard the shard
+ * @param ticker the stock
+ * @return the ticker ID
+ */
+uint32_t internTicker(Shard& shard, const string& ticker) {
+	auto it = shard.tickerIds.find(ticker);
+	if (it != shard.tickerIds.end()) {
+		return it->second;
+	}
+	shard.tickerNames.push_back(ticker);
+	shard.prices.push_back(0);
+	shard.holders.emplace_back();
+	return shard.tickerIds[ticker] = shard.tickerNames.size() - 1;
+}
+
+/*
+ * Convert a price to whole cents.
+ * @param price the price
+ * @return the price in cents
+ */
+int64_t toCents(double price) {
+	return llround(price * 100);
+}
+
+/*
+ * Add a position to the cost and value of its portfolio, or take it out before it changes.
+ * @param shard the shard
+ * @param portfolio the portfolio
+ * @param stock the position
+ * @param sign 1 to add, -1 to take out
+ */
+void bookPosition(Shard& shard, Portfolio& portfolio, const Position& stock, int sign) {
+	portfolio.cost += sign * stock.shares * toCents(stock.avgPrice);
+	portfolio.value += sign * stock.shares * shard.prices[stock.tickerId];
+}
+
+/*
+ * Find the position of a portfolio in a stock.
+ * @param portfolio the portfolio
+ * @param tickerId the ticker ID of the stock
+ * @return the position, or NULL if the stock is not held
+ */
+Position* findPosition(Portfolio& portfolio, uint32_t tickerId) {
+	auto it = portfolio.slots.find(tickerId);
+	return it == portfolio.slots.end() ? NULL : &portfolio.positions[it->second];
+}
+
+/*
+ * Add a stock that is not held yet to a portfolio.
+ * @param shard the shard
+ * @param portfolio the portfolio
+ * @param tickerId the ticker ID of the stock
+ * @param shares the number of shares
+ * @param avgPrice the average buy price
+ */
+void addPosition(Shard& shard, Portfolio& portfolio, uint32_t tickerId, int shares, double avgPrice) {
+	vector<Portfolio*>& holders = shard.holders[tickerId];
+	portfolio.slots[tickerId] = portfolio.positions.size();
+	portfolio.positions.push_back({tickerId, shares, avgPrice, 0, holders.size()});
+	holders.push_back(&portfolio);
+	bookPosition(shard, portfolio, portfolio.positions.back(), 1);
+}
+
+/*
+ * Load member portfolios from the input "portfolios.txt" into the shards.
  */
 void loadPortfolios() {
 	string line, member, ticker, temp;
@@ -33,13 +270,13 @@ void loadPortfolios() {
 			iss >> temp;
 			if (!(iss >> shares)) {
 				member = temp;
-				pf[member] = vector<OneStockInfo>();
+				shardOf(member).pf[member]; // the holders of its stocks point to it, so it is created in place
 			}
 			else {
 				ticker = temp;
 				iss >> avgP;
-				OneStockInfo newStock = {ticker, shares, avgP};
-				pf[member].push_back(newStock);
+				Shard& shard = shardOf(member);
+				addPosition(shard, shard.pf[member], internTicker(shard, ticker), shares, avgP);
 			}
 		}
 	}
@@ -52,218 +289,1172 @@ void loadPortfolios() {
 
 /*
  * Update the portfolio for an approved buy request.
- * @param uname the username
- * @param bTicker the stock for which the user intends to buy some shares
+ * @param shard the shard
+ * @param portfolio the user's portfolio
+ * @param tickerId the ticker ID of the stock for which the user intends to buy some shares
  * @param bShares the number of shares involved in the purchase
  * @param bPrice the current price of this specific stock
  */
-void buyStock(const string& uname, const string& bTicker, const int& bShares, const double& bPrice) {
-	for (OneStockInfo& stock : pf[uname]) {
-		if (stock.ticker == bTicker) {
-			// Calculate the previous total cost for this stock
-			int prevCost = stock.shares * stock.avgPrice;
-			// Update the number of shares
-			stock.shares += bShares;
-			// Update the average buy price
-			stock.avgPrice = (prevCost + bShares * bPrice) / stock.shares;
-			return;
-		}
+void buyStock(Shard& shard, Portfolio& portfolio, uint32_t tickerId, const int& bShares, const double& bPrice) {
+	Position* stock = findPosition(portfolio, tickerId);
+	if (stock != NULL) {
+		bookPosition(shard, portfolio, *stock, -1);
+		// Calculate the previous total cost for this stock
+		int prevCost = stock->shares * stock->avgPrice;
+		// Update the number of shares
+		stock->shares += bShares;
+		// Update the average buy price
+		stock->avgPrice = (prevCost + bShares * bPrice) / stock->shares;
+		bookPosition(shard, portfolio, *stock, 1);
+		return;
 	}
 
-	// bTicker is not in the portfolio
-	pf[uname].push_back({bTicker, bShares, bPrice});
+	// The stock is not in the portfolio
+	addPosition(shard, portfolio, tickerId, bShares, bPrice);
 }
 
 /*
  * Check the number of shares currently held by the user for a stock of interest to be sold.
- * @param uname the username
- * @param sTicker the stock for which the user intends to sell some shares
+ * Shares held for other sales do not count.
+ * @param portfolio the user's portfolio
+ * @param tickerId the ticker ID of the stock for which the user intends to sell some shares
  * @param sShares the number of shares involved in the sale
  * @return true, if there are sufficient shares. false, if the number of shares is not sufficient.
  */
-bool checkShareNum(const string& uname, const string& sTicker, const int& sShares) {
-	for (OneStockInfo& stock : pf[uname]) {
-		if (stock.ticker == sTicker) {
-			if (stock.shares >= sShares) {
-				return true;
-			}
-			else {
-				return false;
-			}
-		}
+bool checkShareNum(Portfolio& portfolio, uint32_t tickerId, const int& sShares) {
+	Position* stock = findPosition(portfolio, tickerId);
+	return stock != NULL && stock->shares - stock->held >= sShares;
+}
+
+/*
+ * Hold the shares of a sale that has passed the share check until the user's decision arrives or SELL_HOLD_MS has passed.
+ * @param shard the shard of the user
+ * @param reqId the ID of the sell request, which the decision carries too
+ * @param uname the username
+ * @param tickerId the ticker ID of the stock to sell
+ * @param sShares the number of shares involved in the sale
+ */
+void holdShares(Shard& shard, uint32_t reqId, const string& uname, uint32_t tickerId, const int& sShares) {
+	findPosition(shard.pf[uname], tickerId)->held += sShares;
+	PendingSell& sale = shard.sells[reqId];
+	sale = {uname, tickerId, sShares, chrono::steady_clock::now() + chrono::milliseconds(SELL_HOLD_MS)};
+	shard.expiries.insert(make_pair(sale.expiry, reqId));
+}
+
+/*
+ * Release the shares held for a sale and forget the sale.
+ * @param shard the shard of the user
+ * @param reqId the ID of the sell request
+ * @return the sale
+ */
+PendingSell releaseShares(Shard& shard, uint32_t reqId) {
+	auto it = shard.sells.find(reqId);
+	PendingSell sale = it->second;
+	Position* stock = findPosition(shard.pf[sale.uname], sale.tickerId);
+	if (stock != NULL) {
+		stock->held -= sale.shares;
 	}
-	return false;
+	shard.expiries.erase(make_pair(sale.expiry, reqId));
+	shard.sells.erase(it);
+	return sale;
 }
 
 /*
- * Update the portfolio for an approved sell request.
+ * Reserve shares of a portfolio for a limit sell. Until its order rests on a book, the reservation expires after
+ * RESERVE_HOLD_MS.
+ * @param shard the shard of the user
+ * @param id the reservation ID
  * @param uname the username
- * @param sTicker the stock for which the user intends to sell some shares
+ * @param tickerId the ticker ID of the stock to sell
+ * @param rShares the number of shares
+ * @param epoch the epoch of the Server E on whose book the order rests, or 0 if it has not rested yet
+ */
+void reserveShares(Shard& shard, uint32_t id, const string& uname, uint32_t tickerId, int rShares, uint32_t epoch) {
+	Position* stock = findPosition(shard.pf[uname], tickerId);
+	if (stock != NULL) {
+		stock->held += rShares;
+	}
+	Reservation& reserve = shard.reserves[id];
+	reserve = {uname, tickerId, rShares, epoch, chrono::steady_clock::time_point::max()};
+	if (epoch == 0) {
+		reserve.expiry = chrono::steady_clock::now() + chrono::milliseconds(RESERVE_HOLD_MS);
+		shard.expiries.insert(make_pair(reserve.expiry, id));
+	}
+}
+
+/*
+ * Keep a reservation until its order fills or is cancelled, now that the order rests on a book.
+ * @param shard the shard of the user
+ * @param id the reservation ID
+ * @param epoch the epoch of the Server E on whose book the order rests
+ * @return false, if the reservation is gone
+ */
+bool restReserve(Shard& shard, uint32_t id, uint32_t epoch) {
+	auto it = shard.reserves.find(id);
+	if (it == shard.reserves.end()) {
+		return false;
+	}
+	Reservation& reserve = it->second;
+	if (reserve.epoch == 0) {
+		shard.expiries.erase(make_pair(reserve.expiry, id));
+		reserve.expiry = chrono::steady_clock::time_point::max();
+	}
+	reserve.epoch = epoch;
+	return true;
+}
+
+/*
+ * Take shares out of a reservation, for a fill of its order or to release them, and forget the reservation once it is empty.
+ * @param shard the shard of the user
+ * @param id the reservation ID
+ * @param rShares the number of shares, at most those left in the reservation
+ */
+void takeReserved(Shard& shard, uint32_t id, int rShares) {
+	auto it = shard.reserves.find(id);
+	if (it == shard.reserves.end()) {
+		return;
+	}
+	Reservation& reserve = it->second;
+	Position* stock = findPosition(shard.pf[reserve.uname], reserve.tickerId);
+	if (stock != NULL) {
+		stock->held -= rShares;
+	}
+	reserve.shares -= rShares;
+	if (reserve.shares == 0) {
+		shard.expiries.erase(make_pair(reserve.expiry, id));
+		shard.reserves.erase(it);
+	}
+}
+
+/*
+ * Combine the epoch of Server E and a sequence number into a fill ID.
+ * @param epoch the engine epoch
+ * @param seq the sequence number
+ * @return the fill ID
+ */
+uint64_t fillId(uint32_t epoch, uint32_t seq) {
+	return ((uint64_t)epoch << 32) | seq;
+}
+
+/*
+ * Check whether a fill has been applied already, and forget the IDs of the fills below a new floor.
+ * @param id the fill ID
+ * @param floor the fill ID below which Server E has had every fill acknowledged
+ * @return true, if the fill has been applied
+ */
+bool fillApplied(uint64_t id, uint64_t floor) {
+	lock_guard<mutex> guard(fillLock);
+	if (floor > fillFloor) {
+		fillFloor = floor;
+		appliedFills.erase(appliedFills.begin(), appliedFills.lower_bound(floor));
+	}
+	return id < fillFloor || appliedFills.count(id) > 0;
+}
+
+/*
+ * Remember that a fill has been applied.
+ * @param id the fill ID
+ */
+void markFillApplied(uint64_t id) {
+	lock_guard<mutex> guard(fillLock);
+	if (id >= fillFloor) {
+		appliedFills.insert(id);
+	}
+}
+
+/*
+ * Encode the journal record of a released reservation.
+ * @param uname the username
+ * @param id the reservation ID
+ * @return the record
+ */
+string releaseRecord(const string& uname, uint32_t id) {
+	MsgWriter record(REC_RELEASE, 0);
+	record.putSymbol(uname);
+	record.putU32(id);
+	return string(record.bytes(), record.size);
+}
+
+/*
+ * Update the portfolio for an approved sell request.
+ * A stock sold out is replaced by the last position of the portfolio, and the portfolio among the holders of the
+ * stock by the last holder, which keeps the removal O(1).
+ * @param shard the shard
+ * @param portfolio the user's portfolio
+ * @param tickerId the ticker ID of the stock for which the user intends to sell some shares
  * @param sShares the number of shares involved in the sale
  */
-void sellStock(const string& uname, const string& sTicker, const int& sShares) {
-	vector<OneStockInfo>& stocks = pf[uname];
-	for (auto it = stocks.begin(); it != stocks.end(); it++) {
-		if (it->ticker == sTicker) {
-			// Update the share number
-			it->shares -= sShares;
-			if (it->shares == 0) {
-				stocks.erase(it);
-			}
-			break;
+void sellStock(Shard& shard, Portfolio& portfolio, uint32_t tickerId, const int& sShares) {
+	Position* stock = findPosition(portfolio, tickerId);
+	if (stock == NULL) {
+		return;
+	}
+	// Update the share number
+	bookPosition(shard, portfolio, *stock, -1);
+	stock->shares -= sShares;
+	if (stock->shares != 0) {
+		bookPosition(shard, portfolio, *stock, 1);
+	}
+	else {
+		vector<Portfolio*>& holders = shard.holders[tickerId];
+		holders[stock->holder] = holders.back();
+		findPosition(*holders[stock->holder], tickerId)->holder = stock->holder;
+		holders.pop_back();
+		size_t slot = portfolio.slots[tickerId];
+		portfolio.positions[slot] = portfolio.positions.back();
+		portfolio.slots[portfolio.positions[slot].tickerId] = slot;
+		portfolio.positions.pop_back();
+		portfolio.slots.erase(tickerId);
+	}
+}
+
+/*
+ * Get the market-data segment, opening it if Server Q has created it since the last attempt.
+ * @return the segment, or NULL
+ */
+const MdSegment* marketData() {
+	lock_guard<mutex> guard(marketLock);
+	long long now = nowUs() / 1000;
+	if (market == NULL && now - marketAttachTime >= MD_ATTACH_MS) {
+		marketAttachTime = now;
+		market = mdAttach();
+	}
+	return market;
+}
+
+/*
+ * Move a stock to a new price in the value of every portfolio of the shard holding it.
+ * @param shard the shard
+ * @param tickerId the ticker ID
+ * @param price the new price in cents
+ */
+void applyPrice(Shard& shard, uint32_t tickerId, int64_t price) {
+	int64_t change = price - shard.prices[tickerId];
+	if (change == 0) {
+		return;
+	}
+	shard.prices[tickerId] = price;
+	for (Portfolio* portfolio : shard.holders[tickerId]) {
+		portfolio->value += findPosition(*portfolio, tickerId)->shares * change;
+	}
+}
+
+/*
+ * Apply the price updates published in the market-data segment since the last call to the portfolios of a shard.
+ * @param shard the shard
+ * @param pid the process ID of the Server Q that Server M has sent its time shifts to, or 0 if it does not know
+ * @param timeShifts the number of time shifts Server M has sent to that Server Q
+ * @return true, if the prices of the shard are current and reflect those time shifts
+ */
+bool updatePrices(Shard& shard, int32_t pid, uint32_t timeShifts) {
+	const MdSegment* seg = marketData();
+	if (seg == NULL || pid == 0 || seg->pid.load(memory_order_acquire) != pid) {
+		return false;
+	}
+	// Counted after their prices were published, so the updates read next include them
+	if ((int32_t)(seg->timeShifts.load(memory_order_acquire) - timeShifts) < 0) {
+		return false;
+	}
+	uint32_t version = seg->version.load(memory_order_acquire);
+	if (version == 0) {
+		return false;
+	}
+	bool complete = mdChanges(seg, shard.marketCursor, shard.changed);
+	if (!complete || version != shard.marketVersion || pid != shard.marketPid) {
+		// A new directory or a new Server Q, or updates were missed: read every price
+		uint32_t n = min(seg->numTickers.load(memory_order_relaxed), (uint32_t)MD_MAX_TICKERS);
+		shard.marketIds.clear();
+		shard.changed.clear();
+		for (uint32_t id = 0; id < n; id++) {
+			shard.marketIds.push_back(internTicker(shard, string(seg->tickers[id], strnlen(seg->tickers[id], MD_TICKER_LEN))));
+			shard.changed.push_back(id);
+		}
+		shard.marketVersion = version;
+		shard.marketPid = pid;
+	}
+	for (uint16_t id : shard.changed) {
+		double price;
+		uint32_t shifts;
+		if (id >= shard.marketIds.size() || !mdRead(seg, version, id, price, shifts)) {
+			shard.marketVersion = 0; // the directory changed meanwhile
+			return false;
 		}
+		applyPrice(shard, shard.marketIds[id], toCents(price));
 	}
+	return true;
 }
 
-int main() {
-	int sockfd;
-	int numbytes;
-	char buf[MAXBUFSIZE];
+/*
+ * Record a request that has been answered in the metrics.
+ * @param type the message type of the request
+ * @param received the time (us) the request was received
+ * @param ok whether the request was answered without a failure status
+ */
+void recordRequest(uint8_t type, long long received, bool ok) {
+	type &= ~MSG_REPLY;
+	if (type < NUM_MSG_TYPES) {
+		lock_guard<mutex> guard(statsLock);
+		stats[type].record(nowUs() - received, ok);
+	}
+}
 
-	struct sockaddr_in serverAddr; // socket address of Server M
-	socklen_t addrLen = sizeof(serverAddr);
+/*
+ * Remember a reply, so that a retransmission of the request gets the same reply.
+ * @param shard the shard of the user
+ * @param job the request being answered
+ * @param response the encoded reply
+ */
+void rememberReply(Shard& shard, const Job& job, const MsgWriter& response) {
+	if (shard.replyCache.find(job.request) == shard.replyCache.end()) {
+		shard.replyOrder.push_back(job.request);
+		if (shard.replyOrder.size() > REPLY_CACHE_SIZE) {
+			shard.replyCache.erase(shard.replyOrder.front());
+			shard.replyOrder.pop_front();
+		}
+	}
+	shard.replyCache[job.request].assign(response.bytes(), response.size);
+}
 
-	// Bootup
-	// Load input file
-	loadPortfolios();
-	// Set up UDP socket
-	printf("[Server P] Booting up using UDP on port %s.\n", PORT_P);
-	sockfd = setupUDP('P', PORT_P);
-	
-	while (1) {
-		// Receive a new request from Server M
-		if ((numbytes = recvfrom(sockfd, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&serverAddr, &addrLen)) == -1) {
-			perror("Server P: recvfrom");
+/*
+ * Send a reply to Server M and remember it.
+ * @param shard the shard of the user
+ * @param job the request being answered
+ * @param response the encoded reply
+ * @return the result of sendto
+ */
+int sendReply(Shard& shard, const Job& job, const MsgWriter& response) {
+	rememberReply(shard, job, response);
+	int rv = sendTo(sockfd, response.bytes(), response.size, job.serverAddr);
+	recordRequest(response.type(), job.received, response.status() == ST_OK);
+	return rv;
+}
+
+/*
+ * Queue a reply for the journal thread, which sends it once everything queued before it is durable.
+ * @param record the journal record of a trade, or empty if there is nothing to journal
+ * @param reply the encoded reply
+ * @param job the request being answered
+ */
+void queueCommit(const string& record, const string& reply, const Job& job) {
+	{
+		lock_guard<mutex> guard(journalLock);
+		commits.push_back({record, reply, job.serverAddr, job.received});
+	}
+	journalReady.notify_one();
+}
+
+/*
+ * Journal a trade that has been applied to the portfolio, and reply to Server M once the journal entry is durable.
+ * @param shard the shard of the user
+ * @param job the request being answered
+ * @param record the journal record of the trade
+ * @param response the encoded reply
+ */
+void commitTrade(Shard& shard, const Job& job, const MsgWriter& record, const MsgWriter& response) {
+	rememberReply(shard, job, response);
+	queueCommit(string(record.bytes(), record.size), string(response.bytes(), response.size), job);
+}
+
+/*
+ * Release the shares of every sale whose user has not decided in time, and of every limit sell whose order has not
+ * rested on a book in time.
+ * @param shard the shard
+ */
+void expireSales(Shard& shard) {
+	auto now = chrono::steady_clock::now();
+	while (!shard.expiries.empty() && shard.expiries.begin()->first <= now) {
+		uint32_t id = shard.expiries.begin()->second;
+		if (shard.sells.count(id)) {
+			PendingSell sale = releaseShares(shard, id);
+			LOG_INFO("[Server P] No confirmation for selling %d shares of %s by %s in time. Released the shares.\n",
+				sale.shares, shard.tickerNames[sale.tickerId].c_str(), sale.uname.c_str());
 			continue;
 		}
-		buf[numbytes] = '\0';
-
-     	// Parse the request
-		string request(buf), transID, payload;
-		int colon = request.find(':');
-		transID = request.substr(0, colon);
-		payload = request.substr(colon + 1);
-
-     	// Process the payload
-		if (payload[0] == 'b') { // a buy request, format: bUname|ticker,shares_price
-			printf("[Server P] Received a buy request from the client.\n");
-			string uname, bTicker;
-			int bShares;
-			double bPrice;
-
-			payload = payload.substr(1);
-			int pipe = payload.find('|');
-			uname = payload.substr(0, pipe);
-			payload = payload.substr(pipe + 1);
-			int comma = payload.find(',');
-			bTicker = payload.substr(0, comma);
-			payload = payload.substr(comma+1);
-			int underscore = payload.find('_');
-			bShares = stoi(payload.substr(0, underscore));
-			bPrice = stod(payload.substr(underscore + 1));
-
-			// Update pf
-			buyStock(uname, bTicker, bShares, bPrice);
-
-			// Send a purchase confirmation to Server M
-			string response = transID + ":s";
-			if (sendto(sockfd, response.c_str(), response.length(), 0, (struct sockaddr*)&serverAddr, addrLen) == -1) {
-				perror("Server P: buy sendto");
-				continue;
+		Reservation reserve = shard.reserves.at(id);
+		takeReserved(shard, id, reserve.shares);
+		queueCommit(releaseRecord(reserve.uname, id), "", Job());
+		LOG_INFO("[Server P] The limit sell of %d shares of %s by %s did not rest on a book in time. Released the shares.\n",
+			reserve.shares, shard.tickerNames[reserve.tickerId].c_str(), reserve.uname.c_str());
+	}
+}
+
+/*
+ * Handle one request from Server M on the shard of its user.
+ * @param shard the shard
+ * @param job the request
+ */
+void handleRequest(Shard& shard, const Job& job) {
+	string uname, ticker;
+
+	// A retransmission of a request that has been answered already; the reply may be of a trade still being committed
+	auto cached = shard.replyCache.find(job.request);
+	if (cached != shard.replyCache.end()) {
+		queueCommit("", cached->second, job);
+		return;
+	}
+
+	// Parse the request; every request starts with the username
+	MsgReader request(job.request.data(), job.request.length());
+	request.getSymbol(uname);
+	if (!request.ok) {
+		return;
+	}
+	// Only a purchase creates a portfolio; the other requests of a user without one see an empty one
+	auto found = shard.pf.find(uname);
+	Portfolio none;
+	Portfolio& portfolio = found != shard.pf.end() ? found->second : none;
+
+	// Process the request
+	if (request.type == MSG_BUY) { // a buy request, body: uname, ticker, shares, price
+		LOG_INFO("[Server P] Received a buy request from the client.\n");
+		request.getSymbol(ticker);
+		int bShares = request.getI32();
+		double bPrice = request.getF64();
+		if (!request.ok) {
+			return;
+		}
+
+		// Update pf
+		buyStock(shard, shard.pf[uname], internTicker(shard, ticker), bShares, bPrice);
+
+		// Journal the purchase and then send a purchase confirmation to Server M
+		MsgWriter record(REC_BUY, 0);
+		record.putSymbol(uname);
+		record.putSymbol(ticker);
+		record.putI32(bShares);
+		record.putF64(bPrice);
+		MsgWriter response(MSG_BUY | MSG_REPLY, request.reqId);
+		commitTrade(shard, job, record, response);
+		LOG_INFO("[Server P] Successfully bought %d shares of %s and updated %s’s portfolio.\n",
+			bShares, ticker.c_str(), uname.c_str());
+	}
+	else if (request.type == MSG_SELL) { // a sell check request, body: uname, ticker, shares
+		LOG_INFO("[Server P] Received a sell request from the main server.\n");
+		request.getSymbol(ticker);
+		int sShares = request.getI32();
+		if (!request.ok) {
+			return;
+		}
+		uint32_t tickerId = internTicker(shard, ticker);
+
+		// Check if there are sufficient shares; a sale holding shares already is a retransmission that outlived the reply cache
+		if (shard.sells.count(request.reqId) || checkShareNum(portfolio, tickerId, sShares)) {
+			// Sufficient shares: hold them while requesting users' confirmation via Server M, which answers with the ID of this request
+			if (!shard.sells.count(request.reqId)) {
+				holdShares(shard, request.reqId, uname, tickerId, sShares);
 			}
-			printf("[Server P] Successfully bought %d shares of %s and updated %s’s portfolio.\n", 
-				bShares, bTicker.c_str(), uname.c_str());
-		}
-		else if (payload[0] == 's') { // a sell check request, format: sUname|ticker,shares
-			printf("[Server P] Received a sell request from the main server.\n");
-			string uname, sTicker;
-			int sShares;
-
-			payload = payload.substr(1);
-			int pipe = payload.find('|');
-			uname = payload.substr(0, pipe);
-			payload = payload.substr(pipe + 1);
-			int comma = payload.find(',');
-			sTicker = payload.substr(0, comma);
-			sShares = stoi(payload.substr(comma + 1));
-			
-			string stockStatus = transID + ":";
-			// Check if there are sufficient shares
-			if (checkShareNum(uname, sTicker, sShares)) {
-				// Sufficient shares: requesting users' confirmation via Server M
-				stockStatus += "SUFF";
-				if (sendto(sockfd, stockStatus.c_str(), stockStatus.length(), 0, (struct sockaddr*)&serverAddr, addrLen) == -1) {
-					perror("Server P: sell sendto");
-					continue;
-				}
-				printf("[Server P] Stock %s has sufficient shares in %s’s portfolio. Requesting users’ confirmation for selling stock.\n", 
-					sTicker.c_str(), uname.c_str());
-				
-				string response;
-				while (1) {
-					// Receive users' confirmation responses
-					if ((numbytes = recvfrom(sockfd, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&serverAddr, &addrLen)) == -1) {
-						perror("Server P: sell recvfrom");
-						continue;
-					}
-					buf[numbytes] = '\0';
-					// Parse the response
-					response = buf;
-					int colon = response.find(':');
-					if (response.substr(0, colon) == transID) {
-						response = response.substr(colon + 1);
-						break;
-					}
-				}
-				
-				if (response == "S_CONFIRMED") {
-					printf("[Server P] User approves selling the stock.\n");
-					// Update pf
-					sellStock(uname, sTicker, sShares);
-					// Send a sell result to Server M
-					string sellConfirm = transID + ":s";
-					if (sendto(sockfd, sellConfirm.c_str(), sellConfirm.length(), 0, (struct sockaddr*)&serverAddr, addrLen) == -1) {
-						perror("Server P: sell sendto");
-						continue;
-					}
-					printf("[Server P] Successfully sold %d shares of %s and updated %s’s portfolio.\n", 
-						sShares, sTicker.c_str(), uname.c_str());
-				}
-				else if (response == "S_DENIED") {
-					printf("[Server P] Sell denied.\n");
+			MsgWriter stockStatus(MSG_SELL | MSG_REPLY, request.reqId, ST_OK);
+			if (sendReply(shard, job, stockStatus) == -1) {
+				perror("Server P: sell sendto");
+				return;
+			}
+			LOG_INFO("[Server P] Stock %s has sufficient shares in %s’s portfolio. Requesting users’ confirmation for selling stock.\n",
+				ticker.c_str(), uname.c_str());
+		}
+		else {
+			// Not sufficient shares: reporting the issue to Server M
+			MsgWriter stockStatus(MSG_SELL | MSG_REPLY, request.reqId, ST_NOT_SUFF);
+			if (sendReply(shard, job, stockStatus) == -1) {
+				perror("Server P: sell sendto");
+				return;
+			}
+			LOG_INFO("[Server P] Stock %s does not have enough shares in %s’s portfolio. Unable to sell %d shares of %s.\n",
+				ticker.c_str(), uname.c_str(), sShares, ticker.c_str());
+		}
+	}
+	else if (request.type == MSG_SELL_CONFIRM || request.type == MSG_SELL_DENY) { // the user's decision on a sale, body: uname
+		bool waiting = shard.sells.count(request.reqId) > 0;
+		if (request.type == MSG_SELL_DENY) {
+			if (waiting) {
+				releaseShares(shard, request.reqId);
+				LOG_INFO("[Server P] Sell denied.\n");
+			}
+			recordRequest(MSG_SELL_DENY, job.received, true);
+			return;
+		}
+		if (!waiting) { // the held shares have been released already
+			MsgWriter sellConfirm(MSG_SELL_CONFIRM | MSG_REPLY, request.reqId, ST_EXPIRED);
+			if (sendReply(shard, job, sellConfirm) == -1) {
+				perror("Server P: sell sendto");
+			}
+			return;
+		}
+
+		LOG_INFO("[Server P] User approves selling the stock.\n");
+		PendingSell sale = releaseShares(shard, request.reqId);
+		ticker = shard.tickerNames[sale.tickerId];
+		// Update pf
+		sellStock(shard, portfolio, sale.tickerId, sale.shares);
+		// Journal the sale and then send a sell result to Server M
+		MsgWriter record(REC_SELL, 0);
+		record.putSymbol(uname);
+		record.putSymbol(ticker);
+		record.putI32(sale.shares);
+		MsgWriter sellConfirm(MSG_SELL_CONFIRM | MSG_REPLY, request.reqId);
+		commitTrade(shard, job, record, sellConfirm);
+		LOG_INFO("[Server P] Successfully sold %d shares of %s and updated %s’s portfolio.\n",
+			sale.shares, ticker.c_str(), uname.c_str());
+	}
+	else if (request.type == MSG_POSITION) { // a position request, body: uname, Server Q's pid, time shifts sent to it
+		LOG_INFO("[Server P] Received a position request from the main server for Member: %s\n", uname.c_str());
+		int32_t pid = request.getI32();
+		uint32_t timeShifts = request.getU32();
+		// Compose the portfolio message, with the profit if the prices are current
+		MsgWriter response(MSG_POSITION | MSG_REPLY, request.reqId);
+		response.putU16(portfolio.positions.size());
+		for (const auto& stock : portfolio.positions) {
+			response.putSymbol(shard.tickerNames[stock.tickerId]);
+			response.putI32(stock.shares);
+			response.putF64(stock.avgPrice);
+		}
+		bool priced = request.ok && updatePrices(shard, pid, timeShifts);
+		response.putU8(priced);
+		response.putF64(priced ? (portfolio.value - portfolio.cost) / 100.0 : 0);
+		// Send the portfolio to Server M
+		if (sendTo(sockfd, response.bytes(), response.size, job.serverAddr) == -1) {
+			perror("Server P: portfolio sendto");
+			return;
+		}
+		recordRequest(MSG_POSITION, job.received, true);
+		LOG_INFO("[Server P] Finished sending the gain and portfolio of %s to the main server.\n", uname.c_str());
+	}
+	else if (request.type == MSG_RESERVE) { // shares of a limit sell, body: uname, ticker, shares; the request ID is the reservation ID
+		request.getSymbol(ticker);
+		int rShares = request.getI32();
+		if (!request.ok || rShares <= 0) {
+			return;
+		}
+		uint32_t tickerId = internTicker(shard, ticker);
+		auto reserved = shard.reserves.find(request.reqId);
+		if (reserved != shard.reserves.end()) {
+			// A retransmission that outlived the reply cache, unless an earlier run of Server M used the same ID
+			const Reservation& reserve = reserved->second;
+			bool same = reserve.uname == uname && reserve.tickerId == tickerId && reserve.shares == rShares && reserve.epoch == 0;
+			MsgWriter response(MSG_RESERVE | MSG_REPLY, request.reqId, same ? ST_OK : ST_NOT_SUFF);
+			if (sendReply(shard, job, response) == -1) {
+				perror("Server P: reserve sendto");
+			}
+			return;
+		}
+		if (!checkShareNum(portfolio, tickerId, rShares)) {
+			MsgWriter response(MSG_RESERVE | MSG_REPLY, request.reqId, ST_NOT_SUFF);
+			if (sendReply(shard, job, response) == -1) {
+				perror("Server P: reserve sendto");
+				return;
+			}
+			LOG_INFO("[Server P] Could not reserve %d shares of %s in %s’s portfolio for a limit sell.\n",
+				rShares, ticker.c_str(), uname.c_str());
+			return;
+		}
+		reserveShares(shard, request.reqId, uname, tickerId, rShares, 0);
+		// Journal the reservation and then confirm it to Server M, which places the order
+		MsgWriter record(REC_RESERVE, 0);
+		record.putSymbol(uname);
+		record.putSymbol(ticker);
+		record.putI32(rShares);
+		record.putU32(request.reqId);
+		record.putU32(0);
+		MsgWriter response(MSG_RESERVE | MSG_REPLY, request.reqId);
+		commitTrade(shard, job, record, response);
+		LOG_INFO("[Server P] Reserved %d shares of %s in %s’s portfolio for a limit sell.\n",
+			rShares, ticker.c_str(), uname.c_str());
+	}
+	else if (request.type == MSG_RESTED) { // a limit sell resting on a book, body: uname, reservation ID, engine epoch
+		uint32_t reserveId = request.getU32();
+		uint32_t epoch = request.getU32();
+		if (!request.ok) {
+			return;
+		}
+		auto reserved = shard.reserves.find(reserveId);
+		if (reserved == shard.reserves.end() || reserved->second.uname != uname || reserved->second.epoch == epoch) {
+			// Gone, so Server E takes the order off its book; or a retransmission
+			bool gone = reserved == shard.reserves.end() || reserved->second.uname != uname;
+			MsgWriter response(MSG_RESTED | MSG_REPLY, request.reqId, gone ? ST_NOT_EXIST : ST_OK);
+			if (sendReply(shard, job, response) == -1) {
+				perror("Server P: rested sendto");
+			}
+			return;
+		}
+		restReserve(shard, reserveId, epoch);
+		MsgWriter record(REC_RESTED, 0);
+		record.putSymbol(uname);
+		record.putU32(reserveId);
+		record.putU32(epoch);
+		MsgWriter response(MSG_RESTED | MSG_REPLY, request.reqId);
+		commitTrade(shard, job, record, response);
+	}
+	else if (request.type == MSG_FILL) { // a fill of a limit order from Server E, body: uname, ticker, side, shares, price, reservation ID
+		request.getSymbol(ticker);
+		uint8_t side = request.getU8();
+		int fShares = request.getI32();
+		double fPrice = request.getF64();
+		uint32_t reserveId = request.getU32();
+		uint32_t epoch = request.getU32();
+		uint32_t seq = request.getU32();
+		uint32_t floor = request.getU32();
+		if (!request.ok || fShares <= 0) {
+			return;
+		}
+		MsgWriter response(MSG_FILL | MSG_REPLY, request.reqId);
+		if (fillApplied(fillId(epoch, seq), fillId(epoch, floor))) {
+			// A retransmission that outlived the reply cache or a restart; acknowledged once the fill is committed
+			rememberReply(shard, job, response);
+			queueCommit("", string(response.bytes(), response.size), job);
+			return;
+		}
+		uint32_t tickerId = internTicker(shard, ticker);
+		if (side == SIDE_BUY) {
+			buyStock(shard, shard.pf[uname], tickerId, fShares, fPrice);
+		}
+		else {
+			// Sell the shares reserved for the order and no others; without them, Server E drops the buyer's side too
+			auto reserved = shard.reserves.find(reserveId);
+			if (reserved == shard.reserves.end() || reserved->second.uname != uname || reserved->second.tickerId != tickerId
+				|| reserved->second.shares < fShares) {
+				MsgWriter refusal(MSG_FILL | MSG_REPLY, request.reqId, ST_NOT_SUFF);
+				if (sendReply(shard, job, refusal) == -1) {
+					perror("Server P: fill sendto");
 				}
+				LOG_ERROR("[Server P] Refused a fill of %d shares of %s sold by %s: reservation %u does not hold them.\n",
+					fShares, ticker.c_str(), uname.c_str(), reserveId);
+				return;
+			}
+			takeReserved(shard, reserveId, fShares);
+			sellStock(shard, portfolio, tickerId, fShares);
+		}
+		// Journal the fill and then acknowledge it to Server E
+		MsgWriter record(REC_FILL, 0);
+		record.putSymbol(uname);
+		record.putSymbol(ticker);
+		record.putU8(side);
+		record.putI32(fShares);
+		record.putF64(fPrice);
+		record.putU32(reserveId);
+		record.putU32(epoch);
+		record.putU32(seq);
+		markFillApplied(fillId(epoch, seq));
+		commitTrade(shard, job, record, response);
+		LOG_INFO("[Server P] Filled a limit %s of %d shares of %s at %.2f in %s’s portfolio.\n",
+			side == SIDE_BUY ? "buy" : "sell", fShares, ticker.c_str(), fPrice, uname.c_str());
+	}
+	else if (request.type == MSG_RELEASE) { // reserved shares of a limit sell that will not trade, body: uname, reservation ID
+		uint32_t reserveId = request.getU32();
+		if (!request.ok) {
+			return;
+		}
+		auto reserved = shard.reserves.find(reserveId);
+		MsgWriter response(MSG_RELEASE | MSG_REPLY, request.reqId);
+		if (reserved == shard.reserves.end() || reserved->second.uname != uname) { // filled, released or expired already
+			if (sendReply(shard, job, response) == -1) {
+				perror("Server P: release sendto");
+			}
+			return;
+		}
+		int rShares = reserved->second.shares;
+		ticker = shard.tickerNames[reserved->second.tickerId];
+		takeReserved(shard, reserveId, rShares);
+		MsgWriter record(REC_RELEASE, 0);
+		record.putSymbol(uname);
+		record.putU32(reserveId);
+		commitTrade(shard, job, record, response);
+		LOG_INFO("[Server P] Released %d reserved shares of %s in %s’s portfolio.\n", rShares, ticker.c_str(), uname.c_str());
+	}
+}
+
+/*
+ * Read a whole journal or snapshot file.
+ * @param fileName the file
+ * @param data the returned contents
+ * @return false, if the file does not exist
+ */
+bool readFile(const char* fileName, string& data) {
+	ifstream file(fileName, ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+	ostringstream contents;
+	contents << file.rdbuf();
+	data = contents.str();
+	return true;
+}
+
+/*
+ * Find the length of the record starting at an offset of a journal or snapshot.
+ * @param data the contents of the file
+ * @param pos the offset
+ * @return the length of the record, or 0 if the file ends within it
+ */
+size_t recordLength(const string& data, size_t pos) {
+	if (pos + MSG_HEADER_SIZE > data.length()) {
+		return 0;
+	}
+	size_t len = MSG_HEADER_SIZE + (((unsigned char)data[pos + 2] << 8) | (unsigned char)data[pos + 3]);
+	return pos + len <= data.length() ? len : 0;
+}
+
+/*
+ * Load the portfolios from the snapshot, if there is one.
+ * @param snapshotLsn the returned sequence number of the last trade included in the snapshot
+ * @return false, if there is no snapshot
+ */
+bool loadSnapshot(uint32_t& snapshotLsn) {
+	string data, uname, ticker;
+	if (!readFile(SNAPSHOT_FILE, data)) {
+		return false;
+	}
+	size_t pos = 0, len;
+	while ((len = recordLength(data, pos)) != 0) {
+		MsgReader record(data.data() + pos, len);
+		pos += len;
+		if (record.type == REC_SNAPSHOT) {
+			snapshotLsn = record.reqId;
+			continue;
+		}
+		if (record.type == REC_FILL_FLOOR || record.type == REC_APPLIED) {
+			uint32_t epoch = record.getU32();
+			uint64_t id = fillId(epoch, record.getU32());
+			if (record.type == REC_FILL_FLOOR) {
+				fillFloor = id;
 			}
 			else {
-				// Not sufficient shares: reporting the issue to Server M
-				stockStatus += "NOT_SUFF";
-				if (sendto(sockfd, stockStatus.c_str(), stockStatus.length(), 0, (struct sockaddr*)&serverAddr, addrLen) == -1) {
-					perror("Server P: sell sendto");
-					continue;
-				}
-				printf("[Server P] Stock %s does not have enough shares in %s’s portfolio. Unable to sell %d shares of %s.\n", 
-					sTicker.c_str(), uname.c_str(), sShares, sTicker.c_str());
+				appliedFills.insert(id);
+			}
+			continue;
+		}
+		record.getSymbol(uname);
+		Shard& shard = shardOf(uname);
+		Portfolio& portfolio = shard.pf[uname];
+		if (record.type == REC_POSITION) {
+			record.getSymbol(ticker);
+			int shares = record.getI32();
+			double avgPrice = record.getF64();
+			addPosition(shard, portfolio, internTicker(shard, ticker), shares, avgPrice);
+		}
+		else if (record.type == REC_RESERVE) {
+			record.getSymbol(ticker);
+			int shares = record.getI32();
+			uint32_t id = record.getU32();
+			reserveShares(shard, id, uname, internTicker(shard, ticker), shares, record.getU32());
+		}
+	}
+	return true;
+}
+
+/*
+ * Replay the trades and reservations journaled after the snapshot, and open the journal for appending.
+ * @param snapshotLsn the sequence number of the last trade included in the snapshot
+ */
+void openJournal(uint32_t snapshotLsn) {
+	string data, uname, ticker;
+	readFile(JOURNAL_FILE, data);
+	int replayed = 0;
+	lastLsn = snapshotLsn;
+	size_t pos = 0, len;
+	while ((len = recordLength(data, pos)) != 0) {
+		MsgReader record(data.data() + pos, len);
+		pos += len;
+		// The journal is emptied after a snapshot, unless Server P stopped in between
+		if (record.reqId <= snapshotLsn) {
+			continue;
+		}
+		record.getSymbol(uname);
+		Shard& shard = shardOf(uname);
+		Portfolio& portfolio = shard.pf[uname];
+		if (record.type == REC_BUY || record.type == REC_SELL) {
+			record.getSymbol(ticker);
+			int shares = record.getI32();
+			uint32_t tickerId = internTicker(shard, ticker);
+			if (record.type == REC_BUY) {
+				buyStock(shard, portfolio, tickerId, shares, record.getF64());
+			}
+			else {
+				sellStock(shard, portfolio, tickerId, shares);
+			}
+		}
+		else if (record.type == REC_FILL) {
+			record.getSymbol(ticker);
+			uint8_t side = record.getU8();
+			int shares = record.getI32();
+			double price = record.getF64();
+			uint32_t id = record.getU32();
+			uint32_t epoch = record.getU32();
+			markFillApplied(fillId(epoch, record.getU32()));
+			uint32_t tickerId = internTicker(shard, ticker);
+			if (side == SIDE_BUY) {
+				buyStock(shard, portfolio, tickerId, shares, price);
+			}
+			else {
+				takeReserved(shard, id, shares);
+				sellStock(shard, portfolio, tickerId, shares);
 			}
 		}
-		else if (payload[0] == 'p') { // a position request, format: pUname
-			string uname = request.substr(colon + 2);
-			printf("[Server P] Received a position request from the main server for Member: %s\n", uname.c_str());
-			// Compose the portfolio message
-			ostringstream oss;
-			oss << transID << ":";
-			for (const auto& stock : pf[uname]) {
-				oss << stock.ticker << " ";
-				oss << stock.shares << " ";
-				oss << fixed << setprecision(2) << stock.avgPrice << "\n";
+		else if (record.type == REC_RESERVE) {
+			record.getSymbol(ticker);
+			int shares = record.getI32();
+			uint32_t id = record.getU32();
+			reserveShares(shard, id, uname, internTicker(shard, ticker), shares, record.getU32());
+		}
+		else if (record.type == REC_RESTED) {
+			uint32_t id = record.getU32();
+			restReserve(shard, id, record.getU32());
+		}
+		else if (record.type == REC_RELEASE) {
+			uint32_t id = record.getU32();
+			auto reserved = shard.reserves.find(id);
+			if (reserved != shard.reserves.end()) {
+				takeReserved(shard, id, reserved->second.shares);
 			}
-			string response = oss.str();
-			// Send the portfolio to Server M
-			if (sendto(sockfd, response.c_str(), response.length(), 0, (struct sockaddr*)&serverAddr, addrLen) == -1) {
-				perror("Server P: portfolio sendto");
+		}
+		lastLsn = record.reqId;
+		replayed++;
+	}
+	tradesSinceSnapshot = replayed;
+
+	if ((journalFd = open(JOURNAL_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1) {
+		perror("Server P: open journal");
+		exit(1);
+	}
+	// Cut off a trade whose write was torn by a crash, so that new trades follow the last complete one
+	if (pos < data.length() && ftruncate(journalFd, pos) == -1) {
+		perror("Server P: truncate journal");
+		exit(1);
+	}
+	if (replayed > 0) {
+		LOG_INFO("[Server P] Replayed %d records from the journal.\n", replayed);
+	}
+}
+
+/*
+ * Write a whole buffer to a file.
+ * @param fd the file descriptor
+ * @param data the buffer
+ * @return false, if writing failed
+ */
+bool writeAll(int fd, const string& data) {
+	size_t done = 0;
+	while (done < data.length()) {
+		ssize_t n = write(fd, data.data() + done, data.length() - done);
+		if (n == -1) {
+			if (errno == EINTR) {
 				continue;
 			}
-			printf("[Server P] Finished sending the gain and portfolio of %s to the main server.\n", uname.c_str());
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+/*
+ * Append the trades of a batch to the journal with a single write and fdatasync, then send the replies of the batch.
+ * @param batch the trades and replies, in the order they were queued
+ */
+void commitBatch(deque<Commit>& batch) {
+	long long start = nowUs();
+	string out;
+	for (Commit& c : batch) {
+		if (c.record.empty()) {
+			continue;
 		}
+		// Stamp the record with its sequence number, in the request ID field
+		lastLsn++;
+		for (int i = 0; i < 4; i++) {
+			c.record[4 + i] = (char)(lastLsn >> (24 - 8 * i));
+		}
+		out += c.record;
+		tradesSinceSnapshot++;
+	}
+	if (!out.empty() && (!writeAll(journalFd, out) || fdatasync(journalFd) == -1)) {
+		// Replying to trades that a restart would lose is worse than stopping
+		perror("Server P: journal write");
+		exit(1);
+	}
+	if (!out.empty()) {
+		lock_guard<mutex> guard(statsLock);
+		journalStats.record(nowUs() - start, true);
+		maxBatch = max(maxBatch, batch.size());
+	}
+	for (const Commit& c : batch) {
+		if (c.reply.empty()) {
+			continue;
+		}
+		if (sendTo(sockfd, c.reply.data(), c.reply.length(), c.serverAddr) == -1) {
+			perror("Server P: sendto");
+		}
+		recordRequest(c.reply[0], c.received, c.reply[1] == ST_OK);
+	}
+	batch.clear();
+}
+
+/*
+ * Save all portfolios to a new snapshot and empty the journal.
+ * The workers are paused meanwhile, so that the snapshot matches the journal exactly.
+ */
+void takeSnapshot() {
+	for (Shard& shard : shards) {
+		shard.stateLock.lock();
+	}
+	// Every trade applied so far has been queued; commit the queued ones, so that the snapshot covers the whole journal
+	deque<Commit> batch;
+	{
+		lock_guard<mutex> guard(journalLock);
+		batch.swap(commits);
+	}
+	commitBatch(batch);
+
+	// Write the snapshot to a temporary file and move it into place once it is durable
+	string tmpFile = string(SNAPSHOT_FILE) + ".tmp";
+	FILE* file = fopen(tmpFile.c_str(), "wb");
+	bool saved = file != NULL;
+	if (saved) {
+		MsgWriter header(REC_SNAPSHOT, lastLsn);
+		fwrite(header.bytes(), 1, header.size, file);
+		for (Shard& shard : shards) {
+			for (const auto& member : shard.pf) {
+				MsgWriter record(REC_MEMBER, 0);
+				record.putSymbol(member.first);
+				fwrite(record.bytes(), 1, record.size, file);
+				for (const Position& stock : member.second.positions) {
+					MsgWriter position(REC_POSITION, 0);
+					position.putSymbol(member.first);
+					position.putSymbol(shard.tickerNames[stock.tickerId]);
+					position.putI32(stock.shares);
+					position.putF64(stock.avgPrice);
+					fwrite(position.bytes(), 1, position.size, file);
+				}
+			}
+			// After the positions, which the reservations are held in
+			for (const auto& entry : shard.reserves) {
+				const Reservation& reserve = entry.second;
+				MsgWriter record(REC_RESERVE, 0);
+				record.putSymbol(reserve.uname);
+				record.putSymbol(shard.tickerNames[reserve.tickerId]);
+				record.putI32(reserve.shares);
+				record.putU32(entry.first);
+				record.putU32(reserve.epoch);
+				fwrite(record.bytes(), 1, record.size, file);
+			}
+		}
+		lock_guard<mutex> guard(fillLock);
+		MsgWriter floor(REC_FILL_FLOOR, 0);
+		floor.putU32(fillFloor >> 32);
+		floor.putU32(fillFloor);
+		fwrite(floor.bytes(), 1, floor.size, file);
+		for (uint64_t id : appliedFills) {
+			MsgWriter applied(REC_APPLIED, 0);
+			applied.putU32(id >> 32);
+			applied.putU32(id);
+			fwrite(applied.bytes(), 1, applied.size, file);
+		}
+		saved = fflush(file) == 0 && fsync(fileno(file)) == 0;
+		saved = fclose(file) == 0 && saved;
+	}
+	if (saved && rename(tmpFile.c_str(), SNAPSHOT_FILE) == 0) {
+		// Make the rename durable before the journal it replaces is emptied
+		int dirFd = open(".", O_RDONLY);
+		if (dirFd != -1) {
+			fsync(dirFd);
+			close(dirFd);
+		}
+		if (ftruncate(journalFd, 0) == -1 || fdatasync(journalFd) == -1) {
+			perror("Server P: truncate journal");
+		}
+		tradesSinceSnapshot = 0;
+		LOG_INFO("[Server P] Saved a snapshot of all portfolios.\n");
+	}
+	else {
+		// The journal still holds every trade, so the next attempt loses nothing
+		perror("Server P: snapshot");
+	}
+
+	for (Shard& shard : shards) {
+		shard.stateLock.unlock();
+	}
+}
+
+/*
+ * Journal thread: commit the queued trades in batches, and take a snapshot after every SNAPSHOT_EVERY trades.
+ */
+void commitJournal() {
+	deque<Commit> batch;
+	while (1) {
+		{
+			unique_lock<mutex> guard(journalLock);
+			journalReady.wait(guard, [] { return !commits.empty(); });
+			batch.swap(commits);
+		}
+		commitBatch(batch);
+		if (tradesSinceSnapshot >= SNAPSHOT_EVERY) {
+			takeSnapshot();
+		}
+	}
+}
+
+/*
+ * Worker thread of a shard: handle the requests queued on the shard, in order of arrival,
+ * and release the shares of sales that have not been decided in time.
+ * @param shard the shard
+ */
+void serveShard(Shard* shard) {
+	while (1) {
+		unique_lock<mutex> guard(shard->lock);
+		// Sleep until a request arrives or the earliest held sale expires; only this thread changes the expiries
+		bool expired = false;
+		while (shard->jobs.empty() && !expired) {
+			if (shard->expiries.empty()) {
+				shard->ready.wait(guard);
+			}
+			else {
+				expired = shard->ready.wait_until(guard, shard->expiries.begin()->first) == cv_status::timeout;
+			}
+		}
+		bool hasJob = !shard->jobs.empty();
+		Job job;
+		if (hasJob) {
+			job = shard->jobs.front();
+			shard->jobs.pop_front();
+		}
+		guard.unlock();
+
+		lock_guard<mutex> state(shard->stateLock);
+		expireSales(*shard);
+		if (hasJob) {
+			handleRequest(*shard, job);
+		}
+	}
+}
+
+/*
+ * Answer a stats request with the metrics of this server, including the queue depth of every shard.
+ * @param addr the socket address of the requester
+ * @param reqId the request ID of the stats request
+ */
+void sendStats(const Endpoint& addr, uint32_t reqId) {
+	string table = "[Server P] queued requests per shard (now/max):";
+	for (Shard& shard : shards) {
+		lock_guard<mutex> guard(shard.lock);
+		table += " " + to_string(shard.jobs.size()) + "/" + to_string(shard.maxJobs);
+	}
+	{
+		lock_guard<mutex> guard(journalLock);
+		table += "; queued replies: " + to_string(commits.size());
+	}
+	lock_guard<mutex> guard(statsLock);
+	table += "; largest commit batch: " + to_string(maxBatch) + "\n" + metricHeader();
+	for (int type = 0; type < NUM_MSG_TYPES; type++) {
+		appendMetric(table, msgTypeName(type), stats[type]);
+	}
+	appendMetric(table, "journal write", journalStats);
+	MsgWriter reply(MSG_STATS | MSG_REPLY, reqId);
+	reply.putText(table);
+	if (sendTo(sockfd, reply.bytes(), reply.size, addr) == -1) {
+		perror("Server P: stats sendto");
+	}
+}
+
+/*
+ * Release the reservations of the limit sells resting on the books of earlier runs of Server E, which a restarted
+ * Server E has lost, and acknowledge the start of Server E once the releases are journaled.
+ * The workers are paused meanwhile, as every shard may hold such reservations.
+ * @param job the message of Server E
+ */
+void releaseLostOrders(const Job& job) {
+	MsgReader msg(job.request.data(), job.request.length());
+	uint32_t epoch = msg.getU32();
+	if (!msg.ok) {
+		return;
+	}
+	int released = 0;
+	for (Shard& shard : shards) {
+		shard.stateLock.lock();
+	}
+	for (Shard& shard : shards) {
+		vector<uint32_t> lost;
+		for (const auto& entry : shard.reserves) {
+			if (entry.second.epoch != 0 && entry.second.epoch < epoch) {
+				lost.push_back(entry.first);
+			}
+		}
+		for (uint32_t id : lost) {
+			Reservation reserve = shard.reserves.at(id);
+			takeReserved(shard, id, reserve.shares);
+			queueCommit(releaseRecord(reserve.uname, id), "", job);
+		}
+		released += lost.size();
+	}
+	MsgWriter response(MSG_ENGINE_START | MSG_REPLY, msg.reqId);
+	queueCommit("", string(response.bytes(), response.size), job);
+	for (Shard& shard : shards) {
+		shard.stateLock.unlock();
+	}
+	if (released > 0) {
+		LOG_INFO("[Server P] Server E has restarted. Released the shares of %d limit sells that were on its books.\n", released);
+	}
+}
+
+/*
+ * Receiving thread: receive requests from Server M on a socket and queue each one on the shard of its user.
+ * @param sock the socket of the thread
+ */
+void receiveRequests(int sock) {
+	int numbytes;
+	char buf[MAXBUFSIZE];
+
+	Endpoint serverAddr; // socket address of Server M
+
+	while (1) {
+		// Receive a new request from Server M
+		if ((numbytes = recvFrom(sock, buf, MAXBUFSIZE - 1, serverAddr)) == -1) {
+			perror("Server P: recvfrom");
+			continue;
+		}
+
+		long long received = nowUs();
+
+		// Queue the request on the shard of its user
+		MsgReader request(buf, numbytes);
+		if (request.ok && request.type == MSG_STATS) {
+			sendStats(serverAddr, request.reqId);
+			continue;
+		}
+		if (request.ok && request.type == MSG_ENGINE_START) {
+			releaseLostOrders({string(buf, numbytes), serverAddr, received});
+			continue;
+		}
+		string_view uname = request.getSymbol(); // only routes the request, so it stays in the receive buffer
+		if (!request.ok) {
+			continue;
+		}
+		Shard& shard = shardOf(uname);
+		{
+			lock_guard<mutex> guard(shard.lock);
+			shard.jobs.push_back({string(buf, numbytes), serverAddr, received});
+			shard.maxJobs = max(shard.maxJobs, shard.jobs.size());
+		}
+		shard.ready.notify_one();
+	}
+}
+
+int main() {
+	// Bootup
+	startLogger();
+	// Recover the portfolios from the snapshot and the journal, or load the input file on the first run
+	uint32_t snapshotLsn = 0;
+	if (!loadSnapshot(snapshotLsn)) {
+		loadPortfolios();
+	}
+	openJournal(snapshotLsn);
+	// Set up UDP sockets, one per receiving thread
+	LOG_INFO("[Server P] Booting up using UDP on port %s.\n", PORT_P);
+	vector<int> socks = setupWorkerSockets('P', PORT_P, workerCount());
+	sockfd = socks[0];
+	for (int i = 0; i < NUM_SHARDS; i++) {
+		thread(serveShard, &shards[i]).detach();
+	}
+	thread(commitJournal).detach();
+	for (size_t i = 1; i < socks.size(); i++) {
+		thread(receiveRequests, socks[i]).detach();
 	}
-	close(sockfd);
+	receiveRequests(sockfd);
 	return 0;
 }
@@ -1,40 +1,138 @@
-/* This file implements the quote server (Server Q) to manage and report stock price data. 
+/* This file implements the quote server (Server Q) to manage and report stock price data.
  * In the bootup phase, a list of stocks with their corresponding prices at different times is uploaded
- * to this server. Server Q is responsible for keeping a record of the current price for each stock. 
- * For every successful and unsuccessful "buy" and "sell" commands issued by the user, Server Q needs to 
- * update the current prices of stocks involved in those commands. 
+ * to this server. Server Q is responsible for keeping a record of the current price for each stock.
+ * For every successful and unsuccessful "buy" and "sell" commands issued by the user, Server Q needs to
+ * update the current prices of stocks involved in those commands.
+ *
+ * At load time every ticker is interned into a dense integer ID (its rank in alphabetical order), and the prices of
+ * each stock form a series with a cursor at the current one. Server M fetches the ticker directory once and then
+ * asks for prices by ID, which costs one array access per stock instead of string lookups.
+ *
+ * The series come from the price-history file quotes.hist (history.h) if there is one, and from quotes.txt otherwise.
+ * The history is mapped into memory and paged in as it is used, so it may hold years of ticks of thousands of stocks.
+ * By default a time shift moves a stock on to its next tick, as it moves on to the next price of quotes.txt, and a
+ * series starts over after its last price. With a history and HISTORY_SPEED=n, the history is replayed on a clock
+ * instead: a clock thread moves every stock to its tick current at n times the real time elapsed since bootup,
+ * counted from the earliest tick, and time shifts leave the series alone.
+ *
+ * Server M may subscribe to stocks. Whenever the price of a subscribed stock changes, Server Q pushes the
+ * new price to Server M, which forwards it to the clients watching that stock.
+ *
+ * The matching engine (Server E) reports the price of every limit order that trades. The last trade price is the
+ * current price of the stock until its next time shift moves it on to the next price of its list.
+ *
+ * The replay driver (replay.cpp) may feed recorded ticks of a market into this server, in batches by ticker ID.
+ * A replayed tick is the current price of its stock like a trade, except that time shifts no longer move the
+ * stock on: from its first replayed tick on, the recording drives its price, along with trades.
+ *
+ * Every current price is also published into the market-data segment (marketdata.h), a shared-memory object
+ * from which Server M reads prices on the same host without asking this server. With every price, the segment
+ * holds the number of time shifts applied to the stock, so that Server M can tell a price that does not reflect
+ * a time shift it has sent yet, and ask this server instead.
+ *
+ * With WORKERS=n, n worker threads receive and answer requests, each on a socket of its own (utility.h). They share
+ * the prices under a reader-writer lock: quotes and price lists are served concurrently, while time shifts, trades
+ * and subscriptions take the lock exclusively, which also keeps a single writer on the market-data segment.
  */
 
 #include "utility.h"
+#include "metrics.h"
+#include "logger.h"
+#include "marketdata.h"
+#include "history.h"
+#include <thread>
+#include <mutex>
+#include <pthread.h>
+#include <queue>
 using namespace std;
 
+#define SPEED_ENV "HISTORY_SPEED"
+#define CLOCK_SLEEP_MS 100 // longest the clock thread sleeps before it looks at the time again
+
+// Structure to contain the price series of a stock
+struct Series {
+	const int64_t* times;  // time (ms) of each tick in the history, or NULL for prices from quotes.txt
+	const double* prices;
+	uint64_t count;
+};
+
 // Global Variables
-map<string, vector<string>> quotes; // structure storing stock quotes
-unordered_map<string, int> timestamp; // structure storing current time stamps of all stocks
+vector<string> tickerNames;                // ticker of each ticker ID
+unordered_map<string, uint16_t> tickerIds; // ticker ID of each ticker
+History history;                           // the mapped price history, if there is one
+vector<double> quotePrices;                // prices from quotes.txt, into which their series point
+vector<Series> series;                     // price series of each ticker ID
+vector<uint64_t> cursor;                   // index of the current price of each ticker ID in its series
+double speed = 0;                          // multiple of real time at which the history is replayed, or 0 for time shifts
+vector<double> tradePrice;                 // price of the last trade or replayed tick of each ticker ID since its last time shift, or 0
+vector<bool> replayed;                     // whether the replay driver has fed a tick of each ticker ID
+vector<uint32_t> shifts;                   // number of time shifts applied to each ticker ID since bootup
+MdSegment* market = NULL;                  // the market-data segment, or NULL if it could not be set up
+uint32_t dirVersion;                       // version of the ticker directory, a hash of all tickers
+vector<bool> subscribed;                   // whether Server M has subscribed to each ticker ID
+Endpoint subscriberAddr;                   // socket address Server M subscribed from
+Metric stats[NUM_MSG_TYPES];               // count and service time of the requests of each type
+pthread_rwlock_t stateLock;                // guards the cursors, subscriptions and the market-data segment
+mutex statsLock;                           // guards stats
+
+// Holds the state lock, shared or exclusive, for as long as it lives
+struct StateGuard {
+	StateGuard(bool exclusive) {
+		if (exclusive) {
+			pthread_rwlock_wrlock(&stateLock);
+		}
+		else {
+			pthread_rwlock_rdlock(&stateLock);
+		}
+	}
+	~StateGuard() {
+		pthread_rwlock_unlock(&stateLock);
+	}
+};
 
-/* 
- * Load stock prices from the input "quotes.txt" to the global variable quotes. 
- * Set the time stamp of all stocks to 0, which represents the index of the current price 
- * among the price list of each stock.
+/*
+ * Give the next ticker ID to a stock, with its price series.
+ * @param ticker the stock, which must come after the stocks added so far in alphabetical order
+ * @param prices the price series
+ */
+void addTicker(const string& ticker, const Series& prices) {
+	tickerIds[ticker] = tickerNames.size();
+	tickerNames.push_back(ticker);
+	series.push_back(prices);
+	cursor.push_back(0);
+	tradePrice.push_back(0);
+	replayed.push_back(false);
+	shifts.push_back(0);
+	subscribed.push_back(false);
+	for (char c : ticker + "\n") {
+		dirVersion = (dirVersion ^ (unsigned char)c) * 16777619u;
+	}
+}
+
+/*
+ * Load stock prices from the input "quotes.txt" to the global variables.
+ * Tickers get their IDs in alphabetical order. Set the cursor of all stocks to 0,
+ * which represents the index of the current price among the price list of each stock.
  */
 void loadQuotes() {
-	string line, ticker, price;
-	
+	string line, ticker;
+	double price;
+	map<string, vector<double>> quotes; // sorts the stocks by ticker
+
 	ifstream file("quotes.txt");
 	if (file.is_open()) {
 		while (getline(file, line)) {
 			istringstream iss(line);
 			// Get the ticker of each stock
 			iss >> ticker;
-			// Get ten prices
-			vector<string> priceList;
+			// Get its prices
+			vector<double> priceList;
 			while (iss >> price) {
 				priceList.push_back(price);
 			}
-			
-			if (priceList.size() == 10) {
+
+			if (!priceList.empty()) {
 				quotes[ticker] = priceList;
-				timestamp[ticker] = 0;
 			}
 			else {
 				perror("Wrong number of prices");
@@ -47,117 +145,425 @@ void loadQuotes() {
 		exit(1);
 	}
 	file.close();
+
+	// Intern the tickers and flatten the prices
+	dirVersion = 2166136261u; // FNV-1a hash of the tickers
+	for (const auto& pair : quotes) {
+		quotePrices.insert(quotePrices.end(), pair.second.begin(), pair.second.end());
+	}
+	size_t first = 0;
+	for (const auto& pair : quotes) {
+		addTicker(pair.first, {NULL, &quotePrices[first], pair.second.size()});
+		first += pair.second.size();
+	}
 }
 
 /*
- * Get the quote of a specific stock. Return the availability of the queried stock in the database.
- * @param ticker the stock for which the user intends to get a quote
- * @param price the returned current price of this quoted stock
- * @return 1 if the queried stock exists in the database; otherwise, return 0
+ * Take the price series from the price-history file, if there is one. Only its directory is read here.
+ * @return false, if there is no history
  */
-int getQuote(const string& ticker, string& price) {
-	auto it = quotes.find(ticker);
-	if (it != quotes.end()) {
-		auto itTime = timestamp.find(ticker);
-		price = it->second[itTime->second];
-		return 1;
+bool loadHistory() {
+	if (!histOpen(HISTORY_FILE, history)) {
+		return false;
 	}
-	else {
-		return 0;
+	if (history.header->numTickers > UINT16_MAX) {
+		fprintf(stderr, "Server Q: %s has more stocks than ticker IDs\n", HISTORY_FILE);
+		exit(1);
+	}
+	dirVersion = 2166136261u; // FNV-1a hash of the tickers
+	for (uint32_t i = 0; i < history.header->numTickers; i++) {
+		const HistTicker& t = history.tickers[i];
+		addTicker(t.ticker, {history.times + t.first, history.prices + t.first, t.count});
 	}
+	LOG_INFO("[Server Q] Mapped %llu ticks of %u stocks from %s.\n",
+		(unsigned long long)history.header->numTicks, history.header->numTickers, HISTORY_FILE);
+	return true;
 }
 
-int main() {
-	int sockfd;
+/*
+ * Look up the ticker ID of a stock.
+ * @param ticker the stock
+ * @return the ticker ID, or -1 if the stock does not exist in the database
+ */
+int findTicker(const string& ticker) {
+	auto it = tickerIds.find(ticker);
+	return it == tickerIds.end() ? -1 : it->second;
+}
+
+/*
+ * Get the current price of a stock.
+ * @param id the ticker ID
+ * @return the current price
+ */
+double currentPrice(int id) {
+	if (tradePrice[id] > 0) {
+		return tradePrice[id];
+	}
+	return series[id].prices[cursor[id]];
+}
+
+/*
+ * Publish the current prices of all stocks into the market-data segment, along with the ticker directory.
+ */
+void publishMarketData() {
+	market = mdCreate();
+	if (market == NULL) {
+		return;
+	}
+	vector<double> current;
+	for (size_t id = 0; id < tickerNames.size(); id++) {
+		current.push_back(currentPrice(id));
+	}
+	if (!mdPublishDirectory(market, dirVersion, tickerNames, current)) {
+		LOG_ERROR("Server Q: the ticker directory does not fit into the market-data segment\n");
+		market = NULL;
+	}
+}
+
+/*
+ * Publish the current price of a stock into the market-data segment after it has changed.
+ * @param id the ticker ID
+ */
+void publishPrice(int id) {
+	if (market != NULL) {
+		mdPublish(market, id, currentPrice(id), shifts[id]);
+	}
+}
+
+/*
+ * Push the current price of a stock to Server M if it has subscribed to the stock.
+ * @param sockfd the UDP socket
+ * @param id the ticker ID
+ */
+void pushPrice(int sockfd, int id) {
+	if (!subscribed[id]) {
+		return;
+	}
+	MsgWriter update(MSG_PRICE_UPDATE, 0);
+	update.putSymbol(tickerNames[id]);
+	update.putF64(currentPrice(id));
+	if (sendTo(sockfd, update.bytes(), update.size, subscriberAddr) == -1) {
+		perror("Server Q: price update sendto");
+		return;
+	}
+	LOG_INFO("[Server Q] Pushed the new price of %s to the main server.\n", tickerNames[id].c_str());
+}
+
+/*
+ * Answer a stats request with the metrics of this server.
+ * @param sockfd the UDP socket
+ * @param addr the socket address of the requester
+ * @param reqId the request ID of the stats request
+ */
+void sendStats(int sockfd, const Endpoint& addr, uint32_t reqId) {
+	StateGuard state(false);
+	lock_guard<mutex> guard(statsLock);
+	size_t watched = count(subscribed.begin(), subscribed.end(), true);
+	string table = "[Server Q] " + to_string(tickerNames.size()) + " stocks, " + to_string(watched) + " subscribed\n" + metricHeader();
+	for (int type = 0; type < NUM_MSG_TYPES; type++) {
+		appendMetric(table, msgTypeName(type), stats[type]);
+	}
+	MsgWriter reply(MSG_STATS | MSG_REPLY, reqId);
+	reply.putText(table);
+	if (sendTo(sockfd, reply.bytes(), reply.size, addr) == -1) {
+		perror("Server Q: stats sendto");
+	}
+}
+
+/*
+ * Clock thread: replay the history at a multiple of real time. Every stock whose next tick has come is moved to the
+ * tick current now, which is published and pushed like a time shift.
+ * @param sockfd the UDP socket to push prices from
+ */
+void runClock(int sockfd) {
+	int64_t start = INT64_MAX; // time (ms) of the earliest tick, at which the replay starts
+	for (const Series& s : series) {
+		start = min(start, s.times[0]);
+	}
+	auto boot = chrono::steady_clock::now();
+	// Time of the next tick of every stock that has one, earliest first
+	priority_queue<pair<int64_t, uint16_t>, vector<pair<int64_t, uint16_t>>, greater<pair<int64_t, uint16_t>>> due;
+	for (size_t id = 0; id < series.size(); id++) {
+		if (series[id].count > 1) {
+			due.push(make_pair(series[id].times[1], id));
+		}
+	}
+	while (!due.empty()) {
+		double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - boot).count();
+		int64_t now = start + (int64_t)(elapsed * speed);
+		if (due.top().first > now) {
+			double wait = min((due.top().first - now) / speed, (double)CLOCK_SLEEP_MS);
+			this_thread::sleep_for(chrono::duration<double, milli>(wait));
+			continue;
+		}
+		StateGuard state(true);
+		while (!due.empty() && due.top().first <= now) {
+			uint16_t id = due.top().second;
+			due.pop();
+			const Series& s = series[id];
+			cursor[id] = histSeek(history, id, now);
+			tradePrice[id] = 0;
+			publishPrice(id);
+			pushPrice(sockfd, id);
+			if (cursor[id] + 1 < s.count) {
+				due.push(make_pair(s.times[cursor[id] + 1], id));
+			}
+		}
+	}
+	LOG_INFO("[Server Q] Reached the end of the history.\n");
+}
+
+/*
+ * Worker thread: receive requests from Server M and Server E on a socket and answer them.
+ * @param sockfd the socket of the worker
+ */
+void serveRequests(int sockfd) {
 	int numbytes;
 	char buf[MAXBUFSIZE];
-	string response;
-	struct sockaddr_in serverAddr; // socket address of Server M
-	socklen_t addrLen = sizeof(serverAddr);
-	
-	// Bootup
-	// Load input file
-	loadQuotes();
-	// Set up UDP socket
-	printf("[Server Q] Booting up using UDP on port %s.\n", PORT_Q);
-	sockfd = setupUDP('Q', PORT_Q);
-	
+	string ticker;
+	Endpoint serverAddr; // socket address of Server M
+
 	while (1) {
         // Receive a quote request from Server M
-		if ((numbytes = recvfrom(sockfd, buf, MAXBUFSIZE - 1, 0, (struct sockaddr*)&serverAddr, &addrLen)) == -1) {
+		if ((numbytes = recvFrom(sockfd, buf, MAXBUFSIZE - 1, serverAddr)) == -1) {
 			perror("Server Q: recvfrom");
 			continue;
 		}
-		buf[numbytes] = '\0';
-		
-     	// Parse the request
-		string quoteRequest(buf), transID, payload;
-		int colon = quoteRequest.find(':');
-		transID = quoteRequest.substr(0, colon);
-		payload = quoteRequest.substr(colon + 1);
+		long long received = nowUs();
+		MsgReader request(buf, numbytes);
+		if (!request.ok) {
+			continue;
+		}
+		if (request.type == MSG_STATS) { // for the metrics of this server, which takes the locks itself
+			sendStats(sockfd, serverAddr, request.reqId);
+			continue;
+		}
+		bool ok = true; // whether the request was served without a failure status
+		// Requests that change a price or a subscription take the state lock exclusively
+		StateGuard state(request.type == MSG_TIME_SHIFT || request.type == MSG_TRADE || request.type == MSG_TICKS
+			|| request.type == MSG_SUBSCRIBE || request.type == MSG_UNSUBSCRIBE);
 
      	// Send a response to Server M based on the request
-		response = "";
-        if (payload == "All_Stock") { // for a general quote request
-			printf("[Server Q] Received a quote request from the main server.\n");
-			response += transID + ":";
-			for (const auto& pair : quotes) {
-				response += pair.first + " " + pair.second[timestamp[pair.first]] + "\n";
-			}
-			if (sendto(sockfd, response.c_str(), response.length(), 0, (struct sockaddr*)&serverAddr, addrLen) == -1) {
+		if (request.type == MSG_PRICES_BY_ID) { // for prices by ticker ID
+			uint32_t version = request.getU32();
+			uint16_t n = request.getU16();
+			ok = version == dirVersion;
+			MsgWriter priceList(MSG_PRICES_BY_ID | MSG_REPLY, request.reqId, ok ? ST_OK : ST_STALE_DIRECTORY);
+			if (version == dirVersion) {
+				priceList.putU16(n);
+				for (uint16_t i = 0; i < n; i++) {
+					uint16_t id = request.getU16();
+					priceList.putF64(id < tickerNames.size() ? currentPrice(id) : 0);
+				}
+			}
+			if (sendTo(sockfd, priceList.bytes(), priceList.size, serverAddr) == -1) {
+				perror("Server Q: price list sendto");
+				continue;
+			}
+		}
+        else if (request.type == MSG_QUOTE_ALL) { // for a general quote request
+			LOG_INFO("[Server Q] Received a quote request from the main server.\n");
+			MsgWriter response(MSG_QUOTE_ALL | MSG_REPLY, request.reqId);
+			response.putU16(tickerNames.size());
+			for (size_t id = 0; id < tickerNames.size(); id++) {
+				response.putSymbol(tickerNames[id]);
+				response.putF64(currentPrice(id));
+			}
+			if (!response.ok) { // a truncated list would still claim every stock
+				LOG_ERROR("Server Q: the quotes of %zu stocks do not fit into one message\n", tickerNames.size());
+				response = MsgWriter(MSG_QUOTE_ALL | MSG_REPLY, request.reqId, ST_TOO_LARGE);
+			}
+			if (sendTo(sockfd, response.bytes(), response.size, serverAddr) == -1) {
 				perror("Server Q: sendto");
 				continue;
 			}
-			printf("[Server Q] Returned all stock quotes.\n");
+			LOG_INFO("[Server Q] Returned all stock quotes.\n");
         }
-        else if (payload[0] == '+') { // for a time shift request
-			string ticker = payload.substr(1);
-			string price;
-			auto it = quotes.find(ticker);
-			if (it != quotes.end()) {
-				int time = timestamp[ticker];
-				timestamp[ticker] = (time + 1) % 10;
-				price = it->second[timestamp[ticker]];
-				printf("[Server Q] Received a time forward request for %s,"
-						" the current price of that stock is %s at time %d.\n", ticker.c_str(), price.c_str(), timestamp[ticker]);
+        else if (request.type == MSG_TIME_SHIFT) { // for a time shift request
+			request.getSymbol(ticker);
+			int id = findTicker(ticker);
+			if (id != -1) {
+				if (!replayed[id]) {
+					if (speed == 0) {
+						cursor[id] = (cursor[id] + 1) % series[id].count;
+					}
+					tradePrice[id] = 0;
+				}
+				shifts[id]++;
+				publishPrice(id);
+				if (market != NULL) {
+					mdCountTimeShift(market);
+				}
+				LOG_INFO("[Server Q] Received a time forward request for %s,"
+						" the current price of that stock is %.2f at time %llu.\n", ticker.c_str(), currentPrice(id),
+						(unsigned long long)cursor[id]);
+				pushPrice(sockfd, id);
 			}
 			else {
 				perror("Stock name does not exist.");
-				continue;
+				ok = false;
 			}
         }
-		else if (payload[0] == 'p') { // for a position request
+		else if (request.type == MSG_DIRECTORY) { // for a page of the ticker directory
+			// Send the tickers from the requested ID on, as many as fit into one message
+			size_t first = min((size_t)request.getU16(), tickerNames.size());
+			size_t n = 0;
+			size_t size = MSG_HEADER_SIZE + 10;
+			while (first + n < tickerNames.size() && size + 1 + tickerNames[first + n].size() <= MAXBUFSIZE) {
+				size += 1 + tickerNames[first + n].size();
+				n++;
+			}
+			MsgWriter directory(MSG_DIRECTORY | MSG_REPLY, request.reqId);
+			directory.putU32(dirVersion);
+			directory.putU16(tickerNames.size());
+			directory.putU16(first);
+			directory.putU16(n);
+			for (size_t id = first; id < first + n; id++) {
+				directory.putSymbol(tickerNames[id]);
+			}
+			if (sendTo(sockfd, directory.bytes(), directory.size, serverAddr) == -1) {
+				perror("Server Q: directory sendto");
+				continue;
+			}
+		}
+		else if (request.type == MSG_PRICES) { // for a position request by ticker
 			// Read in a list of stock tickers and send a list of the current prices of those stocks back to Server M
-			istringstream tickerList(payload.substr(1));
-			string ticker, price;
-			string priceList = transID + ":";
-			while (tickerList >> ticker) {
-				priceList += quotes[ticker][timestamp[ticker]] + " ";
+			uint16_t n = request.getU16();
+			MsgWriter priceList(MSG_PRICES | MSG_REPLY, request.reqId);
+			priceList.putU16(n);
+			for (uint16_t i = 0; i < n; i++) {
+				request.getSymbol(ticker);
+				int id = findTicker(ticker);
+				priceList.putF64(id != -1 ? currentPrice(id) : 0);
+			}
+			if (!priceList.ok) { // a truncated list would price the missing stocks at 0
+				LOG_ERROR("Server Q: the prices of %u stocks do not fit into one message\n", (unsigned)n);
+				priceList = MsgWriter(MSG_PRICES | MSG_REPLY, request.reqId, ST_TOO_LARGE);
 			}
-			if (sendto(sockfd, priceList.c_str(), priceList.length(), 0, (struct sockaddr*)&serverAddr, addrLen) == -1) {
+			if (sendTo(sockfd, priceList.bytes(), priceList.size, serverAddr) == -1) {
 				perror("Server Q: price list sendto");
 				continue;
 			}
 		}
-        else { // for a specific quote request
-			string ticker = payload;
-			string price;
-			printf("[Server Q] Received a quote request from the main server for stock %s.\n", ticker.c_str());
-			response += transID + ":";
-			if (getQuote(ticker, price)) {
-				response += ticker + " " + price;
-			}
-			else {
-				response += "NOT_EXIST";
+        else if (request.type == MSG_QUOTE) { // for a specific quote request by ticker
+			request.getSymbol(ticker);
+			LOG_INFO("[Server Q] Received a quote request from the main server for stock %s.\n", ticker.c_str());
+			int id = findTicker(ticker);
+			ok = id != -1;
+			MsgWriter response(MSG_QUOTE | MSG_REPLY, request.reqId, id != -1 ? ST_OK : ST_NOT_EXIST);
+			response.putU16(id != -1 ? 1 : 0);
+			if (id != -1) {
+				response.putSymbol(ticker);
+				response.putF64(currentPrice(id));
 			}
-			if (sendto(sockfd, response.c_str(), response.length(), 0, (struct sockaddr*)&serverAddr, addrLen) == -1) {
+			if (sendTo(sockfd, response.bytes(), response.size, serverAddr) == -1) {
 				perror("Server Q: sendto");
 				continue;
 			}
-			printf("[Server Q] Returned the stock quote of %s.\n", ticker.c_str());
+			LOG_INFO("[Server Q] Returned the stock quote of %s.\n", ticker.c_str());
         }
+		else if (request.type == MSG_SUBSCRIBE) { // for a subscription to a stock's price changes
+			request.getSymbol(ticker);
+			LOG_INFO("[Server Q] Received a subscription request from the main server for stock %s.\n", ticker.c_str());
+			int id = findTicker(ticker);
+			ok = id != -1;
+			// Reply with the current price, from which on Server M follows the changes
+			MsgWriter response(MSG_SUBSCRIBE | MSG_REPLY, request.reqId, id != -1 ? ST_OK : ST_NOT_EXIST);
+			response.putU16(id != -1 ? 1 : 0);
+			if (id != -1) {
+				response.putF64(currentPrice(id));
+				subscribed[id] = true;
+				subscriberAddr = serverAddr;
+			}
+			if (sendTo(sockfd, response.bytes(), response.size, serverAddr) == -1) {
+				perror("Server Q: sendto");
+				continue;
+			}
+		}
+		else if (request.type == MSG_UNSUBSCRIBE) { // when no client watches a stock any more
+			request.getSymbol(ticker);
+			int id = findTicker(ticker);
+			if (id != -1) {
+				subscribed[id] = false;
+				LOG_INFO("[Server Q] Stopped pushing the price of %s.\n", ticker.c_str());
+			}
+		}
+		else if (request.type == MSG_TRADE) { // for the price of a trade on the matching engine
+			request.getSymbol(ticker);
+			double price = request.getF64();
+			int id = findTicker(ticker);
+			ok = request.ok && id != -1 && price > 0;
+			if (ok) {
+				tradePrice[id] = price;
+				publishPrice(id);
+				LOG_INFO("[Server Q] Received a trade of %s at %.2f from the matching engine.\n", ticker.c_str(), price);
+				pushPrice(sockfd, id);
+			}
+		}
+		else if (request.type == MSG_TICKS) { // for a batch of recorded ticks from the replay driver
+			uint32_t version = request.getU32();
+			uint16_t n = request.getU16();
+			ok = version == dirVersion;
+			uint16_t applied = 0;
+			for (uint16_t i = 0; ok && i < n; i++) {
+				uint16_t id = request.getU16();
+				double price = request.getF64();
+				if (request.ok && id < tickerNames.size() && price > 0) {
+					tradePrice[id] = price;
+					replayed[id] = true;
+					publishPrice(id);
+					pushPrice(sockfd, id);
+					applied++;
+				}
+			}
+			// The reply paces the driver, which sends its next batch once this one is applied
+			MsgWriter response(MSG_TICKS | MSG_REPLY, request.reqId, ok ? ST_OK : ST_STALE_DIRECTORY);
+			if (ok) {
+				response.putU16(applied);
+			}
+			LOG_DEBUG("[Server Q] Applied %u replayed ticks.\n", (unsigned)applied);
+			if (sendTo(sockfd, response.bytes(), response.size, serverAddr) == -1) {
+				perror("Server Q: ticks sendto");
+				continue;
+			}
+		}
+		if (request.type < NUM_MSG_TYPES) {
+			lock_guard<mutex> guard(statsLock);
+			stats[request.type].record(nowUs() - received, ok);
+		}
 	}
 
-	close(sockfd);
+}
+
+int main() {
+	// Bootup
+	startLogger();
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	// Quotes far outnumber time shifts; without this, a steady flow of them would keep the shifts waiting
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&stateLock, &attr);
+	// Load input file
+	bool replay = false;
+	if (loadHistory()) {
+		const char* speedEnv = getenv(SPEED_ENV);
+		speed = speedEnv != NULL ? max(atof(speedEnv), 0.0) : 0;
+		replay = speed > 0 && !series.empty();
+	}
+	else {
+		loadQuotes();
+	}
+	publishMarketData();
+	// Set up UDP sockets, one per worker thread
+	LOG_INFO("[Server Q] Booting up using UDP on port %s.\n", PORT_Q);
+	vector<int> socks = setupWorkerSockets('Q', PORT_Q, workerCount());
+	for (size_t i = 1; i < socks.size(); i++) {
+		thread(serveRequests, socks[i]).detach();
+	}
+	if (replay) {
+		LOG_INFO("[Server Q] Replaying the history at %g times real time.\n", speed);
+		thread(runClock, socks[0]).detach();
+	}
+	serveRequests(socks[0]);
 	return 0;
 }
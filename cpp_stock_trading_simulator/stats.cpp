@@ -0,0 +1,89 @@
+/* This file implements the stats query, which asks the servers for their metrics on their datagram sockets and prints them.
+ * It uses the transport set by the environment variable TRANSPORT, like the servers.
+ * Every server answers a MSG_STATS request with a table of the requests it has served: their counts, failures,
+ * timeouts and retransmissions, and the mean and percentiles of their latency, along with its queue depths.
+ *
+ * Usage: ./stats [M] [A] [P] [Q] [E]   (all five servers if none is given)
+ */
+
+#include "utility.h"
+using namespace std;
+
+#define STATS_TIMEOUT_MS 1000 // time to wait for each server's answer
+
+/*
+ * Ask one server for its metrics and print them.
+ * @param sockfd the UDP socket
+ * @param name the letter of the server
+ * @param portNum the UDP port of the server
+ * @return 0 if the server answered, -1 otherwise
+ */
+int queryServer(int sockfd, char name, const char* portNum) {
+	Endpoint addr = serverEndpoint(portNum);
+
+	uint32_t reqId = (uint32_t)time(NULL) ^ name;
+	MsgWriter request(MSG_STATS, reqId);
+	if (sendTo(sockfd, request.bytes(), request.size, addr) == -1) {
+		perror("Stats: sendto");
+		return -1;
+	}
+
+	// Wait for the answer, skipping anything else that arrives
+	char buf[MAXBUFSIZE];
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(STATS_TIMEOUT_MS);
+	while (1) {
+		long long left = chrono::duration_cast<chrono::microseconds>(deadline - chrono::steady_clock::now()).count();
+		if (left <= 0) {
+			break;
+		}
+		struct timeval tv = {(time_t)(left / 1000000), (suseconds_t)(left % 1000000)};
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(sockfd, &readfds);
+		if (select(sockfd + 1, &readfds, NULL, NULL, &tv) <= 0) {
+			break;
+		}
+		int numbytes = recv(sockfd, buf, MAXBUFSIZE, 0);
+		if (numbytes == -1) {
+			perror("Stats: recv");
+			return -1;
+		}
+		MsgReader reply(buf, numbytes);
+		if (reply.ok && reply.type == (MSG_STATS | MSG_REPLY) && reply.reqId == reqId) {
+			string table;
+			reply.getText(table);
+			printf("%s\n", table.c_str());
+			return 0;
+		}
+	}
+	printf("[Server %c] No answer on port %s.\n\n", name, portNum);
+	return -1;
+}
+
+int main(int argc, char** argv) {
+	string which = "MAPQE";
+	if (argc > 1) {
+		which = "";
+		for (int i = 1; i < argc; i++) {
+			which += toupper(argv[i][0]);
+		}
+	}
+	if (which.find_first_not_of("MAPQE") != string::npos) {
+		fprintf(stderr, "Usage: %s [M] [A] [P] [Q] [E]\n", argv[0]);
+		exit(1);
+	}
+
+	int sockfd = setupDatagram('S', NULL);
+	int failed = 0;
+	for (char name : which) {
+		switch (name) {
+		case 'M': failed |= queryServer(sockfd, 'M', PORT_M_UDP); break;
+		case 'A': failed |= queryServer(sockfd, 'A', PORT_A); break;
+		case 'P': failed |= queryServer(sockfd, 'P', PORT_P); break;
+		case 'Q': failed |= queryServer(sockfd, 'Q', PORT_Q); break;
+		case 'E': failed |= queryServer(sockfd, 'E', PORT_E); break;
+		}
+	}
+	close(sockfd);
+	return failed ? 1 : 0;
+}
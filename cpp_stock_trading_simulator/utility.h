@@ -11,19 +11,32 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h> 
+#include <sys/un.h>
+#include <linux/filter.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <cctype>
 #include <unordered_map>
 #include <map>
 #include <vector>
+#include <deque>
+#include <set>
+#include <chrono>
+#include <algorithm>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
 using namespace std;
 
 #define STDIN 0
@@ -33,22 +46,405 @@ using namespace std;
 #define PORT_Q "43710"
 #define PORT_M_UDP "44710"
 #define PORT_M_TCP "45710"
+#define PORT_E "46710"
 
 #define LOCALHOST "127.0.0.1"
 
+/* Transport between Server M and the backend servers. UDP over loopback by default; with the environment variable
+ * TRANSPORT=unix, every server binds a Unix-domain datagram socket in the abstract namespace instead, named after
+ * its port number, which skips the IP stack and makes a full receive queue block or fail the sender instead of
+ * dropping the datagram. All servers and tools must be started with the same setting. */
+#define TRANSPORT_ENV "TRANSPORT"
+#define UNIX_NAME_PREFIX "stock_trading."  // abstract socket name of a server is this prefix and its port number
+
+/* Worker threads of the backend servers A, P and Q. With the environment variable WORKERS=n, such a server receives
+ * and serves requests on n threads instead of one; see setupWorkerSockets. */
+#define WORKERS_ENV "WORKERS"
+#define MAX_WORKERS 16
+
 #define MAXBUFSIZE 8196
 #define BACKLOG 10 // number of pending connections at TCP server side 
+#define TIMEOUT_MSG "TIMEOUT" // sent to a client when a backend server did not answer its request
+#define BUSY_MSG "BUSY" // sent to a client when Server M refuses a new request under load
+#define PUSH_ID 0 // request ID of the price updates Server M pushes to subscribed clients
+
+/* Framing of the TCP link between clients and Server M.
+ * Every message is a frame: u32 payload length, u32 request ID (both big-endian), then the text payload.
+ * A client tags each request with its own request ID, and every message belonging to that request,
+ * in either direction, carries the same ID. This lets a client have several requests outstanding at once.
+ * Clients never use PUSH_ID for a request, as Server M uses it for messages no request asked for.
+ */
+#define FRAME_HEADER_SIZE 8
+#define MAX_FRAME_SIZE (1 << 20) // larger frames are treated as a protocol error
 
 /*
- * This function is cited from Beej's Guide to Network Programming.
- * Handle dead processes.
+ * Encode a frame.
+ * @param id the request ID
+ * @param payload the message
+ * @return the frame
+ */
+string encodeFrame(uint32_t id, const string& payload) {
+	string frame(FRAME_HEADER_SIZE, '\0');
+	uint32_t len = payload.length();
+	for (int i = 0; i < 4; i++) {
+		frame[i] = (char)(len >> (24 - 8 * i));
+		frame[4 + i] = (char)(id >> (24 - 8 * i));
+	}
+	return frame + payload;
+}
+
+/*
+ * Decode the frame starting at a given position of a receive buffer, if it has arrived completely.
+ * @param buf the bytes received so far
+ * @param pos the position of the frame; advanced past it if it is complete
+ * @param id the returned request ID
+ * @param payload the returned message, a view into buf
+ * @return 1 if a frame was decoded, 0 if it is incomplete, -1 if it is malformed
+ */
+int decodeFrame(string_view buf, size_t& pos, uint32_t& id, string_view& payload) {
+	if (buf.length() - pos < FRAME_HEADER_SIZE) {
+		return 0;
+	}
+	const unsigned char* h = (const unsigned char*)buf.data() + pos;
+	uint32_t len = ((uint32_t)h[0] << 24) | ((uint32_t)h[1] << 16) | ((uint32_t)h[2] << 8) | h[3];
+	if (len > MAX_FRAME_SIZE) {
+		return -1;
+	}
+	if (buf.length() - pos < FRAME_HEADER_SIZE + len) {
+		return 0;
+	}
+	id = ((uint32_t)h[4] << 24) | ((uint32_t)h[5] << 16) | ((uint32_t)h[6] << 8) | h[7];
+	payload = buf.substr(pos + FRAME_HEADER_SIZE, len);
+	pos += FRAME_HEADER_SIZE + len;
+	return 1;
+}
+
+/*
+ * Send a frame over a blocking TCP socket.
+ * @param sockfd the TCP socket
+ * @param id the request ID
+ * @param payload the message
+ * @return 0 on success, -1 on error
+ */
+int sendFrame(int sockfd, uint32_t id, const string& payload) {
+	string frame = encodeFrame(id, payload);
+	size_t sent = 0;
+	while (sent < frame.length()) {
+		ssize_t n = send(sockfd, frame.data() + sent, frame.length() - sent, MSG_NOSIGNAL);
+		if (n == -1) {
+			return -1;
+		}
+		sent += n;
+	}
+	return 0;
+}
+
+/*
+ * Receive exactly the given number of bytes from a blocking TCP socket.
+ * @param sockfd the TCP socket
+ * @param dest the buffer to fill
+ * @param len the number of bytes to receive
+ * @return 0 on success, -1 on error or if the connection was closed
+ */
+int recvAll(int sockfd, char* dest, size_t len) {
+	size_t got = 0;
+	while (got < len) {
+		ssize_t n = recv(sockfd, dest + got, len - got, 0);
+		if (n <= 0) {
+			return -1;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+/*
+ * Receive one frame from a blocking TCP socket.
+ * @param sockfd the TCP socket
+ * @param id the returned request ID
+ * @param payload the returned message
+ * @return 0 on success, -1 on error or if the connection was closed
+ */
+int recvFrame(int sockfd, uint32_t& id, string& payload) {
+	string header(FRAME_HEADER_SIZE, '\0');
+	if (recvAll(sockfd, &header[0], FRAME_HEADER_SIZE) == -1) {
+		return -1;
+	}
+	size_t pos = 0;
+	uint32_t len = ((uint32_t)(unsigned char)header[0] << 24) | ((uint32_t)(unsigned char)header[1] << 16)
+		| ((uint32_t)(unsigned char)header[2] << 8) | (unsigned char)header[3];
+	if (len > MAX_FRAME_SIZE) {
+		return -1;
+	}
+	header.resize(FRAME_HEADER_SIZE + len);
+	if (len > 0 && recvAll(sockfd, &header[FRAME_HEADER_SIZE], len) == -1) {
+		return -1;
+	}
+	string_view view;
+	if (decodeFrame(header, pos, id, view) != 1) {
+		return -1;
+	}
+	payload.assign(view);
+	return 0;
+}
+
+/* Binary protocol between Server M and the backend servers.
+ * Every message is an 8-byte header (u8 type, u8 status, u16 body length, u32 request ID) followed by the body.
+ * Integers are big-endian, doubles are sent as the big-endian bits of their IEEE 754 representation,
+ * and symbols (usernames, passwords, tickers) are a u8 length followed by the characters.
+ * A reply has the type of its request with MSG_REPLY set, and echoes the request ID.
+ */
+#define MSG_HEADER_SIZE 8
+#define MSG_REPLY 0x80
+
+// Message types, with the body of each request and of its reply
+enum MsgType {
+	MSG_AUTH = 1,     // M→A: uname, encrypted password                   reply: status ST_OK or ST_AUTH_FAILED
+	MSG_QUOTE_ALL,    // M→Q: empty                                        reply: u16 n, n × (ticker, f64 price), or status ST_TOO_LARGE
+	MSG_QUOTE,        // M→Q: ticker                                       reply: u16 n, n × (ticker, f64 price), or status ST_NOT_EXIST
+	MSG_TIME_SHIFT,   // M→Q: ticker                                       no reply
+	MSG_PRICES,       // M→Q: u16 n, n × ticker                            reply: u16 n, n × f64 price, or status ST_TOO_LARGE
+	MSG_BUY,          // M→P: uname, ticker, i32 shares, f64 price         reply: status ST_OK
+	MSG_SELL,         // M→P: uname, ticker, i32 shares                    reply: status ST_OK or ST_NOT_SUFF
+	MSG_SELL_CONFIRM, // M→P: uname, sent with the ID of the MSG_SELL      reply: status ST_OK or ST_EXPIRED
+	MSG_SELL_DENY,    // M→P: uname, sent with the ID of the MSG_SELL      no reply
+	MSG_POSITION,     // M→P: uname, i32 pid of Server Q, u32 time shifts sent to it
+	                  //      reply: u16 n, n × (ticker, i32 shares, f64 avg price), u8 priced, f64 profit (if priced)
+	MSG_DIRECTORY,    // M→Q: u16 first ticker ID
+	                  //      reply: u32 version, u16 total, u16 first, u16 n, n × ticker (the tickers with IDs first, first + 1, ...)
+	MSG_PRICES_BY_ID, // M→Q: u32 version, u16 n, n × u16 ticker ID        reply: u16 n, n × f64 price, or status ST_STALE_DIRECTORY
+	MSG_SUBSCRIBE,    // M→Q: ticker                                       reply: u16 n, n × f64 price, or status ST_NOT_EXIST
+	MSG_UNSUBSCRIBE,  // M→Q: ticker                                       no reply
+	MSG_PRICE_UPDATE, // Q→M: ticker, f64 price, pushed with request ID 0  no reply
+	MSG_AUTH_INVALIDATE, // A→M: empty, sent with request ID 0 whenever Server A loads its credentials  no reply
+	MSG_STATS,        // any→M/A/P/Q/E: empty                              reply: text, the server's metrics
+	MSG_LIMIT,        // M→E: uname, ticker, u8 side, i32 shares, f64 limit price, u32 reservation ID (0 for a buy)
+	                  //      reply: u32 order ID, i32 shares filled, f64 avg fill price, i32 shares resting; or status ST_NOT_EXIST
+	MSG_CANCEL,       // M→E: uname, u32 order ID                          reply: i32 shares cancelled, or status ST_NOT_EXIST
+	MSG_RESERVE,      // M→P: uname, ticker, i32 shares; the request ID is the reservation ID  reply: status ST_OK or ST_NOT_SUFF
+	MSG_FILL,         // E→P: uname, ticker, u8 side, i32 shares, f64 price, u32 reservation ID (0 for a buy),
+	                  //      u32 engine epoch, u32 fill sequence number, u32 lowest sequence number not acknowledged
+	                  //      reply: status ST_OK, or ST_NOT_SUFF if the reservation of a sell does not hold the shares
+	MSG_RELEASE,      // E→P, M→P: uname, u32 reservation ID               reply: status ST_OK
+	MSG_TRADE,        // E→Q: ticker, f64 price of the last fill           no reply
+	MSG_TICKS,        // R→Q: u32 version, u16 n, n × (u16 ticker ID, f64 price), from the replay driver
+	                  //      reply: u16 n applied, or status ST_STALE_DIRECTORY
+	MSG_RESTED,       // E→P: uname, u32 reservation ID, u32 engine epoch, once the rest of a limit sell rests on the book
+	                  //      reply: status ST_OK, or ST_NOT_EXIST if the reservation is gone
+	MSG_ENGINE_START, // E→P: u32 engine epoch, when Server E starts with empty books  reply: status ST_OK
+	NUM_MSG_TYPES
+};
+
+// Side of a limit order or a fill
+enum Side {
+	SIDE_BUY = 0,
+	SIDE_SELL
+};
+
+/*
+ * Get the name of a message type, for logs and metrics.
+ * @param type the message type, with or without MSG_REPLY
+ * @return the name
  */
-void sigchld_handler(int s) {
-    int saved_errno = errno;
-    while (waitpid(-1, NULL, WNOHANG) > 0);
-    errno = saved_errno;
+const char* msgTypeName(uint8_t type) {
+	static const char* names[NUM_MSG_TYPES] = {"?", "auth", "quote all", "quote", "time shift", "prices", "buy", "sell",
+		"sell confirm", "sell deny", "position", "directory", "prices by id", "subscribe", "unsubscribe", "price update",
+		"auth invalidate", "stats", "limit", "cancel", "reserve", "fill", "release", "trade", "ticks", "rested",
+		"engine start"};
+	type &= ~MSG_REPLY;
+	return type < NUM_MSG_TYPES ? names[type] : "?";
 }
 
+// Status codes carried in the header of a reply
+enum MsgStatus {
+	ST_OK = 0,
+	ST_AUTH_FAILED,
+	ST_NOT_EXIST,
+	ST_NOT_SUFF,
+	ST_STALE_DIRECTORY, // the request used ticker IDs from another version of the directory
+	ST_EXPIRED,         // the shares of a sale were released before its confirmation arrived
+	ST_TOO_LARGE        // the reply does not fit into one message
+};
+
+// Structure to encode a message into a fixed buffer
+struct MsgWriter {
+	unsigned char data[MAXBUFSIZE];
+	size_t size;
+	bool ok; // false once a field did not fit into the buffer
+
+	MsgWriter(uint8_t type, uint32_t reqId, uint8_t status = ST_OK) : size(MSG_HEADER_SIZE), ok(true) {
+		data[0] = type;
+		data[1] = status;
+		setReqId(reqId);
+		setBodyLen();
+	}
+	void setReqId(uint32_t reqId) {
+		for (int i = 0; i < 4; i++) {
+			data[4 + i] = (unsigned char)(reqId >> (24 - 8 * i));
+		}
+	}
+	void putU8(uint8_t v) {
+		if (size + 1 > sizeof data) {
+			ok = false;
+			return;
+		}
+		data[size++] = v;
+		setBodyLen();
+	}
+	void putU16(uint16_t v) {
+		putU8(v >> 8);
+		putU8(v);
+	}
+	void putU32(uint32_t v) {
+		putU16(v >> 16);
+		putU16(v);
+	}
+	void putI32(int32_t v) {
+		putU32((uint32_t)v);
+	}
+	void putF64(double v) {
+		uint64_t bits;
+		memcpy(&bits, &v, sizeof bits);
+		putU32(bits >> 32);
+		putU32(bits);
+	}
+	void putSymbol(string_view sym) {
+		size_t len = min(sym.length(), (size_t)255);
+		if (size + 1 + len > sizeof data) {
+			ok = false;
+			return;
+		}
+		data[size++] = len;
+		memcpy(data + size, sym.data(), len);
+		size += len;
+		setBodyLen();
+	}
+	void putText(const string& text) { // the rest of the body
+		if (size + text.length() > sizeof data) {
+			ok = false;
+			return;
+		}
+		memcpy(data + size, text.data(), text.length());
+		size += text.length();
+		setBodyLen();
+	}
+	const char* bytes() const {
+		return (const char*)data;
+	}
+	uint8_t type() const {
+		return data[0];
+	}
+	uint8_t status() const {
+		return data[1];
+	}
+	uint32_t reqId() const {
+		return ((uint32_t)data[4] << 24) | ((uint32_t)data[5] << 16) | ((uint32_t)data[6] << 8) | data[7];
+	}
+
+private:
+	void setBodyLen() {
+		data[2] = (unsigned char)((size - MSG_HEADER_SIZE) >> 8);
+		data[3] = (unsigned char)(size - MSG_HEADER_SIZE);
+	}
+};
+
+// Structure to decode a received message; every getter returns 0 or an empty symbol once the message runs out
+struct MsgReader {
+	const unsigned char* data;
+	size_t size, pos;
+	bool ok;         // false if the message is malformed or a field ran past its end
+	uint8_t type, status;
+	uint32_t reqId;
+
+	MsgReader(const char* buf, size_t n) : data((const unsigned char*)buf), size(n), pos(0), ok(true) {
+		type = getU8();
+		status = getU8();
+		uint16_t bodyLen = getU16();
+		reqId = getU32();
+		if (ok && (size_t)MSG_HEADER_SIZE + bodyLen != n) {
+			ok = false;
+		}
+	}
+	uint8_t getU8() {
+		if (pos + 1 > size) {
+			ok = false;
+			return 0;
+		}
+		return data[pos++];
+	}
+	uint16_t getU16() {
+		uint16_t hi = getU8();
+		return (hi << 8) | getU8();
+	}
+	uint32_t getU32() {
+		uint32_t hi = getU16();
+		return (hi << 16) | getU16();
+	}
+	int32_t getI32() {
+		return (int32_t)getU32();
+	}
+	double getF64() {
+		uint64_t hi = getU32();
+		uint64_t bits = (hi << 32) | getU32();
+		double v;
+		memcpy(&v, &bits, sizeof v);
+		return v;
+	}
+	string_view getSymbol() { // a view into the received message
+		size_t len = getU8();
+		if (pos + len > size) {
+			ok = false;
+			len = 0;
+		}
+		string_view sym((const char*)data + pos, len);
+		pos += len;
+		return sym;
+	}
+	void getSymbol(string& sym) {
+		sym.assign(getSymbol());
+	}
+	void getText(string& text) { // the rest of the body
+		text.assign((const char*)data + pos, size - pos);
+		pos = size;
+	}
+};
+
+// Structure to split a text message from a client into fields in place, without copying it; every getter returns 0
+// or an empty field once the message runs out
+struct TextReader {
+	string_view rest; // the part of the message not read yet
+	bool ok;          // false if a number could not be parsed
+
+	TextReader(string_view text) : rest(text), ok(true) {}
+	string_view getField(char delim) { // up to the next delimiter, which is skipped, or the end
+		size_t end = rest.find(delim);
+		string_view field = rest.substr(0, end);
+		rest.remove_prefix(end == string_view::npos ? rest.length() : end + 1);
+		return field;
+	}
+	int getInt(char delim) {
+		return getNumber<int>(delim);
+	}
+	uint32_t getU32(char delim) {
+		return getNumber<uint32_t>(delim);
+	}
+	double getDouble(char delim) {
+		return getNumber<double>(delim);
+	}
+
+private:
+	// A field that starts with a number but has more after it counts as the number, as with atoi
+	template<typename T> T getNumber(char delim) {
+		string_view field = getField(delim);
+		T v = 0;
+		if (from_chars(field.data(), field.data() + field.length(), v).ec != errc()) {
+			ok = false;
+			v = 0;
+		}
+		return v;
+	}
+};
+
 /* 
  * This function is cited from Beej's Guide to Network Programming.
  * Set up the UDP socket for either Server M or one of the three backend servers.
@@ -102,3 +498,193 @@ int setupUDP(char serverName, const char* portNum) {
 	return sockfd;
 }
 
+// Structure to contain the socket address of a server, or of the sender of a message, on either transport
+struct Endpoint {
+	struct sockaddr_storage addr;
+	socklen_t len;
+
+	Endpoint() : len(sizeof addr) {
+		memset(&addr, 0, sizeof addr);
+	}
+	struct sockaddr* sa() {
+		return (struct sockaddr*)&addr;
+	}
+	const struct sockaddr* sa() const {
+		return (const struct sockaddr*)&addr;
+	}
+};
+
+/*
+ * Tell whether the servers talk over Unix-domain datagram sockets, as set by the environment variable TRANSPORT.
+ * @return true for TRANSPORT=unix, false for UDP
+ */
+bool unixTransport() {
+	static int useUnix = -1;
+	if (useUnix == -1) {
+		const char* transport = getenv(TRANSPORT_ENV);
+		useUnix = transport != NULL && strcmp(transport, "unix") == 0;
+	}
+	return useUnix == 1;
+}
+
+/*
+ * Get the socket address of a server on the configured transport.
+ * @param portNum the macro static port number of the server
+ * @return the socket address
+ */
+Endpoint serverEndpoint(const char* portNum) {
+	Endpoint ep;
+	if (unixTransport()) {
+		struct sockaddr_un* un = (struct sockaddr_un*)&ep.addr;
+		un->sun_family = AF_UNIX;
+		// A leading NUL puts the name into the abstract namespace, which leaves no file behind
+		string name = string(UNIX_NAME_PREFIX) + portNum;
+		memcpy(un->sun_path + 1, name.data(), name.length());
+		ep.len = offsetof(struct sockaddr_un, sun_path) + 1 + name.length();
+	}
+	else {
+		struct sockaddr_in* in = (struct sockaddr_in*)&ep.addr;
+		in->sin_family = AF_INET;
+		in->sin_port = htons(atoi(portNum));
+		in->sin_addr.s_addr = inet_addr(LOCALHOST);
+		ep.len = sizeof(struct sockaddr_in);
+	}
+	return ep;
+}
+
+/*
+ * Tell whether two socket addresses are the same.
+ * @param a a socket address
+ * @param b another socket address
+ * @return true, if they are
+ */
+bool sameEndpoint(const Endpoint& a, const Endpoint& b) {
+	if (a.addr.ss_family != b.addr.ss_family) {
+		return false;
+	}
+	if (a.addr.ss_family == AF_INET) {
+		const struct sockaddr_in* x = (const struct sockaddr_in*)&a.addr;
+		const struct sockaddr_in* y = (const struct sockaddr_in*)&b.addr;
+		return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+	}
+	return a.len == b.len && memcmp(&a.addr, &b.addr, a.len) == 0;
+}
+
+/*
+ * Set up the datagram socket of a server on the configured transport.
+ * @param serverName a single letter representing the server that is setting up this socket. (e.g., 'M', 'A', 'P', 'Q')
+ * @param portNum the macro static port number of the server, or NULL for a socket with an address of its own choosing
+ * @return the socket descriptor
+ */
+int setupDatagram(char serverName, const char* portNum) {
+	if (!unixTransport()) {
+		if (portNum != NULL) {
+			return setupUDP(serverName, portNum);
+		}
+		int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (sockfd == -1) {
+			fprintf(stderr, "Server %c: UDP socket\n", serverName);
+			exit(1);
+		}
+		return sockfd;
+	}
+	int sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (sockfd == -1) {
+		fprintf(stderr, "Server %c: Unix socket\n", serverName);
+		exit(1);
+	}
+	Endpoint local;
+	if (portNum != NULL) {
+		local = serverEndpoint(portNum);
+	}
+	else { // binding only the family picks a unique abstract name, so that replies can come back
+		local.addr.ss_family = AF_UNIX;
+		local.len = sizeof(sa_family_t);
+	}
+	if (bind(sockfd, local.sa(), local.len) == -1) {
+		fprintf(stderr, "Server %c: Unix bind: %s\n", serverName, strerror(errno));
+		exit(1);
+	}
+	return sockfd;
+}
+
+/*
+ * Get the number of worker threads a backend server runs, as set by the environment variable WORKERS.
+ * @return the number, between 1 (the default) and MAX_WORKERS
+ */
+int workerCount() {
+	const char* workers = getenv(WORKERS_ENV);
+	int n = workers != NULL ? atoi(workers) : 1;
+	return max(1, min(n, MAX_WORKERS));
+}
+
+/*
+ * Set up the datagram sockets of a server's worker threads on the configured transport.
+ * Over UDP, every worker gets a socket of its own, all bound to the same port with SO_REUSEPORT. The kernel would
+ * pick the socket by a hash of the sender's address, which sends everything from Server M to one socket, so a
+ * classic BPF program picks it by the request ID in the message header instead; the retransmissions of a request
+ * thus reach the same worker. A Unix-domain socket cannot share its name, so there the workers share one socket
+ * and its receive queue.
+ * @param serverName a single letter representing the server that is setting up the sockets
+ * @param portNum the macro static port number of the server
+ * @param workers the number of worker threads
+ * @return the socket of each worker
+ */
+vector<int> setupWorkerSockets(char serverName, const char* portNum, int workers) {
+	if (workers == 1 || unixTransport()) {
+		return vector<int>(workers, setupDatagram(serverName, portNum));
+	}
+	vector<int> socks;
+	Endpoint local = serverEndpoint(portNum);
+	int yes = 1;
+	for (int i = 0; i < workers; i++) {
+		int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (sockfd == -1 || setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1
+				|| setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+			fprintf(stderr, "Server %c: UDP socket: %s\n", serverName, strerror(errno));
+			exit(1);
+		}
+		if (bind(sockfd, local.sa(), local.len) == -1) {
+			fprintf(stderr, "Server %c: UDP bind: %s\n", serverName, strerror(errno));
+			exit(1);
+		}
+		socks.push_back(sockfd);
+	}
+	// Index of the socket = request ID (bytes 4 to 7 of the UDP payload) modulo the number of sockets
+	struct sock_filter code[] = {
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, 4},
+		{BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)workers},
+		{BPF_RET | BPF_A, 0, 0, 0},
+	};
+	struct sock_fprog prog = {sizeof code / sizeof code[0], code};
+	if (setsockopt(socks[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == -1) {
+		perror("setsockopt SO_ATTACH_REUSEPORT_CBPF"); // the kernel's hash still works, if unevenly
+	}
+	return socks;
+}
+
+/*
+ * Receive a datagram and the address of its sender.
+ * @param sockfd the datagram socket
+ * @param buf the buffer to receive into
+ * @param n the size of the buffer
+ * @param from the returned address of the sender
+ * @return the result of recvfrom
+ */
+int recvFrom(int sockfd, char* buf, size_t n, Endpoint& from) {
+	from.len = sizeof from.addr;
+	return recvfrom(sockfd, buf, n, 0, from.sa(), &from.len);
+}
+
+/*
+ * Send a datagram.
+ * @param sockfd the datagram socket
+ * @param buf the bytes to send
+ * @param n the number of bytes
+ * @param to the address of the receiver
+ * @return the result of sendto
+ */
+int sendTo(int sockfd, const char* buf, size_t n, const Endpoint& to) {
+	return sendto(sockfd, buf, n, 0, to.sa(), to.len);
+}
+